@@ -61,14 +61,14 @@ it must have the following methods
         this method is called for every call to the C function
         nsapy_Service( pblockptr, sessionptr, requestptr )
 
-        return value must be a Python string, one of
-        "REQ_NOACTION", "REQ_PROCEED", "REQ_ABORTED", "REQ_EXIT"
+        return value must be one of nsapi.REQ_NOACTION, REQ_PROCEED,
+        REQ_ABORTED or REQ_EXIT ( or its name as a string )
         
 
    2.   Log( string )
 
-        this method may be called a lot to log what happens if
-        NSAPYDEBUG is defined
+        no longer called, nsapi logs by itself ( see nsapi.log ),
+        nsapy's CallBack keeps it for old code
 
         return value doesn't matter
 
@@ -86,22 +86,79 @@ look at its Python source in nsapy.py
 /* Uncomment this for debugging */
 #define NSAPYDEBUG 1
 
+/* Python Headers, first: pyconfig.h sets feature macros that the
+   system headers the NSAPI ones include must see */
+#include "Python.h"
+#include "pythonrun.h"
+
 /* NSAPI headers */
 #include "base/pblock.h"
 #include "base/session.h"
 #include "base/crit.h"
 #include "base/systhr.h"
+#include "base/file.h"
 #include "frame/req.h"
 #include "frame/protocol.h"
 #include "frame/log.h"
 #include "frame/http.h"
 
-/* Python Headers */
-#include "Python.h"
-#include "pythonrun.h"
+/* Python 2.5 made lengths and indexes Py_ssize_t */
+#if PY_VERSION_HEX < 0x02050000
+typedef int Py_ssize_t;
+#define lenfunc inquiry
+#define ssizeargfunc intargfunc
+#endif
+
+/* sn.send_file() reads files with pread() and keeps copies of small
+   ones where it can */
+#if defined( XP_UNIX ) && ! defined( NSAPY_NO_PREAD )
+#define NSAPY_PREAD 1
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+/* sn.out can compress the response, see out_start() */
+#ifndef NSAPY_NO_ZLIB
+#define NSAPY_ZLIB 1
+#include "zlib.h"
+#endif
+
+/* with "processes", Python runs in worker processes, see pf_start() */
+#if defined( XP_UNIX ) && ! defined( NSAPY_NO_PREFORK )
+#define NSAPY_PREFORK 1
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+/* for the log */
+#include <stdarg.h>
+#include <time.h>
+#if defined( XP_WIN32 ) && ! defined( vsnprintf )
+#define vsnprintf _vsnprintf
+#endif
+
+/* header names are folded to lower case, see rq.header_map */
+#include <ctype.h>
+
+/* for timing requests, see stats_clock() */
+#ifndef XP_WIN32
+#include <sys/time.h>
+#endif
 
 /* some forward declarations */
 NSAPI_PUBLIC void initnsapi();
+NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq);
+NSAPI_PUBLIC int nsapy_AuthTrans(pblock *pb, Session *sn, Request *rq);
+static int netbuf_read( netbuf *buf, char *dst, int len );
 
 
 PyObject *NsapiModule = NULL;
@@ -112,6 +169,38 @@ static PyObject *obCallBack = NULL;
 /* pointer to a global CRITICAL object for CriticalOnly processing */
 static PyObject * obCrit = NULL;
 
+/* largest request body to accept, 0 means no limit ( "maxbody" ) */
+static int maxBody = 0;
+
+/* default sn.out flush threshold, 0 means no buffering ( "outbuf" ) */
+static int outBuf = 8192;
+
+/* zlib level sn.out compresses responses with, 0 for none ( "compress" ),
+   and the smallest whole response that is worth it ( "compressmin" ) */
+static int compressLevel = 0;
+static int compressMin = 1024;
+
+/* seconds between checks for changed modules, 0 for never ( "reload" ) */
+static int reloadInterval = 0;
+
+/* largest file sn.send_file() keeps a copy of, 0 for none ( "filecache" ) */
+static int fileCacheMax = 65536;
+#ifdef NSAPY_PREAD
+static CRITICAL fileCacheCrit;
+#endif
+
+/* most form fields, and longest name or value, sn.parse_form() and
+   nsapi.parse_qs() accept, 0 for no limit ( "maxfields", "maxfieldsize" ) */
+static int formMaxFields = 1000;
+static int formMaxFieldSize = 1024 * 1024;
+
+/* biggest part of a multipart body sn.parse_multipart() keeps in 
+   memory, bigger ones go to a temporary file ( "spool" ) */
+static int multipartSpool = 65536;
+
+/* bytes of responses kept by sn.out.cache(), 0 for none ( "cache" ) */
+static long rcacheMax = 0;
+
 /* 
  * These are Python equivalents of NSAPI
  * pblock, Session, Request, CRITICAL
@@ -121,29 +210,142 @@ static PyObject * obCrit = NULL;
 typedef struct pblockobject {
     PyObject_VAR_HEAD
     pblock *pb;
+    int at;                         /* where "for name in pb" is, */
+    int bucket, depth;              /* see pblock_item() */
 } pblockobject;
 
 typedef struct sessionobject {
     PyObject_VAR_HEAD
     Session *sn;
+    Request *rq;                    /* the request being served */
+    struct pblockobject *client;    /* made on first use */
+    struct outobject *out;          /* sn.out, made on first use */
+    int body_left;                  /* request body not read yet */
+    int max_body;                   /* largest body we'll accept */
+    long sent;                      /* response body bytes written */
+    struct nsapy_task *tasks;       /* sn.defer()ed, until the request is over */
 } sessionobject;
 
+/* sessionobject.body_left before we looked at content-length,
+   and when there is no content-length */
+#define BODY_UNKNOWN    -1
+#define BODY_NOLENGTH   -2
+
+/* a request body read in chunks, see sn.chunks() */
+typedef struct chunksobject {
+    PyObject_HEAD
+    struct sessionobject *sno;
+    int size;
+} chunksobject;
+
+/* sn.out, the response body buffered on its way to the client */
+typedef struct outobject {
+    PyObject_HEAD
+    Session *sn;                    /* NULL once the request is over */
+    char *buf;                      /* borrowed from the thread, see out_buffer() */
+    int len;                        /* bytes waiting in buf */
+    int size;                       /* how big buf is */
+    int threshold;                  /* flush when this much is waiting */
+    long sent;                      /* bytes written, see out_finish() */
+    Request *rq;                    /* while the headers wait, see out_defer() */
+    int pending;
+    int discard;                    /* the server wants no body */
+    int compress;                   /* zlib level for this response */
+    int zip;                        /* ZIP_GZIP or ZIP_DEFLATE once compressing */
+    int etag;                       /* hash the body for an ETag, see sn.out.set_etag() */
+    int chunked;                    /* sent chunked, 2 once a chunk is open, see out_write() */
+#ifdef NSAPY_ZLIB
+    z_stream *z;                    /* borrowed from the thread, see zip_begin() */
+    char *zbuf;
+#endif
+    char *cbuf;                     /* the body as sent, see rcache_add() */
+    int clen, csize;
+    int cttl;                       /* seconds to keep it, from sn.out.cache() */
+} outobject;
+
 typedef struct requestobject {
     PyObject_VAR_HEAD
     Request *rq;
+    /* wrappers for the member pblocks, made on first use */
+    struct pblockobject *reqpb, *srvhdrs, *vars, *headers;
+    struct headersobject *header_map;   /* rq.header_map, made on first use */
 } requestobject;
 
+/* rq.header_map, the request headers as a read-only dictionary */
+typedef struct headersobject {
+    PyObject_HEAD
+    PyObject *dict;                 /* lower case name: value */
+    PyObject *keys;                 /* for "for name in", made on first use */
+} headersobject;
+
+/* a part of a multipart/form-data body, see sn.parse_multipart() */
+typedef struct partobject {
+    PyObject_HEAD
+    PyObject *name, *filename;      /* filename is None for a plain field */
+    PyObject *type;                 /* its content-type */
+    PyObject *headers;              /* lower case name: value */
+    char *data;                     /* the content, while it is small */
+    long len, size;
+    FILE *file;                     /* or else the temporary file it's in */
+    long total;                     /* how big it is */
+    long pos;                       /* where read() is */
+    int closed;
+} partobject;
+
 typedef struct criticalobject {
     PyObject_VAR_HEAD
     CRITICAL crit;
 } criticalobject;
 
+/* nsapi.lock(), see Locks */
+typedef struct lockobject {
+    PyObject_HEAD
+    struct nsapy_lock *lock;
+    struct lockobject *owner;       /* for lk.shared, the lk it's of */
+} lockobject;
+
+struct nsapy_lock;
+static struct nsapy_lock * lock_new( char *name );
+static int lock_enter( struct nsapy_lock *lk, int shared, long timeout );
+static int lock_exit( struct nsapy_lock *lk, int shared );
+
+/* a name for a number, see reqCodes and friends */
+typedef struct nsapy_code {
+    char *name;
+    int code;
+} nsapy_code;
+
+static int code_lookup( PyObject *o, nsapy_code *table, int *code );
+
 /* type objects corresponding to the above object types */
 
 static PyTypeObject pblockobjecttype;
 static PyTypeObject requestobjecttype;
 static PyTypeObject sessionobjecttype;
 static PyTypeObject criticalobjecttype;
+static PyTypeObject lockobjecttype;
+static PyTypeObject chunksobjecttype;
+static PyTypeObject outobjecttype;
+static PyTypeObject headersobjecttype;
+static PyTypeObject partobjecttype;
+
+/*
+ * Free lists of pblock, session, request and sn.out wrappers, so that
+ * a request doesn't have to malloc() and free() them every time.
+ * Wrappers are only ever made and disposed of while holding the 
+ * interpreter lock, which is all the protection these need. 
+ * Like Python's own int free list, the ob_type field links them.
+ */
+
+#define NSAPY_MAXFREE 256
+
+static PyObject *pblock_freelist = NULL;
+static PyObject *session_freelist = NULL;
+static PyObject *request_freelist = NULL;
+static PyObject *out_freelist = NULL;
+static PyObject *headers_freelist = NULL;
+static int pblock_nfree = 0, session_nfree = 0, request_nfree = 0, out_nfree = 0;
+static int headers_nfree = 0;
 
 /* methods of pblocks */
 
@@ -151,12 +353,24 @@ static PyObject * Py_pblock2str( pblockobject *pbo, PyObject *args );
 static PyObject * Py_nvinsert( pblockobject *pbo, PyObject *args );
 static PyObject * Py_findval( pblockobject *pbo, PyObject *args );
 static PyObject * Py_pblock_remove( pblockobject *pbo, PyObject *args );
+static PyObject * Py_pblock_get( pblockobject *pbo, PyObject *args );
+static PyObject * Py_pblock_has_key( pblockobject *pbo, PyObject *args );
+static PyObject * Py_pblock_keys( pblockobject *pbo, PyObject *args );
+static PyObject * Py_pblock_values( pblockobject *pbo, PyObject *args );
+static PyObject * Py_pblock_items( pblockobject *pbo, PyObject *args );
+static PyObject * Py_pblock_to_dict( pblockobject *pbo, PyObject *args );
 
 static PyMethodDef Pypblockmethods[] = {
 	{ "pblock2str",		(PyCFunction) Py_pblock2str,     1},
 	{ "nvinsert",       (PyCFunction) Py_nvinsert,       1},
 	{ "findval",        (PyCFunction) Py_findval,        1},
 	{ "pblock_remove",  (PyCFunction) Py_pblock_remove,  1},
+	{ "get",            (PyCFunction) Py_pblock_get,     1},
+	{ "has_key",        (PyCFunction) Py_pblock_has_key, 1},
+	{ "keys",           (PyCFunction) Py_pblock_keys,    1},
+	{ "values",         (PyCFunction) Py_pblock_values,  1},
+	{ "items",          (PyCFunction) Py_pblock_items,   1},
+	{ "to_dict",        (PyCFunction) Py_pblock_to_dict, 1},
 	{ NULL, NULL } /* sentinel */
 };
 
@@ -166,6 +380,58 @@ static PyObject * Py_session_dns( sessionobject *sno, PyObject *args );
 static PyObject * Py_net_write( sessionobject *sno, PyObject *args );
 static PyObject * Py_sn_client( sessionobject *sno, PyObject *args );
 static PyObject * Py_form_data(sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_read( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_readinto( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_chunks( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_remaining( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_set_max_body( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_send_file( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_parse_form( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_parse_multipart( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_validate( sessionobject *sno, PyObject *args );
+static PyObject * Py_sn_defer( sessionobject *sno, PyObject *args );
+static void task_release( sessionobject *sno );
+
+/* methods of sn.out */
+
+static outobject * make_outobject( Session *sn );
+static int out_send( outobject *oo, char *data, int len );
+static int out_flush( outobject *oo );
+static int out_finish( sessionobject *sno, int flush );
+static int out_defer( sessionobject *sno, Request *rq );
+static int out_start( outobject *oo, int final );
+static int out_push( outobject *oo );
+#ifdef NSAPY_ZLIB
+static int out_deflate( outobject *oo, char *data, int len, int mode );
+#endif
+
+static PyObject * Py_out_write( outobject *oo, PyObject *args );
+static PyObject * Py_out_flush( outobject *oo, PyObject *args );
+static PyObject * Py_out_set_threshold( outobject *oo, PyObject *args );
+static PyObject * Py_out_set_compress( outobject *oo, PyObject *args );
+static PyObject * Py_out_cache( outobject *oo, PyObject *args );
+static PyObject * Py_out_set_etag( outobject *oo, PyObject *args );
+
+static int not_modified( Request *rq );
+static int start_not_modified( Session *sn, Request *rq );
+static void etag_hash( Request *rq, char *body, int len );
+#ifdef NSAPY_ZLIB
+static void etag_weaken( Request *rq );
+#endif
+
+static int rcache_init( void );
+static void rcache_add( outobject *oo, char *data, int n );
+static void rcache_forget( outobject *oo );
+
+static PyMethodDef Pyoutmethods[] = {
+	{ "write",           (PyCFunction) Py_out_write,         1},
+	{ "flush",           (PyCFunction) Py_out_flush,         1},
+	{ "set_threshold",   (PyCFunction) Py_out_set_threshold, 1},
+	{ "set_compress",    (PyCFunction) Py_out_set_compress,  1},
+	{ "cache",           (PyCFunction) Py_out_cache,         1},
+	{ "set_etag",        (PyCFunction) Py_out_set_etag,      1},
+	{ NULL, NULL } /* sentinel */
+};
 
 static PyMethodDef Pysessionmethods[] = {
 	{ "session_dns",     (PyCFunction) Py_session_dns,     1},
@@ -173,6 +439,16 @@ static PyMethodDef Pysessionmethods[] = {
 	{ "client",          (PyCFunction) Py_sn_client,       1},
 	/*{ "net_read",        (PyCFunction)Py_net_read,        1},*/
 	{ "form_data",            (PyCFunction) Py_form_data,     1}, 
+	{ "read",            (PyCFunction) Py_sn_read,         1},
+	{ "readinto",        (PyCFunction) Py_sn_readinto,     1},
+	{ "chunks",          (PyCFunction) Py_sn_chunks,       1},
+	{ "remaining",       (PyCFunction) Py_sn_remaining,    1},
+	{ "set_max_body",    (PyCFunction) Py_sn_set_max_body, 1},
+	{ "send_file",       (PyCFunction) Py_sn_send_file,    1},
+	{ "parse_form",      (PyCFunction) Py_sn_parse_form,   1},
+	{ "parse_multipart", (PyCFunction) Py_sn_parse_multipart, 1},
+	{ "validate",        (PyCFunction) Py_sn_validate,     1},
+	{ "defer",           (PyCFunction) Py_sn_defer,        1},
 	{ NULL, NULL } /* sentinel */
 };
 
@@ -182,6 +458,8 @@ static PyObject * Py_request_header( requestobject *rqo, PyObject *args );
 static PyObject * Py_log_warn( requestobject *rqo, PyObject *args );
 static PyObject * Py_start_response( requestobject *rqo, PyObject *args );
 static PyObject * Py_protocol_status( requestobject *rqo, PyObject *args );
+static headersobject * make_headersobject( pblock *pb );
+static PyObject * headers_name( char *name, int len );
 
 static PyMethodDef Pyrequestmethods[] = {
 	{ "request_header",		(PyCFunction) Py_request_header,     1},
@@ -197,13 +475,43 @@ static PyObject * SetCallBack( PyObject *self, PyObject *args );
 static PyObject * Py_crit_enter( PyObject *self, PyObject *args );
 static PyObject * Py_crit_exit( PyObject *self, PyObject *args );
 static PyObject * Py_crit_init( PyObject *self, PyObject *args );
+static PyObject * Py_cache_handler( PyObject *self, PyObject *args );
+static PyObject * Py_clear_handlers( PyObject *self, PyObject *args );
+static PyObject * Py_watch( PyObject *self, PyObject *args );
+static PyObject * Py_changes( PyObject *self, PyObject *args );
+static PyObject * Py_log( PyObject *self, PyObject *args );
+static PyObject * Py_log_open( PyObject *self, PyObject *args );
+static PyObject * Py_log_level( PyObject *self, PyObject *args );
+static PyObject * Py_stats( PyObject *self, PyObject *args );
+static PyObject * Py_parse_qs( PyObject *self, PyObject *args );
+static PyObject * Py_cache_info( PyObject *self, PyObject *args );
+static PyObject * Py_cache_clear( PyObject *self, PyObject *args );
+static PyObject * Py_defer( PyObject *self, PyObject *args );
+static PyObject * Py_task_stats( PyObject *self, PyObject *args );
+static PyObject * Py_lock( PyObject *self, PyObject *args );
+static PyObject * Py_lock_stats( PyObject *self, PyObject *args );
 
 static struct PyMethodDef nsapi_module_methods[] = {
-	{"SetCallBack",     (PyCFunction) SetCallBack,		1},
-	{"crit_enter",		(PyCFunction) Py_crit_enter,	1},
-	{"crit_exit",		(PyCFunction) Py_crit_exit,		1},
-	{"crit_init",       (PyCFunction) Py_crit_init,     1},
-	{NULL, NULL} /* sentinel */
+    {"SetCallBack",     (PyCFunction) SetCallBack,        1},
+    {"crit_enter",        (PyCFunction) Py_crit_enter,    1},
+    {"crit_exit",        (PyCFunction) Py_crit_exit,        1},
+    {"crit_init",       (PyCFunction) Py_crit_init,     1},
+    {"cache_handler",   (PyCFunction) Py_cache_handler, 1},
+    {"clear_handlers",  (PyCFunction) Py_clear_handlers, 1},
+    {"watch",           (PyCFunction) Py_watch,          1},
+    {"changes",         (PyCFunction) Py_changes,        1},
+    {"log",             (PyCFunction) Py_log,            1},
+    {"log_open",        (PyCFunction) Py_log_open,       1},
+    {"log_level",       (PyCFunction) Py_log_level,      1},
+    {"stats",           (PyCFunction) Py_stats,          1},
+    {"parse_qs",        (PyCFunction) Py_parse_qs,       1},
+    {"cache_info",      (PyCFunction) Py_cache_info,     1},
+    {"cache_clear",     (PyCFunction) Py_cache_clear,    1},
+    {"defer",           (PyCFunction) Py_defer,          1},
+    {"task_stats",      (PyCFunction) Py_task_stats,     1},
+    {"lock",            (PyCFunction) Py_lock,           1},
+    {"lock_stats",      (PyCFunction) Py_lock_stats,     1},
+    {NULL, NULL} /* sentinel */
 };
 
 
@@ -213,10 +521,10 @@ static struct PyMethodDef nsapi_module_methods[] = {
  **/
 static int nsapy_log_error(int degree, char *func, Session *sn, Request *rq, char *fmt )
 {
-	char buff[1000];
+    char buff[1000];
 
-	/* prepend a pointer for the current thread */
-	sprintf( buff, "(thread %d) %s", ( int ) systhread_current(), func );
+    /* prepend a pointer for the current thread */
+    sprintf( buff, "(thread %lu) %s", ( unsigned long ) systhread_current(), func );
 
     /* call the Netscape log_error function, assume it succeeds */
     return log_error(degree, buff, sn, rq, fmt);
@@ -224,44 +532,257 @@ static int nsapy_log_error(int degree, char *func, Session *sn, Request *rq, cha
 }
 
 /**
- ** Log - This is optional logging, mostly for debug,
- ** normally disabled.
+ ** The log
+ **
+ *  nsapy's own log ( the file given to nsapy.init(), not the server's
+ *  error log ). Writing a line has to be cheap enough to leave debug 
+ *  logging on under load, so:
+ *
+ *  - below logLevel, or with no log file, nothing is even formatted
+ *  - every thread appends to a ring buffer of its own, without locks,
+ *    system calls or the interpreter lock
+ *  - a thread of our own empties the rings into the file every 
+ *    LOG_FLUSH_MS, and formats the time stamps while it's at it
+ *
+ *  A ring is only written by its own thread and only read by the 
+ *  flusher, head is only moved by the one and tail by the other. If
+ *  a ring is full, the line is dropped ( and counted ), a request
+ *  never waits on the disk.
+ */
+
+#define NSAPY_DEBUG     0
+#define NSAPY_INFO      1
+#define NSAPY_WARNING   2
+#define NSAPY_ERROR     3
+
+#define LOG_RING        65536       /* bytes per thread, a power of 2 */
+#define LOG_LINE        1024        /* longest line */
+#define LOG_FLUSH_MS    100
+
+/* the ring's contents must be in memory before head says so */
+#ifdef __GNUC__
+#define NSAPY_BARRIER() __sync_synchronize()
+#else
+#define NSAPY_BARRIER()
+#endif
+
+static nsapy_code logLevels[] = {
+    { "debug",      NSAPY_DEBUG },
+    { "info",       NSAPY_INFO },
+    { "warning",    NSAPY_WARNING },
+    { "error",      NSAPY_ERROR },
+    { NULL, 0 }
+};
+
+typedef struct log_record {
+    int len;                        /* of the text that follows */
+    int level;
+    time_t when;
+    unsigned long thread;           /* systhread_current(), a pointer */
+} log_record;
+
+typedef struct log_ring {
+    volatile unsigned head;         /* where the thread writes next */
+    volatile unsigned tail;         /* where the flusher reads next */
+    volatile unsigned dropped;      /* lines that didn't fit */
+    unsigned reported;              /* dropped lines already reported */
+    struct log_ring *next;          /* all of them, see logRings */
+    char buf[ LOG_RING ];
+} log_ring;
+
+static int logLevel = NSAPY_INFO;
+static FILE *logFile = NULL;
+static int logKey = -1;             /* the thread's log_ring */
+static log_ring *logRings = NULL;   /* logCrit protects this and logFile */
+static CRITICAL logCrit;
+static int logFlushing = 0;
+
+static void ring_put( log_ring *r, unsigned pos, char *src, int n )
+{
+    int i, first;
+
+    i = pos & ( LOG_RING - 1 );
+    first = LOG_RING - i < n ? LOG_RING - i : n;
+    memcpy( r->buf + i, src, first );
+    memcpy( r->buf, src + first, n - first );
+}
+
+static void ring_get( log_ring *r, unsigned pos, char *dst, int n )
+{
+    int i, first;
+
+    i = pos & ( LOG_RING - 1 );
+    first = LOG_RING - i < n ? LOG_RING - i : n;
+    memcpy( dst, r->buf + i, first );
+    memcpy( dst + first, r->buf, n - first );
+}
+
+/* this thread's ring, made the first time it logs */
+
+static log_ring * log_ring_get( void )
+{
+    log_ring *r;
+
+    r = ( log_ring * ) systhread_getdata( logKey );
+    if ( r )
+        return r;
+
+    r = ( log_ring * ) calloc( 1, sizeof( log_ring ) );
+    if ( ! r )
+        return NULL;
+
+    crit_enter( logCrit );
+    r->next = logRings;
+    logRings = r;
+    crit_exit( logCrit );
+
+    systhread_setdata( logKey, r );
+    return r;
+}
+
+/* append a line to this thread's ring, or drop it */
+
+static void log_put( int level, char *text, int len )
+{
+    log_record rec;
+    log_ring *r;
+    unsigned need;
+
+    r = log_ring_get();
+    if ( ! r )
+        return;
+
+    if ( len > LOG_LINE )
+        len = LOG_LINE;
+
+    need = sizeof( rec ) + len;
+    if ( LOG_RING - ( r->head - r->tail ) < need )
+    {
+        r->dropped++;
+        return;
+    }
+
+    rec.len = len;
+    rec.level = level;
+    rec.when = time( NULL );
+    rec.thread = ( unsigned long ) systhread_current();
+
+    ring_put( r, r->head, ( char * ) &rec, sizeof( rec ) );
+    ring_put( r, r->head + sizeof( rec ), text, len );
+    NSAPY_BARRIER();
+    r->head += need;
+}
+
+/**
+ ** nsapy_log - log a printf style line at level
  **/
 
-#ifdef NSAPYDEBUG
+static void nsapy_log( int level, char *fmt, ... )
+{
+    char buff[2000];
+    va_list ap;
+
+    if ( level < logLevel || ! logFile )
+        return;
+
+    va_start( ap, fmt );
+    vsnprintf( buff, sizeof( buff ), fmt, ap );
+    va_end( ap );
+
+    log_put( level, buff, strlen( buff ) );
+}
+
+/* write out everything in the rings, called by the flusher */
 
-    static int Log( char * string )
+static void log_flush( void )
+{
+    static time_t last = 0;
+    static char stamp[64];
+    log_record rec;
+    log_ring *r;
+    char text[ LOG_LINE ];
+    unsigned head;
+    struct tm *tm;
+#ifdef XP_UNIX
+    struct tm tmbuf;
+#endif
+
+    crit_enter( logCrit );
+    for ( r = logRings; r && logFile; r = r->next )
     {
+        head = r->head;
+        NSAPY_BARRIER();
 
-		/* This function never returns NULL. If there is no
-		   callback object, it calls log_error */
+        while ( r->tail != head )
+        {
+            ring_get( r, r->tail, ( char * ) &rec, sizeof( rec ) );
+            ring_get( r, r->tail + sizeof( rec ), text, rec.len );
 
-		char buff[1000];
-        PyObject *dummy;
+            if ( rec.when != last )
+            {
+#ifdef XP_UNIX
+                tm = localtime_r( &rec.when, &tmbuf );
+#else
+                tm = localtime( &rec.when );
+#endif
+                strftime( stamp, sizeof( stamp ), "[%d/%b/%Y:%H:%M:%S]", tm );
+                last = rec.when;
+            }
 
-        /* fail if no callback object is registered */
-        if ( obCallBack ) 
-		{
+            fprintf( logFile, "%s %s: (thread %lu) %.*s\n", stamp, 
+                     logLevels[ rec.level ].name, rec.thread, rec.len, text );
 
-			/* prepend a pointer for the current thread */
-			sprintf( buff, "(thread %d) %s", ( int ) systhread_current(), string );
+            NSAPY_BARRIER();
+            r->tail += sizeof( rec ) + rec.len;
+        }
 
-			/* attempt to call obCallBack.Log( string ) */
-			dummy = PyObject_CallMethod( obCallBack, "Log", "s", buff );
+        if ( r->dropped != r->reported )
+        {
+            fprintf( logFile, "%s warning: %u log lines dropped, the log can't keep up\n", 
+                     stamp, r->dropped - r->reported );
+            r->reported = r->dropped;
+        }
+    }
 
-			if ( !dummy ) 
-				nsapy_log_error(LOG_WARN, "couldn't Log() (obCallBack error)", NULL, NULL, string);
-			else
-		        /* discard result */
-				Py_XDECREF( dummy );
-		}
+    if ( logFile )
+        fflush( logFile );
+    crit_exit( logCrit );
+}
 
-        return 1;
+static void log_flusher( void *arg )
+{
+    for ( ;; )
+    {
+        systhread_sleep( LOG_FLUSH_MS );
+        log_flush();
+    }
+}
+
+/**
+ ** Log - debug logging, compiled in if NSAPYDEBUG is defined
+ **/
+
+#ifdef NSAPYDEBUG
+
+    static void Log( char *fmt, ... )
+    {
+        char buff[2000];
+        va_list ap;
+
+        /* the usual case, don't bother formatting */
+        if ( logLevel > NSAPY_DEBUG || ! logFile )
+            return;
+
+        va_start( ap, fmt );
+        vsnprintf( buff, sizeof( buff ), fmt, ap );
+        va_end( ap );
+
+        log_put( NSAPY_DEBUG, buff, strlen( buff ) );
     }
 
 #else /* #ifdef NSAPYDEBUG */
 
-    static int Log( char * string ) { return 1; }
+    static void Log( char *fmt, ... ) { }
 
 #endif /* #ifdef NSAPYDEBUG */
 
@@ -281,930 +802,9345 @@ static int InitAbort( pblock *pb, char *diagnostic )
 
 }
 
-
 /**
- ** nsapy_Init - The initialization function.
- **
- * 
- *  Initialize Python and get the callback object.
- *
- *  This function is called by the NS Server at initialization
- *  in order to initialize Python and obtain obCallBack.
- *
- *  The function expects two parameters in the pblock
- *
- *        "module"      -   the module name to be imported
- *        "initstring"  -   a string to be executed after that
- *
- *  "initstring" must return a Python object with all the methods
- *  descripbed above defined ( Service, Log, etc. )
- *
- *  This object is a.k.a. obCallBack.
- *
- *  *sn and *rq parameters are ignored.
- *
- */
+ ** str_hash - hash a string, for our own little hash tables
+ **/
 
-NSAPI_PUBLIC int nsapy_Init(pblock *pb, Session *sn, Request *rq)
+static unsigned str_hash( char *s )
 {
+    unsigned h;
 
-    char buff[1000];
-    char *module, *initstring, *criticalonly;
-	PyObject *d;
+    for ( h = 0; *s; s++ )
+        h = h * 31 + ( unsigned char ) *s;
 
-    /* get the parameters from the parameter block */
+    return h;
+}
 
-    module = pblock_findval("module", pb);
-    initstring = pblock_findval("initstring", pb);
-    criticalonly = pblock_findval("criticalonly", pb);
+/**
+ ** The handler cache
+ **
+ *  Maps a URI to the RequestHandler class the CallBack object found
+ *  for it ( it tells us with nsapi.cache_handler ), so that the next
+ *  request for that URI can hand the class to Service() and skip 
+ *  working out the module name, the import and the attribute lookup.
+ *  Every interpreter has its own, as every interpreter has its own
+ *  classes. Only used while holding the interpreter lock.
+ *
+ *  Whoever reloads a module must call nsapi.clear_handlers(), or 
+ *  requests will keep getting the old class.
+ */
 
-    if ( !module ) 
-        return InitAbort( pb, "nsapy_Init: No module defined in pb" );
+#define HANDLER_BUCKETS 256
+#define HANDLER_MAX     1024
 
-    if ( !initstring ) 
-        return InitAbort(pb, "nsapy_Init: No initstring defined in pb");
+typedef struct handler_entry {
+    char *uri;
+    unsigned hash;
+    PyObject *cls;
+    struct handler_entry *next;
+} handler_entry;
 
-    /* initialize Python */
+typedef struct handler_cache {
+    handler_entry *buckets[ HANDLER_BUCKETS ];
+    int count;
+} handler_cache;
 
-    Py_Initialize();
+/* the main interpreter's, see nsapy_interp for the pool's */
+static handler_cache mainHandlers;
 
-    /*  Initialize nsapi 
-        This makes an nsapi module available for import, but remember,
-        YOU should use "import nsapy" not "nsapi". "nsapi" is for internal
-        use only. ( The only time it's needed is to assign obCallBack )
-    */
+/* handler_find - the class for uri, a borrowed reference, or NULL */
 
-    initnsapi();
+static PyObject * handler_find( handler_cache *hc, char *uri )
+{
+    handler_entry *he;
+    unsigned h;
 
-    /* If a criticalonly parameter was defined,
-	   create a python object CRITICAL that can be used
-	   to exit the critical section by passing it to 
-	   crit_exit. 
-	*/
-
-	d = PyModule_GetDict( NsapiModule );
-	if ( criticalonly )
-	{
-		obCrit =  Py_crit_init( NsapiModule, Py_None  );
-		if ( !obCrit )
-			return InitAbort( pb, "nsapy_Init: could not create CRITICAL variable" );
-		Py_INCREF( obCrit );
-		PyDict_SetItemString( d, "CRITICAL", obCrit );
-	}
-	else
-	{
-		Py_INCREF( Py_None );
-		PyDict_SetItemString( d, "CRITICAL", Py_None );
-		Py_INCREF( Py_None );
-		obCrit = Py_None;
-	}
+    if ( ! hc->count )
+        return NULL;
 
-    /* Now execute the equivalent of
-        >>> import nsapi
-        >>> import sys
-        >>> import <module>
-        >>> <initstring>
-        in the __main__ module to start up Python.
-    */
+    h = str_hash( uri );
+    for ( he = hc->buckets[ h % HANDLER_BUCKETS ]; he; he = he->next )
+        if ( he->hash == h && strcmp( he->uri, uri ) == 0 )
+            return he->cls;
 
-    PyRun_SimpleString( "import nsapi\n" );
+    return NULL;
+}
 
-    if ( PyErr_Occurred() )
-        return InitAbort( pb, "nsapy_Init: could not import nsapi" );
+/* handler_add - remember cls for uri, unless the cache is full */
 
-    PyRun_SimpleString( "import sys\n" );
+static int handler_add( handler_cache *hc, char *uri, PyObject *cls )
+{
+    handler_entry *he;
+    unsigned h;
 
-    if ( PyErr_Occurred() )
-        return InitAbort( pb, "nsapy_Init: could not import sys" );
+    h = str_hash( uri );
+    for ( he = hc->buckets[ h % HANDLER_BUCKETS ]; he; he = he->next )
+        if ( he->hash == h && strcmp( he->uri, uri ) == 0 )
+        {
+            Py_INCREF( cls );
+            Py_DECREF( he->cls );
+            he->cls = cls;
+            return 1;
+        }
 
-    sprintf( buff, "import %s\n", module);
-    PyRun_SimpleString( buff );
+    if ( hc->count >= HANDLER_MAX )
+        return 1;
 
-    if ( PyErr_Occurred() ) 
+    he = ( handler_entry * ) malloc( sizeof( handler_entry ) );
+    if ( he )
+        he->uri = strdup( uri );
+    if ( ! he || ! he->uri )
     {
-        sprintf( buff, "nsapy_Init: could not import %s", module );
-        return InitAbort( pb, buff );
+        free( he );
+        PyErr_NoMemory();
+        return 0;
     }
 
-    sprintf( buff, "%s\n", initstring );
-    PyRun_SimpleString( buff );
+    he->hash = h;
+    he->cls = cls;
+    Py_INCREF( cls );
+    he->next = hc->buckets[ h % HANDLER_BUCKETS ];
+    hc->buckets[ h % HANDLER_BUCKETS ] = he;
+    hc->count++;
 
-    if ( PyErr_Occurred() )
-    {
-        sprintf( buff, "nsapy_Init: could not call %s", initstring );
-        return InitAbort( pb, buff );
-    }
+    return 1;
+}
 
-    /* the "initstring" should execute something like
-        >>> import nsapi
-        >>> nsapi.SetCallBack( someobject )
-        at this point obCallBack is a reference to someobject
-    */
+static void handler_clear( handler_cache *hc )
+{
+    handler_entry *he, *next;
+    int i;
 
-    if ( ! obCallBack ) 
+    for ( i = 0; i < HANDLER_BUCKETS; i++ )
     {
-        sprintf( buff, "nsapy_Init: after %s no callback object found", initstring );
-        return InitAbort( pb, buff );
+        for ( he = hc->buckets[i]; he; he = next )
+        {
+            next = he->next;
+            Py_DECREF( he->cls );
+            free( he->uri );
+            free( he );
+        }
+        hc->buckets[i] = NULL;
     }
-
-
-    /* Wow, this worked! */
-    return REQ_PROCEED;
+    hc->count = 0;
 }
 
 /**
- ** SetCallBack - assign a CallBack object
+ ** The module watcher
  **
- *  This function must be called from Python upon execution
- *  the initstring parameter, like this
- *
- *  >>> import nsapi
- *  >>> nsapi.SetCallBack( instance )
+ *  With "reload" given to nsapy_Init, handler modules are reloaded
+ *  when their source changes rather than on every debug request. 
+ *  The CallBack object tells us which files to watch ( nsapi.watch ),
+ *  and a thread of our own stat()s them every reloadInterval seconds.
+ *  A change bumps watchGen and marks the module with it. The CallBack
+ *  object asks nsapi.changes() what changed since the last generation
+ *  it has seen, and reloads those, so every interpreter in the pool
+ *  gets to reload its own copy. 
  *
- *  providing the instance as the CallBack object.
+ *  Only the watcher thread and nsapi.watch/changes touch the list, 
+ *  always inside watchLock. Looking is done with it shared, so the
+ *  watcher's stat()s don't hold up nsapi.changes().
  */
 
-static PyObject * SetCallBack( PyObject *self, PyObject *args )
-{
-
-    PyObject *callback;
-
-    /* returning NULL means error, returning Py_None is good */
-
-    /* see if CallBack is in *args */
-
-    if ( ! PyArg_ParseTuple( args, "O", &callback ) ) 
-        return NULL;
-
-    /* dispose of the old call back object, if there was one */
-  
-    Py_XDECREF( obCallBack );
- 
-    /* store the object, incref */
-
-    obCallBack = callback;  
-    Py_INCREF( obCallBack );
+#ifndef SYSTHREAD_DEFAULT_PRIORITY
+#define SYSTHREAD_DEFAULT_PRIORITY 16
+#endif
 
-    /* informative log message (callback) */
+typedef struct watch_entry {
+    char *name;                     /* module name */
+    char *path;                     /* its source */
+    time_t mtime;                   /* as of the last check */
+    off_t size;
+    int gen;                        /* watchGen when it last changed */
+    struct watch_entry *next;
+} watch_entry;
 
-    Log( "SetCallBack: obCallBack Initialized" );
+static watch_entry *watchList = NULL;
+static int watchGen = 0;
+static struct nsapy_lock *watchLock;
 
-    /* return None */
+/* has the file changed since we last looked? st is what it is now */
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static int watch_changed( watch_entry *we, struct stat *st )
+{
+    return system_stat( we->path, st ) == 0 && 
+           ( st->st_mtime != we->mtime || st->st_size != we->size );
 }
 
-/* typetest macro */
-#define is_criticalobject(o) ((o)->ob_type = &criticalobjecttype)
+static void watcher( void *arg )
+{
+    watch_entry *we;
+    struct stat st;
 
+    for ( ;; )
+    {
+        systhread_sleep( reloadInterval * 1000 );
+
+        lock_enter( watchLock, 1, -1 );
+        for ( we = watchList; we; we = we->next )
+            if ( watch_changed( we, &st ) )
+                break;
+        lock_exit( watchLock, 1 );
+        if ( ! we )
+            continue;
+
+        /* entries are never taken out, we is still good */
+        lock_enter( watchLock, 0, -1 );
+        for ( ; we; we = we->next )
+            if ( watch_changed( we, &st ) )
+            {
+                we->mtime = st.st_mtime;
+                we->size = st.st_size;
+                we->gen = ++watchGen;
+            }
+        lock_exit( watchLock, 0 );
+    }
+}
 
 /**
- ** crit_enter - enter a critical section
+ ** watch - nsapi.watch( name, path )
  **
- *  
- *  Netscape will halt all other processing
- *  until crit_exit for this critical section
- *  variable.
- *
+ *  Watch path, the source of module name. Watching a module again
+ *  ( from another interpreter, say ) changes nothing unless the 
+ *  path is different.
  */
 
-static PyObject * Py_crit_enter( PyObject *self, PyObject *args )
+static PyObject * Py_watch( PyObject *self, PyObject *args )
 {
+    watch_entry *we;
+    struct stat st;
+    char *name, *path;
 
-	criticalobject * crit;
-	char buff[1000];
-
-    if ( ! PyArg_ParseTuple( args, "O", &crit ) ) 
+    if ( ! PyArg_ParseTuple( args, "ss", &name, &path ) )
         return NULL;
 
+    if ( ! reloadInterval )
+    {
+        PyErr_SetString( PyExc_ValueError, "nsapi.watch needs \"reload\" in nsapy_Init" );
+        return NULL;
+    }
 
-	if ( ! is_criticalobject( crit ) )
+    if ( system_stat( path, &st ) != 0 )
     {
-        PyErr_SetString( PyExc_TypeError, 
-            "argument to crit_enter must be a CRITICAL object");
+        PyErr_SetString( PyExc_IOError, "nsapi.watch can't stat the file" );
         return NULL;
     }
 
-	crit_enter( crit->crit );
+    lock_enter( watchLock, 0, -1 );
+    for ( we = watchList; we; we = we->next )
+        if ( strcmp( we->name, name ) == 0 )
+            break;
 
-	sprintf( buff, "crit_enter: entered critical section %d", ( int ) crit->crit );
-    Log( buff );
+    if ( we && strcmp( we->path, path ) != 0 )
+    {
+        free( we->path );
+        we->path = strdup( path );
+        we->mtime = st.st_mtime;
+        we->size = st.st_size;
+    }
+    else if ( ! we )
+    {
+        we = ( watch_entry * ) malloc( sizeof( watch_entry ) );
+        if ( we )
+        {
+            we->name = strdup( name );
+            we->path = strdup( path );
+            we->mtime = st.st_mtime;
+            we->size = st.st_size;
+            we->gen = 0;
+            we->next = watchList;
+            watchList = we;
+        }
+    }
+    lock_exit( watchLock, 0 );
 
-    /* return None */
+    if ( ! we || ! we->name || ! we->path )
+        return PyErr_NoMemory();
 
-    Py_INCREF(Py_None);
+    Py_INCREF( Py_None );
     return Py_None;
 }
 
 /**
- ** crit_exit - exit a critical section
+ ** changes - nsapi.changes( since )
  **
+ *  Returns ( generation, [ names of modules changed since since ] ),
+ *  pass generation next time. 
  */
 
-static PyObject * Py_crit_exit( PyObject *self, PyObject *args )
+static PyObject * Py_changes( PyObject *self, PyObject *args )
 {
+    watch_entry *we;
+    PyObject *names, *name;
+    int since, gen;
 
-	criticalobject * crit;
-	char buff[1000];
-
-    if ( ! PyArg_ParseTuple( args, "O", &crit ) ) 
+    if ( ! PyArg_ParseTuple( args, "i", &since ) )
         return NULL;
 
-
-	if ( ! is_criticalobject( crit ) )
-    {
-        PyErr_SetString( PyExc_TypeError, 
-            "argument to crit_exit must be a CRITICAL object");
+    names = PyList_New( 0 );
+    if ( ! names )
         return NULL;
-    }
 
-	/* we must log this *BEFORE* we exit critical-section */
-	sprintf( buff, "crit_exit: exiting critical section %d", ( int ) crit->crit );
-    Log( buff );
+    /* nothing changed, the usual case, needn't wait for the lock */
+    gen = watchGen;
+    if ( gen == since )
+        return Py_BuildValue( "(iN)", gen, names );
 
-	crit_exit( crit->crit );
+    lock_enter( watchLock, 1, -1 );
+    gen = watchGen;
+    for ( we = watchList; we; we = we->next )
+        if ( we->gen > since )
+        {
+            name = PyString_FromString( we->name );
+            if ( ! name || PyList_Append( names, name ) < 0 )
+            {
+                Py_XDECREF( name );
+                Py_DECREF( names );
+                lock_exit( watchLock, 1 );
+                return NULL;
+            }
+            Py_DECREF( name );
+        }
+    lock_exit( watchLock, 1 );
 
-    /* return None */
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    return Py_BuildValue( "(iN)", gen, names );
 }
 
-
 /**
- ** Py_crit_init
+ ** log - nsapi.log( level, message )
  **
- *  This routine creates a Python version of NSAPI CRITICAL object 
- *
+ *  level is one of "debug", "info", "warning" or "error".
  */
-static PyObject * Py_crit_init( PyObject *self, PyObject *args )
+
+static PyObject * Py_log( PyObject *self, PyObject *args )
 {
+    PyObject *level;
+    char *message;
+    int len, n;
 
-	char buff[256];
+    if ( ! PyArg_ParseTuple( args, "Os#", &level, &message, &len ) )
+        return NULL;
 
-    criticalobject * result;
-	CRITICAL crit;
+    if ( ! code_lookup( level, logLevels, &n ) || n < NSAPY_DEBUG || n > NSAPY_ERROR )
+    {
+        PyErr_SetString( PyExc_ValueError, "unknown log level" );
+        return NULL;
+    }
 
-    result = PyMem_NEW( criticalobject, 1 );
+    if ( n >= logLevel && logFile )
+        log_put( n, message, len );
 
-    if ( ! result )
-        return PyErr_NoMemory();
+    Py_INCREF( Py_None );
+    return Py_None;
+}
 
-    result->ob_type = &criticalobjecttype;
+/**
+ ** log_open - nsapi.log_open( path )
+ **
+ *  Log to path ( appending ), from now on. Called again, it reopens
+ *  the file, which is what you want after the log has been rotated.
+ */
 
-	crit = crit_init();
-    result ->crit = crit;
+static PyObject * Py_log_open( PyObject *self, PyObject *args )
+{
+    FILE *f;
+    char *path;
+    int start;
 
-    _Py_NewReference( result );
+    if ( ! PyArg_ParseTuple( args, "s", &path ) )
+        return NULL;
 
-	sprintf( buff, "Py_crit_init: critical-section variable %d allocated", ( int ) crit ); 
-    Log( buff );
+    Py_BEGIN_ALLOW_THREADS
+    f = fopen( path, "a" );
+    Py_END_ALLOW_THREADS
 
-    return ( PyObject * ) result;
-}
+    if ( ! f )
+    {
+        PyErr_SetString( PyExc_IOError, "can't open the log file" );
+        return NULL;
+    }
 
-/*
- * critical_dealloc
- */
+    crit_enter( logCrit );
+    if ( logFile )
+        fclose( logFile );
+    logFile = f;
+    start = ! logFlushing;
+    logFlushing = 1;
+    crit_exit( logCrit );
 
-static void critical_dealloc( criticalobject *co )
-{
-	crit_terminate( co->crit );
-    free( co );
+    if ( start && ! systhread_start( SYSTHREAD_DEFAULT_PRIORITY, 0, log_flusher, NULL ) )
+    {
+        PyErr_SetString( PyExc_SystemError, "can't start the log flusher thread" );
+        return NULL;
+    }
+
+    Py_INCREF( Py_None );
+    return Py_None;
 }
 
 /**
- ** make_pblockobject
+ ** log_level - nsapi.log_level( [level] )
  **
- *  This routine creates a Python pblockobject given an NSAPI
- *  pblock pointer.
- *
+ *  Returns the log level, and changes it if level is given.
  */
 
-static pblockobject * make_pblockobject( pblock * from_pb )
+static PyObject * Py_log_level( PyObject *self, PyObject *args )
 {
-    pblockobject *result;
+    PyObject *level;
+    int n, old;
 
-    result = PyMem_NEW( pblockobject, 1 );
-    if ( ! result )
-        return ( pblockobject * ) PyErr_NoMemory();
+    level = NULL;
+    if ( ! PyArg_ParseTuple( args, "|O", &level ) )
+        return NULL;
 
-    result->pb = from_pb;
-    result->ob_type = &pblockobjecttype;
+    old = logLevel;
+    if ( level )
+    {
+        if ( ! code_lookup( level, logLevels, &n ) || n < NSAPY_DEBUG || n > NSAPY_ERROR )
+        {
+            PyErr_SetString( PyExc_ValueError, "unknown log level" );
+            return NULL;
+        }
+        logLevel = n;
+    }
 
-    _Py_NewReference( result );
-    return result;
+    return PyString_FromString( logLevels[ old ].name );
 }
 
 
-/** 
- ** Object Methods for pblock
+/**
+ ** Statistics
  **
- *  NOTE: FOR NOW ASSUME WE DON'T NEED THE pb_param STRUCTURE
- *      OR THE FUNCTIONS
- *  param_create, param_free, pblock_create, pblock_free,
- *  pblock_find (use pblock_findval instead), 
- *  pblock_pinsert (use pblock_nvinsert instead)
+ *  For every phase ( Service, AuthTrans, and Task for background tasks,
+ *  see below ) and handler module we count
+ *  requests, results and response bytes, and keep a histogram of the
+ *  time spent in the callback. As with the log, every thread has
+ *  counters of its own, so recording a request takes no lock, not
+ *  even the interpreter lock. nsapi.stats() and the "statsuri" page
+ *  add them up when asked, which is rare.
  *
+ *  The histogram has STATS_SUB buckets per power of two, the way HDR
+ *  histograms do it: anything from a microsecond to over an hour is
+ *  known to within about 6%, in a fixed STATS_BUCKETS counters.
  */
 
-static void pblock_dealloc( pblockobject *op )
-{  
-    /* Note that this frees the Python object, but not
-       the refrenece to a pblock that it holds. Httpd
-       should take care of that.
-    */
-    free( op );
+#define STATS_SERVICE   0
+#define STATS_AUTHTRANS 1
+#define STATS_TASK      2
+#define STATS_PHASES    3
+
+#define STATS_NAME      64          /* longest handler name kept */
+#define STATS_SLOTS     256         /* handlers per thread, a power of 2 */
+#define STATS_SHIFT     4
+#define STATS_SUB       ( 1 << STATS_SHIFT )
+#define STATS_BUCKETS   ( STATS_SUB + ( 32 - STATS_SHIFT ) * STATS_SUB )
+#define STATS_RESULTS   4
+
+static char *statsPhases[] = { "Service", "AuthTrans", "Task" };
+static char *statsResults[] = { "proceed", "noaction", "aborted", "exit" };
+
+typedef struct stats_entry {
+    char name[ STATS_NAME ];        /* the handler module */
+    int phase;
+    unsigned long requests;
+    unsigned long results[ STATS_RESULTS ];
+    double bytes;                   /* of response body */
+    double usec;                    /* all the time in the callback */
+    unsigned long min, max;
+    unsigned long hist[ STATS_BUCKETS ];
+} stats_entry;
+
+typedef struct stats_table {
+    stats_entry * volatile slots[ STATS_SLOTS ];
+    stats_entry other[ STATS_PHASES ]; /* when the slots run out */
+    struct stats_table *next;       /* all of them, see statsTables */
+} stats_table;
+
+static int statsKey = -1;           /* the thread's stats_table */
+static stats_table *statsTables = NULL; /* statsLock protects this */
+static struct nsapy_lock *statsLock;
+
+/* the URI that shows the statistics, NULL for none ( "statsuri" ) */
+static char *statsUri = NULL;
+
+/* microseconds from some point, only differences matter */
+
+static unsigned long stats_clock( void )
+{
+#ifdef XP_WIN32
+    return GetTickCount() * 1000UL;
+#else
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+#endif
 }
 
-/*
- * pb.findval( string ) 
- */
+/* which histogram bucket usec goes in */
 
-static PyObject * Py_findval( pblockobject *pbo, PyObject *args )
+static int stats_bucket( unsigned long usec )
 {
-    char *string, *value;
+    int e;
 
-    if (! PyArg_ParseTuple( args, "s", &string ) )
-        return NULL; /* error */
+    if ( usec < STATS_SUB )
+        return ( int ) usec;
+    if ( usec > 0xffffffffUL )
+        usec = 0xffffffffUL;
 
-    /* find the value as a string */
-    value = pblock_findval( string, pbo->pb );
+    for ( e = STATS_SHIFT; usec >> ( e + 1 ); e++ )
+        ;
 
-    if ( ! value )
+    return STATS_SUB + ( e - STATS_SHIFT ) * STATS_SUB + 
+           ( int ) ( usec >> ( e - STATS_SHIFT ) ) - STATS_SUB;
+}
+
+/* the largest value that goes in bucket i */
+
+static unsigned long stats_bucket_top( int i )
+{
+    int e, sub;
+
+    if ( i < STATS_SUB )
+        return i;
+
+    e = ( i - STATS_SUB ) / STATS_SUB + STATS_SHIFT;
+    sub = ( i - STATS_SUB ) % STATS_SUB + STATS_SUB;
+
+    return ( ( unsigned long ) ( sub + 1 ) << ( e - STATS_SHIFT ) ) - 1;
+}
+
+static int stats_result( int result )
+{
+    switch ( result )
     {
-        PyErr_SetString( PyExc_ValueError, "no such parameter" );
-        return NULL;
+        case REQ_PROCEED:   return 0;
+        case REQ_NOACTION:  return 1;
+        case REQ_EXIT:      return 3;
+        default:            return 2;
     }
+}
 
-    return PyString_FromString( value );
+/* one more time of usec for e */
+
+static void stats_time( stats_entry *e, unsigned long usec )
+{
+    e->requests++;
+    e->usec += usec;
+    if ( e->requests == 1 || usec < e->min )
+        e->min = usec;
+    if ( usec > e->max )
+        e->max = usec;
+    e->hist[ stats_bucket( usec ) ]++;
 }
 
-/*
- * pb.nvinsert( namestring, valuestring )
- */
+/* this thread's table, made the first time it serves a request */
 
-static PyObject * Py_nvinsert( pblockobject *pbo, PyObject *args )
+static stats_table * stats_table_get( void )
 {
+    stats_table *t;
+    int i;
 
-  char *name, *value;
+    t = ( stats_table * ) systhread_getdata( statsKey );
+    if ( t )
+        return t;
 
-  if (! PyArg_ParseTuple(args, "ss", &name, &value) )
-        return NULL; /* error */
+    t = ( stats_table * ) calloc( 1, sizeof( stats_table ) );
+    if ( ! t )
+        return NULL;
+    for ( i = 0; i < STATS_PHASES; i++ )
+    {
+        strcpy( t->other[i].name, "(other)" );
+        t->other[i].phase = i;
+    }
 
-  /* set the name/value, there doesn't seem to be any way to
-     check for success or failure. */
-  pblock_nvinsert( name, value, pbo->pb );
+    lock_enter( statsLock, 0, -1 );
+    t->next = statsTables;
+    statsTables = t;
+    lock_exit( statsLock, 0 );
 
-  Py_INCREF(Py_None);
-  return Py_None;
+    systhread_setdata( statsKey, t );
+    return t;
 }
 
-/*
- * pb.pblock2str() 
- */
+/* the entry for name in phase, added if it isn't there yet */
 
-static PyObject * Py_pblock2str( pblockobject *pbo, PyObject *args )
+static stats_entry * stats_entry_get( stats_table *t, int phase, char *name )
 {
-    char *temp;
-    PyObject *result;
+    stats_entry *e;
+    unsigned h;
+    int i;
 
-    if ( ! PyArg_ParseTuple( args, "" ) )
-        return NULL; /* error */
+    h = str_hash( name ) + phase;
+    for ( i = 0; i < STATS_SLOTS; i++ )
+    {
+        e = t->slots[ ( h + i ) & ( STATS_SLOTS - 1 ) ];
+        if ( ! e )
+            break;
+        if ( e->phase == phase && strcmp( e->name, name ) == 0 )
+            return e;
+    }
+    if ( i == STATS_SLOTS )
+        return &t->other[ phase ];
 
-    /* get the result, have the server allocate space */
-    temp = pblock_pblock2str( pbo->pb, NULL );
+    e = ( stats_entry * ) calloc( 1, sizeof( stats_entry ) );
+    if ( ! e )
+        return &t->other[ phase ];
+    strcpy( e->name, name );
+    e->phase = phase;
 
-    /* convert it to a PythonString */
-    result = PyString_FromString( temp ); 
+    /* readers may look at the slot any time, the entry
+       has to be all there before it shows up */
+    NSAPY_BARRIER();
+    t->slots[ ( h + i ) & ( STATS_SLOTS - 1 ) ] = e;
 
-    return result;
+    return e;
 }
 
-/* 
- * pb.pblock_remove( name )
- *
- */
-static PyObject * Py_pblock_remove( pblockobject *pbo, PyObject *args )
-{
-  char *name;
-  pb_param *temp;
-
-  if (! PyArg_ParseTuple(args, "s", &name) ) {
-    return NULL;  /* bad args */
-  }
+/**
+ ** stats_record - count a request, name is the handler module
+ ** ( len characters of it, or all if len is -1 )
+ **/
 
-  /* imitated from nsapi/examples/session.c */
-  temp = pblock_remove( name, pbo->pb );
+static void stats_record( int phase, char *name, int len, int result, 
+                          unsigned long usec, long bytes )
+{
+    char key[ STATS_NAME ];
+    stats_table *t;
+    stats_entry *e;
 
-  if ( temp )
-        param_free( temp );
+    if ( statsKey == -1 )
+        return;
+    t = stats_table_get();
+    if ( ! t )
+        return;
 
-  Py_INCREF( Py_None );
-  return Py_None;
+    if ( ! name || ! len )
+    {
+        name = "(none)";
+        len = -1;
+    }
+    if ( len < 0 || len >= STATS_NAME )
+        len = strlen( name ) < STATS_NAME ? strlen( name ) : STATS_NAME - 1;
+    memcpy( key, name, len );
+    key[ len ] = '\0';
+
+    e = stats_entry_get( t, phase, key );
+    stats_time( e, usec );
+    e->results[ stats_result( result ) ]++;
+    e->bytes += bytes;
 }
 
-/* standard getattr for pblocks */
+/* add src to dst */
 
-static PyObject * pblock_getattr( PyObject *pbo, char *name )
+static void stats_merge( stats_entry *dst, stats_entry *src )
 {
-    return Py_FindMethod( Pypblockmethods, pbo, name );
+    int i;
+
+    if ( ! src->requests )
+        return;
+
+    if ( ! dst->requests || src->min < dst->min )
+        dst->min = src->min;
+    if ( src->max > dst->max )
+        dst->max = src->max;
+    dst->requests += src->requests;
+    for ( i = 0; i < STATS_RESULTS; i++ )
+        dst->results[i] += src->results[i];
+    dst->bytes += src->bytes;
+    dst->usec += src->usec;
+    for ( i = 0; i < STATS_BUCKETS; i++ )
+        dst->hist[i] += src->hist[i];
 }
 
+static int stats_cmp( const void *a, const void *b )
+{
+    stats_entry *x = ( stats_entry * ) a, *y = ( stats_entry * ) b;
 
-/* typetest macro */
-#define is_sessionobject(op) ((op)->ob_type = &sessionobjecttype)
+    if ( x->phase != y->phase )
+        return x->phase - y->phase;
+    return strcmp( x->name, y->name );
+}
 
 /**
- ** make_session_object
- **
- *  Given a NSAPI Session, create a Python sessionobject
- *
- */
+ ** stats_collect - all the threads' counters added up, one entry
+ ** per phase and handler, sorted. *n is set to how many, the caller
+ ** frees the result. The owners keep counting while we read, so the
+ ** numbers are a request or two behind, never torn beyond that.
+ **/
 
-static sessionobject * make_sessionobject( Session *from_sn )
+static stats_entry * stats_collect( int *n )
 {
-    sessionobject *result;
-
-    result = PyMem_NEW( sessionobject, 1 );
-    if (! result )
-        return ( sessionobject * ) PyErr_NoMemory();
+    stats_entry *all, *e, *more;
+    stats_table *t;
+    int i, j, size;
+
+    *n = 0;
+    size = 16;
+    all = ( stats_entry * ) malloc( size * sizeof( stats_entry ) );
+    if ( ! all )
+        return NULL;
 
-    result->sn = from_sn;
-    result->ob_type = &sessionobjecttype;
-    _Py_NewReference( result );
+    /* the tables only ever come, the statistics pages can read together */
+    lock_enter( statsLock, 1, -1 );
+    for ( t = statsTables; t; t = t->next )
+        for ( i = 0; i < STATS_SLOTS + STATS_PHASES; i++ )
+        {
+            e = i < STATS_SLOTS ? t->slots[i] : &t->other[ i - STATS_SLOTS ];
+            if ( ! e || ! e->requests )
+                continue;
+
+            for ( j = 0; j < *n; j++ )
+                if ( all[j].phase == e->phase && strcmp( all[j].name, e->name ) == 0 )
+                    break;
+            if ( j == *n )
+            {
+                if ( *n == size )
+                {
+                    more = ( stats_entry * ) realloc( all, size * 2 * sizeof( stats_entry ) );
+                    if ( ! more )
+                        continue;
+                    all = more;
+                    size *= 2;
+                }
+                memset( &all[j], 0, sizeof( stats_entry ) );
+                strcpy( all[j].name, e->name );
+                all[j].phase = e->phase;
+                ( *n )++;
+            }
+            stats_merge( &all[j], e );
+        }
+    lock_exit( statsLock, 1 );
 
-    return result;
+    qsort( all, *n, sizeof( stats_entry ), stats_cmp );
+    return all;
 }
 
-/** 
- ** Object Methods for Session
- **
- */
+/* latencies reported for an entry, in microseconds */
 
-static void session_dealloc( sessionobject *op )
-{
-    /* Again, notice we let httpd do its freeing */
-    free( op );
-}
+#define STATS_LATENCIES 7
 
-/*
- * sn.session_dns() 
- */
-static PyObject * Py_session_dns( sessionobject *sno, PyObject *args )
+static char *statsLatencies[] = { "min", "mean", "p50", "p90", "p99", "p999", "max" };
+
+static void stats_latency( stats_entry *e, unsigned long *v )
 {
-    char *dns;
+    static double p[] = { 0.50, 0.90, 0.99, 0.999 };
+    unsigned long total, seen, want;
+    int i, k;
 
-    if (! PyArg_ParseTuple(args, "") )
-        return NULL; /* error */
+    memset( v, 0, STATS_LATENCIES * sizeof( unsigned long ) );
+    if ( ! e->requests )
+        return;
 
-    dns = session_dns( sno->sn );
+    v[0] = e->min;
+    v[1] = ( unsigned long ) ( e->usec / e->requests );
+    v[6] = e->max;
 
-    if ( dns )
-        return PyString_FromString( dns );
-    else 
+    total = 0;
+    for ( i = 0; i < STATS_BUCKETS; i++ )
+        total += e->hist[i];
+
+    for ( k = 0; k < 4; k++ )
     {
-        Py_INCREF( Py_None );
-        return Py_None;
+        want = ( unsigned long ) ( p[k] * total );
+        seen = 0;
+        for ( i = 0; i < STATS_BUCKETS; i++ )
+        {
+            seen += e->hist[i];
+            if ( seen > want )
+                break;
+        }
+        v[ k + 2 ] = i < STATS_BUCKETS && stats_bucket_top( i ) < e->max ? 
+                     stats_bucket_top( i ) : e->max;
     }
 }
 
-/*
- * sn.net_write(string)
- */
+/* a string that grows, for the statistics page */
 
-static PyObject * Py_net_write( sessionobject *sno, PyObject *args )
-{
+typedef struct stats_buf {
+    char *s;
     int len;
-    char *string;
+    int size;
+    int failed;
+} stats_buf;
 
-    if (! PyArg_ParseTuple(args, "s#", &string, &len) )
-        return NULL;  /* bad args */
+static void buf_printf( stats_buf *b, char *fmt, ... )
+{
+    char buff[1000], *s;
+    va_list ap;
+    int n;
+
+    va_start( ap, fmt );
+    vsnprintf( buff, sizeof( buff ), fmt, ap );
+    va_end( ap );
 
-    if ( net_write(sno->sn->csd, string, len) == IO_ERROR )
+    n = strlen( buff );
+    if ( b->len + n + 1 > b->size )
     {
-        PyErr_SetString( PyExc_IOError, "net_write failed" );
-        return NULL;
+        s = ( char * ) realloc( b->s, ( b->len + n + 1 ) * 2 );
+        if ( ! s )
+        {
+            b->failed = 1;
+            return;
+        }
+        b->s = s;
+        b->size = ( b->len + n + 1 ) * 2;
     }
 
-    Py_INCREF( Py_None );
-    return Py_None;
+    memcpy( b->s + b->len, buff, n + 1 );
+    b->len += n;
 }
 
-
-/* This is taken from an example that Netscape provides */
-
-/*
-   This function reads in data from the specified netbuf, discarding
-   the header and then converting the rest into a string in query
-   string format, up to len characters. qstr must already have been
-   allocated. It returns the number of characters actually read.
-   If the buffer is emptied early, a NULL is returned indicating
-   the error. 
-*/
-
-int post2qstr(netbuf *buf, char* qstr, int clen)
+static void stats_text_line( stats_buf *b, stats_entry *e, char *name )
 {
-    int i;                   /* index into qstr */
-    int ichar;               /* char read in from netbuf */
+    unsigned long v[ STATS_LATENCIES ];
+    int i;
+
+    stats_latency( e, v );
+    buf_printf( b, "  %-24.24s %9lu", name, e->requests );
+    for ( i = 0; i < STATS_RESULTS; i++ )
+        buf_printf( b, " %9lu", e->results[i] );
+    buf_printf( b, " %13.0f", e->bytes );
+    for ( i = 0; i < STATS_LATENCIES; i++ )
+        buf_printf( b, " %8lu", v[i] );
+    buf_printf( b, "\n" );
+}
 
-    i = 0;
-    ichar = !IO_EOF;
+/* a handler name as a JSON string */
 
-    /*
-       Loop through reading a character and writing it to qstr, until
-       either len characters have been read, there's no more input,
-       or there's an IO error.
-    */
+static void stats_json_name( stats_buf *b, char *name )
+{
+    char quoted[ STATS_NAME * 2 + 3 ], *q;
 
-     while (clen && ichar != IO_EOF)
-     {
-          ichar = netbuf_getc(buf);
-          /* check for error in reading */
-          if(ichar == IO_ERROR)
-          {
-               return 0;
-          }
-          qstr[i++] = ichar;
-          clen--;
-     }
-     qstr[i] = '\0';
+    q = quoted;
+    *q++ = '"';
+    for ( ; *name; name++ )
+    {
+        if ( *name == '"' || *name == '\\' )
+            *q++ = '\\';
+        else if ( ( unsigned char ) *name < ' ' )
+            continue;
+        *q++ = *name;
+    }
+    *q++ = '"';
+    *q = '\0';
 
-     return(i);
+    buf_printf( b, "%s", quoted );
 }
 
+static void stats_json_entry( stats_buf *b, stats_entry *e )
+{
+    unsigned long v[ STATS_LATENCIES ];
+    int i;
+
+    stats_latency( e, v );
+    buf_printf( b, "{\"requests\": %lu", e->requests );
+    for ( i = 0; i < STATS_RESULTS; i++ )
+        buf_printf( b, ", \"%s\": %lu", statsResults[i], e->results[i] );
+    buf_printf( b, ", \"bytes\": %.0f, \"usec\": {", e->bytes );
+    for ( i = 0; i < STATS_LATENCIES; i++ )
+        buf_printf( b, "%s\"%s\": %lu", i ? ", " : "", statsLatencies[i], v[i] );
+    buf_printf( b, "}}" );
+}
 
-/* 
- * sn.form_data(int)
- */
+/* the statistics as text ( json is 0 ) or JSON */
 
-static PyObject * Py_form_data(sessionobject *sno, PyObject *args )
+static void stats_format( stats_buf *b, int json )
 {
-    int clen;
-    PyObject *result;
-    char *qstr;              /* actual query string to work on */
-    int postlen;             /* number of chars read from net_buf */
+    stats_entry *all, total;
+    int n, i, j, phase;
 
-    result = NULL;
-    postlen = 0;
+    all = stats_collect( &n );
+    if ( ! all )
+    {
+        b->failed = 1;
+        return;
+    }
 
-    /* get length */
-    if (! PyArg_ParseTuple(args, "i", &clen) )
+    buf_printf( b, json ? "{" : "nsapy statistics, times in microseconds\n" );
+    for ( phase = 0; phase < STATS_PHASES; phase++ )
+    {
+        memset( &total, 0, sizeof( total ) );
+        for ( i = 0; i < n; i++ )
+            if ( all[i].phase == phase )
+                stats_merge( &total, &all[i] );
+
+        if ( json )
+        {
+            buf_printf( b, "%s\"%s\": {\"total\": ", phase ? ", " : "", statsPhases[ phase ] );
+            stats_json_entry( b, &total );
+            buf_printf( b, ", \"handlers\": {" );
+            for ( i = 0, j = 0; i < n; i++ )
+                if ( all[i].phase == phase )
+                {
+                    if ( j++ )
+                        buf_printf( b, ", " );
+                    stats_json_name( b, all[i].name );
+                    buf_printf( b, ": " );
+                    stats_json_entry( b, &all[i] );
+                }
+            buf_printf( b, "}}" );
+            continue;
+        }
+
+        buf_printf( b, "\n%s\n  %-24s %9s", statsPhases[ phase ], "handler", "requests" );
+        for ( i = 0; i < STATS_RESULTS; i++ )
+            buf_printf( b, " %9s", statsResults[i] );
+        buf_printf( b, " %13s", "bytes" );
+        for ( i = 0; i < STATS_LATENCIES; i++ )
+            buf_printf( b, " %8s", statsLatencies[i] );
+        buf_printf( b, "\n" );
+        for ( i = 0; i < n; i++ )
+            if ( all[i].phase == phase )
+                stats_text_line( b, &all[i], all[i].name );
+        stats_text_line( b, &total, "(total)" );
+    }
+    buf_printf( b, json ? "}\n" : "" );
+
+    free( all );
+}
+
+/**
+ ** stats_page - answer a request for statsuri, without Python.
+ ** Text, or JSON if the query string or Accept header asks for it.
+ **/
+
+static int stats_page( Session *sn, Request *rq )
+{
+    stats_buf b;
+    char *query, *accept, clen[32];
+    int json, rv;
+
+    query = pblock_findval( "query", rq->reqpb );
+    accept = pblock_findval( "accept", rq->headers );
+    json = ( query && strstr( query, "json" ) ) || ( accept && strstr( accept, "json" ) );
+
+    memset( &b, 0, sizeof( b ) );
+    stats_format( &b, json );
+    if ( b.failed || ! b.s )
+    {
+        free( b.s );
+        protocol_status( sn, rq, PROTOCOL_SERVER_ERROR, NULL );
+        return REQ_ABORTED;
+    }
+
+    param_free( pblock_remove( "content-type", rq->srvhdrs ) );
+    pblock_nvinsert( "content-type", json ? "application/json" : "text/plain", rq->srvhdrs );
+    sprintf( clen, "%d", b.len );
+    param_free( pblock_remove( "content-length", rq->srvhdrs ) );
+    pblock_nvinsert( "content-length", clen, rq->srvhdrs );
+    pblock_nvinsert( "cache-control", "no-cache", rq->srvhdrs );
+    protocol_status( sn, rq, PROTOCOL_OK, NULL );
+
+    rv = protocol_start_response( sn, rq );
+    if ( rv == REQ_NOACTION )
+        rv = REQ_PROCEED;
+    else if ( rv != REQ_ABORTED && net_write( sn->csd, b.s, b.len ) == IO_ERROR )
+        rv = REQ_EXIT;
+
+    free( b.s );
+    return rv;
+}
+
+/* the handler module for a URI: between the last slash and the last dot */
+
+static void stats_uri_name( char *uri, char **name, int *len )
+{
+    char *slash, *dot;
+
+    *name = NULL;
+    *len = 0;
+    if ( ! uri )
+        return;
+
+    slash = strrchr( uri, '/' );
+    *name = slash ? slash + 1 : uri;
+    dot = strrchr( *name, '.' );
+    *len = dot ? dot - *name : strlen( *name );
+}
+
+/**
+ ** nsapi.stats( [histogram] )
+ **
+ *  Returns { phase: { "total": counts, "handlers": { module: counts }}},
+ *  where counts is a dictionary of requests, results, bytes and 
+ *  latencies ( "usec" ). With histogram true, counts also has the 
+ *  histogram as a list of ( up to usec, requests ), empty buckets left out.
+ */
+
+static PyObject * stats_dict( stats_entry *e, int histogram )
+{
+    unsigned long v[ STATS_LATENCIES ];
+    PyObject *d, *lat, *hist, *o;
+    int i;
+
+    d = PyDict_New();
+    lat = PyDict_New();
+    if ( ! d || ! lat )
+    {
+        Py_XDECREF( d );
+        Py_XDECREF( lat );
         return NULL;
+    }
 
-    if ( clen <= 0 )
+    stats_latency( e, v );
+    for ( i = 0; i < STATS_LATENCIES; i++ )
     {
-        PyErr_SetString( PyExc_ValueError, 
-            "sn.form_data must have positive integer parameter" );
+        o = PyLong_FromUnsignedLong( v[i] );
+        PyDict_SetItemString( lat, statsLatencies[i], o );
+        Py_XDECREF( o );
+    }
+    PyDict_SetItemString( d, "usec", lat );
+    Py_DECREF( lat );
+
+    o = PyLong_FromUnsignedLong( e->requests );
+    PyDict_SetItemString( d, "requests", o );
+    Py_XDECREF( o );
+    for ( i = 0; i < STATS_RESULTS; i++ )
+    {
+        o = PyLong_FromUnsignedLong( e->results[i] );
+        PyDict_SetItemString( d, statsResults[i], o );
+        Py_XDECREF( o );
+    }
+    o = PyLong_FromDouble( e->bytes );
+    PyDict_SetItemString( d, "bytes", o );
+    Py_XDECREF( o );
+
+    if ( histogram )
+    {
+        hist = PyList_New( 0 );
+        if ( hist )
+        {
+            for ( i = 0; i < STATS_BUCKETS; i++ )
+                if ( e->hist[i] )
+                {
+                    o = Py_BuildValue( "(ll)", ( long ) stats_bucket_top( i ), ( long ) e->hist[i] );
+                    if ( o )
+                        PyList_Append( hist, o );
+                    Py_XDECREF( o );
+                }
+            PyDict_SetItemString( d, "histogram", hist );
+            Py_DECREF( hist );
+        }
+    }
+
+    if ( PyErr_Occurred() )
+    {
+        Py_DECREF( d );
         return NULL;
     }
 
-    /* allocate space to put the query string after we read it in */
+    return d;
+}
 
-    result = PyString_FromStringAndSize( (char *) NULL, clen );
-    if ( result == NULL )
+static PyObject * Py_stats( PyObject *self, PyObject *args )
+{
+    stats_entry *all, total;
+    PyObject *result, *phased, *handlers, *o;
+    int n, i, phase, histogram;
+
+    histogram = 0;
+    if ( ! PyArg_ParseTuple( args, "|i", &histogram ) )
         return NULL;
 
-    qstr = PyString_AS_STRING( (PyStringObject *) result);
+    Py_BEGIN_ALLOW_THREADS
+    all = stats_collect( &n );
+    Py_END_ALLOW_THREADS
+    if ( ! all )
+        return PyErr_NoMemory();
 
-    /* call the function above */
-    postlen = post2qstr( sno->sn->inbuf, qstr, clen );
+    result = PyDict_New();
+    for ( phase = 0; result && phase < STATS_PHASES; phase++ )
+    {
+        phased = PyDict_New();
+        handlers = PyDict_New();
+        memset( &total, 0, sizeof( total ) );
+        for ( i = 0; phased && handlers && i < n; i++ )
+            if ( all[i].phase == phase )
+            {
+                stats_merge( &total, &all[i] );
+                o = stats_dict( &all[i], histogram );
+                if ( o )
+                    PyDict_SetItemString( handlers, all[i].name, o );
+                Py_XDECREF( o );
+            }
 
-    if ( postlen != clen )
-        if ( _PyString_Resize( &result, postlen ) < 0 )
-            return NULL;
+        o = phased && handlers ? stats_dict( &total, histogram ) : NULL;
+        if ( o )
+        {
+            PyDict_SetItemString( phased, "total", o );
+            PyDict_SetItemString( phased, "handlers", handlers );
+            PyDict_SetItemString( result, statsPhases[ phase ], phased );
+        }
+        Py_XDECREF( o );
+        Py_XDECREF( handlers );
+        Py_XDECREF( phased );
+
+        if ( PyErr_Occurred() )
+        {
+            Py_XDECREF( result );
+            result = NULL;
+        }
+    }
 
+    free( all );
     return result;
 }
 
-/* 
- * sn.net_read(int)
+
+/**
+ ** Locks
+ **
+ *  nsapi.lock() is a lock of our own that readers can share. It can
+ *  be held by one writer, or by any number of readers at once, for
+ *  what is read far more often than it is changed. Waiting writers go
+ *  first, so readers coming and going can't keep one out for ever.
+ *  Waiting for it lets the other threads run Python, and a wait can
+ *  be given up after a while ( try_enter ).
+ *
+ *  A lock given a name is the same lock for everybody who asks for
+ *  that name: every handler module, and every interpreter in the
+ *  pool. Named locks stay until the server goes.
+ *
+ *  Only the thread that entered a lock can exit it: the writer's
+ *  thread is kept, and for the locks Python has, how many times each
+ *  thread holds it shared. A reader can enter again past waiting
+ *  writers, and an enter that would wait for the thread itself fails.
+ *
+ *  Every lock counts how often it was entered, how often that meant
+ *  waiting and for how long, and how many held it at once. We use the
+ *  same locks for what we read a lot and change rarely ourselves ( the
+ *  statistics tables, the watched modules ).
  */
-/*
-   This function is commented and omitted, because The Netscape
-   documentation didn't make it clear how to read additional information
-   from the session without incurring the possibility of blocking
-   and without violating the Server assumptions about the behavior
-   of the connection (whatever they may be).  If you want to be trusting
-   you can modify the function given below to use netbuf_getc(...) to
-   get one character at a time, but if you geuss the number of characters
-   in the buffer incorrectly the function may block, so we omit it.
 
-static PyObject *
-Py_net_read( sno, args )
-     sessionobject *sno;
-     PyObject *args;
+#define LOCK_POLL_MS    5           /* how often a timed wait looks again */
+
+/* the thread asking */
+#define lock_thread()   ( ( unsigned long ) systhread_current() )
+
+/* how many times a thread holds a lock shared */
+typedef struct lock_reader {
+    unsigned long thread;
+    int count;
+    struct lock_reader *next;
+} lock_reader;
+
+typedef struct nsapy_lock {
+    CRITICAL crit;                  /* only held to look at the rest */
+    CONDVAR changed;                /* notified when it's let go */
+    int readers;                    /* holding it shared */
+    int writer;                     /* holding it exclusively, 0 or 1 */
+    unsigned long owner;            /* the writer's thread */
+    int writers;                    /* waiting to, new readers wait behind them */
+    int sleepers;                   /* in condvar_wait() */
+    int waiters;                    /* in lock_enter(), sleeping or not */
+    int maxreaders;
+    unsigned long contended;        /* enters that had to wait */
+    unsigned long timeouts;         /* and gave up */
+    stats_entry wait;               /* all enters, how long they waited */
+    char *name;                     /* NULL if it isn't in the registry */
+    int track;                      /* keep holders, for Python's locks */
+    lock_reader *holders, *spare;   /* the readers by thread, and unused ones */
+    int orphaned;                   /* its lockobject went while it was busy */
+    struct nsapy_lock *next;
+} nsapy_lock;
+
+static nsapy_lock *namedLocks = NULL; /* lockRegistry protects this */
+static nsapy_lock *lockRegistry;
+
+/* a new lock, NULL if there's no memory */
+
+static nsapy_lock * lock_new( char *name )
 {
-  int test, len, realsize;
-  PyObject *result;
-  char *charbuffer;
-  result = NULL;
-  realsize = 0;
-  if (!Log("sn.net_read(...)\n")) {
-    return NULL;
-  }
-  test = PyArg_ParseTuple(args, "i", &len);
-  if (!test) {
-    return NULL;
-  }
-  if (len<=0) {
-    PyErr_SetString(PyExc_ValueError, 
-            "sn.net_read must have positive integer parameter");
-    return NULL;
-  }
-//  printf("s.nr: getting string\n");
-  result = PyString_FromStringAndSize((char *)NULL, len);
-  if (result == NULL) {
-    return NULL;
-  }
-//  printf("s.nr: getting internal string %d\n", len);
-  charbuffer = PyString_AS_STRING( (PyStringObject *) result);
-//  printf("s.nr: reading\n");
-//  *** this doesn't work on our system (bombs) ***
-  realsize = net_read(sno->sn->csd, charbuffer, len, 1);
-//  printf("s.nr: done reading %d\n", realsize);
-  if (realsize != len) {
-//    printf("s.nr: resizing string\n");
-    test = _PyString_Resize(&result, realsize);
-    if (test<0) {
-      return NULL;
+    nsapy_lock *lk;
+
+    lk = ( nsapy_lock * ) calloc( 1, sizeof( nsapy_lock ) );
+    if ( ! lk )
+        return NULL;
+    if ( name && ! ( lk->name = strdup( name ) ) )
+    {
+        free( lk );
+        return NULL;
     }
-  }
-//  printf("s.nr: exiting normally\n");
-  return result;
+
+    lk->crit = crit_init();
+    lk->changed = condvar_init( lk->crit );
+    return lk;
 }
-*/
 
-/* 
- *  sn.client()
- */
+static void lock_free( nsapy_lock *lk )
+{
+    lock_reader *r;
 
-static PyObject * Py_sn_client( sessionobject *sno, PyObject *args )
+    while ( ( r = lk->holders ) != NULL )
+    {
+        lk->holders = r->next;
+        free( r );
+    }
+    while ( ( r = lk->spare ) != NULL )
+    {
+        lk->spare = r->next;
+        free( r );
+    }
+    condvar_terminate( lk->changed );
+    crit_terminate( lk->crit );
+    free( lk->name );
+    free( lk );
+}
+
+/* nobody has it or wants it ( lk->crit held ) */
+#define lock_idle( lk ) \
+    ( ! ( lk )->readers && ! ( lk )->writer && ! ( lk )->waiters )
+
+/* this thread holds it shared ( lk->crit held, only known if lk->track ) */
+
+static int lock_reading( nsapy_lock *lk )
 {
+    lock_reader *r;
+    unsigned long thread;
 
-    if (! PyArg_ParseTuple(args, "") )
-        return NULL; /* error */
+    thread = lock_thread();
+    for ( r = lk->holders; r; r = r->next )
+        if ( r->thread == thread )
+            return 1;
 
-    return (PyObject *) make_pblockobject( sno->sn->client );
+    return 0;
 }
 
-/* 
- *standard getattr for sessions 
- */
+/* can't be had that way right now ( lk->crit held ). A reader coming
+   back for more goes past waiting writers, they're waiting for it */
 
-static PyObject * session_getattr( PyObject *pbo, char *name )
+static int lock_busy( nsapy_lock *lk, int shared )
 {
-    return Py_FindMethod( Pysessionmethods, pbo, name );
+    if ( ! shared )
+        return lk->writer || lk->readers;
+    if ( lk->writer )
+        return 1;
+    return lk->writers && ! ( lk->track && lock_reading( lk ) );
 }
 
+/* this thread would be waiting for itself: it's the writer, or it
+   holds it shared and wants it exclusively ( lk->crit held ) */
+#define lock_mine( lk, shared ) \
+    ( ( ( lk )->writer && ( lk )->owner == lock_thread() ) || \
+      ( ! ( shared ) && ( lk )->track && lock_reading( lk ) ) )
 
-/**
- ** make_requestobject
- **
- *  Given a Request, make a Python requestobject
- */
+/* count one more shared hold for this thread, 0 if there's no memory */
 
-static requestobject * make_requestobject( Request *from_rq )
+static int lock_reader_add( nsapy_lock *lk )
 {
-    requestobject *result;
+    lock_reader *r;
+    unsigned long thread;
 
-    result = PyMem_NEW( requestobject, 1 );
+    thread = lock_thread();
+    for ( r = lk->holders; r; r = r->next )
+        if ( r->thread == thread )
+        {
+            r->count++;
+            return 1;
+        }
 
-    if (! result )
-        return ( requestobject * ) PyErr_NoMemory();
+    r = lk->spare;
+    if ( r )
+        lk->spare = r->next;
+    else if ( ! ( r = ( lock_reader * ) malloc( sizeof( lock_reader ) ) ) )
+        return 0;
+    r->thread = thread;
+    r->count = 1;
+    r->next = lk->holders;
+    lk->holders = r;
+
+    return 1;
+}
 
-    result->rq = from_rq;
-    result->ob_type = &requestobjecttype;
+/* and one less, 0 if this thread doesn't hold it shared */
 
-    _Py_NewReference( result );
-    return result;
+static int lock_reader_remove( nsapy_lock *lk )
+{
+    lock_reader *r, **rp;
+    unsigned long thread;
+
+    thread = lock_thread();
+    for ( rp = &lk->holders; ( r = *rp ) != NULL; rp = &r->next )
+        if ( r->thread == thread )
+        {
+            if ( --r->count == 0 )
+            {
+                *rp = r->next;
+                r->next = lk->spare;
+                lk->spare = r;
+            }
+            return 1;
+        }
+
+    return 0;
+}
+
+/* have it, readers or the writer, and count it ( lk->crit held ).
+   0 if there's no memory to say which thread has it */
+
+static int lock_take( nsapy_lock *lk, int shared, unsigned long waited )
+{
+    if ( shared )
+    {
+        if ( lk->track && ! lock_reader_add( lk ) )
+            return 0;
+        lk->readers++;
+        if ( lk->readers > lk->maxreaders )
+            lk->maxreaders = lk->readers;
+    }
+    else
+    {
+        lk->writer = 1;
+        lk->owner = lock_thread();
+    }
+
+    stats_time( &lk->wait, waited );
+    return 1;
+}
+
+/* take it if it's free, without waiting or counting a miss;
+   -1 or -2 as for lock_enter() */
+
+static int lock_try( nsapy_lock *lk, int shared )
+{
+    int got;
+
+    crit_enter( lk->crit );
+    if ( lock_mine( lk, shared ) )
+    {
+        crit_exit( lk->crit );
+        return -2;
+    }
+    got = ! lock_busy( lk, shared );
+    if ( got && ! lock_take( lk, shared, 0 ) )
+        got = -1;
+    crit_exit( lk->crit );
+
+    return got;
 }
 
 /*
- * request_dealloc
- */
+ * lock_enter
+ *
+   Hold lk, shared or not, waiting up to timeout milliseconds for it
+   ( -1 for as long as it takes ). Returns 0 if it timed out, -1 if a
+   lock Python has couldn't be held shared for want of memory ( never
+   for our own ), -2 if this thread holds it so that it would wait for
+   itself. Doesn't let go of the interpreter, callers from Python must.
+*/
 
-static void request_dealloc( requestobject *op )
+static int lock_enter( nsapy_lock *lk, int shared, long timeout )
 {
-    free( op );
+    unsigned long start;
+    long waited;
+    int busy, got, gone;
+
+    crit_enter( lk->crit );
+    if ( lock_mine( lk, shared ) )
+    {
+        crit_exit( lk->crit );
+        return -2;
+    }
+    busy = lock_busy( lk, shared );
+    start = 0;
+    if ( busy )
+    {
+        start = stats_clock();
+        lk->contended++;
+        lk->waiters++;
+        if ( ! shared )
+            lk->writers++;
+    }
+
+    while ( lock_busy( lk, shared ) && timeout != 0 )
+    {
+        if ( timeout < 0 )
+        {
+            lk->sleepers++;
+            condvar_wait( lk->changed );
+            lk->sleepers--;
+        }
+        else
+        {
+            /* sleeps can run long, go by the clock */
+            waited = ( long ) ( ( stats_clock() - start ) / 1000 );
+            if ( waited >= timeout )
+                break;
+            crit_exit( lk->crit );
+            systhread_sleep( timeout - waited < LOCK_POLL_MS ? ( int ) ( timeout - waited ) : LOCK_POLL_MS );
+            crit_enter( lk->crit );
+        }
+    }
+
+    if ( busy )
+    {
+        lk->waiters--;
+        if ( ! shared )
+            lk->writers--;
+    }
+    got = ! lock_busy( lk, shared );
+    if ( got && ! lock_take( lk, shared, busy ? stats_clock() - start : 0 ) )
+        got = -1;
+    if ( got <= 0 )
+    {
+        if ( ! got )
+            lk->timeouts++;
+        /* readers kept back for this writer needn't be any more */
+        if ( ! shared && lk->sleepers )
+            condvar_notifyAll( lk->changed );
+    }
+    gone = lk->orphaned && lock_idle( lk );
+    crit_exit( lk->crit );
+
+    if ( gone )
+        lock_free( lk );
+    return got;
 }
 
-/* 
- * rq.request_header(namestring, sn)
- */
+/* let go of lk, returns 0 if this thread didn't hold it that way */
 
-static PyObject * Py_request_header( requestobject *rqo, PyObject *args )
+static int lock_exit( nsapy_lock *lk, int shared )
 {
+    int held, gone;
 
-    char *namestring, *value;
-    sessionobject *sno;
+    crit_enter( lk->crit );
+    if ( shared )
+        held = lk->track ? lock_reader_remove( lk ) : lk->readers > 0;
+    else
+        held = lk->writer && lk->owner == lock_thread();
+    if ( held )
+    {
+        if ( shared )
+            lk->readers--;
+        else
+            lk->writer = 0;
+        if ( ! lk->readers && lk->sleepers )
+            condvar_notifyAll( lk->changed );
+    }
+    gone = lk->orphaned && lock_idle( lk );
+    crit_exit( lk->crit );
 
-    if (! PyArg_ParseTuple(args, "sO", &namestring, &sno) )
-        return NULL; /* error */
+    if ( gone )
+        lock_free( lk );
+    return held;
+}
 
-    /* check that sno is a sessionobject */
-    if ( ! is_sessionobject( sno ) )
+/* the lock called name, made if it's the first time, NULL for no memory */
+
+static nsapy_lock * lock_named( char *name )
+{
+    nsapy_lock *lk;
+
+    lock_enter( lockRegistry, 1, -1 );
+    for ( lk = namedLocks; lk; lk = lk->next )
+        if ( strcmp( lk->name, name ) == 0 )
+            break;
+    lock_exit( lockRegistry, 1 );
+    if ( lk )
+        return lk;
+
+    /* somebody may have made it meanwhile */
+    lock_enter( lockRegistry, 0, -1 );
+    for ( lk = namedLocks; lk; lk = lk->next )
+        if ( strcmp( lk->name, name ) == 0 )
+            break;
+    if ( ! lk )
     {
-        PyErr_SetString( PyExc_TypeError, 
-            "second arg to request_header must be session object");
+        lk = lock_new( name );
+        if ( lk )
+        {
+            lk->track = 1;
+            lk->next = namedLocks;
+            namedLocks = lk;
+        }
+    }
+    lock_exit( lockRegistry, 0 );
+
+    return lk;
+}
+
+/* lk's counters, as a dictionary */
+
+static PyObject * lock_dict( nsapy_lock *lk )
+{
+    stats_entry wait;
+    unsigned long v[ STATS_LATENCIES ];
+    PyObject *result, *lat, *o;
+    int readers, writer, writers, maxreaders, i;
+    unsigned long contended, timeouts;
+
+    crit_enter( lk->crit );
+    wait = lk->wait;
+    readers = lk->readers;
+    writer = lk->writer;
+    writers = lk->writers;
+    maxreaders = lk->maxreaders;
+    contended = lk->contended;
+    timeouts = lk->timeouts;
+    crit_exit( lk->crit );
+
+    lat = PyDict_New();
+    if ( ! lat )
         return NULL;
+    stats_latency( &wait, v );
+    for ( i = 0; i < STATS_LATENCIES; i++ )
+    {
+        o = PyLong_FromUnsignedLong( v[i] );
+        PyDict_SetItemString( lat, statsLatencies[i], o );
+        Py_XDECREF( o );
     }
 
-    /* call the underlying request_header function */
-    if ( request_header( namestring, &value, sno->sn, rqo->rq ) 
-            == REQ_ABORTED)
+    result = Py_BuildValue( "{s:i,s:i,s:i,s:i,s:l,s:l,s:l,s:O}",
+                            "readers", readers, "writer", writer,
+                            "writers", writers, "maxreaders", maxreaders,
+                            "enters", ( long ) wait.requests, "contended", ( long ) contended,
+                            "timeouts", ( long ) timeouts, "wait", lat );
+    Py_DECREF( lat );
+    return result;
+}
+
+static PyObject * make_lockobject( nsapy_lock *lk, lockobject *owner )
+{
+    lockobject *result;
+
+    result = PyMem_NEW( lockobject, 1 );
+    if ( ! result )
+        return PyErr_NoMemory();
+
+    result->ob_type = &lockobjecttype;
+    result->lock = lk;
+    result->owner = owner;
+    Py_XINCREF( owner );
+
+    _Py_NewReference( result );
+    return ( PyObject * ) result;
+}
+
+static void lock_dealloc( lockobject *lo )
+{
+    nsapy_lock *lk;
+    int busy;
+
+    /* a named one is for everybody, an unnamed one only for us */
+    lk = lo->lock;
+    if ( lo->owner )
+        Py_DECREF( lo->owner );
+    else if ( ! lk->name )
+    {
+        /* one still held or waited for goes when it's let go */
+        crit_enter( lk->crit );
+        busy = ! lock_idle( lk );
+        lk->orphaned = busy;
+        crit_exit( lk->crit );
+        if ( busy )
+            nsapy_log_error( LOG_WARN, "nsapi.lock", NULL, NULL,
+                             "an unnamed lock went away while it was held, it's kept till it's let go" );
+        else
+            lock_free( lk );
+    }
+    free( lo );
+}
+
+/* enter lo waiting up to seconds ( for ever if negative ), 0 if it
+   didn't, -1 with a Python error if there was no memory or this
+   thread already holds it so that it would wait for itself */
+
+static int lock_wait( lockobject *lo, double seconds )
+{
+    int shared, got;
+    long timeout;
+
+    shared = lo->owner != NULL;
+    got = lock_try( lo->lock, shared );
+    if ( ! got )
+    {
+        timeout = seconds < 0 ? -1 : ( long ) ( seconds * 1000 );
+        Py_BEGIN_ALLOW_THREADS
+        got = lock_enter( lo->lock, shared, timeout );
+        Py_END_ALLOW_THREADS
+    }
+
+    if ( got == -2 )
+    {
+        PyErr_SetString( PyExc_ValueError, "the lock is already held by this thread" );
+        got = -1;
+    }
+    else if ( got < 0 )
+        PyErr_NoMemory();
+    return got;
+}
+
+/* exit lo, 0 with a ValueError if this thread doesn't hold it */
+
+static int lock_leave( lockobject *lo )
+{
+    if ( ! lock_exit( lo->lock, lo->owner != NULL ) )
+    {
+        PyErr_SetString( PyExc_ValueError, "the lock isn't held by this thread" );
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * lk.enter( [ seconds ] )
+ *
+   Hold the lock, shared if lk is some lock's shared, waiting as long
+   as it takes, or up to seconds. Returns 1, or 0 if seconds went by.
+ */
+
+static PyObject * Py_lock_enter( lockobject *lo, PyObject *args )
+{
+    double seconds;
+    int got;
+
+    seconds = -1;
+    if ( ! PyArg_ParseTuple( args, "|d", &seconds ) )
+        return NULL;
+
+    got = lock_wait( lo, seconds );
+    return got < 0 ? NULL : PyInt_FromLong( got );
+}
+
+/*
+ * lk.try_enter( [ seconds ] )
+ *
+   The same, but waiting no time at all unless told to.
+ */
+
+static PyObject * Py_lock_try_enter( lockobject *lo, PyObject *args )
+{
+    double seconds;
+    int got;
+
+    seconds = 0;
+    if ( ! PyArg_ParseTuple( args, "|d", &seconds ) )
+        return NULL;
+
+    got = lock_wait( lo, seconds < 0 ? 0 : seconds );
+    return got < 0 ? NULL : PyInt_FromLong( got );
+}
+
+/*
+ * lk.exit()
+ *
+   Let go of it, ValueError if this thread doesn't hold it that way.
+ */
+
+static PyObject * Py_lock_exit( lockobject *lo, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    if ( ! lock_leave( lo ) )
+        return NULL;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/* "with lk:" */
+
+static PyObject * Py_lock_with( lockobject *lo, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    if ( lock_wait( lo, -1 ) < 0 )
+        return NULL;
+
+    Py_INCREF( lo );
+    return ( PyObject * ) lo;
+}
+
+static PyObject * Py_lock_without( lockobject *lo, PyObject *args )
+{
+    if ( ! lock_leave( lo ) )
+        return NULL;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * lk.stats()
+ *
+   A dictionary of the lock: readers and writer holding it now, writers
+   waiting, maxreaders ( the most that held it at once ), enters,
+   contended ( had to wait ), timeouts, and wait, how long enters
+   waited, in microseconds like nsapi.stats().
+ */
+
+static PyObject * Py_lock_stats_of( lockobject *lo, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    return lock_dict( lo->lock );
+}
+
+static PyMethodDef Pylockmethods[] = {
+    { "enter",           (PyCFunction) Py_lock_enter,        1},
+    { "try_enter",       (PyCFunction) Py_lock_try_enter,    1},
+    { "exit",            (PyCFunction) Py_lock_exit,         1},
+    { "stats",           (PyCFunction) Py_lock_stats_of,     1},
+    { "__enter__",       (PyCFunction) Py_lock_with,         1},
+    { "__exit__",        (PyCFunction) Py_lock_without,      1},
+    { NULL, NULL } /* sentinel */
+};
+
+static PyObject * lock_getattr( lockobject *lo, char *name )
+{
+    if ( strcmp( name, "shared" ) == 0 )
+    {
+        if ( lo->owner )
+        {
+            Py_INCREF( lo );
+            return ( PyObject * ) lo;
+        }
+        return make_lockobject( lo->lock, lo );
+    }
+    if ( strcmp( name, "name" ) == 0 )
+    {
+        if ( lo->lock->name )
+            return PyString_FromString( lo->lock->name );
+        Py_INCREF( Py_None );
+        return Py_None;
+    }
+
+    return Py_FindMethod( Pylockmethods, ( PyObject * ) lo, name );
+}
+
+/*
+ * nsapi.lock( [ name ] )
+ *
+   A new lock, or the one called name. lk.enter() and lk.exit() hold
+   it exclusively, lk.shared.enter() and lk.shared.exit() along with
+   other readers. Either can be used with "with".
+ */
+
+static PyObject * Py_lock( PyObject *self, PyObject *args )
+{
+    nsapy_lock *lk;
+    char *name;
+
+    name = NULL;
+    if ( ! PyArg_ParseTuple( args, "|s", &name ) )
+        return NULL;
+
+    lk = name ? lock_named( name ) : lock_new( NULL );
+    if ( ! lk )
+        return PyErr_NoMemory();
+    if ( ! name )
+        lk->track = 1;
+
+    return make_lockobject( lk, NULL );
+}
+
+/*
+ * nsapi.lock_stats()
+ *
+   { name: lk.stats() } for all the named locks.
+ */
+
+static PyObject * Py_lock_stats( PyObject *self, PyObject *args )
+{
+    nsapy_lock *lk;
+    PyObject *result, *o;
+
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    result = PyDict_New();
+    if ( ! result )
+        return NULL;
+
+    /* they're never taken out, the list can be walked as it is */
+    lock_enter( lockRegistry, 1, -1 );
+    lk = namedLocks;
+    lock_exit( lockRegistry, 1 );
+    for ( ; lk; lk = lk->next )
+    {
+        o = lock_dict( lk );
+        if ( ! o || PyDict_SetItemString( result, lk->name, o ) < 0 )
+        {
+            Py_XDECREF( o );
+            Py_DECREF( result );
+            return NULL;
+        }
+        Py_DECREF( o );
+    }
+
+    return result;
+}
+
+
+/**
+ ** The interpreter pool
+ **
+ *  If the "interpreters" parameter is given to nsapy_Init, instead
+ *  of one interpreter serialized by "criticalonly" we create that
+ *  many sub-interpreters ( Py_NewInterpreter ), each with its own 
+ *  modules and its own CallBack object. A request takes a free
+ *  interpreter for the duration of the call into Python and gives
+ *  it back when done, so handler code never sees two requests at
+ *  once in the same interpreter, but N requests can be in progress.
+ *
+ *  NOTE: all the interpreters still share the one interpreter lock,
+ *  so two threads are never inside Python code at exactly the same
+ *  time. The point is that a request that isn't running Python code
+ *  ( e.g. waiting on the server ) doesn't hold up the rest.
+ *
+ */
+
+typedef struct nsapy_interp {
+    PyInterpreterState *istate;     /* the interpreter */
+    PyObject *obCallBack;           /* its CallBack object */
+    handler_cache handlers;         /* its RequestHandler classes */
+    int index;                      /* into nsapy_thread.tstates */
+    struct nsapy_interp *next;      /* next free interpreter */
+} nsapy_interp;
+
+static nsapy_interp *interps = NULL;
+static int ninterps = 0;
+
+/* the main interpreter, used when there is no pool */
+static PyInterpreterState *mainInterp = NULL;
+
+/* free interpreters, protected by interpCrit */
+static nsapy_interp *freeInterps = NULL;
+static CRITICAL interpCrit;
+static CONDVAR interpFree;
+static int interpPicky = 0;         /* waiting for one in particular */
+
+/**
+ ** Thread states
+ **
+ *  Python needs a thread state for every thread that runs in it.
+ *  Each NSAPI thread gets its own the first time it comes through
+ *  ( one per interpreter if there is a pool ) and keeps it, so
+ *  entering Python is just a matter of taking the interpreter lock.
+ *
+ *  While inside, whenever we call something in the server that
+ *  can block ( writing to a slow client, reading the request body,
+ *  DNS, waiting for a critical section ), the lock is let go with
+ *  Py_BEGIN_ALLOW_THREADS so that other requests can run.
+ *
+ */
+
+typedef struct nsapy_thread {
+    PyThreadState *current;         /* thread state in use, NULL if outside */
+    nsapy_interp *interp;           /* interpreter in use, NULL for main */
+    char *outbuf;                   /* sn.out buffer, kept between requests */
+    int outsize;
+#ifdef NSAPY_ZLIB
+    z_stream *z;                    /* sn.out compressor, kept likewise */
+    int zip, zlevel;                /* what it was made for */
+    char *zbuf;                     /* its output */
+#endif
+    PyThreadState *tstates[1];      /* [0] is main, [i+1] is interps[i] */
+} nsapy_thread;
+
+static int threadKey = -1;
+
+/**
+ ** thread_data - this thread's nsapy_thread, allocated on first use
+ **/
+
+static nsapy_thread * thread_data( void )
+{
+    nsapy_thread *t;
+
+    t = ( nsapy_thread * ) systhread_getdata( threadKey );
+    if ( ! t )
+    {
+        t = ( nsapy_thread * ) calloc( 1, sizeof( nsapy_thread ) +
+                                          ninterps * sizeof( PyThreadState * ) );
+        if ( ! t )
+            return NULL;
+        systhread_setdata( threadKey, t );
+    }
+
+    return t;
+}
+
+/**
+ ** thread_enter - take the interpreter lock with this thread's
+ ** state for the given interpreter ( NULL means main ).
+ **/
+
+static int thread_enter( nsapy_interp *interp )
+{
+    nsapy_thread *t;
+    PyThreadState **ts;
+
+    t = thread_data();
+    if ( ! t )
+        return 0;
+
+    ts = &t->tstates[ interp ? interp->index : 0 ];
+    if ( ! *ts )
+        *ts = PyThreadState_New( interp ? interp->istate : mainInterp );
+    if ( ! *ts )
+        return 0;
+
+    PyEval_AcquireThread( *ts );
+    t->current = *ts;
+    t->interp = interp;
+
+    return 1;
+}
+
+/**
+ ** thread_leave - release the interpreter lock
+ **/
+
+static void thread_leave( void )
+{
+    nsapy_thread *t;
+
+    t = ( nsapy_thread * ) systhread_getdata( threadKey );
+    t->current = NULL;
+    PyEval_ReleaseThread( t->tstates[ t->interp ? t->interp->index : 0 ] );
+}
+
+/**
+ ** interp_get - take an interpreter, from the pool if there is
+ ** one ( waiting for a free one if need be ), and enter it.
+ **
+ *  Returns the pool interpreter, or NULL for the main one. 
+ *  *ok is set to 0 if we couldn't get in at all.
+ */
+
+static nsapy_interp * interp_get( int *ok )
+{
+    nsapy_interp *interp;
+
+    interp = NULL;
+    if ( ninterps )
+    {
+        crit_enter( interpCrit );
+        while ( ! freeInterps )
+            condvar_wait( interpFree );
+        interp = freeInterps;
+        freeInterps = interp->next;
+        crit_exit( interpCrit );
+    }
+
+    *ok = thread_enter( interp );
+
+    return interp;
+}
+
+/**
+ ** interp_put - leave the interpreter and give it back to the pool
+ **/
+
+static void interp_put( nsapy_interp *interp, int ok )
+{
+    if ( ok )
+        thread_leave();
+
+    if ( interp )
+    {
+        crit_enter( interpCrit );
+        interp->next = freeInterps;
+        freeInterps = interp;
+        if ( interpPicky )
+            condvar_notifyAll( interpFree );
+        else
+            condvar_notify( interpFree );
+        crit_exit( interpCrit );
+    }
+}
+
+/**
+ ** interp_take - like interp_get, but a given interpreter ( the one
+ ** a task came from ), waiting until it is free.
+ **/
+
+static int interp_take( nsapy_interp *interp )
+{
+    nsapy_interp **ip;
+
+    if ( interp )
+    {
+        crit_enter( interpCrit );
+        for ( ;; )
+        {
+            for ( ip = &freeInterps; *ip && *ip != interp; ip = &( *ip )->next )
+                ;
+            if ( *ip )
+                break;
+            interpPicky++;
+            condvar_wait( interpFree );
+            interpPicky--;
+        }
+        *ip = interp->next;
+        crit_exit( interpCrit );
+    }
+
+    return thread_enter( interp );
+}
+
+/**
+ ** current_callback - the CallBack object of the interpreter
+ ** this thread is in, NULL if it isn't in one. 
+ **/
+
+static PyObject * current_callback( void )
+{
+    nsapy_thread *t;
+    PyInterpreterState *istate;
+    int i;
+
+    t = threadKey == -1 ? NULL : ( nsapy_thread * ) systhread_getdata( threadKey );
+    if ( t )
+    {
+        /* an NSAPI thread, we know where it is */
+        if ( ! t->current )
+            return NULL;
+        return t->interp ? t->interp->obCallBack : obCallBack;
+    }
+
+    /* some other thread ( e.g. nsapy_Init's ) holding the lock */
+    if ( ! ninterps )
+        return obCallBack;
+
+    istate = PyThreadState_Get()->interp;
+    for ( i = 0; i < ninterps; i++ )
+        if ( interps[i].istate == istate )
+            return interps[i].obCallBack;
+
+    return obCallBack;
+}
+
+
+/**
+ ** Background tasks
+ **
+ *  With "tasks" set, that many threads of our own run the callables
+ *  handlers give them: sn.defer( func [, args [, wait ]] ) once the
+ *  request is over and its response is out, nsapi.defer() right away.
+ *  Neither the client nor the server thread waits for them.
+ *
+ *  A task runs in the interpreter it came from ( taken from the pool
+ *  as a request would take it ) and, with criticalonly, inside the
+ *  critical section. The queue holds up to "taskqueue" tasks, counting
+ *  the ones still waiting for their request to end. defer() on a full
+ *  queue waits up to wait seconds for room, then raises IOError, so
+ *  the handler can do the work itself or drop it.
+ *
+ *  Every run is counted in the statistics as a "Task", under the name
+ *  of the callable. nsapi.task_stats() has the queue: how deep it is,
+ *  the deepest it's been, what was refused and how long tasks waited.
+ */
+
+#define TASK_POLL_MS    5           /* how often a timed wait looks at a full queue */
+
+typedef struct nsapy_task {
+    PyObject *func, *args;
+    nsapy_interp *interp;           /* where they belong, NULL for main */
+    unsigned long queued;           /* stats_clock() when it was queued */
+    char name[ STATS_NAME ];
+    struct nsapy_task *next;
+} nsapy_task;
+
+static int taskWorkers = 0;         /* "tasks" */
+static int taskCapacity = 1000;     /* "taskqueue" */
+
+/* the queue and its counters, taskCrit protects them all */
+static nsapy_task *taskHead = NULL, *taskTail = NULL;
+static int taskCount = 0;           /* queued, or waiting for a request */
+static int taskDepth = 0;           /* queued */
+static int taskMaxDepth = 0;
+static int taskBusy = 0;            /* being run */
+static unsigned long taskSubmitted = 0, taskRefused = 0;
+static stats_entry taskWait;        /* time in the queue */
+static int taskSleepers = 0;        /* waiting for room as long as it takes */
+static CRITICAL taskCrit;
+static CONDVAR taskReady;
+static CONDVAR taskRoom;            /* a place in the queue came free */
+
+/* the interpreter the calling thread is in, NULL for main */
+
+static nsapy_interp * task_interp( void )
+{
+    nsapy_thread *t;
+    PyInterpreterState *istate;
+    int i;
+
+    t = threadKey == -1 ? NULL : ( nsapy_thread * ) systhread_getdata( threadKey );
+    if ( t && t->current )
+        return t->interp;
+
+    istate = PyThreadState_Get()->interp;
+    for ( i = 0; i < ninterps; i++ )
+        if ( interps[i].istate == istate )
+            return &interps[i];
+
+    return NULL;
+}
+
+/*
+ * task_room
+ *
+   Take a place in the queue, waiting for one up to wait seconds, or
+   as long as it takes if wait is negative. Returns 0 if there wasn't
+   one in time. Doesn't let go of the interpreter, task_new does.
+*/
+
+static int task_room( double wait )
+{
+    unsigned long start, limit;
+    int room;
+
+    /* stats_clock() differences are good for an hour at least */
+    start = stats_clock();
+    if ( wait < 0 )
+        limit = 0;
+    else
+        limit = wait > 3600 ? 3600000000UL : ( unsigned long ) ( wait * 1000000 );
+
+    crit_enter( taskCrit );
+    while ( taskCount >= taskCapacity )
+    {
+        if ( wait < 0 )
+        {
+            taskSleepers++;
+            condvar_wait( taskRoom );
+            taskSleepers--;
+        }
+        else if ( stats_clock() - start < limit )
+        {
+            crit_exit( taskCrit );
+            systhread_sleep( TASK_POLL_MS );
+            crit_enter( taskCrit );
+        }
+        else
+            break;
+    }
+    room = taskCount < taskCapacity;
+    if ( room )
+    {
+        taskCount++;
+        taskSubmitted++;
+    }
+    crit_exit( taskCrit );
+
+    return room;
+}
+
+/*
+ * task_new
+ *
+   A task for func( *args ), with its place in the queue taken, waiting
+   for one as task_room() does. NULL, with a Python error, if there's
+   no room or it can't be made.
+*/
+
+static nsapy_task * task_new( PyObject *func, PyObject *args, double wait )
+{
+    nsapy_task *task;
+    PyObject *name;
+    int room;
+
+    if ( ! taskWorkers )
+    {
+        PyErr_SetString( PyExc_ValueError, "defer needs \"tasks\" in nsapy_Init" );
+        return NULL;
+    }
+    if ( ! PyCallable_Check( func ) || ( args && ! PyTuple_Check( args ) ) )
+    {
+        PyErr_SetString( PyExc_TypeError, "defer needs a callable and a tuple of arguments" );
+        return NULL;
+    }
+
+    /* straight away if there's room, the interpreter let go if not */
+    room = task_room( 0 );
+    if ( ! room && wait != 0 )
+    {
+        Py_BEGIN_ALLOW_THREADS
+        room = task_room( wait );
+        Py_END_ALLOW_THREADS
+    }
+    if ( ! room )
+    {
+        crit_enter( taskCrit );
+        taskRefused++;
+        crit_exit( taskCrit );
+        PyErr_SetString( PyExc_IOError, "the task queue is full" );
+        return NULL;
+    }
+
+    task = ( nsapy_task * ) malloc( sizeof( nsapy_task ) );
+    if ( args )
+        Py_INCREF( args );
+    else
+        args = PyTuple_New( 0 );
+    if ( ! task || ! args )
+    {
+        free( task );
+        Py_XDECREF( args );
+        crit_enter( taskCrit );
+        taskCount--;
+        if ( taskSleepers )
+            condvar_notify( taskRoom );
+        crit_exit( taskCrit );
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    name = PyObject_GetAttrString( func, "__name__" );
+    if ( name && PyString_Check( name ) )
+    {
+        strncpy( task->name, PyString_AsString( name ), STATS_NAME - 1 );
+        task->name[ STATS_NAME - 1 ] = '\0';
+    }
+    else
+        strcpy( task->name, "(task)" );
+    Py_XDECREF( name );
+    PyErr_Clear();
+
+    Py_INCREF( func );
+    task->func = func;
+    task->args = args;
+    task->interp = task_interp();
+    task->next = NULL;
+
+    return task;
+}
+
+/* put the tasks from first on in the queue, for the workers */
+
+static void task_queue( nsapy_task *first )
+{
+    nsapy_task *last;
+    unsigned long now;
+    int n;
+
+    now = stats_clock();
+    n = 1;
+    for ( last = first; last->next; last = last->next )
+    {
+        last->queued = now;
+        n++;
+    }
+    last->queued = now;
+
+    crit_enter( taskCrit );
+    if ( taskTail )
+        taskTail->next = first;
+    else
+        taskHead = first;
+    taskTail = last;
+    taskDepth += n;
+    if ( taskDepth > taskMaxDepth )
+        taskMaxDepth = taskDepth;
+    if ( n == 1 )
+        condvar_notify( taskReady );
+    else
+        condvar_notifyAll( taskReady );
+    crit_exit( taskCrit );
+}
+
+/* the request is over, what it deferred can run */
+
+static void task_release( sessionobject *sno )
+{
+    if ( sno->tasks )
+        task_queue( sno->tasks );
+    sno->tasks = NULL;
+}
+
+/* log the Python error a task ended with */
+
+static void task_error( nsapy_task *task )
+{
+    PyObject *type, *value, *tb, *t, *v;
+    char buff[ 600 ];
+
+    PyErr_Fetch( &type, &value, &tb );
+    t = type ? PyObject_Str( type ) : NULL;
+    v = value ? PyObject_Str( value ) : NULL;
+    sprintf( buff, "task %.60s failed: %.100s: %.400s", task->name,
+             t && PyString_Check( t ) ? PyString_AsString( t ) : "error",
+             v && PyString_Check( v ) ? PyString_AsString( v ) : "" );
+    Py_XDECREF( t );
+    Py_XDECREF( v );
+    Py_XDECREF( type );
+    Py_XDECREF( value );
+    Py_XDECREF( tb );
+    PyErr_Clear();
+
+    nsapy_log( NSAPY_ERROR, "%s", buff );
+    nsapy_log_error( LOG_WARN, "nsapy_task", NULL, NULL, buff );
+}
+
+static void task_worker( void *arg )
+{
+    nsapy_task *task;
+    nsapy_interp *interp;
+    PyObject *result;
+    unsigned long start, waited, spent;
+    int entered, ok;
+
+    for ( ;; )
+    {
+        crit_enter( taskCrit );
+        while ( ! taskHead )
+            condvar_wait( taskReady );
+        task = taskHead;
+        taskHead = task->next;
+        if ( ! taskHead )
+            taskTail = NULL;
+        taskDepth--;
+        taskCount--;
+        taskBusy++;
+        if ( taskSleepers )
+            condvar_notify( taskRoom );
+
+        start = stats_clock();
+        waited = start - task->queued;
+        stats_time( &taskWait, waited );
+        crit_exit( taskCrit );
+
+        if ( obCrit != Py_None )
+            crit_enter( ( ( criticalobject * ) obCrit )->crit );
+
+        ok = 0;
+        interp = task->interp;
+        entered = interp_take( interp );
+        if ( entered )
+        {
+            start = stats_clock();
+            result = PyEval_CallObject( task->func, task->args );
+            spent = stats_clock() - start;
+            if ( result )
+                ok = 1;
+            else
+                task_error( task );
+            Py_XDECREF( result );
+            Py_DECREF( task->func );
+            Py_DECREF( task->args );
+        }
+        else
+        {
+            /* without a thread state, func and args can't even be let go */
+            spent = 0;
+            nsapy_log_error( LOG_WARN, "nsapy_task", NULL, NULL, "couldn't get a Python thread state" );
+        }
+        interp_put( interp, entered );
+
+        if ( obCrit != Py_None )
+            crit_exit( ( ( criticalobject * ) obCrit )->crit );
+
+        crit_enter( taskCrit );
+        taskBusy--;
+        crit_exit( taskCrit );
+
+        stats_record( STATS_TASK, task->name, -1, ok ? REQ_PROCEED : REQ_ABORTED, spent, 0 );
+        free( task );
+    }
+}
+
+/* start the workers, at the end of nsapy_Init */
+
+static int task_start( void )
+{
+    int i;
+
+    for ( i = 0; i < taskWorkers; i++ )
+        if ( ! systhread_start( SYSTHREAD_DEFAULT_PRIORITY, 0, task_worker, NULL ) )
+            return 0;
+
+    return 1;
+}
+
+/*
+ * nsapi.defer( func [, args [, wait ]] )
+ *
+   Run func( *args ) in a task thread, as soon as one is free. wait is
+   how many seconds to wait for room in the queue ( none by default,
+   negative for as long as it takes ) before IOError.
+ */
+
+static PyObject * Py_defer( PyObject *self, PyObject *args )
+{
+    PyObject *func, *fargs;
+    nsapy_task *task;
+    double wait;
+
+    fargs = NULL;
+    wait = 0;
+    if ( ! PyArg_ParseTuple( args, "O|O!d", &func, &PyTuple_Type, &fargs, &wait ) )
+        return NULL;
+
+    task = task_new( func, fargs, wait );
+    if ( ! task )
+        return NULL;
+    task_queue( task );
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * sn.defer( func [, args [, wait ]] )
+ *
+   The same, but not before the request is over: the response has been
+   sent, and the server thread has let go of Python.
+ */
+
+static PyObject * Py_sn_defer( sessionobject *sno, PyObject *args )
+{
+    PyObject *func, *fargs;
+    nsapy_task *task, **tp;
+    double wait;
+
+    fargs = NULL;
+    wait = 0;
+    if ( ! PyArg_ParseTuple( args, "O|O!d", &func, &PyTuple_Type, &fargs, &wait ) )
+        return NULL;
+
+    task = task_new( func, fargs, wait );
+    if ( ! task )
+        return NULL;
+
+    /* in the order they were deferred */
+    for ( tp = &sno->tasks; *tp; tp = &( *tp )->next )
+        ;
+    *tp = task;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * nsapi.task_stats()
+ *
+   A dictionary of the task queue: workers, capacity, depth ( queued
+   now ), held ( waiting for their request ), busy, maxdepth,
+   submitted, refused, and wait, the time tasks spent in the queue,
+   in microseconds like nsapi.stats().
+ */
+
+static PyObject * Py_task_stats( PyObject *self, PyObject *args )
+{
+    stats_entry wait;
+    unsigned long v[ STATS_LATENCIES ];
+    PyObject *result, *lat, *o;
+    int depth, count, busy, maxdepth, i;
+    unsigned long submitted, refused;
+
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    if ( taskWorkers )
+    {
+        crit_enter( taskCrit );
+        wait = taskWait;
+        depth = taskDepth;
+        count = taskCount;
+        busy = taskBusy;
+        maxdepth = taskMaxDepth;
+        submitted = taskSubmitted;
+        refused = taskRefused;
+        crit_exit( taskCrit );
+    }
+    else
+    {
+        memset( &wait, 0, sizeof( wait ) );
+        depth = count = busy = maxdepth = 0;
+        submitted = refused = 0;
+    }
+
+    lat = PyDict_New();
+    if ( ! lat )
+        return NULL;
+    stats_latency( &wait, v );
+    for ( i = 0; i < STATS_LATENCIES; i++ )
+    {
+        o = PyLong_FromUnsignedLong( v[i] );
+        PyDict_SetItemString( lat, statsLatencies[i], o );
+        Py_XDECREF( o );
+    }
+
+    result = Py_BuildValue( "{s:i,s:i,s:i,s:i,s:i,s:i,s:l,s:l,s:O}",
+                            "workers", taskWorkers, "capacity", taskCapacity,
+                            "depth", depth, "held", count - depth, "busy", busy,
+                            "maxdepth", maxdepth, "submitted", ( long ) submitted,
+                            "refused", ( long ) refused, "wait", lat );
+    Py_DECREF( lat );
+    return result;
+}
+
+/**
+ ** Worker processes
+ **
+ *  With "processes" set, Python doesn't run in the server at all.
+ *  nsapy_Init forks a supervisor process, which forks that many
+ *  workers, and each of them goes on to initialize Python, run module
+ *  and initstring and wait for requests, with "interpreters", "tasks"
+ *  and the rest of nsapy_Init's parameters as they would be in the
+ *  server. A handler that crashes Python, leaks or hangs takes one
+ *  worker with it, not the server, and the supervisor starts another
+ *  in its place.
+ *
+ *  nsapy_Service and nsapy_AuthTrans hand every request to a free
+ *  worker: the pblocks go into its piece of shared memory ( a piece at
+ *  a time if they don't fit ) and a short message down its socket says
+ *  so. The worker runs the request on
+ *  copies of them, so handlers see the same sn and rq as ever. What
+ *  only the server can do, starting the response, writing to the
+ *  client, reading the body, the worker asks the server thread to do,
+ *  through the same memory ( see sn_write() ), and when it's done
+ *  srvhdrs and vars go back into the server's rq.
+ *
+ *  Each worker started gets a new socket, the supervisor passes the
+ *  server its end. A worker that dies closes the other, so the server
+ *  thread waiting on it knows at once: that request fails, and the
+ *  next one for the slot goes to the replacement.
+ *
+ *  The statistics page is the server's, and counts every request;
+ *  nsapi.stats(), the response cache and the log are each worker's own.
+ */
+
+#ifdef NSAPY_PREFORK
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0           /* the server ignores SIGPIPE anyway */
+#endif
+
+#define PF_BUF          65536       /* shared memory for each worker */
+#define PF_PBLOCK       11          /* hash size of a worker's pblocks */
+#define PF_POLL_MS      100         /* how often the supervisor looks */
+#define PF_RESTART      1           /* seconds a worker must last, or the next waits */
+
+/* messages between the server and a worker, data is in the worker's buffer */
+#define PF_SERVICE      1           /* the request, for nsapy_Service */
+#define PF_AUTHTRANS    2           /* the same, for nsapy_AuthTrans */
+#define PF_START        3           /* start the response with these srvhdrs */
+#define PF_WRITE        4           /* write this to the client */
+#define PF_READ         5           /* read up to arg bytes of the body */
+#define PF_DNS          6           /* the client's host name */
+#define PF_DONE         7           /* request over, arg is the REQ_* code */
+#define PF_REPLY        8           /* the server's answer, in arg */
+#define PF_MORE         9           /* the next piece of a PF_START or PF_DONE */
+#define PF_REST         10          /* the request from byte arg on */
+
+typedef struct pf_msg {
+    int op, len, arg;
+} pf_msg;
+
+typedef struct pf_worker {
+    int fd;                         /* our end of its socket, -1 once it died */
+    int pending;                    /* its replacement's, until we notice */
+    char *buf;                      /* its part of the shared memory */
+    struct pf_worker *next;
+} pf_worker;
+
+static int pfCount = 0;             /* "processes" */
+static char *pfShm = NULL;
+
+/* in the server: the workers, and the supervisor's socket */
+static pf_worker *pfWorkers = NULL, *pfFree = NULL;
+static int pfCtl = -1;
+static CRITICAL pfCrit, pfCtlCrit;
+static CONDVAR pfReady;
+
+/* in a worker: its socket and buffer */
+static int pfFd = -1;
+static char *pfBuf = NULL;
+
+/* send or receive one whole message, 0 if the other end is gone */
+
+static int pf_send( int fd, int op, int len, int arg )
+{
+    pf_msg msg;
+    int n, sent;
+
+    msg.op = op;
+    msg.len = len;
+    msg.arg = arg;
+
+    for ( sent = 0; sent < sizeof( msg ); sent += n )
+    {
+        n = send( fd, ( char * ) &msg + sent, sizeof( msg ) - sent, MSG_NOSIGNAL );
+        if ( n < 0 && errno == EINTR )
+            n = 0;
+        else if ( n <= 0 )
+            return 0;
+    }
+
+    return 1;
+}
+
+static int pf_recv( int fd, pf_msg *msg )
+{
+    int n, got;
+
+    for ( got = 0; got < sizeof( *msg ); got += n )
+    {
+        n = recv( fd, ( char * ) msg + got, sizeof( *msg ) - got, 0 );
+        if ( n < 0 && errno == EINTR )
+            n = 0;
+        else if ( n <= 0 )
+            return 0;
+    }
+
+    return 1;
+}
+
+/* the supervisor gives the server a worker's socket, with its slot */
+
+static int pf_send_fd( int ctl, int slot, int fd )
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        struct cmsghdr align;
+        char space[ CMSG_SPACE( sizeof( int ) ) ];
+    } u;
+    int n;
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base = ( char * ) &slot;
+    iov.iov_len = sizeof( slot );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.space;
+    msg.msg_controllen = sizeof( u.space );
+
+    cm = CMSG_FIRSTHDR( &msg );
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN( sizeof( int ) );
+    memcpy( CMSG_DATA( cm ), &fd, sizeof( int ) );
+
+    do
+        n = sendmsg( ctl, &msg, 0 );
+    while ( n < 0 && errno == EINTR );
+
+    return n == sizeof( slot );
+}
+
+static int pf_recv_fd( int ctl, int *slot, int *fd )
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        struct cmsghdr align;
+        char space[ CMSG_SPACE( sizeof( int ) ) ];
+    } u;
+    int n;
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base = ( char * ) slot;
+    iov.iov_len = sizeof( *slot );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.space;
+    msg.msg_controllen = sizeof( u.space );
+
+    do
+        n = recvmsg( ctl, &msg, 0 );
+    while ( n < 0 && errno == EINTR );
+
+    cm = CMSG_FIRSTHDR( &msg );
+    if ( n != sizeof( *slot ) || ! cm || cm->cmsg_type != SCM_RIGHTS )
+        return 0;
+    memcpy( fd, CMSG_DATA( cm ), sizeof( int ) );
+
+    return 1;
+}
+
+/*
+ * pf_pack
+ *
+   Put the n pblocks ( NULL for an empty one ) into buf, each as name,
+   value, name, value, ... '\0' with every string '\0' terminated.
+   buf has to have room for pf_size() of them. Returns the length.
+*/
+
+static int pf_pack( char *buf, pblock **pbs, int n )
+{
+    struct pb_entry *p;
+    int len, i, j, nl, vl;
+
+    len = 0;
+    for ( i = 0; i < n; i++ )
+    {
+        for ( j = 0; pbs[i] && j < pbs[i]->hsize; j++ )
+            for ( p = pbs[i]->ht[j]; p; p = p->next )
+            {
+                nl = strlen( p->param->name ) + 1;
+                vl = strlen( p->param->value ) + 1;
+                memcpy( buf + len, p->param->name, nl );
+                memcpy( buf + len + nl, p->param->value, vl );
+                len += nl + vl;
+            }
+        buf[ len++ ] = '\0';
+    }
+
+    return len;
+}
+
+static int pf_size( pblock **pbs, int n )
+{
+    struct pb_entry *p;
+    int len, i, j;
+
+    len = 0;
+    for ( i = 0; i < n; i++ )
+    {
+        for ( j = 0; pbs[i] && j < pbs[i]->hsize; j++ )
+            for ( p = pbs[i]->ht[j]; p; p = p->next )
+                len += strlen( p->param->name ) + strlen( p->param->value ) + 2;
+        len++;
+    }
+
+    return len;
+}
+
+/* and back, into pblocks that are emptied first */
+
+static void pf_unpack( char *buf, int len, pblock **pbs, int n )
+{
+    char *end, *name;
+    int i, j;
+
+    end = buf + len;
+    for ( i = 0; i < n && buf < end; i++ )
+    {
+        for ( j = 0; j < pbs[i]->hsize; j++ )
+            while ( pbs[i]->ht[j] )
+                param_free( pblock_remove( pbs[i]->ht[j]->param->name, pbs[i] ) );
+
+        while ( buf < end && *buf )
+        {
+            name = buf;
+            buf += strlen( buf ) + 1;
+            pblock_nvinsert( name, buf, pbs[i] );
+            buf += strlen( buf ) + 1;
+        }
+        buf++;
+    }
+}
+
+/*
+ * pf_ask
+ *
+   In a worker, have the server thread do op with the len bytes in
+   pfBuf, and wait for its answer. Without a server there is nothing
+   left to do, so the worker ends.
+*/
+
+static void pf_ask( int op, int len, int arg, pf_msg *reply )
+{
+    if ( ! pf_send( pfFd, op, len, arg ) || ! pf_recv( pfFd, reply ) )
+        _exit( 0 );
+}
+
+/*
+ * pf_put
+ *
+   In a worker, pack the n pblocks for the server. What doesn't fit
+   in pfBuf goes ahead in PF_MORE pieces, the last piece is left there
+   for the message they are for. Returns its length, -1 if there's no
+   memory for them here or in the server.
+*/
+
+static int pf_put( pblock **pbs, int n )
+{
+    pf_msg reply;
+    char *data;
+    int len, done;
+
+    len = pf_size( pbs, n );
+    if ( len <= PF_BUF )
+        return pf_pack( pfBuf, pbs, n );
+
+    data = ( char * ) malloc( len );
+    if ( ! data )
+        return -1;
+    pf_pack( data, pbs, n );
+
+    for ( done = 0; len - done > PF_BUF; done += PF_BUF )
+    {
+        memcpy( pfBuf, data + done, PF_BUF );
+        pf_ask( PF_MORE, PF_BUF, 0, &reply );
+        if ( reply.arg < 0 )
+        {
+            free( data );
+            return -1;
+        }
+    }
+    memcpy( pfBuf, data + done, len - done );
+    free( data );
+
+    return len - done;
+}
+
+/* in a worker, a request of len bytes: the first PF_BUF are in pfBuf,
+   the rest it asks the server for. NULL if there's no memory */
+
+static char * pf_fetch( int len )
+{
+    pf_msg reply;
+    char *data;
+    int done, n;
+
+    data = ( char * ) malloc( len );
+    if ( ! data )
+        return NULL;
+    memcpy( data, pfBuf, PF_BUF );
+
+    for ( done = PF_BUF; done < len; done += n )
+    {
+        pf_ask( PF_REST, 0, done, &reply );
+        n = reply.arg < len - done ? reply.arg : len - done;
+        if ( n <= 0 )
+        {
+            free( data );
+            return NULL;
+        }
+        memcpy( data + done, pfBuf, n );
+    }
+
+    return data;
+}
+
+/* net_write(), or in a worker, the server thread's */
+
+static int sn_write( Session *sn, char *buf, int len )
+{
+    pf_msg reply;
+    int done, n;
+
+    if ( pfFd == -1 )
+        return net_write( sn->csd, buf, len );
+
+    for ( done = 0; done < len; done += n )
+    {
+        n = len - done < PF_BUF ? len - done : PF_BUF;
+        memcpy( pfBuf, buf + done, n );
+        pf_ask( PF_WRITE, n, 0, &reply );
+        if ( reply.arg == IO_ERROR )
+            return IO_ERROR;
+    }
+
+    return len;
+}
+
+/* protocol_start_response(), the same way */
+
+static int sn_start( Session *sn, Request *rq )
+{
+    pf_msg reply;
+    int len;
+
+    if ( pfFd == -1 )
+        return protocol_start_response( sn, rq );
+
+    if ( rq->senthdrs )
+        return REQ_PROCEED;
+    len = pf_put( &rq->srvhdrs, 1 );
+    if ( len < 0 )
+        return REQ_ABORTED;
+    pf_ask( PF_START, len, 0, &reply );
+    if ( reply.arg != REQ_ABORTED )
+        rq->senthdrs = 1;
+
+    return reply.arg;
+}
+
+/* session_dns() */
+
+static char * sn_dns( Session *sn )
+{
+    pf_msg reply;
+
+    if ( pfFd == -1 )
+        return session_dns( sn );
+
+    pf_ask( PF_DNS, 0, 0, &reply );
+    return reply.arg ? pfBuf : NULL;
+}
+
+/* netbuf_read() of the body, in a worker */
+
+static int pf_read( char *dst, int len )
+{
+    pf_msg reply;
+    int i, n;
+
+    for ( i = 0; i < len; i += reply.arg )
+    {
+        n = len - i < PF_BUF ? len - i : PF_BUF;
+        pf_ask( PF_READ, 0, n, &reply );
+        if ( reply.arg < 0 )
+            return -1;
+        memcpy( dst + i, pfBuf, reply.arg );
+        if ( reply.arg < n )
+            return i + reply.arg;
+    }
+
+    return i;
+}
+
+/* a worker's life: requests, one at a time, till the server goes */
+
+static void pf_serve( void )
+{
+    pblock *pbs[6];
+    Session sn;
+    Request rq;
+    pf_msg msg;
+    char *data;
+    int result, len, i;
+
+    for ( ;; )
+    {
+        if ( ! pf_recv( pfFd, &msg ) )
+            _exit( 0 );
+        if ( msg.op != PF_SERVICE && msg.op != PF_AUTHTRANS )
+            continue;
+
+        data = msg.len > PF_BUF ? pf_fetch( msg.len ) : pfBuf;
+        if ( ! data )
+        {
+            nsapy_log_error( LOG_WARN, msg.op == PF_SERVICE ? "nsapy_Service" : "nsapy_AuthTrans", NULL, NULL,
+                             "no memory for the request in a worker process" );
+            if ( ! pf_send( pfFd, PF_DONE, 0, REQ_ABORTED ) )
+                _exit( 0 );
+            continue;
+        }
+
+        /* pb, reqpb, headers, vars, srvhdrs and client */
+        for ( i = 0; i < 6; i++ )
+            pbs[i] = pblock_create( PF_PBLOCK );
+        pf_unpack( data, msg.len, pbs, 6 );
+        if ( data != pfBuf )
+            free( data );
+
+        memset( &sn, 0, sizeof( sn ) );
+        sn.client = pbs[5];
+        sn.csd_open = 1;
+        memset( &rq, 0, sizeof( rq ) );
+        rq.reqpb = pbs[1];
+        rq.loadhdrs = 1;
+        rq.headers = pbs[2];
+        rq.vars = pbs[3];
+        rq.srvhdrs = pbs[4];
+        rq.senthdrs = msg.arg;
+
+        if ( msg.op == PF_SERVICE )
+            result = nsapy_Service( pbs[0], &sn, &rq );
+        else
+            result = nsapy_AuthTrans( pbs[0], &sn, &rq );
+
+        /* what the handler did to vars and srvhdrs goes back */
+        len = pf_put( pbs + 3, 2 );
+        if ( len < 0 )
+        {
+            nsapy_log_error( LOG_WARN, msg.op == PF_SERVICE ? "nsapy_Service" : "nsapy_AuthTrans", NULL, NULL,
+                             "no memory for srvhdrs and vars in a worker process" );
+            len = 0;
+            result = REQ_ABORTED;
+        }
+        if ( ! pf_send( pfFd, PF_DONE, len, result ) )
+            _exit( 0 );
+
+        for ( i = 0; i < 6; i++ )
+            pblock_free( pbs[i] );
+    }
+}
+
+/*
+ * pf_fork
+ *
+   Start the worker for slot, with a new socket. In the supervisor this
+   returns its pid ( -1 if it couldn't ), in the worker 0.
+*/
+
+static pid_t pf_fork( int slot )
+{
+    int sv[2];
+    pid_t pid;
+    char buff[100];
+
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+        pid = -1;
+    else
+        pid = fork();
+
+    if ( pid == 0 )
+    {
+        close( sv[0] );
+        close( pfCtl );
+        pfCtl = -1;
+        pfFd = sv[1];
+        pfBuf = pfShm + slot * PF_BUF;
+        return 0;
+    }
+
+    if ( pid < 0 )
+    {
+        sprintf( buff, "couldn't start worker process %d", slot );
+        nsapy_log_error( LOG_WARN, "nsapy_Init", NULL, NULL, buff );
+        return -1;
+    }
+
+    pf_send_fd( pfCtl, slot, sv[0] );
+    close( sv[0] );
+    close( sv[1] );
+
+    return pid;
+}
+
+/*
+ * pf_supervise
+ *
+   The supervisor starts the workers and replaces the ones that die,
+   until the server closes its end of pfCtl. It only returns in a new
+   worker.
+*/
+
+static void pf_supervise( void )
+{
+    struct pollfd pfd;
+    pid_t *pids, pid;
+    time_t *born;
+    char buff[100];
+    int status, i;
+
+    pids = ( pid_t * ) malloc( pfCount * sizeof( pid_t ) );
+    born = ( time_t * ) malloc( pfCount * sizeof( time_t ) );
+    if ( ! pids || ! born )
+        _exit( 1 );
+
+    for ( i = 0; i < pfCount; i++ )
+    {
+        born[i] = time( NULL );
+        pids[i] = pf_fork( i );
+        if ( pids[i] == 0 )
+            return;
+    }
+
+    for ( ;; )
+    {
+        /* the server never writes, readable means it's gone */
+        pfd.fd = pfCtl;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if ( poll( &pfd, 1, PF_POLL_MS ) > 0 )
+            _exit( 0 );
+
+        while ( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 )
+            for ( i = 0; i < pfCount; i++ )
+                if ( pids[i] == pid )
+                {
+                    if ( WIFSIGNALED( status ) )
+                        sprintf( buff, "worker process %d ( pid %d ) killed by signal %d", i, ( int ) pid, WTERMSIG( status ) );
+                    else
+                        sprintf( buff, "worker process %d ( pid %d ) exited with %d", i, ( int ) pid, WEXITSTATUS( status ) );
+                    nsapy_log_error( LOG_WARN, "nsapy_Init", NULL, NULL, buff );
+                    pids[i] = -1;
+                }
+
+        /* a worker that can't even start shouldn't be forked flat out */
+        for ( i = 0; i < pfCount; i++ )
+            if ( pids[i] == -1 && time( NULL ) - born[i] >= PF_RESTART )
+            {
+                born[i] = time( NULL );
+                pids[i] = pf_fork( i );
+                if ( pids[i] == 0 )
+                    return;
+            }
+    }
+}
+
+/*
+ * pf_start
+ *
+   Called by nsapy_Init, before there's Python or any other thread.
+   Returns 1 in a worker, which is to go on and initialize Python,
+   0 in the server once it has every worker's socket, -1 on failure.
+*/
+
+static int pf_start( void )
+{
+    int ctl[2], slot, fd, i;
+    pid_t pid;
+
+    pfShm = ( char * ) mmap( NULL, pfCount * PF_BUF, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( pfShm == ( char * ) MAP_FAILED )
+        return -1;
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, ctl ) < 0 )
+        return -1;
+
+    pid = fork();
+    if ( pid < 0 )
+        return -1;
+    if ( pid == 0 )
+    {
+        close( ctl[0] );
+        pfCtl = ctl[1];
+        pf_supervise();
+        return 1;
+    }
+    close( ctl[1] );
+    pfCtl = ctl[0];
+
+    pfWorkers = ( pf_worker * ) malloc( pfCount * sizeof( pf_worker ) );
+    if ( ! pfWorkers )
+        return -1;
+    for ( i = 0; i < pfCount; i++ )
+    {
+        pfWorkers[i].fd = -1;
+        pfWorkers[i].pending = -1;
+        pfWorkers[i].buf = pfShm + i * PF_BUF;
+        pfWorkers[i].next = pfFree;
+        pfFree = &pfWorkers[i];
+    }
+    pfCrit = crit_init();
+    pfReady = condvar_init( pfCrit );
+    pfCtlCrit = crit_init();
+
+    for ( i = 0; i < pfCount; i++ )
+    {
+        if ( ! pf_recv_fd( pfCtl, &slot, &fd ) || slot < 0 || slot >= pfCount )
+            return -1;
+        pfWorkers[ slot ].fd = fd;
+    }
+
+    return 0;
+}
+
+/*
+ * pf_socket
+ *
+   The socket of w's worker, taking its replacement's if it has one,
+   and waiting for the supervisor to send it if w's has died. -1 if
+   the supervisor is gone too. Only the thread that has w closes its
+   sockets.
+*/
+
+static int pf_socket( pf_worker *w )
+{
+    int slot, fd;
+
+    crit_enter( pfCtlCrit );
+    for ( ;; )
+    {
+        if ( w->pending != -1 )
+        {
+            if ( w->fd != -1 )
+                close( w->fd );
+            w->fd = w->pending;
+            w->pending = -1;
+        }
+        if ( w->fd != -1 || ! pf_recv_fd( pfCtl, &slot, &fd ) )
+            break;
+        if ( slot < 0 || slot >= pfCount )
+            close( fd );
+        else
+        {
+            if ( pfWorkers[ slot ].pending != -1 )
+                close( pfWorkers[ slot ].pending );
+            pfWorkers[ slot ].pending = fd;
+        }
+    }
+    crit_exit( pfCtlCrit );
+
+    return w->fd;
+}
+
+static void pf_died( pf_worker *w )
+{
+    crit_enter( pfCtlCrit );
+    close( w->fd );
+    w->fd = -1;
+    crit_exit( pfCtlCrit );
+}
+
+/* hand w's worker the request packed in its buffer, returns its socket or -1 */
+
+static int pf_hand( pf_worker *w, int op, int len, int senthdrs )
+{
+    int fd, tries;
+
+    /* a worker that died idle is only noticed now, its replacement
+       can have the request */
+    for ( tries = 0; tries < 2; tries++ )
+    {
+        fd = pf_socket( w );
+        if ( fd == -1 )
+            break;
+        if ( pf_send( fd, op, len, senthdrs ) )
+            return fd;
+        pf_died( w );
+    }
+
+    return -1;
+}
+
+/* add len bytes at buf to what came in PF_MORE pieces, *morelen is
+   -1 once there's been no memory for them */
+
+static void pf_more( char **more, int *morelen, char *buf, int len )
+{
+    char *p;
+
+    if ( *morelen < 0 )
+        return;
+
+    p = ( char * ) realloc( *more, *morelen + len );
+    if ( ! p )
+    {
+        free( *more );
+        *more = NULL;
+        *morelen = -1;
+        return;
+    }
+    memcpy( p + *morelen, buf, len );
+    *more = p;
+    *morelen += len;
+}
+
+/*
+ * pf_relay
+ *
+   Do what the worker on fd asks for the request, until it's done. The
+   REQ_* code is the worker's, its vars and srvhdrs go into pbs. req is
+   the whole request, reqlen bytes, for a worker that couldn't have it
+   all at once.
+*/
+
+static int pf_relay( pf_worker *w, int fd, char *func, pblock **pbs, char *req, int reqlen,
+                     Session *sn, Request *rq, long *sent )
+{
+    pf_msg msg;
+    char *dns, *more, *data;
+    int morelen, off;
+
+    more = NULL;
+    morelen = 0;
+    for ( ;; )
+    {
+        if ( ! pf_recv( fd, &msg ) )
+            break;
+        if ( msg.len > PF_BUF )
+            msg.len = PF_BUF;
+
+        switch ( msg.op )
+        {
+        case PF_DONE:
+        case PF_START:
+            /* the last piece, after any that came ahead of it */
+            data = w->buf;
+            if ( morelen )
+            {
+                pf_more( &more, &morelen, w->buf, msg.len );
+                data = more;
+                msg.len = morelen;
+            }
+            if ( morelen < 0 )
+            {
+                nsapy_log_error( LOG_WARN, func, sn, rq, "no memory for srvhdrs and vars from the worker process" );
+                msg.arg = REQ_ABORTED;
+            }
+            else if ( msg.op == PF_START )
+            {
+                pf_unpack( data, msg.len, pbs + 4, 1 );
+                msg.arg = protocol_start_response( sn, rq );
+            }
+            else if ( msg.len > 0 )
+                pf_unpack( data, msg.len, pbs + 3, 2 );
+            free( more );
+            more = NULL;
+            morelen = 0;
+            if ( msg.op == PF_DONE )
+                return msg.arg;
+            break;
+        case PF_MORE:
+            pf_more( &more, &morelen, w->buf, msg.len );
+            msg.arg = morelen < 0 ? -1 : 0;
+            break;
+        case PF_REST:
+            off = msg.arg;
+            if ( off < PF_BUF || off >= reqlen )
+                msg.arg = -1;
+            else
+            {
+                msg.arg = reqlen - off < PF_BUF ? reqlen - off : PF_BUF;
+                memcpy( w->buf, req + off, msg.arg );
+            }
+            break;
+        case PF_WRITE:
+            msg.arg = net_write( sn->csd, w->buf, msg.len );
+            if ( msg.arg != IO_ERROR )
+                *sent += msg.len;
+            break;
+        case PF_READ:
+            if ( msg.arg > PF_BUF )
+                msg.arg = PF_BUF;
+            msg.arg = sn->inbuf ? netbuf_read( sn->inbuf, w->buf, msg.arg ) : 0;
+            break;
+        case PF_DNS:
+            dns = session_dns( sn );
+            msg.arg = dns != NULL;
+            if ( dns )
+            {
+                strncpy( w->buf, dns, PF_BUF - 1 );
+                w->buf[ PF_BUF - 1 ] = '\0';
+            }
+            break;
+        default:
+            msg.arg = -1;
+        }
+
+        if ( ! pf_send( fd, PF_REPLY, 0, msg.arg ) )
+            break;
+    }
+
+    free( more );
+    nsapy_log_error( LOG_WARN, func, sn, rq, "the worker process died" );
+    pf_died( w );
+    return REQ_ABORTED;
+}
+
+/*
+ * pf_service
+ *
+   In the server, run the request in a free worker, op says which
+   function. Returns the REQ_* code, and the bytes written to the
+   client in *sent.
+*/
+
+static int pf_service( int op, pblock *pb, Session *sn, Request *rq, long *sent )
+{
+    pblock *pbs[6];
+    pf_worker *w;
+    char *func, *req;
+    int fd, len, result;
+
+    func = op == PF_SERVICE ? "nsapy_Service" : "nsapy_AuthTrans";
+    *sent = 0;
+
+    crit_enter( pfCrit );
+    while ( ! pfFree )
+        condvar_wait( pfReady );
+    w = pfFree;
+    pfFree = w->next;
+    crit_exit( pfCrit );
+
+    pbs[0] = pb;
+    pbs[1] = rq->reqpb;
+    pbs[2] = rq->headers;
+    pbs[3] = rq->vars;
+    pbs[4] = rq->srvhdrs;
+    pbs[5] = sn->client;
+
+    /* one too big for the buffer goes a piece at a time, see pf_fetch() */
+    result = REQ_ABORTED;
+    len = pf_size( pbs, 6 );
+    req = len > PF_BUF ? ( char * ) malloc( len ) : w->buf;
+    if ( ! req )
+        nsapy_log_error( LOG_WARN, func, sn, rq, "no memory to hand the request to a worker process" );
+    else
+    {
+        pf_pack( req, pbs, 6 );
+        if ( req != w->buf )
+            memcpy( w->buf, req, PF_BUF );
+        if ( ( fd = pf_hand( w, op, len, rq->senthdrs ) ) == -1 )
+            nsapy_log_error( LOG_WARN, func, sn, rq, "no worker process to run the request" );
+        else
+            result = pf_relay( w, fd, func, pbs, req, len, sn, rq, sent );
+        if ( req != w->buf )
+            free( req );
+    }
+
+    crit_enter( pfCrit );
+    w->next = pfFree;
+    pfFree = w;
+    condvar_notify( pfReady );
+    crit_exit( pfCrit );
+
+    return result;
+}
+
+#else /* #ifdef NSAPY_PREFORK */
+
+#define sn_write( sn, buf, len )    net_write( ( sn )->csd, buf, len )
+#define sn_start( sn, rq )          protocol_start_response( sn, rq )
+#define sn_dns( sn )                session_dns( sn )
+
+#endif /* #ifdef NSAPY_PREFORK */
+
+/**
+ ** interp_count - translate the "interpreters" parameter,
+ ** "auto" means one per processor.
+ **/
+
+static int interp_count( char *interpreters )
+{
+    int n;
+
+    if ( strcmp( interpreters, "auto" ) == 0 )
+    {
+#ifdef XP_WIN32
+        SYSTEM_INFO si;
+
+        GetSystemInfo( &si );
+        n = ( int ) si.dwNumberOfProcessors;
+#else
+        n = ( int ) sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+    }
+    else
+        n = atoi( interpreters );
+
+    return n;
+}
+
+/**
+ ** init_interp - run the module and initstring in the current
+ ** interpreter. Returns NULL if all is well, or an error message
+ ** in buff.
+ **/
+
+static char * init_interp( char *module, char *initstring, char *buff )
+{
+
+    /* Now execute the equivalent of
+        >>> import nsapi
+        >>> import sys
+        >>> import <module>
+        >>> <initstring>
+        in the __main__ module to start up Python.
+    */
+
+    PyRun_SimpleString( "import nsapi\n" );
+
+    if ( PyErr_Occurred() )
+        return "nsapy_Init: could not import nsapi";
+
+    PyRun_SimpleString( "import sys\n" );
+
+    if ( PyErr_Occurred() )
+        return "nsapy_Init: could not import sys";
+
+    sprintf( buff, "import %s\n", module);
+    PyRun_SimpleString( buff );
+
+    if ( PyErr_Occurred() ) 
+    {
+        sprintf( buff, "nsapy_Init: could not import %s", module );
+        return buff;
+    }
+
+    sprintf( buff, "%s\n", initstring );
+    PyRun_SimpleString( buff );
+
+    if ( PyErr_Occurred() )
+    {
+        sprintf( buff, "nsapy_Init: could not call %s", initstring );
+        return buff;
+    }
+
+    /* the "initstring" should execute something like
+        >>> import nsapi
+        >>> nsapi.SetCallBack( someobject )
+        at this point current_callback() is a reference to someobject
+    */
+
+    if ( ! current_callback() ) 
+    {
+        sprintf( buff, "nsapy_Init: after %s no callback object found", initstring );
+        return buff;
+    }
+
+    return NULL;
+}
+
+/*
+ * init_python
+ *
+   The rest of nsapy_Init: Python, the interpreters and their callback
+   objects, and the threads that go with them. In the server, or with
+   "processes" in each worker.
+*/
+
+static int init_python( pblock *pb, char *module, char *initstring, char *criticalonly )
+{
+    char buff[1000];
+    char *err;
+    PyThreadState *mainstate, *tstate;
+    PyObject *d;
+    int i;
+
+    /* initialize Python */
+
+    Py_Initialize();
+
+    /*  Initialize nsapi 
+        This makes an nsapi module available for import, but remember,
+        YOU should use "import nsapy" not "nsapi". "nsapi" is for internal
+        use only. ( The only time it's needed is to assign obCallBack )
+    */
+
+    initnsapi();
+
+    /* If a criticalonly parameter was defined,
+       create a python object CRITICAL that can be used
+       to exit the critical section by passing it to 
+       crit_exit. 
+    */
+
+    d = PyModule_GetDict( NsapiModule );
+    if ( criticalonly )
+    {
+        obCrit =  Py_crit_init( NsapiModule, Py_None  );
+        if ( !obCrit )
+            return InitAbort( pb, "nsapy_Init: could not create CRITICAL variable" );
+        Py_INCREF( obCrit );
+        PyDict_SetItemString( d, "CRITICAL", obCrit );
+    }
+    else
+    {
+        Py_INCREF( Py_None );
+        PyDict_SetItemString( d, "CRITICAL", Py_None );
+        Py_INCREF( Py_None );
+        obCrit = Py_None;
+    }
+
+    /* Threads take turns in Python, so we need the interpreter lock.
+       Every thread that comes through nsapy_Service later gets its
+       own thread state, see thread_enter() */
+
+    PyEval_InitThreads();
+    mainstate = PyThreadState_Get();
+    mainInterp = mainstate->interp;
+    threadKey = systhread_newkey();
+#ifdef NSAPY_PREAD
+    fileCacheCrit = crit_init();
+#endif
+
+    if ( reloadInterval > 0 )
+    {
+        watchLock = lock_new( NULL );
+        if ( ! watchLock )
+            return InitAbort( pb, "nsapy_Init: could not make the module watcher's lock" );
+        if ( ! systhread_start( SYSTHREAD_DEFAULT_PRIORITY, 0, watcher, NULL ) )
+            return InitAbort( pb, "nsapy_Init: could not start the module watcher thread" );
+    }
+
+    if ( ! ninterps )
+    {
+        /* the one and only interpreter */
+        err = init_interp( module, initstring, buff );
+        if ( err )
+            return InitAbort( pb, err );
+
+        /* let go of the interpreter lock, requests will take it */
+        PyEval_ReleaseThread( mainstate );
+
+        if ( ! task_start() )
+            return InitAbort( pb, "nsapy_Init: could not start the task threads" );
+
+        /* Wow, this worked! */
+        return REQ_PROCEED;
+    }
+
+    /* Build the interpreter pool. */
+
+    interpCrit = crit_init();
+    interpFree = condvar_init( interpCrit );
+
+    interps = PyMem_NEW( nsapy_interp, ninterps );
+    if ( ! interps )
+        return InitAbort( pb, "nsapy_Init: out of memory allocating interpreters" );
+
+    for ( i = 0; i < ninterps; i++ )
+    {
+        interps[i].obCallBack = NULL;
+        memset( &interps[i].handlers, 0, sizeof( handler_cache ) );
+        interps[i].index = i + 1;
+        tstate = Py_NewInterpreter();
+        if ( ! tstate )
+        {
+            PyThreadState_Swap( mainstate );
+            return InitAbort( pb, "nsapy_Init: could not create a sub-interpreter" );
+        }
+        interps[i].istate = tstate->interp;
+
+        /* every interpreter has its own nsapi module */
+        initnsapi();
+        Py_INCREF( Py_None );
+        PyDict_SetItemString( PyModule_GetDict( NsapiModule ), "CRITICAL", Py_None );
+
+        err = init_interp( module, initstring, buff );
+        if ( err )
+        {
+            PyThreadState_Swap( mainstate );
+            return InitAbort( pb, err );
+        }
+
+        /* this thread state was only needed to initialize,
+           request threads have their own */
+        PyThreadState_Clear( tstate );
+        PyThreadState_Swap( mainstate );
+        PyThreadState_Delete( tstate );
+
+        interps[i].next = freeInterps;
+        freeInterps = &interps[i];
+    }
+
+    nsapy_log( NSAPY_INFO, "nsapy_Init: %d interpreters created", ninterps );
+
+    /* let go of the interpreter lock, requests will take it */
+    PyEval_ReleaseThread( mainstate );
+
+    if ( ! task_start() )
+        return InitAbort( pb, "nsapy_Init: could not start the task threads" );
+
+    /* Wow, this worked! */
+    return REQ_PROCEED;
+}
+
+/**
+ ** nsapy_Init - The initialization function.
+ **
+ * 
+ *  Initialize Python and get the callback object.
+ *
+ *  This function is called by the NS Server at initialization
+ *  in order to initialize Python and obtain obCallBack.
+ *
+ *  The function expects two parameters in the pblock
+ *
+ *        "module"      -   the module name to be imported
+ *        "initstring"  -   a string to be executed after that
+ *
+ *  "initstring" must return a Python object with all the methods
+ *  descripbed above defined ( Service, Log, etc. )
+ *
+ *  This object is a.k.a. obCallBack.
+ *
+ *  Optionally:
+ *
+ *        "criticalonly"  - serialize all calls into Python
+ *        "interpreters"  - number of interpreters in the pool
+ *                          ( or "auto" for one per processor ),
+ *                          module and initstring are run in each
+ *        "maxbody"       - largest request body ( in bytes ) that
+ *                          sn.read() and friends will accept
+ *        "outbuf"        - how much sn.out buffers before writing
+ *        "filecache"     - largest file sn.send_file() keeps a copy of
+ *        "reload"        - check handler modules for changes every 
+ *                          this many seconds, and reload them
+ *        "loglevel"      - debug, info ( the default ), warning or error
+ *        "statsuri"      - URI of the statistics page
+ *        "maxfields"     - most fields a form may have
+ *        "maxfieldsize"  - longest name or value of a form field
+ *        "spool"         - biggest part of a multipart form kept in memory
+ *        "compress"      - zlib level to compress responses with
+ *        "compressmin"   - smallest response worth compressing
+ *        "cache"         - bytes of responses to keep for sn.out.cache()
+ *        "tasks"         - threads that run sn.defer()ed tasks
+ *        "taskqueue"     - most tasks waiting to run
+ *        "processes"     - worker processes to run Python in, instead
+ *                          of the server
+ *
+ *  *sn and *rq parameters are ignored.
+ *
+ */
+
+NSAPI_PUBLIC int nsapy_Init(pblock *pb, Session *sn, Request *rq)
+{
+
+    char *module, *initstring, *criticalonly, *interpreters, *maxbody, *outbuf, *filecache, *reload, *loglevel, *statsuri, *maxfields, *maxfieldsize, *spool, *compress, *compressmin, *cache, *tasks, *taskqueue, *processes;
+    int i;
+
+    /* get the parameters from the parameter block */
+
+    module = pblock_findval("module", pb);
+    initstring = pblock_findval("initstring", pb);
+    criticalonly = pblock_findval("criticalonly", pb);
+    interpreters = pblock_findval("interpreters", pb);
+    maxbody = pblock_findval("maxbody", pb);
+    outbuf = pblock_findval("outbuf", pb);
+    filecache = pblock_findval("filecache", pb);
+    reload = pblock_findval("reload", pb);
+    loglevel = pblock_findval("loglevel", pb);
+    statsuri = pblock_findval("statsuri", pb);
+    maxfields = pblock_findval("maxfields", pb);
+    maxfieldsize = pblock_findval("maxfieldsize", pb);
+    spool = pblock_findval("spool", pb);
+    compress = pblock_findval("compress", pb);
+    compressmin = pblock_findval("compressmin", pb);
+    cache = pblock_findval("cache", pb);
+    tasks = pblock_findval("tasks", pb);
+    taskqueue = pblock_findval("taskqueue", pb);
+    processes = pblock_findval("processes", pb);
+
+    if ( !module ) 
+        return InitAbort( pb, "nsapy_Init: No module defined in pb" );
+
+    if ( !initstring ) 
+        return InitAbort(pb, "nsapy_Init: No initstring defined in pb");
+
+    if ( interpreters )
+    {
+        ninterps = interp_count( interpreters );
+        if ( ninterps <= 0 )
+            return InitAbort( pb, "nsapy_Init: interpreters must be a positive number or \"auto\"" );
+        if ( criticalonly )
+            return InitAbort( pb, "nsapy_Init: criticalonly and interpreters can not be used together" );
+    }
+
+    if ( maxbody )
+        maxBody = atoi( maxbody );
+    if ( outbuf )
+        outBuf = atoi( outbuf );
+    if ( filecache )
+        fileCacheMax = atoi( filecache );
+    if ( reload )
+        reloadInterval = atoi( reload );
+    if ( maxfields )
+        formMaxFields = atoi( maxfields );
+    if ( maxfieldsize )
+        formMaxFieldSize = atoi( maxfieldsize );
+    if ( spool )
+        multipartSpool = atoi( spool );
+    if ( compress )
+    {
+        compressLevel = atoi( compress );
+        if ( compressLevel < 0 || compressLevel > 9 )
+            return InitAbort( pb, "nsapy_Init: compress must be a zlib level, 0 to 9" );
+#ifndef NSAPY_ZLIB
+        if ( compressLevel )
+            return InitAbort( pb, "nsapy_Init: compress needs nsapy built with zlib" );
+#endif
+    }
+    if ( compressmin )
+        compressMin = atoi( compressmin );
+    if ( cache )
+        rcacheMax = atol( cache );
+    if ( rcacheMax > 0 && ! rcache_init() )
+        return InitAbort( pb, "nsapy_Init: no memory for the response cache" );
+    if ( tasks )
+        taskWorkers = atoi( tasks );
+    if ( taskqueue )
+        taskCapacity = atoi( taskqueue );
+    if ( taskWorkers > 0 )
+    {
+        taskCrit = crit_init();
+        taskReady = condvar_init( taskCrit );
+        taskRoom = condvar_init( taskCrit );
+    }
+    if ( loglevel )
+    {
+        for ( i = 0; logLevels[i].name; i++ )
+            if ( strcmp( loglevel, logLevels[i].name ) == 0 )
+                break;
+        if ( ! logLevels[i].name )
+            return InitAbort( pb, "nsapy_Init: loglevel must be debug, info, warning or error" );
+        logLevel = logLevels[i].code;
+    }
+
+    /* the log is opened by nsapy.init(), but must be ready for it */
+    logCrit = crit_init();
+    logKey = systhread_newkey();
+
+    lockRegistry = lock_new( NULL );
+    statsLock = lock_new( NULL );
+    if ( ! lockRegistry || ! statsLock )
+        return InitAbort( pb, "nsapy_Init: out of memory making locks" );
+    statsKey = systhread_newkey();
+    if ( statsuri )
+        statsUri = strdup( statsuri );
+
+#ifdef NSAPY_PREFORK
+    /* the server only passes requests to the workers, which run Python */
+    if ( processes && ( pfCount = atoi( processes ) ) > 0 )
+    {
+        i = pf_start();
+        if ( i < 0 )
+            return InitAbort( pb, "nsapy_Init: could not start the worker processes" );
+        if ( i == 0 )
+            return REQ_PROCEED;
+
+        /* a worker, never to return to the server */
+        if ( init_python( pb, module, initstring, criticalonly ) != REQ_PROCEED )
+        {
+            nsapy_log_error( LOG_WARN, "nsapy_Init", NULL, NULL, pblock_findval( "error", pb ) );
+            _exit( 1 );
+        }
+        pf_serve();
+    }
+#else
+    if ( processes && atoi( processes ) > 0 )
+        return InitAbort( pb, "nsapy_Init: processes needs nsapy built with fork(), on UNIX" );
+#endif
+
+    return init_python( pb, module, initstring, criticalonly );
+}
+
+/**
+ ** SetCallBack - assign a CallBack object
+ **
+ *  This function must be called from Python upon execution
+ *  the initstring parameter, like this
+ *
+ *  >>> import nsapi
+ *  >>> nsapi.SetCallBack( instance )
+ *
+ *  providing the instance as the CallBack object.
+ */
+
+static PyObject * SetCallBack( PyObject *self, PyObject *args )
+{
+
+    PyObject *callback, **slot;
+    PyInterpreterState *istate;
+    int i;
+
+    /* returning NULL means error, returning Py_None is good */
+
+    /* see if CallBack is in *args */
+
+    if ( ! PyArg_ParseTuple( args, "O", &callback ) ) 
+        return NULL;
+
+    /* with an interpreter pool, every interpreter has its own */
+
+    slot = &obCallBack;
+    istate = PyThreadState_Get()->interp;
+    for ( i = 0; i < ninterps; i++ )
+        if ( interps[i].istate == istate )
+            slot = &interps[i].obCallBack;
+
+    /* dispose of the old call back object, if there was one */
+  
+    Py_XDECREF( *slot );
+ 
+    /* store the object, incref */
+
+    *slot = callback;  
+    Py_INCREF( callback );
+
+    /* informative log message (callback) */
+
+    Log( "SetCallBack: obCallBack Initialized" );
+
+    /* return None */
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* this interpreter's handler cache */
+
+static handler_cache * current_handlers( void )
+{
+    PyInterpreterState *istate;
+    int i;
+
+    istate = PyThreadState_Get()->interp;
+    for ( i = 0; i < ninterps; i++ )
+        if ( interps[i].istate == istate )
+            return &interps[i].handlers;
+
+    return &mainHandlers;
+}
+
+/**
+ ** cache_handler - nsapi.cache_handler( uri, Class )
+ **
+ *  Remember that requests for uri are handled by Class, nsapy_Service
+ *  will pass it as the 4th argument to Service() from now on.
+ */
+
+static PyObject * Py_cache_handler( PyObject *self, PyObject *args )
+{
+    PyObject *cls;
+    char *uri;
+
+    if ( ! PyArg_ParseTuple( args, "sO", &uri, &cls ) )
+        return NULL;
+
+    if ( ! handler_add( current_handlers(), uri, cls ) )
+        return NULL;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/**
+ ** clear_handlers - nsapi.clear_handlers()
+ **
+ *  Forget all cached handler classes, e.g. after a reload.
+ */
+
+static PyObject * Py_clear_handlers( PyObject *self, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    handler_clear( current_handlers() );
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/* typetest macro */
+#define is_criticalobject(o) ((o)->ob_type == &criticalobjecttype)
+
+
+/**
+ ** crit_enter - enter a critical section
+ **
+ *  
+ *  Netscape will halt all other processing
+ *  until crit_exit for this critical section
+ *  variable.
+ *
+ */
+
+static PyObject * Py_crit_enter( PyObject *self, PyObject *args )
+{
+
+    criticalobject * crit;
+
+    if ( ! PyArg_ParseTuple( args, "O", &crit ) ) 
+        return NULL;
+
+
+    if ( ! is_criticalobject( crit ) )
+    {
+        PyErr_SetString( PyExc_TypeError, 
+            "argument to crit_enter must be a CRITICAL object");
+        return NULL;
+    }
+
+    /* this can take a while, let others run */
+    Py_BEGIN_ALLOW_THREADS
+    crit_enter( crit->crit );
+    Py_END_ALLOW_THREADS
+
+    Log( "crit_enter: entered critical section %p", ( void * ) crit->crit );
+
+    /* return None */
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ ** crit_exit - exit a critical section
+ **
+ */
+
+static PyObject * Py_crit_exit( PyObject *self, PyObject *args )
+{
+
+    criticalobject * crit;
+
+    if ( ! PyArg_ParseTuple( args, "O", &crit ) ) 
+        return NULL;
+
+
+    if ( ! is_criticalobject( crit ) )
+    {
+        PyErr_SetString( PyExc_TypeError, 
+            "argument to crit_exit must be a CRITICAL object");
+        return NULL;
+    }
+
+    /* we must log this *BEFORE* we exit critical-section */
+    Log( "crit_exit: exiting critical section %p", ( void * ) crit->crit );
+
+    crit_exit( crit->crit );
+
+    /* return None */
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/**
+ ** Py_crit_init
+ **
+ *  This routine creates a Python version of NSAPI CRITICAL object 
+ *
+ */
+static PyObject * Py_crit_init( PyObject *self, PyObject *args )
+{
+
+
+    criticalobject * result;
+	CRITICAL crit;
+
+    result = PyMem_NEW( criticalobject, 1 );
+
+    if ( ! result )
+        return PyErr_NoMemory();
+
+    result->ob_type = &criticalobjecttype;
+
+	crit = crit_init();
+    result ->crit = crit;
+
+    _Py_NewReference( result );
+
+	Log( "Py_crit_init: critical-section variable %p allocated", ( void * ) crit );
+
+    return ( PyObject * ) result;
+}
+
+/*
+ * critical_dealloc
+ */
+
+static void critical_dealloc( criticalobject *co )
+{
+	crit_terminate( co->crit );
+    free( co );
+}
+
+/**
+ ** make_pblockobject
+ **
+ *  This routine creates a Python pblockobject given an NSAPI
+ *  pblock pointer.
+ *
+ */
+
+static pblockobject * make_pblockobject( pblock * from_pb )
+{
+    pblockobject *result;
+
+    /* reuse one from the free list if we can */
+    if ( pblock_freelist )
+    {
+        result = ( pblockobject * ) pblock_freelist;
+        pblock_freelist = ( PyObject * ) pblock_freelist->ob_type;
+        pblock_nfree--;
+    }
+    else
+    {
+        result = PyMem_NEW( pblockobject, 1 );
+        if ( ! result )
+            return ( pblockobject * ) PyErr_NoMemory();
+    }
+
+    result->pb = from_pb;
+    result->at = -1;
+    result->ob_type = &pblockobjecttype;
+
+    _Py_NewReference( result );
+    return result;
+}
+
+/**
+ ** member_pblock
+ **
+ *  Return a ( new reference to a ) wrapper for a pblock that is a
+ *  member of a session or request, making it only the first time.
+ *  *cache is where the session or request object keeps it.
+ *
+ */
+
+static PyObject * member_pblock( pblockobject **cache, pblock *member )
+{
+    if ( ! member )
+    {
+        PyErr_SetString( PyExc_AttributeError, "no such pblock in this request" );
+        return NULL;
+    }
+
+    /* the server may have replaced the pblock since */
+    if ( *cache && ( *cache )->pb != member )
+    {
+        Py_DECREF( *cache );
+        *cache = NULL;
+    }
+
+    if ( ! *cache )
+    {
+        *cache = make_pblockobject( member );
+        if ( ! *cache )
+            return NULL;
+    }
+
+    Py_INCREF( *cache );
+    return ( PyObject * ) *cache;
+}
+
+
+/** 
+ ** Object Methods for pblock
+ **
+ *  NOTE: FOR NOW ASSUME WE DON'T NEED THE pb_param STRUCTURE
+ *      OR THE FUNCTIONS
+ *  param_create, param_free, pblock_create, pblock_free,
+ *  pblock_find (use pblock_findval instead), 
+ *  pblock_pinsert (use pblock_nvinsert instead)
+ *
+ */
+
+static void pblock_dealloc( pblockobject *op )
+{  
+    /* Note that this frees the Python object, but not
+       the refrenece to a pblock that it holds. Httpd
+       should take care of that.
+    */
+    if ( pblock_nfree < NSAPY_MAXFREE )
+    {
+        op->ob_type = ( PyTypeObject * ) pblock_freelist;
+        pblock_freelist = ( PyObject * ) op;
+        pblock_nfree++;
+    }
+    else
+        free( op );
+}
+
+/*
+ * pb.findval( string ) 
+ */
+
+static PyObject * Py_findval( pblockobject *pbo, PyObject *args )
+{
+    char *string, *value;
+
+    if (! PyArg_ParseTuple( args, "s", &string ) )
+        return NULL; /* error */
+
+    /* find the value as a string */
+    value = pblock_findval( string, pbo->pb );
+
+    if ( ! value )
+    {
+        PyErr_SetString( PyExc_ValueError, "no such parameter" );
+        return NULL;
+    }
+
+    return PyString_FromString( value );
+}
+
+/*
+ * pb.nvinsert( namestring, valuestring )
+ */
+
+static PyObject * Py_nvinsert( pblockobject *pbo, PyObject *args )
+{
+
+  char *name, *value;
+
+  if (! PyArg_ParseTuple(args, "ss", &name, &value) )
+        return NULL; /* error */
+
+  /* set the name/value, there doesn't seem to be any way to
+     check for success or failure. */
+  pblock_nvinsert( name, value, pbo->pb );
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*
+ * pb.pblock2str() 
+ */
+
+static PyObject * Py_pblock2str( pblockobject *pbo, PyObject *args )
+{
+    char *temp;
+    PyObject *result;
+
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL; /* error */
+
+    /* get the result, have the server allocate space */
+    temp = pblock_pblock2str( pbo->pb, NULL );
+
+    /* convert it to a PythonString */
+    result = PyString_FromString( temp ); 
+
+    return result;
+}
+
+/* 
+ * pb.pblock_remove( name )
+ *
+ */
+static PyObject * Py_pblock_remove( pblockobject *pbo, PyObject *args )
+{
+  char *name;
+  pb_param *temp;
+
+  if (! PyArg_ParseTuple(args, "s", &name) ) {
+    return NULL;  /* bad args */
+  }
+
+  /* imitated from nsapi/examples/session.c */
+  temp = pblock_remove( name, pbo->pb );
+
+  if ( temp )
+        param_free( temp );
+
+  Py_INCREF( Py_None );
+  return Py_None;
+}
+
+/**
+ ** pblocks as mappings
+ **
+ *  pb[ name ], pb[ name ] = value, del pb[ name ], len( pb ),
+ *  "for name in pb", "name in pb", and get(), has_key(), keys(),
+ *  values(), items() and to_dict() the way a dictionary has them.
+ *
+ *  All of these walk the pblock's hash chains directly rather than 
+ *  going through pblock2str and taking the string apart again ( which
+ *  also broke on values with quotes in them ). A name can be in a 
+ *  pblock more than once ( nvinsert doesn't replace ), pb[ name ] and
+ *  to_dict() give the value findval would, keys() and items() give 
+ *  them all. pb[ name ] = value does replace.
+ */
+
+static PyObject * pblock_subscript( pblockobject *pbo, PyObject *key )
+{
+    char *value;
+
+    if ( ! PyString_Check( key ) )
+    {
+        PyErr_SetString( PyExc_TypeError, "pblock names are strings" );
+        return NULL;
+    }
+
+    value = pblock_findval( PyString_AsString( key ), pbo->pb );
+    if ( ! value )
+    {
+        PyErr_SetObject( PyExc_KeyError, key );
+        return NULL;
+    }
+
+    return PyString_FromString( value );
+}
+
+static int pblock_ass_subscript( pblockobject *pbo, PyObject *key, PyObject *value )
+{
+    pb_param *pp;
+    char *name;
+
+    if ( ! PyString_Check( key ) || ( value && ! PyString_Check( value ) ) )
+    {
+        PyErr_SetString( PyExc_TypeError, "pblock names and values are strings" );
+        return -1;
+    }
+    name = PyString_AsString( key );
+
+    pp = pblock_remove( name, pbo->pb );
+    if ( ! value )
+    {
+        if ( ! pp )
+        {
+            PyErr_SetObject( PyExc_KeyError, key );
+            return -1;
+        }
+        param_free( pp );
+        return 0;
+    }
+
+    /* any duplicates have to go too, or they'd show up again */
+    while ( pp )
+    {
+        param_free( pp );
+        pp = pblock_remove( name, pbo->pb );
+    }
+    pblock_nvinsert( name, PyString_AsString( value ), pbo->pb );
+
+    return 0;
+}
+
+static Py_ssize_t pblock_length( pblockobject *pbo )
+{
+    struct pb_entry *p;
+    int i, n;
+
+    n = 0;
+    for ( i = 0; i < pbo->pb->hsize; i++ )
+        for ( p = pbo->pb->ht[i]; p; p = p->next )
+            n++;
+
+    return n;
+}
+
+/*
+   The i-th name, for "for name in pb" ( and "in", before Python 
+   had sq_contains ). Going through a pblock like this asks for
+   0, 1, 2 ..., so we remember where i-1 was, as a bucket and the
+   depth in its chain rather than a pointer to the entry, which the
+   loop may have removed.
+*/
+
+static PyObject * pblock_item( pblockobject *pbo, Py_ssize_t i )
+{
+    struct pb_entry *p;
+    int bucket, depth, left, d;
+
+    bucket = 0;
+    depth = 0;
+    if ( i > 0 && i == pbo->at + 1 )
+    {
+        bucket = pbo->bucket;
+        depth = pbo->depth + 1;
+    }
+    else
+    {
+        /* from the top, skipping i entries */
+        left = i;
+        for ( ; bucket < pbo->pb->hsize; bucket++ )
+        {
+            for ( p = pbo->pb->ht[ bucket ], d = 0; p && d < left; p = p->next, d++ )
+                ;
+            if ( p )
+                break;
+            left -= d;
+        }
+        depth = left;
+    }
+
+    for ( ; bucket < pbo->pb->hsize; bucket++, depth = 0 )
+    {
+        for ( p = pbo->pb->ht[ bucket ], d = 0; p && d < depth; p = p->next, d++ )
+            ;
+        if ( p )
+        {
+            pbo->at = i;
+            pbo->bucket = bucket;
+            pbo->depth = depth;
+            return PyString_FromString( p->param->name );
+        }
+    }
+
+    pbo->at = -1;
+    PyErr_SetString( PyExc_IndexError, "pblock index out of range" );
+    return NULL;
+}
+
+static int pblock_contains( pblockobject *pbo, PyObject *key )
+{
+    if ( ! PyString_Check( key ) )
+        return 0;
+
+    return pblock_findval( PyString_AsString( key ), pbo->pb ) != NULL;
+}
+
+static PyMappingMethods pblock_as_mapping = {
+    (lenfunc)pblock_length,            /*mp_length*/
+    (binaryfunc)pblock_subscript,      /*mp_subscript*/
+    (objobjargproc)pblock_ass_subscript, /*mp_ass_subscript*/
+};
+
+static PySequenceMethods pblock_as_sequence = {
+    (lenfunc)pblock_length,            /*sq_length*/
+    0,                                 /*sq_concat*/
+    0,                                 /*sq_repeat*/
+    (ssizeargfunc)pblock_item,         /*sq_item*/
+    0,                                 /*sq_slice*/
+    0,                                 /*sq_ass_item*/
+    0,                                 /*sq_ass_slice*/
+#ifdef Py_TPFLAGS_HAVE_SEQUENCE_IN
+    (objobjproc)pblock_contains,       /*sq_contains*/
+#endif
+};
+
+/*
+ * pb.get( name [, default ] )
+ */
+
+static PyObject * Py_pblock_get( pblockobject *pbo, PyObject *args )
+{
+    PyObject *dflt;
+    char *name, *value;
+
+    dflt = Py_None;
+    if ( ! PyArg_ParseTuple( args, "s|O", &name, &dflt ) )
+        return NULL;
+
+    value = pblock_findval( name, pbo->pb );
+    if ( value )
+        return PyString_FromString( value );
+
+    Py_INCREF( dflt );
+    return dflt;
+}
+
+/*
+ * pb.has_key( name )
+ */
+
+static PyObject * Py_pblock_has_key( pblockobject *pbo, PyObject *args )
+{
+    char *name;
+
+    if ( ! PyArg_ParseTuple( args, "s", &name ) )
+        return NULL;
+
+    return PyInt_FromLong( pblock_findval( name, pbo->pb ) != NULL );
+}
+
+/* what pblock_list() makes of every entry */
+
+#define PBLOCK_KEYS     0
+#define PBLOCK_VALUES   1
+#define PBLOCK_ITEMS    2
+
+static PyObject * pblock_list( pblockobject *pbo, PyObject *args, int what )
+{
+    struct pb_entry *p;
+    PyObject *result, *o;
+    int i, n;
+
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    result = PyList_New( pblock_length( pbo ) );
+    if ( ! result )
+        return NULL;
+
+    n = 0;
+    for ( i = 0; i < pbo->pb->hsize; i++ )
+        for ( p = pbo->pb->ht[i]; p; p = p->next )
+        {
+            if ( what == PBLOCK_KEYS )
+                o = PyString_FromString( p->param->name );
+            else if ( what == PBLOCK_VALUES )
+                o = PyString_FromString( p->param->value );
+            else
+                o = Py_BuildValue( "(ss)", p->param->name, p->param->value );
+            if ( ! o )
+            {
+                Py_DECREF( result );
+                return NULL;
+            }
+            PyList_SET_ITEM( result, n++, o );
+        }
+
+    return result;
+}
+
+static PyObject * Py_pblock_keys( pblockobject *pbo, PyObject *args )
+{
+    return pblock_list( pbo, args, PBLOCK_KEYS );
+}
+
+static PyObject * Py_pblock_values( pblockobject *pbo, PyObject *args )
+{
+    return pblock_list( pbo, args, PBLOCK_VALUES );
+}
+
+static PyObject * Py_pblock_items( pblockobject *pbo, PyObject *args )
+{
+    return pblock_list( pbo, args, PBLOCK_ITEMS );
+}
+
+/*
+ * pb.to_dict() - a dictionary with what findval would give for 
+ * every name
+ */
+
+static PyObject * Py_pblock_to_dict( pblockobject *pbo, PyObject *args )
+{
+    struct pb_entry *p;
+    PyObject *result, *value;
+    int i;
+
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    result = PyDict_New();
+    if ( ! result )
+        return NULL;
+
+    for ( i = 0; i < pbo->pb->hsize; i++ )
+        for ( p = pbo->pb->ht[i]; p; p = p->next )
+        {
+            /* the first one in a chain is the one findval finds */
+            if ( PyDict_GetItemString( result, p->param->name ) )
+                continue;
+            value = PyString_FromString( p->param->value );
+            if ( ! value || PyDict_SetItemString( result, p->param->name, value ) < 0 )
+            {
+                Py_XDECREF( value );
+                Py_DECREF( result );
+                return NULL;
+            }
+            Py_DECREF( value );
+        }
+
+    return result;
+}
+
+
+/* standard getattr for pblocks */
+
+static PyObject * pblock_getattr( PyObject *pbo, char *name )
+{
+    return Py_FindMethod( Pypblockmethods, pbo, name );
+}
+
+
+/* typetest macro */
+#define is_sessionobject(op) ((op)->ob_type == &sessionobjecttype)
+
+/**
+ ** make_session_object
+ **
+ *  Given a NSAPI Session ( and the Request being served on it ), 
+ *  create a Python sessionobject
+ *
+ */
+
+static sessionobject * make_sessionobject( Session *from_sn, Request *from_rq )
+{
+    sessionobject *result;
+
+    if ( session_freelist )
+    {
+        result = ( sessionobject * ) session_freelist;
+        session_freelist = ( PyObject * ) session_freelist->ob_type;
+        session_nfree--;
+    }
+    else
+    {
+        result = PyMem_NEW( sessionobject, 1 );
+        if (! result )
+            return ( sessionobject * ) PyErr_NoMemory();
+    }
+
+    result->sn = from_sn;
+    result->rq = from_rq;
+    result->client = NULL;
+    result->out = NULL;
+    result->body_left = BODY_UNKNOWN;
+    result->max_body = maxBody;
+    result->sent = 0;
+    result->tasks = NULL;
+    result->ob_type = &sessionobjecttype;
+    _Py_NewReference( result );
+
+    return result;
+}
+
+/** 
+ ** Object Methods for Session
+ **
+ */
+
+static void session_dealloc( sessionobject *op )
+{
+    /* Again, notice we let httpd do its freeing */
+    Py_XDECREF( op->client );
+    if ( op->out )
+    {
+        out_finish( op, 0 );
+        Py_DECREF( op->out );
+    }
+    task_release( op );
+
+    if ( session_nfree < NSAPY_MAXFREE )
+    {
+        op->ob_type = ( PyTypeObject * ) session_freelist;
+        session_freelist = ( PyObject * ) op;
+        session_nfree++;
+    }
+    else
+        free( op );
+}
+
+/*
+ * sn.session_dns() 
+ */
+static PyObject * Py_session_dns( sessionobject *sno, PyObject *args )
+{
+    char *dns;
+
+    if (! PyArg_ParseTuple(args, "") )
+        return NULL; /* error */
+
+    /* a reverse DNS lookup can take a long time */
+    Py_BEGIN_ALLOW_THREADS
+    dns = sn_dns( sno->sn );
+    Py_END_ALLOW_THREADS
+
+    if ( dns )
+        return PyString_FromString( dns );
+    else 
+    {
+        Py_INCREF( Py_None );
+        return Py_None;
+    }
+}
+
+/*
+ * sn.net_write(string)
+ */
+
+static PyObject * Py_net_write( sessionobject *sno, PyObject *args )
+{
+    outobject *oo;
+    int len, rv;
+    char *string;
+
+    if (! PyArg_ParseTuple(args, "s#", &string, &len) )
+        return NULL;  /* bad args */
+
+    /* if the headers are waiting, the body is compressed or chunked
+       or it's being kept for the cache, it has to go through sn.out,
+       and out right away */
+    oo = sno->out;
+    if ( oo && oo->sn && ( oo->pending || oo->zip || oo->chunked || oo->cttl > 0 ) )
+    {
+        if ( ! out_flush( oo ) || ! out_send( oo, string, len ) || ! out_push( oo ) )
+            return NULL;
+
+        Py_INCREF( Py_None );
+        return Py_None;
+    }
+
+    /* whatever is waiting in sn.out goes first */
+    if ( oo && ! out_flush( oo ) )
+        return NULL;
+
+    /* a slow client shouldn't hold up everyone else. We hold
+       a reference to the string through args, so it's safe */
+    Py_BEGIN_ALLOW_THREADS
+    rv = sn_write( sno->sn, string, len );
+    Py_END_ALLOW_THREADS
+
+    if ( rv == IO_ERROR )
+    {
+        PyErr_SetString( PyExc_IOError, "net_write failed" );
+        return NULL;
+    }
+    sno->sent += len;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+
+/**
+ ** sn.out
+ **
+ *  Handlers that send the response in many small pieces would 
+ *  otherwise pay a net_write ( a system call, and likely a packet )
+ *  per piece. sn.out.write() copies them into a buffer instead, 
+ *  and only writes when threshold bytes are waiting, on flush(), 
+ *  before a sn.net_write() and at the end of the request. Writes
+ *  of threshold bytes or more go straight out.
+ *
+ *  The buffer itself belongs to the thread and is handed from one
+ *  request to the next, so once a thread has served a request or
+ *  two buffering allocates nothing.
+ */
+
+static outobject * make_outobject( Session *sn )
+{
+    outobject *result;
+
+    if ( out_freelist )
+    {
+        result = ( outobject * ) out_freelist;
+        out_freelist = ( PyObject * ) out_freelist->ob_type;
+        out_nfree--;
+    }
+    else
+    {
+        result = PyMem_NEW( outobject, 1 );
+        if (! result )
+            return ( outobject * ) PyErr_NoMemory();
+    }
+
+    result->sn = sn;
+    result->buf = NULL;
+    result->len = 0;
+    result->size = 0;
+    result->threshold = outBuf;
+    result->sent = 0;
+    result->rq = NULL;
+    result->pending = 0;
+    result->discard = 0;
+    result->compress = compressLevel;
+    result->zip = 0;
+    result->etag = 0;
+    result->chunked = 0;
+    result->cbuf = NULL;
+    result->clen = 0;
+    result->csize = 0;
+    result->cttl = 0;
+    result->ob_type = &outobjecttype;
+    _Py_NewReference( result );
+
+    return result;
+}
+
+static void out_dealloc( outobject *oo )
+{
+    /* out_finish() has been called by now, unless the request 
+       never got that far, in which case there is nobody to tell */
+    if ( oo->buf )
+        free( oo->buf );
+    if ( oo->cbuf )
+        free( oo->cbuf );
+
+    if ( out_nfree < NSAPY_MAXFREE )
+    {
+        oo->ob_type = ( PyTypeObject * ) out_freelist;
+        out_freelist = ( PyObject * ) oo;
+        out_nfree++;
+    }
+    else
+        free( oo );
+}
+
+/* get a buffer of at least threshold bytes, the thread's if it has one */
+
+static int out_buffer( outobject *oo )
+{
+    nsapy_thread *t;
+    char *buf;
+
+    if ( oo->buf && oo->size >= oo->threshold )
+        return 1;
+
+    t = thread_data();
+    if ( ! oo->buf && t && t->outbuf )
+    {
+        oo->buf = t->outbuf;
+        oo->size = t->outsize;
+        t->outbuf = NULL;
+        t->outsize = 0;
+    }
+
+    if ( oo->size < oo->threshold )
+    {
+        buf = ( char * ) realloc( oo->buf, oo->threshold );
+        if ( ! buf )
+        {
+            PyErr_NoMemory();
+            return 0;
+        }
+        oo->buf = buf;
+        oo->size = oo->threshold;
+    }
+
+    return 1;
+}
+
+/*
+ * out_write
+ *
+   net_write len bytes of the body, as a chunk if the response is
+   chunked ( see out_start() ), without touching Python. The CRLF that
+   ends a chunk goes with the size line of the next, or the last one,
+   and a small chunk is copied in behind its size line, so it costs no
+   extra write at all.
+*/
+
+#define OUT_CHUNK_COPY  2048        /* chunks this small go in one write */
+
+static int out_chunk( outobject *oo, off_t len )
+{
+    char head[40];
+
+    if ( ! oo->chunked || len <= 0 )
+        return 0;
+
+    sprintf( head, "%s%lx\r\n", oo->chunked == 2 ? "\r\n" : "", ( unsigned long ) len );
+    oo->chunked = 2;
+
+    return sn_write( oo->sn, head, strlen( head ) );
+}
+
+static int out_write( outobject *oo, char *data, int len )
+{
+    char buff[ OUT_CHUNK_COPY + 20 ];
+    int n;
+
+    if ( len <= 0 )
+        return 0;
+
+    if ( oo->chunked && len <= OUT_CHUNK_COPY )
+    {
+        n = sprintf( buff, "%s%x\r\n", oo->chunked == 2 ? "\r\n" : "", len );
+        oo->chunked = 2;
+        memcpy( buff + n, data, len );
+        return sn_write( oo->sn, buff, n + len ) == IO_ERROR ? IO_ERROR : len;
+    }
+
+    if ( out_chunk( oo, len ) == IO_ERROR )
+        return IO_ERROR;
+
+    return sn_write( oo->sn, data, len );
+}
+
+/* write len bytes to the client, without the interpreter lock */
+
+static int out_send( outobject *oo, char *data, int len )
+{
+    int rv;
+
+    /* the first of the body lets the headers go */
+    if ( oo->pending && ! out_start( oo, 0 ) )
+        return 0;
+    if ( oo->discard )
+        return 1;
+#ifdef NSAPY_ZLIB
+    if ( oo->zip )
+        return out_deflate( oo, data, len, Z_NO_FLUSH );
+#endif
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = out_write( oo, data, len );
+    Py_END_ALLOW_THREADS
+
+    if ( rv == IO_ERROR )
+    {
+        PyErr_SetString( PyExc_IOError, "net_write failed" );
+        return 0;
+    }
+    oo->sent += len;
+    rcache_add( oo, data, len );
+
+    return 1;
+}
+
+/* send whatever is waiting, returns 0 ( with an IOError ) on error */
+
+static int out_flush( outobject *oo )
+{
+    int len;
+
+    if ( oo->len == 0 )
+        return 1;
+
+    /* even if this fails, there's no point in trying again */
+    len = oo->len;
+    oo->len = 0;
+
+    return out_send( oo, oo->buf, len );
+}
+
+/*
+ * out_finish
+ *
+   The request is over: send what's left ( if flush is set, else it's
+   dropped, held back headers and all, and a chunked body isn't ended )
+   and give the buffer back to the thread. Writing to sn.out after this
+   is an error. Returns 0 if the last flush failed.
+*/
+
+static int out_finish( sessionobject *sno, int flush )
+{
+    outobject *oo;
+    nsapy_thread *t;
+    int ok;
+
+    oo = sno->out;
+    if ( ! oo || ! oo->sn )
+        return 1;
+
+    /* headers that waited for a body that never came go now, and
+       if the server doesn't want the body, that's fine too */
+    ok = 1;
+    if ( flush && oo->pending && ! out_start( oo, 1 ) )
+    {
+        ok = oo->discard;
+        if ( ok )
+            PyErr_Clear();
+    }
+    oo->pending = 0;
+    oo->rq = NULL;
+
+    if ( ok && flush )
+        ok = out_flush( oo );
+#ifdef NSAPY_ZLIB
+    if ( oo->zip )
+    {
+        if ( ok && flush )
+            ok = out_deflate( oo, NULL, 0, Z_FINISH );
+        oo->zip = 0;
+        oo->z = NULL;
+        oo->zbuf = NULL;
+    }
+#endif
+    if ( oo->chunked )
+    {
+        /* the last chunk, unless there's no body to end */
+        if ( ok && flush && ! oo->discard )
+        {
+            Py_BEGIN_ALLOW_THREADS
+            ok = sn_write( oo->sn, oo->chunked == 2 ? "\r\n0\r\n\r\n" : "0\r\n\r\n",
+                           oo->chunked == 2 ? 7 : 5 ) != IO_ERROR;
+            Py_END_ALLOW_THREADS
+            if ( ! ok )
+                PyErr_SetString( PyExc_IOError, "net_write failed" );
+        }
+        oo->chunked = 0;
+    }
+    oo->sn = NULL;
+    oo->len = 0;
+    sno->sent += oo->sent;
+    oo->sent = 0;
+
+    if ( oo->buf )
+    {
+        t = thread_data();
+        if ( t && ! t->outbuf )
+        {
+            t->outbuf = oo->buf;
+            t->outsize = oo->size;
+        }
+        else
+            free( oo->buf );
+        oo->buf = NULL;
+        oo->size = 0;
+    }
+
+    return ok;
+}
+
+static int out_check( outobject *oo )
+{
+    if ( ! oo->sn )
+    {
+        PyErr_SetString( PyExc_ValueError, "sn.out used after the request is over" );
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * sn.out.write( string )
+ */
+
+static PyObject * Py_out_write( outobject *oo, PyObject *args )
+{
+    char *string;
+    int len;
+
+    if (! PyArg_ParseTuple(args, "s#", &string, &len) )
+        return NULL;
+
+    if ( ! out_check( oo ) )
+        return NULL;
+
+    /* doesn't fit with what's already waiting */
+    if ( oo->len + len > oo->threshold )
+        if ( ! out_flush( oo ) )
+            return NULL;
+
+    if ( len >= oo->threshold )
+    {
+        /* too big to be worth copying */
+        if ( ! out_send( oo, string, len ) )
+            return NULL;
+    }
+    else if ( len > 0 )
+    {
+        if ( ! out_buffer( oo ) )
+            return NULL;
+        memcpy( oo->buf + oo->len, string, len );
+        oo->len += len;
+    }
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * sn.out.flush()
+ */
+
+static PyObject * Py_out_flush( outobject *oo, PyObject *args )
+{
+    if (! PyArg_ParseTuple(args, "") )
+        return NULL;
+
+    if ( ! out_check( oo ) || ! out_push( oo ) )
+        return NULL;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * sn.out.set_threshold( n )
+ *
+   Flush when n bytes are waiting, 0 turns buffering off. The
+   default comes from "outbuf" in obj.conf.
+ */
+
+static PyObject * Py_out_set_threshold( outobject *oo, PyObject *args )
+{
+    int n;
+
+    if (! PyArg_ParseTuple(args, "i", &n) )
+        return NULL;
+
+    if ( n < 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "threshold can't be negative" );
+        return NULL;
+    }
+
+    if ( ! out_check( oo ) )
+        return NULL;
+
+    if ( n < oo->len && ! out_flush( oo ) )
+        return NULL;
+
+    oo->threshold = n;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+static PyObject * out_getattr( PyObject *oo, char *name )
+{
+    if ( strcmp( name, "threshold" ) == 0 )
+        return PyInt_FromLong( ( ( outobject * ) oo )->threshold );
+    if ( strcmp( name, "compress" ) == 0 )
+        return PyInt_FromLong( ( ( outobject * ) oo )->compress );
+
+    return Py_FindMethod( Pyoutmethods, oo, name );
+}
+
+
+/* everything so far to the client now, headers and all */
+
+static int out_push( outobject *oo )
+{
+    if ( oo->pending && ! out_start( oo, 0 ) )
+        return 0;
+    if ( ! out_flush( oo ) )
+        return 0;
+#ifdef NSAPY_ZLIB
+    if ( oo->zip && ! oo->discard )
+        return out_deflate( oo, NULL, 0, Z_SYNC_FLUSH );
+#endif
+
+    return 1;
+}
+
+
+/**
+ ** Compression
+ **
+ *  With "compress" set, sn.out gzips ( or deflates ) responses for
+ *  clients that say they take it in Accept-Encoding. Only text and
+ *  the likes of JSON, JavaScript and XML are compressed, the rest
+ *  ( images, archives ) mostly is already.
+ *
+ *  rq.start_response() doesn't send the headers of such a response
+ *  right away but leaves them waiting ( out_defer ) until the first
+ *  of the body goes out ( out_start ). By then we know if the whole
+ *  body fits in sn.out, and if it does and is smaller than
+ *  "compressmin" it's not worth it. Otherwise Content-Encoding goes
+ *  in the headers, Content-Length comes out, and everything after
+ *  them goes through zlib on its way to net_write.
+ *
+ *  zlib allocates a few hundred K for a stream, so each thread keeps
+ *  its stream and output buffer from one request to the next and
+ *  only resets it, the way it keeps the sn.out buffer.
+ */
+
+#ifdef NSAPY_ZLIB
+
+#define ZIP_GZIP     1
+#define ZIP_DEFLATE  2
+
+#define ZIP_BUF      16384
+
+/* is len bytes of s name, whatever the case? */
+
+static int zip_token( char *s, int len, char *name )
+{
+    int i;
+
+    for ( i = 0; i < len && name[i]; i++ )
+        if ( tolower( ( unsigned char ) s[i] ) != name[i] )
+            return 0;
+
+    return i == len && ! name[i];
+}
+
+/* is the q value at s ( up to end ) zero? */
+
+static int zip_qzero( char *s, char *end )
+{
+    if ( s >= end || *s != '0' )
+        return 0;
+    if ( ++s < end && *s == '.' )
+        for ( s++; s < end && *s == '0'; s++ )
+            ;
+
+    return s == end || ! isdigit( ( unsigned char ) *s );
+}
+
+/* ZIP_GZIP or ZIP_DEFLATE if the client takes it, gzip preferred */
+
+static int zip_accepted( Request *rq )
+{
+    char *ae, *p, *end, *q;
+    int len, ok, gzip, deflate, star;
+
+    ae = pblock_findval( "accept-encoding", rq->headers );
+    if ( ! ae )
+        return 0;
+
+    /* 1 if it's there, -1 if it's there with q=0 */
+    gzip = deflate = star = 0;
+    for ( p = ae; *p; p = *end ? end + 1 : end )
+    {
+        while ( *p == ' ' || *p == '\t' )
+            p++;
+        for ( end = p; *end && *end != ','; end++ )
+            ;
+        for ( len = 0; p + len < end && p[len] != ';' && p[len] != ' ' && p[len] != '\t'; len++ )
+            ;
+
+        ok = 1;
+        for ( q = p + len; q < end; q++ )
+            if ( ( *q == 'q' || *q == 'Q' ) && q + 1 < end && q[1] == '=' )
+            {
+                ok = zip_qzero( q + 2, end ) ? -1 : 1;
+                break;
+            }
+
+        if ( zip_token( p, len, "gzip" ) || zip_token( p, len, "x-gzip" ) )
+            gzip = ok;
+        else if ( zip_token( p, len, "deflate" ) )
+            deflate = ok;
+        else if ( zip_token( p, len, "*" ) )
+            star = ok;
+    }
+
+    if ( gzip > 0 || ( gzip == 0 && star > 0 ) )
+        return ZIP_GZIP;
+    if ( deflate > 0 || ( deflate == 0 && star > 0 ) )
+        return ZIP_DEFLATE;
+
+    return 0;
+}
+
+/* could the response in rq be worth compressing? */
+
+static int zip_candidate( Request *rq )
+{
+    char *status, *type, buff[100];
+    int code, i;
+
+    status = pblock_findval( "status", rq->srvhdrs );
+    code = status ? atoi( status ) : PROTOCOL_OK;
+    if ( code < 200 || code == 204 || code == 206 || code == 304 )
+        return 0;
+
+    if ( pblock_findval( "content-encoding", rq->srvhdrs ) )
+        return 0;
+
+    type = pblock_findval( "content-type", rq->srvhdrs );
+    if ( ! type )
+        return 0;
+    for ( i = 0; type[i] && type[i] != ';' && i < ( int ) sizeof( buff ) - 1; i++ )
+        buff[i] = tolower( ( unsigned char ) type[i] );
+    buff[i] = '\0';
+
+    return strncmp( buff, "text/", 5 ) == 0 || strstr( buff, "json" ) ||
+           strstr( buff, "javascript" ) || strstr( buff, "xml" );
+}
+
+/* the response varies with Accept-Encoding, for caches */
+
+static void zip_vary( Request *rq )
+{
+    char *vary, *v, buff[300];
+    int i;
+
+    vary = pblock_findval( "vary", rq->srvhdrs );
+    if ( ! vary )
+    {
+        pblock_nvinsert( "vary", "Accept-Encoding", rq->srvhdrs );
+        return;
+    }
+
+    for ( v = vary; *v; v++ )
+    {
+        for ( i = 0; "accept-encoding"[i] && tolower( ( unsigned char ) v[i] ) == "accept-encoding"[i]; i++ )
+            ;
+        if ( ! "accept-encoding"[i] || *v == '*' )
+            return;
+    }
+
+    if ( strlen( vary ) > sizeof( buff ) - 20 )
+        return;
+    sprintf( buff, "%s, Accept-Encoding", vary );
+    param_free( pblock_remove( "vary", rq->srvhdrs ) );
+    pblock_nvinsert( "vary", buff, rq->srvhdrs );
+}
+
+#endif /* NSAPY_ZLIB */
+
+/* will the response in rq have a body, of a length nobody knows yet? */
+
+static int out_unsized( Request *rq )
+{
+    char *status, *method;
+    int code;
+
+    if ( pblock_findval( "content-length", rq->srvhdrs ) )
+        return 0;
+
+    method = pblock_findval( "method", rq->reqpb );
+    if ( method && strcmp( method, "HEAD" ) == 0 )
+        return 0;
+
+    status = pblock_findval( "status", rq->srvhdrs );
+    code = status ? atoi( status ) : PROTOCOL_OK;
+
+    return code >= 200 && code != 204 && code != 304;
+}
+
+/* does the client take a chunked body? Anything from HTTP/1.1 on does */
+
+static int out_chunkable( Request *rq )
+{
+    char *protocol;
+    int major, minor;
+
+    protocol = pblock_findval( "protocol", rq->reqpb );
+    if ( ! protocol || sscanf( protocol, "HTTP/%d.%d", &major, &minor ) != 2 )
+        return 0;
+
+    return major > 1 || ( major == 1 && minor >= 1 );
+}
+
+/*
+ * out_defer
+ *
+   Called by rq.start_response(). If the response may be compressed,
+   mark it as varying with Accept-Encoding, and if it may be compressed,
+   is to have an ETag from its body or has no content-length, keep the
+   headers back for out_start(). Returns 1 if they wait, 0 if they
+   should go now.
+*/
+
+static int out_defer( sessionobject *sno, Request *rq )
+{
+    outobject *oo;
+    char *method;
+    int zip;
+
+    oo = sno->out;
+    if ( oo && oo->pending )
+        return 1;                   /* again, e.g. for an error page */
+    if ( rq->senthdrs || ( oo && ! oo->sn ) )
+        return 0;
+
+    zip = 0;
+#ifdef NSAPY_ZLIB
+    zip = ( oo ? oo->compress : compressLevel ) && zip_candidate( rq );
+    if ( zip )
+        zip_vary( rq );
+#endif
+    if ( ! zip && ! ( oo && oo->etag ) && ! out_unsized( rq ) )
+        return 0;
+
+    /* a HEAD response has no body to wait for, unless for its ETag */
+    method = pblock_findval( "method", rq->reqpb );
+    if ( method && strcmp( method, "HEAD" ) == 0 && ! ( oo && oo->etag ) )
+        return 0;
+
+    if ( ! oo )
+    {
+        oo = sno->out = make_outobject( sno->sn );
+        if ( ! oo )
+        {
+            PyErr_Clear();
+            return 0;
+        }
+    }
+
+    oo->rq = rq;
+    oo->pending = 1;
+    return 1;
+}
+
+#ifdef NSAPY_ZLIB
+
+/* get the thread's compressor ready for this response */
+
+static int zip_begin( outobject *oo, int zip )
+{
+    nsapy_thread *t;
+
+    t = thread_data();
+    if ( ! t )
+        return 0;
+
+    if ( t->z && ( t->zip != zip || t->zlevel != oo->compress ) )
+    {
+        deflateEnd( t->z );
+        free( t->z );
+        t->z = NULL;
+    }
+
+    if ( t->z )
+        deflateReset( t->z );
+    else
+    {
+        if ( ! t->zbuf )
+            t->zbuf = ( char * ) malloc( ZIP_BUF );
+        t->z = ( z_stream * ) calloc( 1, sizeof( z_stream ) );
+        if ( ! t->zbuf || ! t->z )
+        {
+            free( t->z );
+            t->z = NULL;
+            return 0;
+        }
+
+        /* 15 + 16 is a gzip header and trailer, 15 alone zlib's */
+        if ( deflateInit2( t->z, oo->compress, Z_DEFLATED, zip == ZIP_GZIP ? 31 : 15,
+                           8, Z_DEFAULT_STRATEGY ) != Z_OK )
+        {
+            free( t->z );
+            t->z = NULL;
+            return 0;
+        }
+        t->zip = zip;
+        t->zlevel = oo->compress;
+    }
+
+    oo->z = t->z;
+    oo->zbuf = t->zbuf;
+    return 1;
+}
+
+/*
+ * out_deflate
+ *
+   Compress len bytes of data and write what comes out, without the
+   interpreter lock. mode is Z_NO_FLUSH, Z_SYNC_FLUSH to get everything
+   so far to the client, or Z_FINISH at the end.
+*/
+
+static int out_deflate( outobject *oo, char *data, int len, int mode )
+{
+    z_stream *z;
+    int n, ok, sent;
+
+    z = oo->z;
+    z->next_in = ( Bytef * ) data;
+    z->avail_in = len;
+
+    ok = 1;
+    sent = 0;
+    Py_BEGIN_ALLOW_THREADS
+    do
+    {
+        z->next_out = ( Bytef * ) oo->zbuf;
+        z->avail_out = ZIP_BUF;
+        deflate( z, mode );
+
+        n = ZIP_BUF - z->avail_out;
+        if ( out_write( oo, oo->zbuf, n ) == IO_ERROR )
+            ok = 0;
+        rcache_add( oo, oo->zbuf, n );
+        sent += n;
+    }
+    while ( ok && z->avail_out == 0 );
+    Py_END_ALLOW_THREADS
+
+    oo->sent += sent;
+    if ( ! ok )
+    {
+        PyErr_SetString( PyExc_IOError, "net_write failed" );
+        return 0;
+    }
+
+    return 1;
+}
+
+#endif /* NSAPY_ZLIB */
+
+/*
+ * out_start
+ *
+   Send the headers out_defer() kept back, with an ETag hashed from
+   the body if it's final ( all of it is in sn.out ), or a 304 instead
+   if the client has it. The body is compressed unless it's final and
+   under compressmin, or the client takes neither gzip nor deflate.
+   Without a content-length, a final body that isn't compressed gets
+   one, and any other goes chunked to an HTTP/1.1 client, so either
+   way the connection can be kept open for the next request.
+   Returns 0 with a Python error if they couldn't be sent, or ( with
+   discard set ) if the server wants no body, though a final 304 is
+   no error.
+*/
+
+static int out_start( outobject *oo, int final )
+{
+    Request *rq;
+    char buff[20];
+    int rv;
+#ifdef NSAPY_ZLIB
+    int zip;
+#endif
+
+    rq = oo->rq;
+    oo->pending = 0;
+    oo->rq = NULL;
+
+    if ( oo->etag && final )
+        etag_hash( rq, oo->buf, oo->len );
+
+    if ( not_modified( rq ) )
+    {
+        oo->discard = 1;
+        oo->len = 0;
+#ifdef NSAPY_ZLIB
+        /* the same ETag the 200 would have had */
+        if ( oo->compress && zip_candidate( rq ) && zip_accepted( rq ) )
+            etag_weaken( rq );
+#endif
+
+        Py_BEGIN_ALLOW_THREADS
+        rv = start_not_modified( oo->sn, rq );
+        Py_END_ALLOW_THREADS
+
+        if ( final && rv != REQ_ABORTED )
+            return 1;
+        if ( rv != REQ_ABORTED )
+            rv = REQ_NOACTION;
+    }
+    else
+    {
+#ifdef NSAPY_ZLIB
+        zip = 0;
+        if ( ( ! final || oo->len >= compressMin ) && oo->compress && zip_candidate( rq ) )
+            zip = zip_accepted( rq );
+        if ( zip && zip_begin( oo, zip ) )
+        {
+            param_free( pblock_remove( "content-length", rq->srvhdrs ) );
+            pblock_nvinsert( "content-encoding", zip == ZIP_GZIP ? "gzip" : "deflate", rq->srvhdrs );
+            etag_weaken( rq );
+            oo->zip = zip;
+        }
+#endif
+
+        if ( out_unsized( rq ) )
+        {
+            if ( final && ! oo->zip )
+            {
+                sprintf( buff, "%d", oo->len );
+                pblock_nvinsert( "content-length", buff, rq->srvhdrs );
+            }
+            else if ( out_chunkable( rq ) )
+            {
+                pblock_nvinsert( "transfer-encoding", "chunked", rq->srvhdrs );
+                oo->chunked = 1;
+            }
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        rv = sn_start( oo->sn, rq );
+        Py_END_ALLOW_THREADS
+    }
+
+    if ( rv == REQ_NOACTION )
+    {
+        oo->discard = 1;
+        oo->len = 0;
+        PyErr_SetString( PyExc_KeyboardInterrupt,
+            "protocol_start_response returned REQ_NOACTION");
+        return 0;
+    }
+    if ( rv == REQ_ABORTED )
+    {
+        PyErr_SetString( PyExc_IOError, "protocol_start_response failed" );
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * sn.out.set_compress( level )
+ *
+   zlib level ( 1 fastest to 9 smallest ) for this response, 0 turns
+   compression off, e.g. for content that is compressed already. The
+   default comes from "compress" in obj.conf. Only makes a difference
+   before rq.start_response().
+ */
+
+static PyObject * Py_out_set_compress( outobject *oo, PyObject *args )
+{
+    int n;
+
+    if (! PyArg_ParseTuple(args, "i", &n) )
+        return NULL;
+
+    if ( n < 0 || n > 9 )
+    {
+        PyErr_SetString( PyExc_ValueError, "compress level must be between 0 and 9" );
+        return NULL;
+    }
+#ifndef NSAPY_ZLIB
+    if ( n )
+    {
+        PyErr_SetString( PyExc_ValueError, "nsapy was built without zlib" );
+        return NULL;
+    }
+#endif
+
+    if ( ! out_check( oo ) )
+        return NULL;
+
+    oo->compress = n;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+
+/**
+ ** Conditional requests
+ **
+ *  A response with an ETag or a Last-Modified, whoever put it there,
+ *  is checked against If-None-Match and If-Modified-Since when it
+ *  starts. If the client's copy is current, a 304 with no body goes
+ *  instead, and the handler is stopped the way it is when the server
+ *  wants no body ( see rq.start_response() ).
+ *
+ *  The validator comes from the handler, with sn.validate( etag, mtime )
+ *  as early as it likes ( it also says if the client's copy is current,
+ *  so the body needn't be made at all ), or from the body itself with
+ *  sn.out.set_etag( 1 ). That one needs the whole body in sn.out by
+ *  the end of the request, the headers wait for it like those of a
+ *  compressed response do.
+ */
+
+/* seconds since 1970 of an RFC 1123 date, -1 if it isn't one */
+
+static time_t http_time( char *s )
+{
+    static char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4], *m;
+    int d, mo, y, hh, mm, ss;
+    long days;
+
+    if ( sscanf( s, "%*3s, %d %3s %d %d:%d:%d", &d, mon, &y, &hh, &mm, &ss ) != 6 )
+        return -1;
+    m = strstr( months, mon );
+    if ( strlen( mon ) != 3 || ! m || ( m - months ) % 3 || y < 1970 )
+        return -1;
+
+    /* a year that starts in March has February last */
+    mo = ( m - months ) / 3;
+    if ( mo < 2 )
+        y--;
+    mo = ( mo + 10 ) % 12;
+    days = 365L * y + y / 4 - y / 100 + y / 400 + ( 153 * mo + 2 ) / 5 + d - 1 - 719468L;
+
+    return ( time_t ) ( days * 86400L + hh * 3600L + mm * 60L + ss );
+}
+
+/* is etag in the If-None-Match list inm? W/ doesn't matter */
+
+static int etag_match( char *inm, char *etag )
+{
+    char *end;
+    int len;
+
+    if ( strncmp( etag, "W/", 2 ) == 0 )
+        etag += 2;
+    len = strlen( etag );
+
+    while ( *inm )
+    {
+        while ( *inm == ' ' || *inm == '\t' || *inm == ',' )
+            inm++;
+        if ( *inm == '*' )
+            return 1;
+        if ( strncmp( inm, "W/", 2 ) == 0 )
+            inm += 2;
+
+        /* the tag is quoted, and may have commas in it */
+        end = inm;
+        if ( *end == '"' )
+            for ( end++; *end && *end != '"'; end++ )
+                ;
+        if ( *end == '"' )
+            end++;
+        while ( *end && *end != ',' && *end != ' ' && *end != '\t' )
+            end++;
+
+        if ( end - inm == len && strncmp( inm, etag, len ) == 0 )
+            return 1;
+        inm = end;
+    }
+
+    return 0;
+}
+
+/*
+ * not_modified
+ *
+   Does the client have the response in rq->srvhdrs already? Only a
+   200 to a GET or a HEAD, with a validator, can be answered with a 304.
+*/
+
+static int not_modified( Request *rq )
+{
+    char *method, *status, *inm, *ims, *etag, *lm;
+    time_t since, modified;
+
+    method = pblock_findval( "method", rq->reqpb );
+    if ( ! method || ( strcmp( method, "GET" ) != 0 && strcmp( method, "HEAD" ) != 0 ) )
+        return 0;
+    status = pblock_findval( "status", rq->srvhdrs );
+    if ( status && atoi( status ) != PROTOCOL_OK )
+        return 0;
+
+    /* If-None-Match, if there is one, decides */
+    inm = pblock_findval( "if-none-match", rq->headers );
+    if ( inm )
+    {
+        etag = pblock_findval( "etag", rq->srvhdrs );
+        return etag && etag_match( inm, etag );
+    }
+
+    ims = pblock_findval( "if-modified-since", rq->headers );
+    lm = pblock_findval( "last-modified", rq->srvhdrs );
+    if ( ! ims || ! lm )
+        return 0;
+    since = http_time( ims );
+    modified = http_time( lm );
+
+    return since != -1 && modified != -1 && modified <= since && since <= time( NULL );
+}
+
+/* send a 304 for the response in rq->srvhdrs, returns the REQ_* code */
+
+static int start_not_modified( Session *sn, Request *rq )
+{
+    param_free( pblock_remove( "content-length", rq->srvhdrs ) );
+    param_free( pblock_remove( "content-encoding", rq->srvhdrs ) );
+    protocol_status( sn, rq, PROTOCOL_NOT_MODIFIED, NULL );
+
+    return sn_start( sn, rq );
+}
+
+/* give the response in rq an ETag from its body, unless it has one */
+
+static void etag_hash( Request *rq, char *body, int len )
+{
+    unsigned long h;
+    char buff[40];
+    int i;
+
+    if ( pblock_findval( "etag", rq->srvhdrs ) )
+        return;
+
+    /* FNV-1a */
+    h = 2166136261UL;
+    for ( i = 0; i < len; i++ )
+        h = ( h ^ ( unsigned char ) body[i] ) * 16777619UL;
+
+    sprintf( buff, "\"%x-%08lx\"", len, h & 0xffffffffUL );
+    pblock_nvinsert( "etag", buff, rq->srvhdrs );
+}
+
+#ifdef NSAPY_ZLIB
+
+/* a compressed body isn't the same bytes, its ETag can only be weak */
+
+static void etag_weaken( Request *rq )
+{
+    char *etag, buff[300];
+
+    etag = pblock_findval( "etag", rq->srvhdrs );
+    if ( ! etag || strncmp( etag, "W/", 2 ) == 0 || strlen( etag ) > sizeof( buff ) - 3 )
+        return;
+
+    sprintf( buff, "W/%s", etag );
+    param_free( pblock_remove( "etag", rq->srvhdrs ) );
+    pblock_nvinsert( "etag", buff, rq->srvhdrs );
+}
+
+#endif /* NSAPY_ZLIB */
+
+/*
+ * sn.validate( [ etag [, mtime ]] )
+ *
+   Set the ETag ( quoted for you, unless it is already ) and/or the
+   Last-Modified ( seconds since 1970, as from os.stat() ) of the
+   response, either may be None. Returns 1 if the client has this
+   response already: it is going to get a 304 when the response
+   starts, so don't bother making the body.
+ */
+
+static PyObject * Py_sn_validate( sessionobject *sno, PyObject *args )
+{
+    PyObject *mtime;
+    Request *rq;
+    char *etag, buff[300];
+    time_t t;
+    struct tm *tm;
+#ifdef XP_UNIX
+    struct tm tmbuf;
+#endif
+
+    etag = NULL;
+    mtime = Py_None;
+    if (! PyArg_ParseTuple(args, "|zO", &etag, &mtime) )
+        return NULL;
+
+    rq = sno->rq;
+    if ( ! rq )
+    {
+        PyErr_SetString( PyExc_ValueError, "sn.validate needs a request" );
+        return NULL;
+    }
+
+    if ( etag )
+    {
+        if ( strlen( etag ) > sizeof( buff ) - 3 )
+        {
+            PyErr_SetString( PyExc_ValueError, "etag too long" );
+            return NULL;
+        }
+        if ( *etag == '"' || strncmp( etag, "W/", 2 ) == 0 )
+            strcpy( buff, etag );
+        else
+            sprintf( buff, "\"%s\"", etag );
+        param_free( pblock_remove( "etag", rq->srvhdrs ) );
+        pblock_nvinsert( "etag", buff, rq->srvhdrs );
+    }
+
+    if ( mtime != Py_None )
+    {
+        t = ( time_t ) PyFloat_AsDouble( mtime );
+        if ( PyErr_Occurred() )
+            return NULL;
+#ifdef XP_UNIX
+        tm = gmtime_r( &t, &tmbuf );
+#else
+        tm = gmtime( &t );
+#endif
+        strftime( buff, sizeof( buff ), HTTP_DATE_FMT, tm );
+        param_free( pblock_remove( "last-modified", rq->srvhdrs ) );
+        pblock_nvinsert( "last-modified", buff, rq->srvhdrs );
+    }
+
+    return PyInt_FromLong( not_modified( rq ) );
+}
+
+/*
+ * sn.out.set_etag( on )
+ *
+   With on true, the response gets an ETag hashed from its body, if
+   it hasn't one, and a client that has it gets a 304. The whole body
+   has to fit in sn.out ( see set_threshold ) or there is no ETag. Call
+   it before rq.start_response().
+ */
+
+static PyObject * Py_out_set_etag( outobject *oo, PyObject *args )
+{
+    int on;
+
+    if (! PyArg_ParseTuple(args, "i", &on) )
+        return NULL;
+
+    if ( ! out_check( oo ) )
+        return NULL;
+
+    oo->etag = on != 0;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+
+/**
+ ** Response cache
+ **
+ *  A handler that returns the same response for a while can say so
+ *  with sn.out.cache( seconds ). The body is kept as it goes out (
+ *  compressed, if it is ), and at the end of the request, if it was a
+ *  GET answered with 200 and no Set-Cookie, it is stored with its
+ *  headers under the URI and query string, plus the request headers
+ *  the response's Vary names ( for Accept-Encoding, just whether the
+ *  client takes gzip or deflate ). Until it expires, nsapy_Service
+ *  answers GET and HEAD requests for it from here, with a
+ *  Content-Length, without going near Python.
+ *
+ *  The cache is split into RCACHE_SHARDS shards by hash, each with its
+ *  own lock, hash table and LRU list, and its share of "cache" bytes.
+ *  A shard over its share throws away its least recently used entries.
+ *  A hit only holds the lock to find the entry and count a reference,
+ *  the writing to the client is done without it, and an entry thrown
+ *  away meanwhile is freed by the last one done with it.
+ */
+
+#define RCACHE_SHARDS   16
+#define RCACHE_BUCKETS  256         /* per shard */
+#define RCACHE_KEYMAX   2048
+
+typedef struct rcache_entry {
+    struct rcache_entry *next;      /* in the hash chain */
+    struct rcache_entry *newer, *older;
+    unsigned long hash;
+    time_t expires;
+    int refs;                       /* hits being written */
+    int dead;                       /* out of the cache, free it when refs is 0 */
+    long size;                      /* what it counts for against the cap */
+    char *key;                      /* uri \0 query */
+    int keylen;
+    char *vary;                     /* name \0 value \0 ... \0 */
+    char *hdrs;                     /* the same, of the response */
+    char *body;
+    int len;
+} rcache_entry;
+
+typedef struct rcache_shard {
+    CRITICAL crit;
+    rcache_entry *buckets[ RCACHE_BUCKETS ];
+    rcache_entry *newest, *oldest;
+    long bytes, entries;
+    long hits, misses, stores, evictions;
+} rcache_shard;
+
+/* response headers that aren't kept, the server makes them afresh */
+static char *rcacheSkip[] = {
+    "status", "content-length", "date", "server", "connection",
+    "keep-alive", "transfer-encoding", NULL
+};
+
+static rcache_shard *rcacheShards = NULL;
+
+static int rcache_init( void )
+{
+    int i;
+
+    rcacheShards = ( rcache_shard * ) calloc( RCACHE_SHARDS, sizeof( rcache_shard ) );
+    if ( ! rcacheShards )
+        return 0;
+
+    for ( i = 0; i < RCACHE_SHARDS; i++ )
+        rcacheShards[i].crit = crit_init();
+
+    return 1;
+}
+
+/* uri \0 query \0 host into buf, returns the length, 0 if it's too long.
+   The host header tells virtual servers apart, its case doesn't count */
+
+static int rcache_key( Request *rq, char *buf, unsigned long *hash )
+{
+    char *uri, *query, *host;
+    int ulen, qlen, hlen, len, i;
+    unsigned long h;
+
+    uri = pblock_findval( "uri", rq->reqpb );
+    query = pblock_findval( "query", rq->reqpb );
+    host = pblock_findval( "host", rq->headers );
+    if ( ! uri )
+        return 0;
+
+    ulen = strlen( uri );
+    qlen = query ? strlen( query ) : 0;
+    hlen = host ? strlen( host ) : 0;
+    if ( ulen + qlen + hlen + 3 > RCACHE_KEYMAX )
+        return 0;
+
+    memcpy( buf, uri, ulen + 1 );
+    memcpy( buf + ulen + 1, query ? query : "", qlen + 1 );
+    for ( i = 0; i < hlen; i++ )
+        buf[ ulen + qlen + 2 + i ] = tolower( ( unsigned char ) host[i] );
+    len = ulen + qlen + hlen + 2;
+    buf[ len ] = '\0';
+
+    /* FNV-1a */
+    h = 2166136261UL;
+    for ( i = 0; i < len; i++ )
+        h = ( h ^ ( unsigned char ) buf[i] ) * 16777619UL;
+    *hash = h;
+
+    return len;
+}
+
+static rcache_shard * rcache_shard_of( unsigned long hash )
+{
+    return rcacheShards + hash % RCACHE_SHARDS;
+}
+
+/* what the request has for a header the response varies on */
+
+static char * rcache_vary_value( Request *rq, char *name )
+{
+    char *value;
+
+#ifdef NSAPY_ZLIB
+    /* all that matters is what we'd compress with */
+    if ( strcmp( name, "accept-encoding" ) == 0 )
+        switch ( zip_accepted( rq ) )
+        {
+            case ZIP_GZIP:      return "gzip";
+            case ZIP_DEFLATE:   return "deflate";
+            default:            return "";
+        }
+#endif
+
+    value = pblock_findval( name, rq->headers );
+    return value ? value : "";
+}
+
+/* does the request have what the entry varies on? */
+
+static int rcache_vary_match( rcache_entry *e, Request *rq )
+{
+    char *v;
+
+    for ( v = e->vary; *v; v += strlen( v ) + 1 )
+    {
+        if ( strcmp( rcache_vary_value( rq, v ), v + strlen( v ) + 1 ) != 0 )
+            return 0;
+        v += strlen( v ) + 1;
+    }
+
+    return 1;
+}
+
+/* take e out of the table and the LRU list, with the shard locked */
+
+static void rcache_unlink( rcache_shard *s, rcache_entry *e )
+{
+    rcache_entry **pp;
+
+    for ( pp = &s->buckets[ ( e->hash / RCACHE_SHARDS ) % RCACHE_BUCKETS ]; *pp; pp = &( *pp )->next )
+        if ( *pp == e )
+        {
+            *pp = e->next;
+            break;
+        }
+
+    if ( e->newer )
+        e->newer->older = e->older;
+    else
+        s->newest = e->older;
+    if ( e->older )
+        e->older->newer = e->newer;
+    else
+        s->oldest = e->newer;
+
+    s->bytes -= e->size;
+    s->entries--;
+    e->dead = 1;
+    if ( ! e->refs )
+        free( e );
+}
+
+/* the live entry for this request, with a reference, or NULL */
+
+static rcache_entry * rcache_get( Request *rq, rcache_shard **sp )
+{
+    char key[ RCACHE_KEYMAX ];
+    unsigned long hash;
+    rcache_shard *s;
+    rcache_entry *e, *next;
+    time_t now;
+    int len;
+
+    len = rcache_key( rq, key, &hash );
+    if ( ! len )
+        return NULL;
+
+    s = *sp = rcache_shard_of( hash );
+    now = time( NULL );
+
+    crit_enter( s->crit );
+    for ( e = s->buckets[ ( hash / RCACHE_SHARDS ) % RCACHE_BUCKETS ]; e; e = next )
+    {
+        next = e->next;
+        if ( e->hash != hash || e->keylen != len || memcmp( e->key, key, len ) != 0 )
+            continue;
+        if ( e->expires <= now )
+            rcache_unlink( s, e );
+        else if ( rcache_vary_match( e, rq ) )
+            break;
+    }
+
+    if ( e )
+    {
+        /* most recently used */
+        if ( e->newer )
+        {
+            e->newer->older = e->older;
+            if ( e->older )
+                e->older->newer = e->newer;
+            else
+                s->oldest = e->newer;
+            e->older = s->newest;
+            e->newer = NULL;
+            s->newest->newer = e;
+            s->newest = e;
+        }
+        e->refs++;
+        s->hits++;
+    }
+    else
+        s->misses++;
+    crit_exit( s->crit );
+
+    return e;
+}
+
+static void rcache_release( rcache_shard *s, rcache_entry *e )
+{
+    crit_enter( s->crit );
+    if ( --e->refs == 0 && e->dead )
+        free( e );
+    crit_exit( s->crit );
+}
+
+/*
+ * rcache_serve
+ *
+   Answer the request from the cache if we can. Returns -1 if we
+   can't, otherwise the REQ_* code. Called without the interpreter.
+*/
+
+static int rcache_serve( Session *sn, Request *rq, long *sent )
+{
+    rcache_shard *s;
+    rcache_entry *e;
+    char *method, *h, clen[32];
+    int rv;
+
+    method = pblock_findval( "method", rq->reqpb );
+    if ( ! method || ( strcmp( method, "GET" ) != 0 && strcmp( method, "HEAD" ) != 0 ) )
+        return -1;
+
+    e = rcache_get( rq, &s );
+    if ( ! e )
+        return -1;
+
+    for ( h = e->hdrs; *h; h += strlen( h ) + 1 )
+    {
+        param_free( pblock_remove( h, rq->srvhdrs ) );
+        pblock_nvinsert( h, h + strlen( h ) + 1, rq->srvhdrs );
+        h += strlen( h ) + 1;
+    }
+    sprintf( clen, "%d", e->len );
+    param_free( pblock_remove( "content-length", rq->srvhdrs ) );
+    pblock_nvinsert( "content-length", clen, rq->srvhdrs );
+    protocol_status( sn, rq, PROTOCOL_OK, NULL );
+
+    if ( not_modified( rq ) )
+    {
+        rv = start_not_modified( sn, rq );
+        if ( rv != REQ_ABORTED )
+            rv = REQ_NOACTION;
+    }
+    else
+        rv = sn_start( sn, rq );
+    if ( rv == REQ_NOACTION )
+        rv = REQ_PROCEED;
+    else if ( rv != REQ_ABORTED )
+    {
+        if ( sn_write( sn, e->body, e->len ) == IO_ERROR )
+            rv = REQ_EXIT;
+        else
+            *sent = e->len;
+    }
+
+    rcache_release( s, e );
+    return rv;
+}
+
+/* add n bytes that went out to what sn.out is keeping */
+
+static void rcache_add( outobject *oo, char *data, int n )
+{
+    char *buf;
+    long max;
+
+    if ( oo->cttl <= 0 || n <= 0 )
+        return;
+
+    /* bigger than a shard may hold, forget it */
+    max = rcacheMax / RCACHE_SHARDS;
+    if ( oo->clen + n > max )
+    {
+        rcache_forget( oo );
+        return;
+    }
+
+    if ( oo->clen + n > oo->csize )
+    {
+        buf = ( char * ) realloc( oo->cbuf, ( oo->clen + n ) * 2 < max ? ( oo->clen + n ) * 2 : max );
+        if ( ! buf )
+        {
+            rcache_forget( oo );
+            return;
+        }
+        oo->cbuf = buf;
+        oo->csize = ( oo->clen + n ) * 2 < max ? ( oo->clen + n ) * 2 : max;
+    }
+
+    memcpy( oo->cbuf + oo->clen, data, n );
+    oo->clen += n;
+}
+
+/* not keeping this one after all */
+
+static void rcache_forget( outobject *oo )
+{
+    free( oo->cbuf );
+    oo->cbuf = NULL;
+    oo->clen = oo->csize = 0;
+    oo->cttl = 0;
+}
+
+/* copy a name \0 value \0 pair to d, returns where it ends */
+
+static char * rcache_pair( char *d, char *name, char *value )
+{
+    int n;
+
+    n = strlen( name ) + 1;
+    memcpy( d, name, n );
+    d += n;
+    n = strlen( value ) + 1;
+    memcpy( d, value, n );
+    return d + n;
+}
+
+/*
+ * rcache_store
+ *
+   The request is over, keep its response if sn.out.cache() asked for
+   it and it's fit to be kept. Everything that went out has to have
+   gone through sn.out, so that the body is complete.
+*/
+
+static void rcache_store( sessionobject *sno, Request *rq, int result )
+{
+    outobject *oo;
+    rcache_shard *s;
+    rcache_entry *e, **pp;
+    struct pb_entry *p;
+    char key[ RCACHE_KEYMAX ], vary[ 512 ], *method, *status, *v, *d, *name;
+    unsigned long hash;
+    int keylen, nvary, i, j, ok;
+    long size;
+
+    oo = sno->out;
+    if ( ! oo || oo->cttl <= 0 )
+        return;
+
+    method = pblock_findval( "method", rq->reqpb );
+    status = pblock_findval( "status", rq->srvhdrs );
+    keylen = rcache_key( rq, key, &hash );
+    ok = rcacheShards && result == REQ_PROCEED && ! oo->discard && oo->clen == sno->sent && keylen &&
+         method && strcmp( method, "GET" ) == 0 && ( ! status || atoi( status ) == PROTOCOL_OK ) &&
+         ! pblock_findval( "set-cookie", rq->srvhdrs );
+
+    /* the names in Vary, lower case, one after the other */
+    nvary = 0;
+    v = ok ? pblock_findval( "vary", rq->srvhdrs ) : NULL;
+    while ( ok && v && *v )
+    {
+        while ( *v == ' ' || *v == '\t' || *v == ',' )
+            v++;
+        for ( i = 0; v[i] && v[i] != ',' && v[i] != ' ' && v[i] != '\t'; i++ )
+            ;
+        if ( ! i )
+            break;
+        if ( *v == '*' || nvary + i + 1 > ( int ) sizeof( vary ) )
+            ok = 0;
+        else
+        {
+            for ( j = 0; j < i; j++ )
+                vary[ nvary + j ] = tolower( ( unsigned char ) v[j] );
+            vary[ nvary + i ] = '\0';
+            nvary += i + 1;
+        }
+        v += i;
+    }
+
+    if ( ! ok )
+    {
+        rcache_forget( oo );
+        return;
+    }
+
+    /* how big it all is */
+    size = keylen + 1 + oo->clen;
+    for ( name = vary; name < vary + nvary; name += strlen( name ) + 1 )
+        size += strlen( name ) + strlen( rcache_vary_value( rq, name ) ) + 2;
+    for ( i = 0; i < rq->srvhdrs->hsize; i++ )
+        for ( p = rq->srvhdrs->ht[i]; p; p = p->next )
+            size += strlen( p->param->name ) + strlen( p->param->value ) + 2;
+    size += 1;
+
+    e = ( rcache_entry * ) malloc( sizeof( rcache_entry ) + size );
+    if ( ! e )
+    {
+        rcache_forget( oo );
+        return;
+    }
+
+    d = ( char * ) ( e + 1 );
+    e->key = d;
+    e->keylen = keylen;
+    memcpy( d, key, keylen );
+    d += keylen;
+
+    e->vary = d;
+    for ( name = vary; name < vary + nvary; name += strlen( name ) + 1 )
+        d = rcache_pair( d, name, rcache_vary_value( rq, name ) );
+    *d++ = '\0';
+
+    e->hdrs = d;
+    for ( i = 0; i < rq->srvhdrs->hsize; i++ )
+        for ( p = rq->srvhdrs->ht[i]; p; p = p->next )
+        {
+            for ( j = 0; rcacheSkip[j]; j++ )
+                if ( strcmp( p->param->name, rcacheSkip[j] ) == 0 )
+                    break;
+            if ( ! rcacheSkip[j] )
+                d = rcache_pair( d, p->param->name, p->param->value );
+        }
+    *d++ = '\0';
+
+    e->body = d;
+    e->len = oo->clen;
+    memcpy( d, oo->cbuf, oo->clen );
+
+    e->hash = hash;
+    e->expires = time( NULL ) + oo->cttl;
+    e->refs = 0;
+    e->dead = 0;
+    e->size = sizeof( rcache_entry ) + size;
+    rcache_forget( oo );
+
+    s = rcache_shard_of( hash );
+    crit_enter( s->crit );
+
+    /* it replaces what was there for the same request */
+    pp = &s->buckets[ ( hash / RCACHE_SHARDS ) % RCACHE_BUCKETS ];
+    for ( ; *pp; pp = &( *pp )->next )
+        if ( ( *pp )->hash == hash && ( *pp )->keylen == keylen &&
+             memcmp( ( *pp )->key, key, keylen ) == 0 && rcache_vary_match( *pp, rq ) )
+        {
+            rcache_unlink( s, *pp );
+            break;
+        }
+
+    e->next = s->buckets[ ( hash / RCACHE_SHARDS ) % RCACHE_BUCKETS ];
+    s->buckets[ ( hash / RCACHE_SHARDS ) % RCACHE_BUCKETS ] = e;
+    e->newer = NULL;
+    e->older = s->newest;
+    if ( s->newest )
+        s->newest->newer = e;
+    else
+        s->oldest = e;
+    s->newest = e;
+    s->bytes += e->size;
+    s->entries++;
+    s->stores++;
+
+    /* over its share, the least recently used go */
+    while ( s->bytes > rcacheMax / RCACHE_SHARDS && s->oldest != e )
+    {
+        rcache_unlink( s, s->oldest );
+        s->evictions++;
+    }
+
+    crit_exit( s->crit );
+}
+
+/*
+ * sn.out.cache( seconds )
+ *
+   Keep this response for that long, and answer the same request with
+   it meanwhile. Call it before any of the body is written. 0 changes
+   your mind. Does nothing unless "cache" is set in obj.conf.
+ */
+
+static PyObject * Py_out_cache( outobject *oo, PyObject *args )
+{
+    int ttl;
+
+    if (! PyArg_ParseTuple(args, "i", &ttl) )
+        return NULL;
+
+    if ( ! out_check( oo ) )
+        return NULL;
+
+    if ( ! rcacheShards || ttl <= 0 )
+        rcache_forget( oo );
+    else
+        oo->cttl = ttl;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * nsapi.cache_info()
+ *
+   A dictionary of entries, bytes, hits, misses, stores and evictions
+   of the response cache, all shards together.
+ */
+
+static PyObject * Py_cache_info( PyObject *self, PyObject *args )
+{
+    long entries, bytes, hits, misses, stores, evictions;
+    rcache_shard *s;
+    int i;
+
+    if (! PyArg_ParseTuple(args, "") )
+        return NULL;
+
+    entries = bytes = hits = misses = stores = evictions = 0;
+    for ( i = 0; rcacheShards && i < RCACHE_SHARDS; i++ )
+    {
+        s = rcacheShards + i;
+        crit_enter( s->crit );
+        entries += s->entries;
+        bytes += s->bytes;
+        hits += s->hits;
+        misses += s->misses;
+        stores += s->stores;
+        evictions += s->evictions;
+        crit_exit( s->crit );
+    }
+
+    return Py_BuildValue( "{s:l,s:l,s:l,s:l,s:l,s:l,s:l}", "entries", entries,
+                          "bytes", bytes, "max", rcacheMax, "hits", hits, "misses", misses,
+                          "stores", stores, "evictions", evictions );
+}
+
+/*
+ * nsapi.cache_clear( [ uri ] )
+ *
+   Throw away what the response cache has for uri ( whatever the query
+   string and host ), or everything. Returns how many entries went.
+ */
+
+static PyObject * Py_cache_clear( PyObject *self, PyObject *args )
+{
+    rcache_shard *s;
+    rcache_entry *e, *older;
+    char *uri;
+    long n;
+    int i;
+
+    uri = NULL;
+    if (! PyArg_ParseTuple(args, "|s", &uri) )
+        return NULL;
+
+    n = 0;
+    for ( i = 0; rcacheShards && i < RCACHE_SHARDS; i++ )
+    {
+        s = rcacheShards + i;
+        crit_enter( s->crit );
+        for ( e = s->oldest; e; e = older )
+        {
+            older = e->newer;
+            if ( ! uri || strcmp( e->key, uri ) == 0 )
+            {
+                rcache_unlink( s, e );
+                n++;
+            }
+        }
+        crit_exit( s->crit );
+    }
+
+    return PyInt_FromLong( n );
+}
+
+
+/**
+ ** sn.send_file( path [, offset [, length ]] )
+ **
+ *  Sends ( part of ) a file to the client without it ever passing
+ *  through Python, and without the interpreter lock.
+ *
+ *  The file is opened once, and its size and the rest are taken from
+ *  what was opened, so a rename in between can't give us another file.
+ *  Where there's pread() ( NSAPY_PREAD ) it's read at the offset
+ *  wanted, elsewhere in order. Either way a file cut short while it's
+ *  being sent is a read error, never a read past its end. Small files
+ *  ( up to fileCacheMax bytes ) are kept, copied, in fileCache so that
+ *  the hot ones cost no reads, just the open() and fstat().
+ *
+ *  NSAPI 3.0 has no sendfile(), and the descriptor may be SSL, so
+ *  net_write() is as close to the socket as we get.
+ */
+
+#define SENDFILE_BLOCK  65536
+
+#ifdef NSAPY_PREAD
+typedef int file_fd;
+#else
+typedef SYS_FILE file_fd;
+#endif
+
+/*
+ * file_read
+ *
+   Read up to len bytes of fd at offset into buf. Returns how many, 0
+   at the end of the file or -1. Without pread() offset has to be
+   where the last read left off, see file_skip().
+*/
+
+static int file_read( file_fd fd, char *buf, int len, off_t offset )
+{
+#ifdef NSAPY_PREAD
+    int n;
+
+    do
+        n = ( int ) pread( fd, buf, len, offset );
+    while ( n < 0 && errno == EINTR );
+
+    return n < 0 ? -1 : n;
+#else
+    return system_fread( fd, buf, len );
+#endif
+}
+
+/* get to offset, buf is SENDFILE_BLOCK bytes. NSAPI has no portable
+   seek, so without pread() this reads up to it */
+
+static int file_skip( file_fd fd, char *buf, off_t offset )
+{
+#ifndef NSAPY_PREAD
+    int n;
+
+    while ( offset > 0 )
+    {
+        n = system_fread( fd, buf, offset < SENDFILE_BLOCK ? ( int ) offset : SENDFILE_BLOCK );
+        if ( n <= 0 )
+            return -1;
+        offset -= n;
+    }
+#endif
+    return 0;
+}
+
+#ifdef NSAPY_PREAD
+
+#define FILECACHE_BUCKETS   64
+#define FILECACHE_MAX       1024
+
+typedef struct filecache_entry {
+    char *path;
+    dev_t dev;                      /* these four tell us if the file */
+    ino_t ino;                      /* changed since it was read */
+    off_t size;
+    time_t mtime;
+    char *data;                     /* a copy, the file may change */
+    int refs;                       /* senders, plus one while cached */
+    struct filecache_entry *next;
+} filecache_entry;
+
+static filecache_entry *fileCache[ FILECACHE_BUCKETS ];
+static int fileCacheCount = 0;
+
+/* drop a reference, the last one frees ( fileCacheCrit held ) */
+
+static void filecache_unref( filecache_entry *fe )
+{
+    if ( --fe->refs > 0 )
+        return;
+
+    free( fe->data );
+    free( fe->path );
+    free( fe );
+}
+
+/*
+ * filecache_get
+ *
+   Find path in the cache, reading it from fd ( and adding it, if
+   there is room ) if it isn't there or st says it has changed. The
+   entry returned has a reference for the caller, which filecache_put()
+   gives back. Returns NULL if the file can't be read, or is shorter
+   than st says.
+*/
+
+static filecache_entry * filecache_get( char *path, file_fd fd, struct stat *st )
+{
+    filecache_entry *fe, **pfe;
+    unsigned h;
+    off_t got;
+    int n;
+
+    h = str_hash( path ) % FILECACHE_BUCKETS;
+
+    crit_enter( fileCacheCrit );
+    for ( pfe = &fileCache[h]; *pfe; pfe = &( *pfe )->next )
+        if ( strcmp( ( *pfe )->path, path ) == 0 )
+            break;
+
+    fe = *pfe;
+    if ( fe )
+    {
+        if ( fe->dev == st->st_dev && fe->ino == st->st_ino &&
+             fe->size == st->st_size && fe->mtime == st->st_mtime )
+        {
+            fe->refs++;
+            crit_exit( fileCacheCrit );
+            return fe;
+        }
+
+        /* stale, anyone still sending it keeps their copy */
+        *pfe = fe->next;
+        fileCacheCount--;
+        filecache_unref( fe );
+    }
+    crit_exit( fileCacheCrit );
+
+    /* read it, outside the lock */
+    fe = ( filecache_entry * ) malloc( sizeof( filecache_entry ) );
+    if ( ! fe )
+        return NULL;
+    fe->data = ( char * ) malloc( st->st_size ? st->st_size : 1 );
+    if ( ! fe->data )
+    {
+        free( fe );
+        return NULL;
+    }
+
+    for ( got = 0; got < st->st_size; got += n )
+    {
+        n = file_read( fd, fe->data + got, ( int ) ( st->st_size - got ), got );
+        if ( n <= 0 )
+        {
+            free( fe->data );
+            free( fe );
+            return NULL;
+        }
+    }
+
+    fe->path = strdup( path );
+    fe->dev = st->st_dev;
+    fe->ino = st->st_ino;
+    fe->size = st->st_size;
+    fe->mtime = st->st_mtime;
+    fe->refs = 1;
+    fe->next = NULL;
+
+    crit_enter( fileCacheCrit );
+    if ( fe->path && fileCacheCount < FILECACHE_MAX )
+    {
+        /* another thread may have beaten us to it, newest wins */
+        for ( pfe = &fileCache[h]; *pfe; pfe = &( *pfe )->next )
+            if ( strcmp( ( *pfe )->path, path ) == 0 )
+            {
+                filecache_entry *old = *pfe;
+
+                *pfe = old->next;
+                fileCacheCount--;
+                filecache_unref( old );
+                break;
+            }
+
+        fe->next = fileCache[h];
+        fileCache[h] = fe;
+        fileCacheCount++;
+        fe->refs++;
+    }
+    crit_exit( fileCacheCrit );
+
+    return fe;
+}
+
+static void filecache_put( filecache_entry *fe )
+{
+    crit_enter( fileCacheCrit );
+    filecache_unref( fe );
+    crit_exit( fileCacheCrit );
+}
+
+#endif /* NSAPY_PREAD */
+
+/*
+ * file_send
+ *
+   Write length bytes of the open file fd ( path, as st describes it )
+   starting at offset to the client. Called without the interpreter
+   lock. Returns 0 if all went well, -1 if the file couldn't be read,
+   -2 if the client couldn't be written to.
+*/
+
+static int file_send( Session *sn, char *path, file_fd fd, struct stat *st, off_t offset, off_t length )
+{
+    char *buf;
+    int n, want, rv;
+#ifdef NSAPY_PREAD
+    filecache_entry *fe;
+#endif
+
+    if ( length == 0 )
+        return 0;
+
+#ifdef NSAPY_PREAD
+    if ( st->st_size <= fileCacheMax )
+    {
+        fe = filecache_get( path, fd, st );
+        if ( ! fe )
+            return -1;
+        rv = sn_write( sn, fe->data + offset, ( int ) length ) == IO_ERROR ? -2 : 0;
+        filecache_put( fe );
+        return rv;
+    }
+#endif
+
+    buf = ( char * ) malloc( SENDFILE_BLOCK );
+    if ( ! buf )
+        return -1;
+
+    rv = file_skip( fd, buf, offset );
+    while ( rv == 0 && length > 0 )
+    {
+        want = length < SENDFILE_BLOCK ? ( int ) length : SENDFILE_BLOCK;
+        n = file_read( fd, buf, want, offset );
+        if ( n <= 0 )
+            rv = -1;                    /* it got shorter */
+        else if ( sn_write( sn, buf, n ) == IO_ERROR )
+            rv = -2;
+        else
+        {
+            offset += n;
+            length -= n;
+        }
+    }
+
+    free( buf );
+    return rv;
+}
+
+#ifdef NSAPY_ZLIB
+
+/*
+ * file_deflate
+ *
+   Like file_send(), but through sn.out's compressor. Called with the
+   interpreter lock. Returns -2 ( with a Python error ) if the client
+   couldn't be written to.
+*/
+
+static int file_deflate( outobject *oo, file_fd fd, off_t offset, off_t length )
+{
+    char *buf;
+    int n, want, rv;
+
+    buf = ( char * ) malloc( SENDFILE_BLOCK );
+    if ( ! buf )
+        return -1;
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = file_skip( fd, buf, offset );
+    Py_END_ALLOW_THREADS
+
+    while ( rv == 0 && length > 0 )
+    {
+        want = length < SENDFILE_BLOCK ? ( int ) length : SENDFILE_BLOCK;
+
+        Py_BEGIN_ALLOW_THREADS
+        n = file_read( fd, buf, want, offset );
+        Py_END_ALLOW_THREADS
+
+        if ( n <= 0 )
+            rv = -1;
+        else if ( ! out_send( oo, buf, n ) )
+            rv = -2;
+        else
+        {
+            offset += n;
+            length -= n;
+        }
+    }
+
+    free( buf );
+    return rv;
+}
+
+#endif /* NSAPY_ZLIB */
+
+/*
+ * sn.send_file( path [, offset [, length ]] )
+ *
+   If the response hasn't started yet, sets content-length ( and the
+   status, if there isn't one ) and starts it. For a HEAD request
+   that's all. Returns the number of bytes sent.
+ */
+
+/* a file size or offset for Python, a long integer if it needs one */
+
+static PyObject * off_object( off_t n )
+{
+    if ( n > LONG_MAX )
+        return PyLong_FromDouble( ( double ) n );
+    return PyInt_FromLong( ( long ) n );
+}
+
+/* the rest of sn.send_file(), once the file is open */
+
+static PyObject * send_open_file( sessionobject *sno, char *path, file_fd fd, struct stat *st, off_t offset, off_t length )
+{
+    char buff[300];
+    int rv;
+    outobject *oo;
+    Request *rq;
+
+    rq = sno->rq;
+
+    if ( offset < 0 || offset > st->st_size )
+    {
+        PyErr_SetString( PyExc_ValueError, "sn.send_file offset is outside the file" );
+        return NULL;
+    }
+    if ( length < 0 || length > st->st_size - offset )
+        length = st->st_size - offset;
+
+    /* anything already in sn.out goes first. If there's nothing,
+       headers that were waiting to see about compression can go
+       with the file's content-length instead */
+    oo = sno->out;
+    if ( oo && oo->sn )
+    {
+        if ( oo->pending && oo->len == 0 )
+        {
+            oo->pending = 0;
+            oo->rq = NULL;
+        }
+        if ( ! out_flush( oo ) )
+            return NULL;
+    }
+
+#ifdef NSAPY_ZLIB
+    /* in the middle of a compressed body, the file has to go through zlib too */
+    if ( oo && oo->zip )
+    {
+        rv = file_deflate( oo, fd, offset, length );
+        if ( rv == -1 )
+        {
+            sprintf( buff, "error reading %.200s", path );
+            PyErr_SetString( PyExc_IOError, buff );
+        }
+        return rv < 0 ? NULL : off_object( length );
+    }
+#endif
+
+    if ( ! rq->senthdrs )
+    {
+        /* files may be bigger than an int, or a long, but not a double */
+        sprintf( buff, "%.0f", ( double ) length );
+        param_free( pblock_remove( "content-length", rq->srvhdrs ) );
+        pblock_nvinsert( "content-length", buff, rq->srvhdrs );
+        if ( ! pblock_findval( "status", rq->srvhdrs ) )
+            protocol_status( sno->sn, rq, PROTOCOL_OK, NULL );
+
+        Py_BEGIN_ALLOW_THREADS
+        if ( not_modified( rq ) )
+        {
+            rv = start_not_modified( sno->sn, rq );
+            if ( rv != REQ_ABORTED )
+                rv = REQ_NOACTION;
+        }
+        else
+            rv = sn_start( sno->sn, rq );
+        Py_END_ALLOW_THREADS
+
+        if ( rv == REQ_NOACTION )
+            return PyInt_FromLong( 0 );
+        if ( rv == REQ_ABORTED )
+        {
+            PyErr_SetString( PyExc_IOError, "protocol_start_response failed" );
+            return NULL;
+        }
+    }
+
+    /* in a chunked body, the file is one more chunk */
+    Py_BEGIN_ALLOW_THREADS
+    if ( oo && oo->chunked && out_chunk( oo, length ) == IO_ERROR )
+        rv = -2;
+    else
+        rv = file_send( sno->sn, path, fd, st, offset, length );
+    Py_END_ALLOW_THREADS
+
+    if ( rv < 0 )
+    {
+        if ( rv == -1 )
+            sprintf( buff, "error reading %.200s", path );
+        else
+            sprintf( buff, "net_write failed" );
+        PyErr_SetString( PyExc_IOError, buff );
+        return NULL;
+    }
+    sno->sent += length;
+
+    return off_object( length );
+}
+
+static PyObject * Py_sn_send_file( sessionobject *sno, PyObject *args )
+{
+    char *path, buff[300];
+    struct stat st;
+    long off, len;
+    int rv;
+    file_fd fd;
+    PyObject *result;
+
+    off = 0;
+    len = -1;
+    if (! PyArg_ParseTuple(args, "s|ll", &path, &off, &len) )
+        return NULL;
+
+    if ( ! sno->rq )
+    {
+        PyErr_SetString( PyExc_ValueError, "sn.send_file needs a request" );
+        return NULL;
+    }
+
+    /* open it once and look at what was opened. NSAPI has no fstat(),
+       so without pread() the stat() comes after the open(), and a file
+       swapped in between may be sent in part, but still only read */
+    Py_BEGIN_ALLOW_THREADS
+#ifdef NSAPY_PREAD
+    fd = open( path, O_RDONLY );
+    rv = fd < 0 ? -1 : fstat( fd, &st );
+#else
+    fd = system_fopenRO( path );
+    rv = fd == SYS_ERROR_FD ? -1 : system_stat( path, &st );
+#endif
+    Py_END_ALLOW_THREADS
+
+    if ( rv < 0 || ! S_ISREG( st.st_mode ) )
+        result = NULL;
+    else
+        result = send_open_file( sno, path, fd, &st, ( off_t ) off, ( off_t ) len );
+
+#ifdef NSAPY_PREAD
+    if ( fd >= 0 )
+        close( fd );
+#else
+    if ( fd != SYS_ERROR_FD )
+        system_fclose( fd );
+#endif
+
+    if ( ! result && ! PyErr_Occurred() )
+    {
+        sprintf( buff, "can't send %.200s", path );
+        PyErr_SetString( PyExc_IOError, buff );
+    }
+    return result;
+}
+
+
+/*
+   netbuf_read reads up to len bytes of the request body into dst.
+   It returns the number of bytes actually read, which is less than
+   len only if the client hung up early, or -1 if there was an IO 
+   error.
+
+   Whatever the server has already buffered is copied out of the
+   netbuf in one go, the rest is read from the socket straight into
+   dst, as much as the socket will give at a time.
+*/
+
+static int netbuf_read( netbuf *buf, char *dst, int len )
+{
+    int i;                   /* index into dst */
+    int n;                   /* chars copied or read in one go */
+
+#ifdef NSAPY_PREFORK
+    /* a worker process has no netbuf, the server reads for it */
+    if ( pfFd != -1 )
+        return pf_read( dst, len );
+#endif
+
+    i = 0;
+
+    /* first, what's left in the netbuf */
+    n = buf->cursize - buf->pos;
+    if ( n > len )
+        n = len;
+    if ( n > 0 )
+    {
+        memcpy( dst, buf->inbuf + buf->pos, n );
+        buf->pos += n;
+        i = n;
+    }
+
+    /* then the socket, until we have len or the client is done */
+    while ( i < len )
+    {
+        n = net_read( buf->sd, dst + i, len - i, buf->rdtimeout );
+        if ( n == IO_ERROR )
+            return -1;
+        if ( n == IO_EOF )
+            break;
+        i += n;
+    }
+
+    return i;
+}
+
+/*
+   This function reads in data from the specified netbuf, discarding
+   the header and then converting the rest into a string in query
+   string format, up to clen characters. qstr must already have been
+   allocated ( clen + 1 bytes ). It returns the number of characters
+   actually read, or -1 if there was an IO error.
+*/
+
+int post2qstr(netbuf *buf, char* qstr, int clen)
+{
+    int i;
+
+    i = netbuf_read( buf, qstr, clen );
+    if ( i >= 0 )
+        qstr[i] = '\0';
+
+    return(i);
+}
+
+/*
+ * body_start
+ *
+   Find out how much request body there is ( from content-length )
+   the first time it is asked for, and refuse it if it is more than
+   the session's max_body. Returns 0 and sets a Python error if the
+   body can't be read. 
+*/
+
+static int body_start( sessionobject *sno )
+{
+    char *clen, buff[100];
+    int len;
+
+    if ( sno->body_left != BODY_UNKNOWN )
+        return 1;
+
+    clen = NULL;
+    if ( sno->rq )
+        clen = pblock_findval( "content-length", sno->rq->headers );
+
+    if ( ! clen )
+    {
+        sno->body_left = BODY_NOLENGTH;
+        return 1;
+    }
+
+    len = atoi( clen );
+    if ( len < 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "bad content-length" );
+        return 0;
+    }
+
+    if ( sno->max_body && len > sno->max_body )
+    {
+        sprintf( buff, "request body of %d bytes is over the limit of %d", len, sno->max_body );
+        PyErr_SetString( PyExc_ValueError, buff );
+        return 0;
+    }
+
+    sno->body_left = len;
+    return 1;
+}
+
+/*
+ * body_read
+ *
+   Read up to len bytes of the request body ( never past 
+   content-length ) into dst, letting go of the interpreter 
+   lock while we wait. Returns the number of bytes read, 0 at
+   the end of the body, -1 ( with a Python error set ) on error.
+*/
+
+static int body_read( sessionobject *sno, char *dst, int len )
+{
+    int n;
+
+    if ( ! body_start( sno ) )
+        return -1;
+
+    /* no content-length, no body */
+    if ( sno->body_left == BODY_NOLENGTH )
+        return 0;
+
+    if ( len > sno->body_left )
+        len = sno->body_left;
+    if ( len <= 0 )
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    n = netbuf_read( sno->sn->inbuf, dst, len );
+    Py_END_ALLOW_THREADS
+
+    if ( n < 0 )
+    {
+        PyErr_SetString( PyExc_IOError, "error reading request body" );
+        return -1;
+    }
+
+    /* a short read means the client went away, there won't be more */
+    sno->body_left = n < len ? 0 : sno->body_left - n;
+
+    return n;
+}
+
+
+/* 
+ * sn.form_data(int)
+ */
+
+static PyObject * Py_form_data(sessionobject *sno, PyObject *args )
+{
+    int clen;
+    PyObject *result;
+    char *qstr;              /* actual query string to work on */
+    int postlen;             /* number of chars read from net_buf */
+
+    result = NULL;
+    postlen = 0;
+
+    /* get length */
+    if (! PyArg_ParseTuple(args, "i", &clen) )
+        return NULL;
+
+    if ( clen <= 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, 
+            "sn.form_data must have positive integer parameter" );
+        return NULL;
+    }
+
+    /* never allocate more than max_body, nor read past content-length */
+    if ( ! body_start( sno ) )
+        return NULL;
+
+    if ( sno->max_body && clen > sno->max_body )
+    {
+        PyErr_SetString( PyExc_ValueError, "sn.form_data length is over the max body limit" );
+        return NULL;
+    }
+
+    if ( sno->body_left >= 0 && clen > sno->body_left )
+        clen = sno->body_left;
+
+    /* allocate space to put the query string after we read it in */
+
+    result = PyString_FromStringAndSize( (char *) NULL, clen );
+    if ( result == NULL )
+        return NULL;
+
+    qstr = PyString_AS_STRING( (PyStringObject *) result);
+
+    /* call the function above, the client may be slow to send */
+    Py_BEGIN_ALLOW_THREADS
+    postlen = post2qstr( sno->sn->inbuf, qstr, clen );
+    Py_END_ALLOW_THREADS
+
+    if ( postlen < 0 )
+    {
+        Py_DECREF( result );
+        PyErr_SetString( PyExc_IOError, "error reading request body" );
+        return NULL;
+    }
+
+    if ( sno->body_left >= 0 )
+        sno->body_left = postlen < clen ? 0 : sno->body_left - postlen;
+
+    if ( postlen != clen )
+        if ( _PyString_Resize( &result, postlen ) < 0 )
+            return NULL;
+
+    return result;
+}
+
+/*
+ * sn.read( [n] )
+ *
+   Read up to n bytes of the request body ( all of what's left if
+   n is not given ), returns "" at the end of the body.
+ */
+
+static PyObject * Py_sn_read( sessionobject *sno, PyObject *args )
+{
+    int len, n;
+    PyObject *result;
+
+    len = -1;
+    if (! PyArg_ParseTuple(args, "|i", &len) )
+        return NULL;
+
+    if ( ! body_start( sno ) )
+        return NULL;
+
+    if ( len < 0 || len > sno->body_left )
+        len = sno->body_left < 0 ? 0 : sno->body_left;
+
+    result = PyString_FromStringAndSize( ( char * ) NULL, len );
+    if ( ! result )
+        return NULL;
+
+    n = body_read( sno, PyString_AS_STRING( ( PyStringObject * ) result ), len );
+    if ( n < 0 )
+    {
+        Py_DECREF( result );
+        return NULL;
+    }
+
+    if ( n != len )
+        if ( _PyString_Resize( &result, n ) < 0 )
+            return NULL;
+
+    return result;
+}
+
+/*
+ * sn.readinto( buffer )
+ *
+   Read as much of the request body as fits into a writable buffer
+   ( e.g. an array ), returns the number of bytes read, 0 at the end.
+ */
+
+static PyObject * Py_sn_readinto( sessionobject *sno, PyObject *args )
+{
+    char *buf;
+    int len, n;
+
+    if (! PyArg_ParseTuple(args, "w#", &buf, &len) )
+        return NULL;
+
+    n = body_read( sno, buf, len );
+    if ( n < 0 )
+        return NULL;
+
+    return PyInt_FromLong( n );
+}
+
+/*
+ * sn.chunks( [size] )
+ *
+   Returns an object to loop over the request body size bytes at a
+   time ( 64K by default ), e.g.
+
+       for chunk in sn.chunks():
+           spool.write( chunk )
+ */
+
+static PyObject * Py_sn_chunks( sessionobject *sno, PyObject *args )
+{
+    chunksobject *result;
+    int size;
+
+    size = 65536;
+    if (! PyArg_ParseTuple(args, "|i", &size) )
+        return NULL;
+
+    if ( size <= 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "sn.chunks size must be positive" );
+        return NULL;
+    }
+
+    if ( ! body_start( sno ) )
+        return NULL;
+
+    result = PyMem_NEW( chunksobject, 1 );
+    if ( ! result )
+        return PyErr_NoMemory();
+
+    result->ob_type = &chunksobjecttype;
+    result->sno = sno;
+    Py_INCREF( sno );
+    result->size = size;
+
+    _Py_NewReference( result );
+    return ( PyObject * ) result;
+}
+
+static void chunks_dealloc( chunksobject *co )
+{
+    Py_DECREF( co->sno );
+    free( co );
+}
+
+/* the next chunk, the index is ignored, this only goes forward */
+
+static PyObject * chunks_item( chunksobject *co, Py_ssize_t i )
+{
+    PyObject *result;
+    int len, n;
+
+    len = co->sno->body_left < co->size ? co->sno->body_left : co->size;
+    if ( len <= 0 )
+    {
+        PyErr_SetString( PyExc_IndexError, "end of request body" );
+        return NULL;
+    }
+
+    result = PyString_FromStringAndSize( ( char * ) NULL, len );
+    if ( ! result )
+        return NULL;
+
+    n = body_read( co->sno, PyString_AS_STRING( ( PyStringObject * ) result ), len );
+    if ( n <= 0 )
+    {
+        Py_DECREF( result );
+        if ( n == 0 )
+            PyErr_SetString( PyExc_IndexError, "end of request body" );
+        return NULL;
+    }
+
+    if ( n != len )
+        if ( _PyString_Resize( &result, n ) < 0 )
+            return NULL;
+
+    return result;
+}
+
+static PySequenceMethods chunks_as_sequence = {
+    0,                               /*sq_length*/
+    0,                               /*sq_concat*/
+    0,                               /*sq_repeat*/
+    (ssizeargfunc)chunks_item,       /*sq_item*/
+    0,                               /*sq_slice*/
+    0,                               /*sq_ass_item*/
+    0,                               /*sq_ass_slice*/
+};
+
+/*
+ * sn.remaining()
+ *
+   How much of the request body is left to read, None if the
+   request didn't say ( no content-length ).
+ */
+
+static PyObject * Py_sn_remaining( sessionobject *sno, PyObject *args )
+{
+    if (! PyArg_ParseTuple(args, "") )
+        return NULL;
+
+    if ( ! body_start( sno ) )
+        return NULL;
+
+    if ( sno->body_left == BODY_NOLENGTH )
+    {
+        Py_INCREF( Py_None );
+        return Py_None;
+    }
+
+    return PyInt_FromLong( sno->body_left );
+}
+
+/*
+ * sn.set_max_body( n )
+ *
+   Change the largest request body this request will accept 
+   ( 0 means no limit ), the default comes from "maxbody" in
+   obj.conf. Has to be called before the body is first read.
+ */
+
+static PyObject * Py_sn_set_max_body( sessionobject *sno, PyObject *args )
+{
+    int n;
+
+    if (! PyArg_ParseTuple(args, "i", &n) )
+        return NULL;
+
+    if ( n < 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "max body can't be negative" );
+        return NULL;
+    }
+
+    sno->max_body = n;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/**
+ ** Forms
+ **
+ *  nsapi.parse_qs( string ) and sn.parse_form() turn
+ *  application/x-www-form-urlencoded data into a dictionary of
+ *  lists, the same one cgi.parse_qs makes: fields are separated by
+ *  "&" or ";", "+" is a space, %XX a byte, and fields with no value
+ *  are left out unless keep_blank is given.
+ *
+ *  sn.parse_form() parses the query string and then the request
+ *  body as it comes off the network, a block at a time, so the body
+ *  is never in memory as one string. Only a field that is split
+ *  between two blocks is put together in a buffer.
+ *
+ *  To keep a hostile request from using up memory or time there are
+ *  limits on the number of fields ( "maxfields", 1000 by default )
+ *  and the size of a name or value ( "maxfieldsize", 1M ); 0 is no
+ *  limit. Going over either is a ValueError.
+ */
+
+#define FORM_BLOCK  16384
+
+typedef struct form_parser {
+    PyObject *dict;                 /* the result */
+    int keep_blank;
+    int max_fields;
+    int max_size;
+    int fields;                     /* so far */
+    char *buf;                      /* a field split between blocks */
+    int len, size;
+} form_parser;
+
+/* what the decoder stops at, and the value of hex digits */
+static char formSpecial[256];
+static signed char formHex[256];
+
+static void form_tables( void )
+{
+    int i;
+
+    if ( formSpecial['%'] )
+        return;
+
+    for ( i = 0; i < 256; i++ )
+        formHex[i] = -1;
+    for ( i = 0; i < 10; i++ )
+        formHex[ '0' + i ] = i;
+    for ( i = 0; i < 6; i++ )
+        formHex[ 'a' + i ] = formHex[ 'A' + i ] = 10 + i;
+
+    formSpecial['+'] = 1;
+    formSpecial['%'] = 1;
+}
+
+/* len bytes of s, unquoted, as a new string */
+
+static PyObject * form_decode( char *s, int len )
+{
+    PyObject *result;
+    char *d, *start, *end, *p;
+
+    result = PyString_FromStringAndSize( ( char * ) NULL, len );
+    if ( ! result )
+        return NULL;
+    start = d = PyString_AS_STRING( ( PyStringObject * ) result );
+    end = s + len;
+
+    while ( s < end )
+    {
+        /* plain characters are copied a run at a time */
+        for ( p = s; p < end && ! formSpecial[ ( unsigned char ) *p ]; p++ )
+            ;
+        memcpy( d, s, p - s );
+        d += p - s;
+        s = p;
+        if ( s == end )
+            break;
+
+        if ( *s == '+' )
+        {
+            *d++ = ' ';
+            s++;
+        }
+        else if ( end - s >= 3 && formHex[ ( unsigned char ) s[1] ] >= 0 && 
+                                  formHex[ ( unsigned char ) s[2] ] >= 0 )
+        {
+            *d++ = ( formHex[ ( unsigned char ) s[1] ] << 4 ) | formHex[ ( unsigned char ) s[2] ];
+            s += 3;
+        }
+        else
+            *d++ = *s++;            /* a % that isn't an escape stays */
+    }
+
+    if ( d - start != len )
+        if ( _PyString_Resize( &result, d - start ) < 0 )
+            return NULL;
+
+    return result;
+}
+
+/* one raw "name=value", add it to the dictionary */
+
+static int form_field( form_parser *fp, char *s, int len )
+{
+    PyObject *name, *value, *list;
+    char *eq;
+    int nlen, vlen, rv;
+
+    if ( len == 0 )
+        return 1;
+
+    eq = memchr( s, '=', len );
+    nlen = eq ? eq - s : len;
+    vlen = eq ? len - nlen - 1 : 0;
+    if ( vlen == 0 && ! fp->keep_blank )
+        return 1;
+
+    if ( fp->max_fields && ++fp->fields > fp->max_fields )
+    {
+        PyErr_SetString( PyExc_ValueError, "too many form fields" );
+        return 0;
+    }
+    if ( fp->max_size && ( nlen > fp->max_size || vlen > fp->max_size ) )
+    {
+        PyErr_SetString( PyExc_ValueError, "form field is over the size limit" );
+        return 0;
+    }
+
+    name = form_decode( s, nlen );
+    if ( ! name )
+        return 0;
+    PyString_InternInPlace( &name );
+    value = form_decode( s + nlen + 1, vlen );
+    if ( ! value )
+    {
+        Py_DECREF( name );
+        return 0;
+    }
+
+    list = PyDict_GetItem( fp->dict, name );
+    if ( list )
+        rv = PyList_Append( list, value );
+    else
+    {
+        list = PyList_New( 1 );
+        rv = -1;
+        if ( list )
+        {
+            Py_INCREF( value );
+            PyList_SET_ITEM( list, 0, value );
+            rv = PyDict_SetItem( fp->dict, name, list );
+            Py_DECREF( list );
+        }
+    }
+
+    Py_DECREF( name );
+    Py_DECREF( value );
+    return rv == 0;
+}
+
+/* keep the start of a field until the rest of it comes */
+
+static int form_save( form_parser *fp, char *s, int len )
+{
+    char *buf;
+
+    if ( fp->max_size && fp->len + len > 2 * fp->max_size + 1 )
+    {
+        PyErr_SetString( PyExc_ValueError, "form field is over the size limit" );
+        return 0;
+    }
+
+    if ( fp->len + len > fp->size )
+    {
+        buf = ( char * ) realloc( fp->buf, ( fp->len + len ) * 2 );
+        if ( ! buf )
+        {
+            PyErr_NoMemory();
+            return 0;
+        }
+        fp->buf = buf;
+        fp->size = ( fp->len + len ) * 2;
+    }
+
+    memcpy( fp->buf + fp->len, s, len );
+    fp->len += len;
+    return 1;
+}
+
+/* the next "&" or ";" */
+
+static char * form_separator( char *s, int len )
+{
+    char *amp, *semi;
+
+    amp = memchr( s, '&', len );
+    semi = memchr( s, ';', amp ? amp - s : len );
+
+    return semi ? semi : amp;
+}
+
+/* parse len more bytes of form data */
+
+static int form_feed( form_parser *fp, char *data, int len )
+{
+    char *end, *sep;
+    int ok;
+
+    end = data + len;
+    while ( data < end )
+    {
+        sep = form_separator( data, end - data );
+        if ( ! sep )
+            return form_save( fp, data, end - data );
+
+        if ( fp->len )
+        {
+            ok = form_save( fp, data, sep - data ) && form_field( fp, fp->buf, fp->len );
+            fp->len = 0;
+        }
+        else
+            ok = form_field( fp, data, sep - data );
+        if ( ! ok )
+            return 0;
+
+        data = sep + 1;
+    }
+
+    return 1;
+}
+
+/* the data is over, the last field has no separator after it */
+
+static int form_end( form_parser *fp )
+{
+    int ok;
+
+    ok = form_field( fp, fp->buf, fp->len );
+    fp->len = 0;
+
+    return ok;
+}
+
+static int form_init( form_parser *fp )
+{
+    form_tables();
+
+    memset( fp, 0, sizeof( form_parser ) );
+    fp->max_fields = formMaxFields;
+    fp->max_size = formMaxFieldSize;
+
+    fp->dict = PyDict_New();
+    return fp->dict != NULL;
+}
+
+/* the dictionary, or NULL if ok is 0 */
+
+static PyObject * form_done( form_parser *fp, int ok )
+{
+    free( fp->buf );
+    if ( ! ok )
+    {
+        Py_XDECREF( fp->dict );
+        return NULL;
+    }
+
+    return fp->dict;
+}
+
+/*
+ * nsapi.parse_qs( string [, keep_blank [, maxfields [, maxfieldsize ]]] )
+ */
+
+static PyObject * Py_parse_qs( PyObject *self, PyObject *args )
+{
+    form_parser fp;
+    char *qs;
+    int len;
+
+    if ( ! form_init( &fp ) )
+        return NULL;
+    if ( ! PyArg_ParseTuple( args, "s#|iii", &qs, &len, 
+                             &fp.keep_blank, &fp.max_fields, &fp.max_size ) )
+        return form_done( &fp, 0 );
+
+    return form_done( &fp, form_feed( &fp, qs, len ) && form_end( &fp ) );
+}
+
+/* is the request body urlencoded form data? */
+
+static int form_body( sessionobject *sno )
+{
+    static char urlencoded[] = "application/x-www-form-urlencoded";
+    char *type;
+    int i;
+
+    type = sno->rq ? pblock_findval( "content-type", sno->rq->headers ) : NULL;
+    if ( ! type )
+        return 1;
+
+    for ( i = 0; urlencoded[i]; i++ )
+        if ( tolower( ( unsigned char ) type[i] ) != urlencoded[i] )
+            return 0;
+
+    return type[i] == '\0' || type[i] == ';' || type[i] == ' ';
+}
+
+/*
+ * sn.parse_form( [ keep_blank [, maxfields [, maxfieldsize ]]] )
+ *
+   The query string and the ( rest of the ) body, if it is urlencoded,
+   as a dictionary of lists. A body of some other type ( e.g. a file
+   upload ) is left for the handler to read.
+ */
+
+static PyObject * Py_sn_parse_form( sessionobject *sno, PyObject *args )
+{
+    form_parser fp;
+    char *query, *block;
+    int ok, n;
+
+    if ( ! form_init( &fp ) )
+        return NULL;
+    if ( ! PyArg_ParseTuple( args, "|iii", &fp.keep_blank, &fp.max_fields, &fp.max_size ) )
+        return form_done( &fp, 0 );
+
+    query = sno->rq ? pblock_findval( "query", sno->rq->reqpb ) : NULL;
+    ok = 1;
+    if ( query )
+        ok = form_feed( &fp, query, strlen( query ) ) && form_end( &fp );
+
+    if ( ok && form_body( sno ) )
+    {
+        block = ( char * ) malloc( FORM_BLOCK );
+        if ( ! block )
+        {
+            PyErr_NoMemory();
+            return form_done( &fp, 0 );
+        }
+
+        while ( ok && ( n = body_read( sno, block, FORM_BLOCK ) ) > 0 )
+            ok = form_feed( &fp, block, n );
+        ok = ok && n == 0 && form_end( &fp );
+
+        free( block );
+    }
+
+    return form_done( &fp, ok );
+}
+
+/**
+ ** Multipart forms
+ **
+ *  sn.parse_multipart() reads a multipart/form-data body ( a form with
+ *  a file upload in it ) the same way sn.parse_form() reads a urlencoded
+ *  one: off the network a block at a time, never as a whole. The
+ *  boundary is looked for with Horspool's algorithm, which mostly looks
+ *  at one byte in every boundary-length, so the content of a part is
+ *  hardly touched on its way through.
+ *
+ *  Each part becomes a file-like nsapi_part object. Parts up to "spool"
+ *  bytes ( 64K by default ) are kept in memory, the rest is written to
+ *  a temporary file ( tmpfile(), so it's gone when the part is ) as it
+ *  comes, so however big an upload is, it never takes more memory than
+ *  that. The maxfields limit counts parts, and a part that isn't a file
+ *  can't be longer than maxfieldsize.
+ */
+
+#define MP_BOUNDARY  70             /* longest boundary RFC 2046 allows */
+#define MP_HEADERS   8192           /* longest header block of a part */
+
+#define MP_PREAMBLE  0              /* before the first boundary */
+#define MP_DELIM     1              /* right after a boundary */
+#define MP_HEADERS_  2              /* in the headers of a part */
+#define MP_BODY      3              /* in the content of a part */
+#define MP_DONE      4              /* after the last boundary */
+
+typedef struct mp_parser {
+    char delim[ MP_BOUNDARY + 4 ];  /* CRLF "--" boundary */
+    int dlen;
+    int skip[256];                  /* how far to move on for each byte */
+    int state;
+    char *buf;                      /* what hasn't been parsed yet */
+    int start, end, size;
+    PyObject *dict;                 /* the result */
+    partobject *part;               /* the one being read, borrowed */
+    int spool;
+    int max_fields;
+    int max_size;
+    int fields;                     /* so far */
+} mp_parser;
+
+static PyObject * Py_part_read( partobject *po, PyObject *args );
+static PyObject * Py_part_readline( partobject *po, PyObject *args );
+static PyObject * Py_part_seek( partobject *po, PyObject *args );
+static PyObject * Py_part_tell( partobject *po, PyObject *args );
+static PyObject * Py_part_save( partobject *po, PyObject *args );
+static PyObject * Py_part_close( partobject *po, PyObject *args );
+
+static PyMethodDef Pypartmethods[] = {
+	{ "read",           (PyCFunction) Py_part_read,     1},
+	{ "readline",       (PyCFunction) Py_part_readline, 1},
+	{ "seek",           (PyCFunction) Py_part_seek,     1},
+	{ "tell",           (PyCFunction) Py_part_tell,     1},
+	{ "save",           (PyCFunction) Py_part_save,     1},
+	{ "close",          (PyCFunction) Py_part_close,    1},
+	{ NULL, NULL } /* sentinel */
+};
+
+static partobject * make_partobject( void )
+{
+    partobject *result;
+
+    result = PyMem_NEW( partobject, 1 );
+    if (! result )
+        return ( partobject * ) PyErr_NoMemory();
+
+    memset( result, 0, sizeof( partobject ) );
+    result->ob_type = &partobjecttype;
+    _Py_NewReference( result );
+
+    return result;
+}
+
+/* let go of the content */
+
+static void part_release( partobject *po )
+{
+    free( po->data );
+    po->data = NULL;
+    po->len = po->size = 0;
+
+    if ( po->file )
+        fclose( po->file );
+    po->file = NULL;
+}
+
+static void part_dealloc( partobject *po )
+{
+    Py_XDECREF( po->name );
+    Py_XDECREF( po->filename );
+    Py_XDECREF( po->type );
+    Py_XDECREF( po->headers );
+    part_release( po );
+
+    free( po );
+}
+
+/* add len bytes to the content, moving it to a file once it's too big */
+
+static int part_write( partobject *po, char *s, int len, int spool )
+{
+    FILE *file;
+    char *data;
+    int n;
+
+    if ( ! po->file && po->len + len > spool )
+    {
+        Py_BEGIN_ALLOW_THREADS
+        file = tmpfile();
+        if ( file && po->len && fwrite( po->data, 1, po->len, file ) != ( size_t ) po->len )
+        {
+            fclose( file );
+            file = NULL;
+        }
+        Py_END_ALLOW_THREADS
+
+        if ( ! file )
+        {
+            PyErr_SetString( PyExc_IOError, "can't spool a form part to a temporary file" );
+            return 0;
+        }
+
+        free( po->data );
+        po->data = NULL;
+        po->len = po->size = 0;
+        po->file = file;
+    }
+
+    if ( po->file )
+    {
+        Py_BEGIN_ALLOW_THREADS
+        n = fwrite( s, 1, len, po->file );
+        Py_END_ALLOW_THREADS
+
+        if ( n != len )
+        {
+            PyErr_SetString( PyExc_IOError, "can't spool a form part to a temporary file" );
+            return 0;
+        }
+    }
+    else
+    {
+        if ( po->len + len > po->size )
+        {
+            data = ( char * ) realloc( po->data, ( po->len + len ) * 2 );
+            if ( ! data )
+            {
+                PyErr_NoMemory();
+                return 0;
+            }
+            po->data = data;
+            po->size = ( po->len + len ) * 2;
+        }
+        memcpy( po->data + po->len, s, len );
+        po->len += len;
+    }
+
+    po->total += len;
+    return 1;
+}
+
+/* n bytes from pos on into dst */
+
+static int part_copy( partobject *po, char *dst, long n )
+{
+    int ok;
+
+    if ( ! po->file )
+        memcpy( dst, po->data + po->pos, n );
+    else
+    {
+        Py_BEGIN_ALLOW_THREADS
+        ok = fseek( po->file, po->pos, SEEK_SET ) == 0 &&
+             fread( dst, 1, n, po->file ) == ( size_t ) n;
+        Py_END_ALLOW_THREADS
+
+        if ( ! ok )
+        {
+            PyErr_SetString( PyExc_IOError, "can't read a spooled form part" );
+            return 0;
+        }
+    }
+
+    po->pos += n;
+    return 1;
+}
+
+static int part_open( partobject *po )
+{
+    if ( po->closed )
+    {
+        PyErr_SetString( PyExc_ValueError, "I/O operation on a closed form part" );
+        return 0;
+    }
+    return 1;
+}
+
+/* n bytes from pos on as a new string */
+
+static PyObject * part_read( partobject *po, long n )
+{
+    PyObject *result;
+
+    result = PyString_FromStringAndSize( ( char * ) NULL, n );
+    if ( ! result )
+        return NULL;
+    if ( ! part_copy( po, PyString_AS_STRING( ( PyStringObject * ) result ), n ) )
+    {
+        Py_DECREF( result );
+        return NULL;
+    }
+
+    return result;
+}
+
+/*
+ * part.read( [ size ] )
+ */
+
+static PyObject * Py_part_read( partobject *po, PyObject *args )
+{
+    long n = -1;
+
+    if ( ! PyArg_ParseTuple( args, "|l", &n ) || ! part_open( po ) )
+        return NULL;
+
+    if ( n < 0 || n > po->total - po->pos )
+        n = po->total - po->pos;
+
+    return part_read( po, n );
+}
+
+/*
+ * part.readline( [ size ] )
+ */
+
+static PyObject * Py_part_readline( partobject *po, PyObject *args )
+{
+    char block[256], *nl;
+    long n = -1, start, i, len;
+
+    if ( ! PyArg_ParseTuple( args, "|l", &n ) || ! part_open( po ) )
+        return NULL;
+
+    if ( n < 0 || n > po->total - po->pos )
+        n = po->total - po->pos;
+
+    if ( ! po->file )
+    {
+        nl = memchr( po->data + po->pos, '\n', n );
+        if ( nl )
+            n = nl - ( po->data + po->pos ) + 1;
+    }
+    else
+    {
+        /* look for the newline a block at a time, then read up to it */
+        start = po->pos;
+        for ( i = 0; i < n; i += len )
+        {
+            len = n - i < ( long ) sizeof( block ) ? n - i : ( long ) sizeof( block );
+            if ( ! part_copy( po, block, len ) )
+            {
+                po->pos = start;
+                return NULL;
+            }
+            nl = memchr( block, '\n', len );
+            if ( nl )
+            {
+                n = i + ( nl - block ) + 1;
+                break;
+            }
+        }
+        po->pos = start;
+    }
+
+    return part_read( po, n );
+}
+
+/*
+ * part.seek( offset [, whence ] )
+ */
+
+static PyObject * Py_part_seek( partobject *po, PyObject *args )
+{
+    long offset;
+    int whence = 0;
+
+    if ( ! PyArg_ParseTuple( args, "l|i", &offset, &whence ) || ! part_open( po ) )
+        return NULL;
+
+    if ( whence == 1 )
+        offset += po->pos;
+    else if ( whence == 2 )
+        offset += po->total;
+    else if ( whence != 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "whence must be 0, 1 or 2" );
+        return NULL;
+    }
+
+    if ( offset < 0 )
+    {
+        PyErr_SetString( PyExc_IOError, "can't seek to before the start of a form part" );
+        return NULL;
+    }
+
+    po->pos = offset < po->total ? offset : po->total;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * part.tell()
+ */
+
+static PyObject * Py_part_tell( partobject *po, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) || ! part_open( po ) )
+        return NULL;
+
+    return PyInt_FromLong( po->pos );
+}
+
+/*
+ * part.save( path )
+ *
+   Copy the whole content to a file, without it ever being a Python
+   string. read() carries on from where it was.
+ */
+
+#define PART_BLOCK  65536
+
+static PyObject * Py_part_save( partobject *po, PyObject *args )
+{
+    char *path, *block, buff[ 1100 ];
+    FILE *out;
+    long pos, n;
+    int ok;
+
+    if ( ! PyArg_ParseTuple( args, "s", &path ) || ! part_open( po ) )
+        return NULL;
+
+    block = NULL;
+    if ( po->file && po->total )
+    {
+        block = ( char * ) malloc( PART_BLOCK );
+        if ( ! block )
+            return PyErr_NoMemory();
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    out = fopen( path, "wb" );
+    ok = out != NULL;
+    if ( ok && ! po->file )
+        ok = fwrite( po->data, 1, po->len, out ) == ( size_t ) po->len;
+    else if ( ok && po->total )
+    {
+        ok = fseek( po->file, 0, SEEK_SET ) == 0;
+        for ( pos = 0; ok && pos < po->total; pos += n )
+        {
+            n = po->total - pos < PART_BLOCK ? po->total - pos : PART_BLOCK;
+            ok = fread( block, 1, n, po->file ) == ( size_t ) n &&
+                 fwrite( block, 1, n, out ) == ( size_t ) n;
+        }
+    }
+    if ( out && fclose( out ) != 0 )
+        ok = 0;
+    Py_END_ALLOW_THREADS
+
+    free( block );
+
+    if ( ! ok )
+    {
+        sprintf( buff, "can't save a form part to %.1000s", path );
+        PyErr_SetString( PyExc_IOError, buff );
+        return NULL;
+    }
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * part.close()
+ */
+
+static PyObject * Py_part_close( partobject *po, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+    part_release( po );
+    po->closed = 1;
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+static PyObject * part_getattr( partobject *po, char *name )
+{
+    PyObject *result;
+    long pos;
+
+    if ( strcmp( name, "name" ) == 0 )
+        result = po->name;
+    else if ( strcmp( name, "filename" ) == 0 )
+        result = po->filename;
+    else if ( strcmp( name, "type" ) == 0 )
+        result = po->type;
+    else if ( strcmp( name, "headers" ) == 0 )
+        result = po->headers;
+    else if ( strcmp( name, "size" ) == 0 )
+        return PyInt_FromLong( po->total );
+    else if ( strcmp( name, "spooled" ) == 0 )
+        return PyInt_FromLong( po->file != NULL );
+    else if ( strcmp( name, "closed" ) == 0 )
+        return PyInt_FromLong( po->closed );
+    else if ( strcmp( name, "value" ) == 0 )
+    {
+        /* the whole content, whatever read() has had */
+        if ( ! part_open( po ) )
+            return NULL;
+        pos = po->pos;
+        po->pos = 0;
+        result = part_read( po, po->total );
+        po->pos = pos;
+        return result;
+    }
+    else
+        return Py_FindMethod( Pypartmethods, ( PyObject * ) po, name );
+
+    Py_INCREF( result );
+    return result;
+}
+
+/*
+ * The value of parameter key in a header value like
+ * form-data; name="a"; filename="b.txt" as a new string,
+ * or None if it isn't there.
+ */
+
+static PyObject * mp_param( char *s, int len, char *key )
+{
+    PyObject *result;
+    char *end, *k, *d;
+    int klen, i;
+
+    end = s + len;
+    klen = strlen( key );
+
+    s = memchr( s, ';', len );
+    while ( s && s < end )
+    {
+        /* the name */
+        while ( s < end && ( *s == ';' || *s == ' ' || *s == '\t' ) )
+            s++;
+        for ( k = s; s < end && *s != '=' && *s != ';'; s++ )
+            ;
+        for ( i = s - k; i > 0 && ( k[ i - 1 ] == ' ' || k[ i - 1 ] == '\t' ); i-- )
+            ;
+        if ( i == klen )
+            for ( i = 0; i < klen && tolower( ( unsigned char ) k[i] ) == key[i]; i++ )
+                ;
+        if ( s == end || *s == ';' )
+            continue;
+
+        /* the value */
+        for ( s++; s < end && ( *s == ' ' || *s == '\t' ); s++ )
+            ;
+        if ( i != klen )
+        {
+            /* not the one, skip it */
+            if ( s < end && *s == '"' )
+                for ( s++; s < end && *s != '"'; s++ )
+                    if ( *s == '\\' && s + 1 < end )
+                        s++;
+            s = memchr( s, ';', end - s );
+            continue;
+        }
+
+        result = PyString_FromStringAndSize( ( char * ) NULL, end - s );
+        if ( ! result )
+            return NULL;
+        d = PyString_AS_STRING( ( PyStringObject * ) result );
+
+        if ( s < end && *s == '"' )
+        {
+            /* quoted, \" and \\ are the only escapes */
+            for ( s++; s < end && *s != '"'; s++ )
+            {
+                if ( *s == '\\' && s + 1 < end && ( s[1] == '"' || s[1] == '\\' ) )
+                    s++;
+                *d++ = *s;
+            }
+        }
+        else
+        {
+            for ( ; s < end && *s != ';'; s++ )
+                *d++ = *s;
+            while ( d > PyString_AS_STRING( ( PyStringObject * ) result ) &&
+                    ( d[-1] == ' ' || d[-1] == '\t' ) )
+                d--;
+        }
+
+        if ( _PyString_Resize( &result, d - PyString_AS_STRING( ( PyStringObject * ) result ) ) < 0 )
+            return NULL;
+        return result;
+    }
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+static int mp_init( mp_parser *mp, char *boundary, int blen )
+{
+    int i;
+
+    memset( mp, 0, sizeof( mp_parser ) );
+
+    memcpy( mp->delim, "\r\n--", 4 );
+    memcpy( mp->delim + 4, boundary, blen );
+    mp->dlen = blen + 4;
+
+    /* Horspool: how far the last byte of where we looked lets us move */
+    for ( i = 0; i < 256; i++ )
+        mp->skip[i] = mp->dlen;
+    for ( i = 0; i < mp->dlen - 1; i++ )
+        mp->skip[ ( unsigned char ) mp->delim[i] ] = mp->dlen - 1 - i;
+
+    /* the first boundary has no CRLF in front, pretend it has */
+    mp->size = FORM_BLOCK + MP_HEADERS;
+    mp->buf = ( char * ) malloc( mp->size );
+    if ( ! mp->buf )
+    {
+        PyErr_NoMemory();
+        return 0;
+    }
+    memcpy( mp->buf, "\r\n", 2 );
+    mp->end = 2;
+
+    mp->dict = PyDict_New();
+    return mp->dict != NULL;
+}
+
+/* the next boundary in s, NULL if there isn't a whole one */
+
+static char * mp_search( mp_parser *mp, char *s, int len )
+{
+    char *end, *delim;
+    int last;
+
+    delim = mp->delim;
+    last = mp->dlen - 1;
+    end = s + len - last;
+
+    while ( s < end )
+    {
+        if ( s[ last ] == delim[ last ] && memcmp( s, delim, last ) == 0 )
+            return s;
+        s += mp->skip[ ( unsigned char ) s[ last ] ];
+    }
+
+    return NULL;
+}
+
+/* how long the headers at s are, blank line and all, 0 if they aren't all here yet */
+
+static int mp_header_length( char *s, int len )
+{
+    char *p, *end;
+
+    if ( len >= 2 && s[0] == '\r' && s[1] == '\n' )
+        return 2;
+
+    end = s + len;
+    for ( p = s; ( p = memchr( p, '\r', end - p ) ) != NULL && end - p >= 4; p++ )
+        if ( p[1] == '\n' && p[2] == '\r' && p[3] == '\n' )
+            return p + 4 - s;
+
+    return 0;
+}
+
+/* a new part, from its headers */
+
+static int mp_part( mp_parser *mp, char *s, int len )
+{
+    PyObject *name, *value, *list;
+    partobject *po;
+    char *end, *eol, *colon, *v;
+    int rv;
+
+    if ( mp->max_fields && ++mp->fields > mp->max_fields )
+    {
+        PyErr_SetString( PyExc_ValueError, "too many form fields" );
+        return 0;
+    }
+
+    po = make_partobject();
+    if ( ! po )
+        return 0;
+    po->headers = PyDict_New();
+    if ( ! po->headers )
+    {
+        Py_DECREF( po );
+        return 0;
+    }
+
+    end = s + len - 2;
+    for ( ; s < end; s = eol + 2 )
+    {
+        eol = memchr( s, '\r', end - s );
+        while ( eol && eol[1] != '\n' )
+            eol = memchr( eol + 1, '\r', end - eol - 1 );
+        if ( ! eol )
+            eol = end;
+
+        colon = memchr( s, ':', eol - s );
+        if ( ! colon )
+            continue;
+        for ( v = colon + 1; v < eol && ( *v == ' ' || *v == '\t' ); v++ )
+            ;
+
+        name = headers_name( s, colon - s );
+        value = name ? PyString_FromStringAndSize( v, eol - v ) : NULL;
+        rv = value ? PyDict_SetItem( po->headers, name, value ) : -1;
+        Py_XDECREF( name );
+        Py_XDECREF( value );
+        if ( rv < 0 )
+        {
+            Py_DECREF( po );
+            return 0;
+        }
+    }
+
+    /* name and filename from content-disposition */
+    value = PyDict_GetItemString( po->headers, "content-disposition" );
+    if ( value )
+    {
+        po->name = mp_param( PyString_AS_STRING( ( PyStringObject * ) value ),
+                             PyString_GET_SIZE( value ), "name" );
+        po->filename = mp_param( PyString_AS_STRING( ( PyStringObject * ) value ),
+                                 PyString_GET_SIZE( value ), "filename" );
+    }
+    else
+    {
+        po->name = Py_None;
+        Py_INCREF( Py_None );
+        po->filename = Py_None;
+        Py_INCREF( Py_None );
+    }
+
+    po->type = PyDict_GetItemString( po->headers, "content-type" );
+    if ( po->type )
+        Py_INCREF( po->type );
+    else
+        po->type = PyString_FromString( "text/plain" );
+
+    if ( ! po->name || ! po->filename || ! po->type )
+    {
+        Py_DECREF( po );
+        return 0;
+    }
+
+    /* a part with no name goes under "" */
+    if ( po->name == Py_None )
+    {
+        Py_DECREF( po->name );
+        po->name = PyString_FromString( "" );
+        if ( ! po->name )
+        {
+            Py_DECREF( po );
+            return 0;
+        }
+    }
+    PyString_InternInPlace( &po->name );
+
+    list = PyDict_GetItem( mp->dict, po->name );
+    if ( list )
+        rv = PyList_Append( list, ( PyObject * ) po );
+    else
+    {
+        list = PyList_New( 1 );
+        rv = -1;
+        if ( list )
+        {
+            Py_INCREF( po );
+            PyList_SET_ITEM( list, 0, ( PyObject * ) po );
+            rv = PyDict_SetItem( mp->dict, po->name, list );
+            Py_DECREF( list );
+        }
+    }
+
+    /* the dictionary has it now */
+    Py_DECREF( po );
+    mp->part = po;
+
+    return rv == 0;
+}
+
+/* content for the part being read */
+
+static int mp_content( mp_parser *mp, char *s, int len )
+{
+    partobject *po = mp->part;
+
+    if ( mp->max_size && po->filename == Py_None && po->total + len > mp->max_size )
+    {
+        PyErr_SetString( PyExc_ValueError, "form field is over the size limit" );
+        return 0;
+    }
+
+    return part_write( po, s, len, mp->spool );
+}
+
+/* parse what there is in the buffer */
+
+static int mp_feed( mp_parser *mp )
+{
+    char *s, *hit;
+    int avail, n;
+
+    for ( ;; )
+    {
+        s = mp->buf + mp->start;
+        avail = mp->end - mp->start;
+
+        switch ( mp->state )
+        {
+            case MP_PREAMBLE:
+            case MP_BODY:
+                hit = mp_search( mp, s, avail );
+
+                /* keep back what might be the start of a boundary */
+                n = hit ? hit - s : avail - ( mp->dlen - 1 );
+                if ( n > 0 )
+                {
+                    if ( mp->state == MP_BODY && ! mp_content( mp, s, n ) )
+                        return 0;
+                    mp->start += n;
+                }
+                if ( ! hit )
+                    return 1;
+
+                mp->part = NULL;
+                mp->start += mp->dlen;
+                mp->state = MP_DELIM;
+                break;
+
+            case MP_DELIM:
+                /* "--" after the last one, otherwise ( white space and ) CRLF */
+                if ( avail < 2 )
+                    return 1;
+                if ( s[0] == '-' && s[1] == '-' )
+                    mp->state = MP_DONE;
+                else if ( s[0] == '\r' && s[1] == '\n' )
+                {
+                    mp->start += 2;
+                    mp->state = MP_HEADERS_;
+                }
+                else if ( s[0] == ' ' || s[0] == '\t' )
+                    mp->start++;
+                else
+                {
+                    PyErr_SetString( PyExc_ValueError, "malformed multipart body" );
+                    return 0;
+                }
+                break;
+
+            case MP_HEADERS_:
+                n = mp_header_length( s, avail );
+                if ( ! n && avail < MP_HEADERS )
+                    return 1;
+                if ( ! n || n > MP_HEADERS )
+                {
+                    PyErr_SetString( PyExc_ValueError, "form part headers are too long" );
+                    return 0;
+                }
+                if ( ! mp_part( mp, s, n ) )
+                    return 0;
+                mp->start += n;
+                mp->state = MP_BODY;
+                break;
+
+            default:
+                /* the epilogue, ignored */
+                mp->start = mp->end;
+                return 1;
+        }
+    }
+}
+
+/* the dictionary, or NULL if ok is 0 */
+
+static PyObject * mp_done( mp_parser *mp, int ok )
+{
+    free( mp->buf );
+    if ( ! ok )
+    {
+        Py_XDECREF( mp->dict );
+        return NULL;
+    }
+
+    return mp->dict;
+}
+
+/*
+ * sn.parse_multipart( [ spool [, maxfields [, maxfieldsize ]]] )
+ *
+   The ( rest of the ) multipart/form-data body as a dictionary of
+   lists of parts, by field name.
+ */
+
+static PyObject * Py_sn_parse_multipart( sessionobject *sno, PyObject *args )
+{
+    static char multipart[] = "multipart/";
+    mp_parser mp;
+    PyObject *boundary;
+    char *type;
+    int spool, max_fields, max_size, n, ok, seen;
+
+    spool = multipartSpool;
+    max_fields = formMaxFields;
+    max_size = formMaxFieldSize;
+    if ( ! PyArg_ParseTuple( args, "|iii", &spool, &max_fields, &max_size ) )
+        return NULL;
+
+    type = sno->rq ? pblock_findval( "content-type", sno->rq->headers ) : NULL;
+    for ( n = 0; type && multipart[n]; n++ )
+        if ( tolower( ( unsigned char ) type[n] ) != multipart[n] )
+            break;
+    if ( ! type || multipart[n] )
+    {
+        PyErr_SetString( PyExc_ValueError, "the request body isn't multipart" );
+        return NULL;
+    }
+
+    boundary = mp_param( type, strlen( type ), "boundary" );
+    if ( ! boundary )
+        return NULL;
+    if ( boundary == Py_None || PyString_GET_SIZE( boundary ) == 0 ||
+         PyString_GET_SIZE( boundary ) > MP_BOUNDARY )
+    {
+        Py_DECREF( boundary );
+        PyErr_SetString( PyExc_ValueError, "multipart body without a good boundary" );
+        return NULL;
+    }
+
+    ok = mp_init( &mp, PyString_AS_STRING( ( PyStringObject * ) boundary ),
+                  PyString_GET_SIZE( boundary ) );
+    Py_DECREF( boundary );
+    if ( ! ok )
+        return mp_done( &mp, 0 );
+    mp.spool = spool;
+    mp.max_fields = max_fields;
+    mp.max_size = max_size;
+
+    seen = 0;
+    for ( ;; )
+    {
+        /* what wasn't parsed goes to the front, and more after it */
+        if ( mp.start )
+        {
+            memmove( mp.buf, mp.buf + mp.start, mp.end - mp.start );
+            mp.end -= mp.start;
+            mp.start = 0;
+        }
+
+        n = body_read( sno, mp.buf + mp.end, mp.size - mp.end );
+        if ( n <= 0 )
+            break;
+        mp.end += n;
+        seen = 1;
+
+        if ( ! mp_feed( &mp ) )
+            return mp_done( &mp, 0 );
+    }
+
+    if ( n < 0 )
+        return mp_done( &mp, 0 );
+    if ( seen && mp.state != MP_DONE )
+    {
+        PyErr_SetString( PyExc_ValueError, "multipart body ends before its last boundary" );
+        return mp_done( &mp, 0 );
+    }
+
+    return mp_done( &mp, 1 );
+}
+
+/* 
+ * sn.net_read(int)
+ */
+/*
+   This function is commented and omitted, because The Netscape
+   documentation didn't make it clear how to read additional information
+   from the session without incurring the possibility of blocking
+   and without violating the Server assumptions about the behavior
+   of the connection (whatever they may be).  If you want to be trusting
+   you can modify the function given below to use netbuf_getc(...) to
+   get one character at a time, but if you geuss the number of characters
+   in the buffer incorrectly the function may block, so we omit it.
+
+static PyObject *
+Py_net_read( sno, args )
+     sessionobject *sno;
+     PyObject *args;
+{
+  int test, len, realsize;
+  PyObject *result;
+  char *charbuffer;
+  result = NULL;
+  realsize = 0;
+  if (!Log("sn.net_read(...)\n")) {
+    return NULL;
+  }
+  test = PyArg_ParseTuple(args, "i", &len);
+  if (!test) {
+    return NULL;
+  }
+  if (len<=0) {
+    PyErr_SetString(PyExc_ValueError, 
+            "sn.net_read must have positive integer parameter");
+    return NULL;
+  }
+//  printf("s.nr: getting string\n");
+  result = PyString_FromStringAndSize((char *)NULL, len);
+  if (result == NULL) {
+    return NULL;
+  }
+//  printf("s.nr: getting internal string %d\n", len);
+  charbuffer = PyString_AS_STRING( (PyStringObject *) result);
+//  printf("s.nr: reading\n");
+//  *** this doesn't work on our system (bombs) ***
+  realsize = net_read(sno->sn->csd, charbuffer, len, 1);
+//  printf("s.nr: done reading %d\n", realsize);
+  if (realsize != len) {
+//    printf("s.nr: resizing string\n");
+    test = _PyString_Resize(&result, realsize);
+    if (test<0) {
+      return NULL;
+    }
+  }
+//  printf("s.nr: exiting normally\n");
+  return result;
+}
+*/
+
+/* 
+ *  sn.client()
+ */
+
+static PyObject * Py_sn_client( sessionobject *sno, PyObject *args )
+{
+
+    if (! PyArg_ParseTuple(args, "") )
+        return NULL; /* error */
+
+    return member_pblock( &sno->client, sno->sn->client );
+}
+
+/* 
+ *standard getattr for sessions 
+ */
+
+static PyObject * session_getattr( PyObject *pbo, char *name )
+{
+    sessionobject *sno;
+
+    if ( strcmp( name, "out" ) == 0 )
+    {
+        sno = ( sessionobject * ) pbo;
+        if ( ! sno->out )
+        {
+            sno->out = make_outobject( sno->sn );
+            if ( ! sno->out )
+                return NULL;
+        }
+        Py_INCREF( sno->out );
+        return ( PyObject * ) sno->out;
+    }
+
+    return Py_FindMethod( Pysessionmethods, pbo, name );
+}
+
+
+/**
+ ** make_requestobject
+ **
+ *  Given a Request, make a Python requestobject
+ */
+
+static requestobject * make_requestobject( Request *from_rq )
+{
+    requestobject *result;
+
+    if ( request_freelist )
+    {
+        result = ( requestobject * ) request_freelist;
+        request_freelist = ( PyObject * ) request_freelist->ob_type;
+        request_nfree--;
+    }
+    else
+    {
+        result = PyMem_NEW( requestobject, 1 );
+        if (! result )
+            return ( requestobject * ) PyErr_NoMemory();
+    }
+
+    result->rq = from_rq;
+    result->reqpb = result->srvhdrs = result->vars = result->headers = NULL;
+    result->header_map = NULL;
+    result->ob_type = &requestobjecttype;
+
+    _Py_NewReference( result );
+    return result;
+}
+
+/*
+ * request_dealloc
+ */
+
+static void request_dealloc( requestobject *op )
+{
+    Py_XDECREF( op->reqpb );
+    Py_XDECREF( op->srvhdrs );
+    Py_XDECREF( op->vars );
+    Py_XDECREF( op->headers );
+    Py_XDECREF( op->header_map );
+
+    if ( request_nfree < NSAPY_MAXFREE )
+    {
+        op->ob_type = ( PyTypeObject * ) request_freelist;
+        request_freelist = ( PyObject * ) op;
+        request_nfree++;
+    }
+    else
+        free( op );
+}
+
+/* 
+ * rq.request_header(namestring, sn)
+ */
+
+static PyObject * Py_request_header( requestobject *rqo, PyObject *args )
+{
+
+    char *namestring, *value;
+    sessionobject *sno;
+
+    if (! PyArg_ParseTuple(args, "sO", &namestring, &sno) )
+        return NULL; /* error */
+
+    /* check that sno is a sessionobject */
+    if ( ! is_sessionobject( sno ) )
+    {
+        PyErr_SetString( PyExc_TypeError, 
+            "second arg to request_header must be session object");
+        return NULL;
+    }
+
+    /* call the underlying request_header function */
+    if ( request_header( namestring, &value, sno->sn, rqo->rq ) 
+            == REQ_ABORTED)
+    {
+        PyErr_SetString( PyExc_SystemError, "request_header signalled REQ_ABORTED" );
+        return NULL;
+    }
+
+    /* if the value is NULL, return None */
+    if ( ! value )
+    {
+        Py_INCREF( Py_None );
+        return Py_None;
+    }
+
+    /* otherwise return the value string as a Python string */
+    return PyString_FromString( value );
+}
+
+/*
+ *  rq.start_response(sn)
+ *
+   Signal the beginning of a response to the Server.
+   The sessionobject sn should be the session associated with
+   this request!
+
+   IF THIS FUNCTION RAISES KeyboardInterrupt THE ERROR MUST BE CAUGHT
+   AT THE TOP LEVEL AND THE VALUE "REQ_PROCEED" RETURNED FROM
+   PYTHON, WITHOUT ANY OTHER ACTIONS TAKEN.
+*/
+static PyObject * Py_start_response( requestobject *rqo, PyObject *args )
+{
+
+    sessionobject *sno;
+    int rv;
+
+    if (! PyArg_ParseTuple(args, "O", &sno) )
+        return NULL; /* error */
+
+    if ( !is_sessionobject(sno) )
+    {
+        PyErr_SetString( PyExc_TypeError, "arg of start_response must be session object");
+        return NULL;
+    }
+
+    /* a response that may be compressed waits for its body */
+    if ( out_defer( sno, rqo->rq ) )
+    {
+        Py_INCREF( Py_None );
+        return Py_None;
+    }
+
+    /* this writes the headers to the client, or a 304 if it has
+       the response already, and then it wants no body */
+    Py_BEGIN_ALLOW_THREADS
+    if ( not_modified( rqo->rq ) )
+    {
+        rv = start_not_modified( sno->sn, rqo->rq );
+        if ( rv != REQ_ABORTED )
+            rv = REQ_NOACTION;
+    }
+    else
+        rv = sn_start( sno->sn, rqo->rq );
+    Py_END_ALLOW_THREADS
+
+    /* raise SystemExit if REQ_NOACTION was returned */
+    if ( rv == REQ_NOACTION )
+    {
+        PyErr_SetString( PyExc_KeyboardInterrupt,
+            "protocol_start_response returned REQ_NOACTION");
+        return NULL;
+    }
+
+    Py_INCREF( Py_None );
+    return Py_None;
+}
+
+/*
+ * The REQ_* and PROTOCOL_* codes, exported by the nsapi module as
+ * integers. Their names are still accepted as strings, which is what
+ * nsapy used to pass around.
+ */
+
+static nsapy_code reqCodes[] = {
+    { "REQ_PROCEED",                 REQ_PROCEED },
+    { "REQ_ABORTED",                 REQ_ABORTED },
+    { "REQ_NOACTION",                REQ_NOACTION },
+    { "REQ_EXIT",                    REQ_EXIT },
+    { NULL, 0 }
+};
+
+static nsapy_code protocolCodes[] = {
+    { "PROTOCOL_OK",                 PROTOCOL_OK },
+    { "PROTOCOL_NO_RESPONSE",        PROTOCOL_NO_RESPONSE },
+    { "PROTOCOL_REDIRECT",           PROTOCOL_REDIRECT },
+    { "PROTOCOL_NOT_MODIFIED",       PROTOCOL_NOT_MODIFIED },
+    { "PROTOCOL_BAD_REQUEST",        PROTOCOL_BAD_REQUEST },
+    { "PROTOCOL_UNAUTHORIZED",       PROTOCOL_UNAUTHORIZED },
+    { "PROTOCOL_FORBIDDEN",          PROTOCOL_FORBIDDEN },
+    { "PROTOCOL_NOT_FOUND",          PROTOCOL_NOT_FOUND },
+    { "PROTOCOL_PROXY_UNAUTHORIZED", PROTOCOL_PROXY_UNAUTHORIZED },
+    { "PROTOCOL_SERVER_ERROR",       PROTOCOL_SERVER_ERROR },
+    { "PROTOCOL_NOT_IMPLEMENTED",    PROTOCOL_NOT_IMPLEMENTED },
+    { NULL, 0 }
+};
+
+/* reason phrases for statuses the server may not know */
+
+static nsapy_code reasons[] = {
+    { "Created",                     201 },
+    { "Accepted",                    202 },
+    { "No Content",                  204 },
+    { "Reset Content",               205 },
+    { "Partial Content",             206 },
+    { "Moved Permanently",           301 },
+    { "See Other",                   303 },
+    { "Temporary Redirect",          307 },
+    { "Method Not Allowed",          405 },
+    { "Not Acceptable",              406 },
+    { "Conflict",                    409 },
+    { "Gone",                        410 },
+    { "Length Required",             411 },
+    { "Precondition Failed",         412 },
+    { "Request Entity Too Large",    413 },
+    { "Unsupported Media Type",      415 },
+    { "Requested Range Not Satisfiable", 416 },
+    { "Too Many Requests",           429 },
+    { "Bad Gateway",                 502 },
+    { "Service Unavailable",         503 },
+    { "Gateway Timeout",             504 },
+    { NULL, 0 }
+};
+
+/*
+ * code_lookup
+ *
+   Translate o, an int or a name from table, to a code. Returns 0 if
+   it is neither.
+*/
+
+static int code_lookup( PyObject *o, nsapy_code *table, int *code )
+{
+    char *name;
+
+    if ( PyInt_Check( o ) )
+    {
+        *code = ( int ) PyInt_AS_LONG( ( PyIntObject * ) o );
+        return 1;
+    }
+
+    if ( PyString_Check( o ) )
+    {
+        name = PyString_AS_STRING( ( PyStringObject * ) o );
+        for ( ; table->name; table++ )
+            if ( strcmp( name, table->name ) == 0 )
+            {
+                *code = table->code;
+                return 1;
+            }
+    }
+
+    return 0;
+}
+
+/*
+ * req_result
+ *
+   Translate what Service() or AuthTrans() returned to a REQ_* code,
+   returns 0 if it isn't one.
+*/
+
+static int req_result( PyObject *o, int *result )
+{
+    nsapy_code *c;
+
+    if ( ! code_lookup( o, reqCodes, result ) )
+        return 0;
+
+    for ( c = reqCodes; c->name; c++ )
+        if ( c->code == *result )
+            return 1;
+
+    return 0;
+}
+
+/* 
+ *  rq.protocol_status(sn, status [, reason])
+ *
+    Signal the protocol status.  sn must be the session object for this
+    session.  status is any HTTP status code ( e.g. nsapy.PROTOCOL_OK, 
+    or 201 ), the names of the PROTOCOL_* codes are also understood.
+    reason is the reason phrase, if not given the server's ( or ours,
+    see reasons above ) is used.
+ */
+
+static PyObject * Py_protocol_status( requestobject *rqo, PyObject *args )
+{
+
+    sessionobject *sno;
+    PyObject *status;
+    char *reason;
+    nsapy_code *c;
+    int response;
+
+    reason = NULL;
+    if (! PyArg_ParseTuple(args, "OO|s", &sno, &status, &reason ))
+        return NULL; /* error */
+
+    if (! is_sessionobject(sno))
+    {
+        PyErr_SetString( PyExc_TypeError,
+            "arg 1 of protocol_status must be session object");
+        return NULL;
+    }
+
+    if ( ! code_lookup( status, protocolCodes, &response ) )
+    {
+        PyErr_SetString( PyExc_ValueError, "unknown protocol status" );
+        return NULL;
+    }
+
+    if ( response < 100 || response > 999 )
+    {
+        PyErr_SetString( PyExc_ValueError, "protocol status must be between 100 and 999" );
+        return NULL;
+    }
+
+    if ( ! reason )
+        for ( c = reasons; c->name; c++ )
+            if ( c->code == response )
+            {
+                reason = c->name;
+                break;
+            }
+
+  /* call the underlying nsapi function */
+  protocol_status( sno->sn, rqo->rq, response, reason );
+
+  Py_XINCREF( Py_None );
+  return Py_None;
+}
+
+/*
+ *  rq.nsapy_log_error(function_string, message_string, sn)
+ *
+   Log an error message to the server log file.
+   This implementation always uses the severity LOG_WARN.
+
+*/
+static PyObject * Py_log_warn( requestobject *rqo, PyObject *args )
+{
+    char *message;
+    char *function;
+    sessionobject *sno;
+
+
+    if (! PyArg_ParseTuple(args, "ssO", &function, &message, &sno)) 
+        return NULL; /* error */
+
+    if (!is_sessionobject(sno))
+    {
+        PyErr_SetString( PyExc_TypeError, "third arg of log_error must be session object");
+        return NULL;
+    }
+
+    /* call the underlying log_error function, assume it succeeds */
+    nsapy_log_error(LOG_WARN, function, sno->sn, rqo->rq, message);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+  
+
+
+/* 
+ * ALMOST standard getattr for sessions.
+ *
+   Allow methods defined above as well as
+
+     rq.reqpb, rq.srvhdrs, rq.vars
+
+   which all return pblockobjects based on the members of the
+   request structure.
+
+   NOTE: The os, statpath, finfo, loadhdrs members are ignored
+         because they are not documented.
+*/
+
+static PyObject * request_getattr(requestobject *rqo, char *name)
+{
+
+    /*  If the name is "reqpb", "srvhdrs" or "vars" return
+        the appropriate pblock in Python object form.
+        Note that the headers member should only be read through
+        the official request_header interface, as per documentation.
+    */
+
+    /* check for member names reqpb, srvhdrs, vars, headers, 
+       the wrappers are kept for the life of the request */
+    if ( strcmp(name, "reqpb") == 0 )
+        return member_pblock( &rqo->reqpb, rqo->rq->reqpb );
+    else if ( strcmp(name, "srvhdrs") == 0 )
+        return member_pblock( &rqo->srvhdrs, rqo->rq->srvhdrs );
+    else if ( strcmp(name, "vars") == 0 )
+        return member_pblock( &rqo->vars, rqo->rq->vars );
+    else if ( strcmp(name, "headers") == 0 )
+        return member_pblock( &rqo->headers, rqo->rq->headers );
+    else if ( strcmp(name, "header_map") == 0 )
+    {
+        if ( ! rqo->header_map )
+        {
+            rqo->header_map = make_headersobject( rqo->rq->headers );
+            if ( ! rqo->header_map )
+                return NULL;
+        }
+        Py_INCREF( rqo->header_map );
+        return ( PyObject * ) rqo->header_map;
+    }
+
+    /* otherwise look for a standard method */
+    return Py_FindMethod( Pyrequestmethods, (PyObject *) rqo, name );
+}
+
+
+/**
+ ** rq.header_map
+ **
+ *  The request headers as a read-only dictionary that doesn't care
+ *  about case: rq.header_map[ "Content-Length" ], .get( name [, default ] ),
+ *  has_key(), keys(), values(), items(), len(), "in" and "for name in".
+ *  copy() gives a plain dictionary.
+ *
+ *  It is filled from rq->headers in one go the first time it is used,
+ *  with the names in lower case ( the way the server keeps them ) and 
+ *  interned, so after that every lookup is a dictionary hit, rather 
+ *  than a call into the server and a new string like request_header().
+ *  It is a snapshot: headers changed through rq.headers after that 
+ *  don't show up in it.
+ */
+
+static PyObject * Py_headers_get( headersobject *ho, PyObject *args );
+static PyObject * Py_headers_has_key( headersobject *ho, PyObject *args );
+static PyObject * Py_headers_keys( headersobject *ho, PyObject *args );
+static PyObject * Py_headers_values( headersobject *ho, PyObject *args );
+static PyObject * Py_headers_items( headersobject *ho, PyObject *args );
+static PyObject * Py_headers_copy( headersobject *ho, PyObject *args );
+
+static PyMethodDef Pyheadersmethods[] = {
+	{ "get",            (PyCFunction) Py_headers_get,     1},
+	{ "has_key",        (PyCFunction) Py_headers_has_key, 1},
+	{ "keys",           (PyCFunction) Py_headers_keys,    1},
+	{ "values",         (PyCFunction) Py_headers_values,  1},
+	{ "items",          (PyCFunction) Py_headers_items,   1},
+	{ "copy",           (PyCFunction) Py_headers_copy,    1},
+	{ NULL, NULL } /* sentinel */
+};
+
+/* name in lower case, as a new string */
+
+static PyObject * headers_name( char *name, int len )
+{
+    PyObject *result;
+    char *s;
+    int i;
+
+    result = PyString_FromStringAndSize( ( char * ) NULL, len );
+    if ( ! result )
+        return NULL;
+
+    s = PyString_AS_STRING( ( PyStringObject * ) result );
+    for ( i = 0; i < len; i++ )
+        s[i] = tolower( ( unsigned char ) name[i] );
+
+    return result;
+}
+
+static headersobject * make_headersobject( pblock *pb )
+{
+    headersobject *result;
+    struct pb_entry *p;
+    PyObject *name, *value;
+    int i;
+
+    if ( headers_freelist )
+    {
+        result = ( headersobject * ) headers_freelist;
+        headers_freelist = ( PyObject * ) headers_freelist->ob_type;
+        headers_nfree--;
+    }
+    else
+    {
+        result = PyMem_NEW( headersobject, 1 );
+        if (! result )
+            return ( headersobject * ) PyErr_NoMemory();
+    }
+
+    result->dict = PyDict_New();
+    result->keys = NULL;
+    result->ob_type = &headersobjecttype;
+    _Py_NewReference( result );
+
+    if ( ! result->dict )
+    {
+        Py_DECREF( result );
+        return NULL;
+    }
+
+    for ( i = 0; pb && i < pb->hsize; i++ )
+        for ( p = pb->ht[i]; p; p = p->next )
+        {
+            name = headers_name( p->param->name, strlen( p->param->name ) );
+            if ( ! name )
+            {
+                Py_DECREF( result );
+                return NULL;
+            }
+            PyString_InternInPlace( &name );
+
+            /* the first one in a chain is the one findval finds */
+            if ( PyDict_GetItem( result->dict, name ) )
+            {
+                Py_DECREF( name );
+                continue;
+            }
+
+            value = PyString_FromString( p->param->value );
+            if ( ! value || PyDict_SetItem( result->dict, name, value ) < 0 )
+            {
+                Py_DECREF( name );
+                Py_XDECREF( value );
+                Py_DECREF( result );
+                return NULL;
+            }
+            Py_DECREF( name );
+            Py_DECREF( value );
+        }
+
+    return result;
+}
+
+static void headers_dealloc( headersobject *ho )
+{
+    Py_XDECREF( ho->dict );
+    Py_XDECREF( ho->keys );
+
+    if ( headers_nfree < NSAPY_MAXFREE )
+    {
+        ho->ob_type = ( PyTypeObject * ) headers_freelist;
+        headers_freelist = ( PyObject * ) ho;
+        headers_nfree++;
+    }
+    else
+        free( ho );
+}
+
+/* the value for key ( borrowed ), NULL if there is none or on error */
+
+static PyObject * headers_lookup( headersobject *ho, PyObject *key )
+{
+    PyObject *lower, *value;
+    char *s;
+    int i, len;
+
+    if ( ! PyString_Check( key ) )
     {
-        PyErr_SetString( PyExc_SystemError, "request_header signalled REQ_ABORTED" );
+        PyErr_SetString( PyExc_TypeError, "header names are strings" );
         return NULL;
     }
 
-    /* if the value is NULL, return None */
+    /* names in lower case already ( most are ) are looked up as is */
+    s = PyString_AS_STRING( ( PyStringObject * ) key );
+    len = PyString_GET_SIZE( key );
+    for ( i = 0; i < len; i++ )
+        if ( isupper( ( unsigned char ) s[i] ) )
+            break;
+    if ( i == len )
+        return PyDict_GetItem( ho->dict, key );
+
+    lower = headers_name( s, len );
+    if ( ! lower )
+        return NULL;
+    value = PyDict_GetItem( ho->dict, lower );
+    Py_DECREF( lower );
+
+    return value;
+}
+
+static PyObject * headers_subscript( headersobject *ho, PyObject *key )
+{
+    PyObject *value;
+
+    value = headers_lookup( ho, key );
     if ( ! value )
     {
-        Py_INCREF( Py_None );
-        return Py_None;
+        if ( ! PyErr_Occurred() )
+            PyErr_SetObject( PyExc_KeyError, key );
+        return NULL;
     }
 
-    /* otherwise return the value string as a Python string */
-    return PyString_FromString( value );
+    Py_INCREF( value );
+    return value;
 }
 
-/*
- *  rq.start_response(sn)
- *
-   Signal the beginning of a response to the Server.
-   The sessionobject sn should be the session associated with
-   this request!
-
-   IF THIS FUNCTION RAISES KeyboardInterrupt THE ERROR MUST BE CAUGHT
-   AT THE TOP LEVEL AND THE VALUE "REQ_PROCEED" RETURNED FROM
-   PYTHON, WITHOUT ANY OTHER ACTIONS TAKEN.
-*/
-static PyObject * Py_start_response( requestobject *rqo, PyObject *args )
+static Py_ssize_t headers_length( headersobject *ho )
 {
+    return PyDict_Size( ho->dict );
+}
 
-    sessionobject *sno;
-
-    if (! PyArg_ParseTuple(args, "O", &sno) )
-        return NULL; /* error */
+static PyObject * headers_item( headersobject *ho, Py_ssize_t i )
+{
+    PyObject *name;
 
-    if ( !is_sessionobject(sno) )
+    if ( ! ho->keys )
     {
-        PyErr_SetString( PyExc_TypeError, "arg of start_response must be session object");
-        return NULL;
+        ho->keys = PyDict_Keys( ho->dict );
+        if ( ! ho->keys )
+            return NULL;
     }
 
-    /* raise SystemExit if REQ_NOACTION was returned */
-    if ( protocol_start_response(sno->sn, rqo->rq) == REQ_NOACTION )
+    if ( i < 0 || i >= PyList_Size( ho->keys ) )
     {
-        PyErr_SetString( PyExc_KeyboardInterrupt,
-            "protocol_start_response returned REQ_NOACTION");
+        PyErr_SetString( PyExc_IndexError, "header index out of range" );
         return NULL;
     }
 
-    Py_INCREF( Py_None );
-    return Py_None;
+    name = PyList_GetItem( ho->keys, i );
+    Py_INCREF( name );
+    return name;
 }
 
-/* 
- *  rq.protocol_status(sn, string)
- *
-    Signal the protocol status.  sn must be the session object for this
-    session.  string should be one of the PROTOCOL_* responses listed
-    in the source below.
- */
-
-static PyObject * Py_protocol_status( requestobject *rqo, PyObject *args )
+static int headers_contains( headersobject *ho, PyObject *key )
 {
+    if ( ! PyString_Check( key ) )
+        return 0;
 
-    sessionobject *sno;
-    char *responsestr;
-    int response;
-
-    if (! PyArg_ParseTuple(args, "Os", &sno, &responsestr ))
-        return NULL; /* error */
-
-    if (! is_sessionobject(sno))
-    {
-        PyErr_SetString( PyExc_TypeError,
-            "arg 2 of start_response must be session object");
-        return NULL;
-    }
-
-    /* translate response string to a status code, default to PROTOCOL_FORBIDDEN. */
-    response = PROTOCOL_FORBIDDEN;
-    if ( strcmp( responsestr, "PROTOCOL_OK")==0)
-        response = PROTOCOL_OK;
-    else if ( strcmp( responsestr, "PROTOCOL_NO_RESPONSE")==0)
-        response = PROTOCOL_NO_RESPONSE;
-    else if ( strcmp( responsestr, "PROTOCOL_REDIRECT")==0)
-        response = PROTOCOL_REDIRECT;
-    else if ( strcmp( responsestr, "PROTOCOL_NOT_MODIFIED")==0)
-        response = PROTOCOL_NOT_MODIFIED;
-    else if ( strcmp( responsestr, "PROTOCOL_BAD_REQUEST")==0)
-        response = PROTOCOL_BAD_REQUEST;
-    else if ( strcmp(responsestr, "PROTOCOL_UNAUTHORIZED")==0)
-        response = PROTOCOL_UNAUTHORIZED;
-    else if ( strcmp( responsestr, "PROTOCOL_FORBIDDEN")==0)
-        response = PROTOCOL_FORBIDDEN;
-    else if ( strcmp( responsestr, "PROTOCOL_NOT_FOUND")==0)
-        response = PROTOCOL_NOT_FOUND;
-    else if ( strcmp( responsestr, "PROTOCOL_PROXY_UNAUTHORIZED")==0)
-        response = PROTOCOL_PROXY_UNAUTHORIZED;
-    else if ( strcmp( responsestr, "PROTOCOL_SERVER_ERROR")==0)
-        response = PROTOCOL_SERVER_ERROR;
-    else if ( strcmp( responsestr, "PROTOCOL_NOT_IMPLEMENTED")==0)
-        response = PROTOCOL_NOT_IMPLEMENTED;
+    return headers_lookup( ho, key ) != NULL;
+}
 
-  /* call the underlying nsapi function */
-  protocol_status( sno->sn, rqo->rq, response, NULL );
+static PyMappingMethods headers_as_mapping = {
+    (lenfunc)headers_length,           /*mp_length*/
+    (binaryfunc)headers_subscript,     /*mp_subscript*/
+    0,                                 /*mp_ass_subscript*/
+};
 
-  Py_XINCREF( Py_None );
-  return Py_None;
-}
+static PySequenceMethods headers_as_sequence = {
+    (lenfunc)headers_length,           /*sq_length*/
+    0,                                 /*sq_concat*/
+    0,                                 /*sq_repeat*/
+    (ssizeargfunc)headers_item,        /*sq_item*/
+    0,                                 /*sq_slice*/
+    0,                                 /*sq_ass_item*/
+    0,                                 /*sq_ass_slice*/
+#ifdef Py_TPFLAGS_HAVE_SEQUENCE_IN
+    (objobjproc)headers_contains,      /*sq_contains*/
+#endif
+};
 
 /*
- *  rq.nsapy_log_error(function_string, message_string, sn)
- *
-   Log an error message to the server log file.
-   This implementation always uses the severity LOG_WARN.
+ * rq.header_map.get( name [, default ] )
+ */
 
-*/
-static PyObject * Py_log_warn( requestobject *rqo, PyObject *args )
+static PyObject * Py_headers_get( headersobject *ho, PyObject *args )
 {
-    char *message;
-    char *function;
-    sessionobject *sno;
-
+    PyObject *key, *dflt, *value;
 
-    if (! PyArg_ParseTuple(args, "ssO", &function, &message, &sno)) 
-        return NULL; /* error */
+    dflt = Py_None;
+    if ( ! PyArg_ParseTuple( args, "O|O", &key, &dflt ) )
+        return NULL;
 
-    if (!is_sessionobject(sno))
+    value = headers_lookup( ho, key );
+    if ( ! value )
     {
-        PyErr_SetString( PyExc_TypeError, "third arg of log_error must be session object");
-        return NULL;
+        if ( PyErr_Occurred() )
+            return NULL;
+        value = dflt;
     }
 
-    /* call the underlying log_error function, assume it succeeds */
-    nsapy_log_error(LOG_WARN, function, sno->sn, rqo->rq, message);
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_INCREF( value );
+    return value;
 }
-  
-
-
-/* 
- * ALMOST standard getattr for sessions.
- *
-   Allow methods defined above as well as
 
-     rq.reqpb, rq.srvhdrs, rq.vars
+static PyObject * Py_headers_has_key( headersobject *ho, PyObject *args )
+{
+    PyObject *key;
 
-   which all return pblockobjects based on the members of the
-   request structure.
+    if ( ! PyArg_ParseTuple( args, "O", &key ) )
+        return NULL;
 
-   NOTE: The os, statpath, finfo, loadhdrs members are ignored
-         because they are not documented.
-*/
+    if ( headers_lookup( ho, key ) )
+        return PyInt_FromLong( 1 );
+    if ( PyErr_Occurred() )
+        return NULL;
+    return PyInt_FromLong( 0 );
+}
 
-static PyObject * request_getattr(requestobject *rqo, char *name)
+static PyObject * Py_headers_keys( headersobject *ho, PyObject *args )
 {
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+    return PyDict_Keys( ho->dict );
+}
 
-    /*  If the name is "reqpb", "srvhdrs" or "vars" return
-        the appropriate pblock in Python object form.
-        Note that the headers member should only be read through
-        the official request_header interface, as per documentation.
-    */
-
-    pblock *member;
-
-    member = NULL;
+static PyObject * Py_headers_values( headersobject *ho, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+    return PyDict_Values( ho->dict );
+}
 
-    /* check for member names reqpb, srvhdrs, vars */
-    if ( strcmp(name, "reqpb") == 0 )
-        member = rqo->rq->reqpb;
-    else if ( strcmp(name, "srvhdrs") == 0 )
-        member = rqo->rq->srvhdrs;
-    else if ( strcmp(name, "vars") == 0 )
-        member = rqo->rq->vars;
-    else if ( strcmp(name, "headers") == 0 )
-        member = rqo->rq->headers;
+static PyObject * Py_headers_items( headersobject *ho, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+    return PyDict_Items( ho->dict );
+}
 
-    /* if member is set, return it translated as a pblockobject */
-    if ( member )
-        return (PyObject *) make_pblockobject(member);
+static PyObject * Py_headers_copy( headersobject *ho, PyObject *args )
+{
+    if ( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+    return PyDict_Copy( ho->dict );
+}
 
-    /* otherwise look for a standard method */
-    return Py_FindMethod( Pyrequestmethods, (PyObject *) rqo, name );
+static PyObject * headers_getattr( PyObject *ho, char *name )
+{
+    return Py_FindMethod( Pyheadersmethods, ho, name );
 }
 
 
 /* nsapi MODULE INITIALIZATION FUNCTION */
 NSAPI_PUBLIC void initnsapi()
 {
+    PyObject *d, *o;
+    nsapy_code *c;
 
     PyTypeObject pot = {
         PyObject_HEAD_INIT(&PyType_Type)
@@ -1219,8 +10155,8 @@ NSAPI_PUBLIC void initnsapi()
         0,                               /*tp_compare*/
         0,                               /*tp_repr*/
         0,                               /*tp_as_number*/
-        0,                               /*tp_as_sequence*/
-        0,                               /*tp_as_mapping*/
+        &pblock_as_sequence,             /*tp_as_sequence*/
+        &pblock_as_mapping,              /*tp_as_mapping*/
         0,                               /*tp_hash*/
     };
 
@@ -1280,12 +10216,138 @@ NSAPI_PUBLIC void initnsapi()
         0,                               /*tp_hash*/
     };
 
+    PyTypeObject lot = {
+        PyObject_HEAD_INIT(&PyType_Type)
+        0,
+        "nsapi_lock",
+        sizeof(lockobject),
+        0,
+        (destructor)lock_dealloc,        /*tp_dealloc*/
+        0,                               /*tp_print*/
+        (getattrfunc)lock_getattr,       /*tp_getattr*/
+        0,                               /*tp_setattr*/
+        0,                               /*tp_compare*/
+        0,                               /*tp_repr*/
+        0,                               /*tp_as_number*/
+        0,                               /*tp_as_sequence*/
+        0,                               /*tp_as_mapping*/
+        0,                               /*tp_hash*/
+    };
+
+    PyTypeObject oot = {
+        PyObject_HEAD_INIT(&PyType_Type)
+        0,
+        "nsapi_out",
+        sizeof(outobject),
+        0,
+        (destructor)out_dealloc,         /*tp_dealloc*/
+        0,                               /*tp_print*/
+        (getattrfunc)out_getattr,        /*tp_getattr*/
+        0,                               /*tp_setattr*/
+        0,                               /*tp_compare*/
+        0,                               /*tp_repr*/
+        0,                               /*tp_as_number*/
+        0,                               /*tp_as_sequence*/
+        0,                               /*tp_as_mapping*/
+        0,                               /*tp_hash*/
+    };
+
+    PyTypeObject hot = {
+        PyObject_HEAD_INIT(&PyType_Type)
+        0,
+        "nsapi_headers",
+        sizeof(headersobject),
+        0,
+        (destructor)headers_dealloc,     /*tp_dealloc*/
+        0,                               /*tp_print*/
+        (getattrfunc)headers_getattr,    /*tp_getattr*/
+        0,                               /*tp_setattr*/
+        0,                               /*tp_compare*/
+        0,                               /*tp_repr*/
+        0,                               /*tp_as_number*/
+        &headers_as_sequence,            /*tp_as_sequence*/
+        &headers_as_mapping,             /*tp_as_mapping*/
+        0,                               /*tp_hash*/
+    };
+
+    PyTypeObject paot = {
+        PyObject_HEAD_INIT(&PyType_Type)
+        0,
+        "nsapi_part",
+        sizeof(partobject),
+        0,
+        (destructor)part_dealloc,        /*tp_dealloc*/
+        0,                               /*tp_print*/
+        (getattrfunc)part_getattr,       /*tp_getattr*/
+        0,                               /*tp_setattr*/
+        0,                               /*tp_compare*/
+        0,                               /*tp_repr*/
+        0,                               /*tp_as_number*/
+        0,                               /*tp_as_sequence*/
+        0,                               /*tp_as_mapping*/
+        0,                               /*tp_hash*/
+    };
+
+    PyTypeObject chot = {
+        PyObject_HEAD_INIT(&PyType_Type)
+        0,
+        "nsapi_chunks",
+        sizeof(chunksobject),
+        0,
+        (destructor)chunks_dealloc,      /*tp_dealloc*/
+        0,                               /*tp_print*/
+        0,                               /*tp_getattr*/
+        0,                               /*tp_setattr*/
+        0,                               /*tp_compare*/
+        0,                               /*tp_repr*/
+        0,                               /*tp_as_number*/
+        &chunks_as_sequence,             /*tp_as_sequence*/
+        0,                               /*tp_as_mapping*/
+        0,                               /*tp_hash*/
+    };
+
     pblockobjecttype = pot;
     sessionobjecttype = sot;
     requestobjecttype = rot;
     criticalobjecttype = cot;
+    lockobjecttype = lot;
+    chunksobjecttype = chot;
+    outobjecttype = oot;
+    headersobjecttype = hot;
+    partobjecttype = paot;
+#ifdef Py_TPFLAGS_HAVE_SEQUENCE_IN
+    /* so that "name in pb" looks it up rather than going through all */
+    pblockobjecttype.tp_flags |= Py_TPFLAGS_HAVE_SEQUENCE_IN;
+    headersobjecttype.tp_flags |= Py_TPFLAGS_HAVE_SEQUENCE_IN;
+#endif
+#ifdef Py_TPFLAGS_HAVE_CLASS
+    /* "with" looks __enter__ and __exit__ up in the type, not through getattr */
+    lockobjecttype.tp_flags |= Py_TPFLAGS_HAVE_CLASS;
+    lockobjecttype.tp_methods = Pylockmethods;
+    PyType_Ready( &lockobjecttype );
+#endif
 
     NsapiModule = Py_InitModule("nsapi", nsapi_module_methods);
+
+    /* nsapi.REQ_PROCEED etc., the dictionary keeps its own reference */
+    d = PyModule_GetDict( NsapiModule );
+    for ( c = reqCodes; c->name; c++ )
+    {
+        o = PyInt_FromLong( c->code );
+        PyDict_SetItemString( d, c->name, o );
+        Py_XDECREF( o );
+    }
+    for ( c = protocolCodes; c->name; c++ )
+    {
+        o = PyInt_FromLong( c->code );
+        PyDict_SetItemString( d, c->name, o );
+        Py_XDECREF( o );
+    }
+
+    /* seconds between checks for changed modules, 0 if we don't */
+    o = PyInt_FromLong( reloadInterval );
+    PyDict_SetItemString( d, "RELOAD", o );
+    Py_XDECREF( o );
 }
 
 
@@ -1305,23 +10367,55 @@ NSAPI_PUBLIC void initnsapi()
 
 NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
 {
-	char buff[1000];
     pblockobject *pbo;
     sessionobject *sno;
     requestobject *rqo;
-    PyObject *resultobject;
-    char *resultstring;
-    int result;
+    PyObject *resultobject, *callback, *cls;
+    char *uri, *name;
+    nsapy_interp *interp;
+    unsigned long start, spent;
+    int result, entered, len;
+    long sent;
+
+    uri = pblock_findval( "uri", rq->reqpb );
+
+    /* the statistics page doesn't need Python at all */
+    if ( statsUri && uri && strcmp( uri, statsUri ) == 0 )
+        return stats_page( sn, rq );
+
+#ifdef NSAPY_PREFORK
+    /* with "processes", Python is in the workers */
+    if ( pfWorkers )
+    {
+        start = stats_clock();
+        result = pf_service( PF_SERVICE, pb, sn, rq, &sent );
+        stats_uri_name( uri, &name, &len );
+        stats_record( STATS_SERVICE, name, len, result, stats_clock() - start, sent );
+        return result;
+    }
+#endif
 
     /* pessimistic */
     result = REQ_ABORTED;
+    spent = 0;
+    sent = 0;
+
+    /* nor does a response sn.out.cache() kept */
+    if ( rcacheShards )
+    {
+        start = stats_clock();
+        result = rcache_serve( sn, rq, &sent );
+        if ( result != -1 )
+        {
+            stats_uri_name( uri, &name, &len );
+            stats_record( STATS_SERVICE, name, len, result, stats_clock() - start, sent );
+            return result;
+        }
+        result = REQ_ABORTED;
+    }
 
 	if ( obCrit != Py_None )
-	{
 		crit_enter( ( ( criticalobject * ) obCrit )->crit);
-		sprintf( buff, "nsapy_Service: entered critical section %d", ( int ) ( ( criticalobject * ) obCrit )->crit );
-		Log( buff );
-	}
     
 	/* initialize pointers to NULL */
     pbo = NULL;
@@ -1329,8 +10423,19 @@ NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
     rqo = NULL;
     resultobject = NULL;
 
+    /* take an interpreter ( a free one, if there is a pool ) */
+    interp = interp_get( &entered );
+    callback = interp ? interp->obCallBack : obCallBack;
+
+    if ( entered && obCrit != Py_None )
+    {
+        Log( "nsapy_Service: entered critical section %p", ( void * ) ( ( criticalobject * ) obCrit )->crit );
+    }
+
     /* we must have a callback object to succeed! */
-    if ( !obCallBack ) 
+    if ( !entered )
+        nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "couldn't get a Python thread state");
+    else if ( !callback ) 
         nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "no callback object registered");
     else
     {
@@ -1339,7 +10444,7 @@ NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
             nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "couldn't make pno");
         else
         {
-            sno = make_sessionobject(sn);
+            sno = make_sessionobject(sn, rq);
             if (!sno)
             {
                 nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "couldn't make pno");
@@ -1363,9 +10468,19 @@ NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
 
                      This is the C equivalent of
                        >>> resultobject = obCallBack.Service(pbo, sno, rqo)
+
+                     or, if the handler class for this URI is known, 
+                       >>> resultobject = obCallBack.Service(pbo, sno, rqo, Class)
                     */
-                    resultobject = PyObject_CallMethod( obCallBack, "Service", "OOO",
-                            (PyObject *)pbo, (PyObject *)sno, (PyObject *)rqo);
+                    cls = uri ? handler_find( interp ? &interp->handlers : &mainHandlers, uri ) : NULL;
+                    start = stats_clock();
+                    if ( cls )
+                        resultobject = PyObject_CallMethod( callback, "Service", "OOOO",
+                                (PyObject *)pbo, (PyObject *)sno, (PyObject *)rqo, cls);
+                    else
+                        resultobject = PyObject_CallMethod( callback, "Service", "OOO",
+                                (PyObject *)pbo, (PyObject *)sno, (PyObject *)rqo);
+                    spent = stats_clock() - start;
 
                     if (!resultobject) 
                     {
@@ -1375,42 +10490,49 @@ NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
                     }
                     else
                     {
-                        /* Attempt to analyse the result as a string indicating which
-                         result to return */
-                        if (!PyString_Check(resultobject)) 
+                        /* The result is one of the REQ_* codes, or
+                           its name as a string */
+                        if ( ! req_result( resultobject, &result ) )
                         {
-                            nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "Service returned non-string");
-                            Log("nsapy_Service: Service() result not string");
+                            nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "Service returned something other than a REQ_* code");
+                            Log("nsapy_Service: Service() result not a REQ_* code, defaults to REQ_ABORTED");
+                            result = REQ_ABORTED;
                         }
                         else
                         {
-                            resultstring = PyString_AS_STRING( (PyStringObject *) resultobject);
-                            if (strcmp(resultstring, "REQ_NOACTION")==0) 
-                            {
-                                Log("nsapy_Service: Service() returns REQ_NOACTION");
-                                result = REQ_NOACTION;
-                            }
-                            else if (strcmp(resultstring, "REQ_PROCEED")==0) 
-                            {
-                                Log("nsapy_Service: Service() returns REQ_PROCEED");
-                                result = REQ_PROCEED;
-                            }
-                            else if (strcmp(resultstring, "REQ_EXIT")==0) {
-                                Log("nsapy_Service: Service() returns REQ_EXIT");
-                                result = REQ_EXIT;
-                            }
-                            else
-							{
-							    sprintf( buff, "nsapy_Service: Service() returns %s, defaults to REQ_ABORTED", resultstring );
-								Log( buff );
-                                result = REQ_ABORTED;
-							}
+                            Log( "nsapy_Service: Service() returns %d", result );
                         }
                     }
                 }
             }
         }
     }
+  /* send whatever is still waiting in sn.out. If the handler failed,
+     drop it, and any headers held back with it, so that the server
+     sends its own error. Once some of the body is out, that can't be
+     ended properly either, and the connection has to go */
+  if ( sno && result == REQ_ABORTED )
+  {
+        out_finish( sno, 0 );
+        if ( rq->senthdrs )
+        {
+            nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "REQ_ABORTED after the response started, closing the connection");
+            result = REQ_EXIT;
+        }
+  }
+  else if ( sno && ! out_finish( sno, 1 ) )
+  {
+        PyErr_Clear();
+        nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "couldn't flush sn.out, client gone?");
+        result = REQ_EXIT;
+  }
+  if ( sno )
+  {
+        sent = sno->sent;
+        rcache_store( sno, rq, result );
+        task_release( sno );
+  }
+
   if (result == REQ_ABORTED) 
   {
         nsapy_log_error(LOG_WARN, "nsapy_Service", sn, rq, "REQ_ABORTED");
@@ -1424,13 +10546,22 @@ NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
   Py_XDECREF(rqo);
   Py_XDECREF(resultobject);
 
+  if ( entered && obCrit != Py_None )
+  {
+      Log( "nsapy_Service: exiting critical section %p", ( void * ) ( ( criticalobject * ) obCrit )->crit );
+  }
+
+  /* leave Python, the interpreter goes back to the pool */
+  interp_put( interp, entered );
+
   if ( obCrit != Py_None )
   {
-	sprintf( buff, "nsapy_Service: exiting critical section %d", ( int ) ( ( criticalobject * ) obCrit )->crit );
-	Log( buff );
 	crit_exit( ( ( criticalobject * ) obCrit )->crit );
   }
 
+  stats_uri_name( uri, &name, &len );
+  stats_record( STATS_SERVICE, name, len, result, spent, sent );
+
   /* return the translated result (or default result) to the Server. */
   return result;
 }
@@ -1446,24 +10577,33 @@ NSAPI_PUBLIC int nsapy_Service(pblock *pb, Session *sn, Request *rq)
 
 NSAPI_PUBLIC int nsapy_AuthTrans(pblock *pb, Session *sn, Request *rq)
 {
-	char buff[1000];
     pblockobject *pbo;
     sessionobject *sno;
     requestobject *rqo;
-    PyObject *resultobject;
-    char *resultstring;
-    int result;
+    PyObject *resultobject, *callback;
+    nsapy_interp *interp;
+    unsigned long start, spent;
+    int result, entered;
+    long sent;
+
+#ifdef NSAPY_PREFORK
+    if ( pfWorkers )
+    {
+        start = stats_clock();
+        result = pf_service( PF_AUTHTRANS, pb, sn, rq, &sent );
+        stats_record( STATS_AUTHTRANS, pblock_findval( "userdb", pb ), -1, result, stats_clock() - start, sent );
+        return result;
+    }
+#endif
 
     /* pessimistic */
     result = REQ_ABORTED;
+    spent = 0;
+    sent = 0;
 
 
 if ( obCrit != Py_None )
-{
 	crit_enter( ( ( criticalobject * ) obCrit )->crit );
-	sprintf( buff, "nsapy_AuthTrans: entered critical section %d", ( int ) ( ( criticalobject * ) obCrit )->crit );
-	Log( buff );
-}
 
     /* initialize pointers to NULL */
     pbo = NULL;
@@ -1471,7 +10611,19 @@ if ( obCrit != Py_None )
     rqo = NULL;
     resultobject = NULL;
 
-    if ( !obCallBack ) 
+    /* take an interpreter ( a free one, if there is a pool ) */
+    interp = interp_get( &entered );
+    callback = interp ? interp->obCallBack : obCallBack;
+
+    if ( entered && obCrit != Py_None )
+    {
+        Log( "nsapy_AuthTrans: entered critical section %p", ( void * ) ( ( criticalobject * ) obCrit )->crit );
+    }
+
+    /* we must have a callback object to succeed! */
+    if ( !entered )
+        nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "couldn't get a Python thread state");
+    else if ( !callback ) 
         nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "no callback object registered");
     else
     {
@@ -1480,7 +10632,7 @@ if ( obCrit != Py_None )
             nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "couldn't make pno");
         else
         {
-            sno = make_sessionobject(sn);
+            sno = make_sessionobject(sn, rq);
             if (!sno)
             {
                 nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "couldn't make pno");
@@ -1504,8 +10656,10 @@ if ( obCrit != Py_None )
                      This is the C equivalent of
                        >>> resultobject = obCallBack.AuthTrans(pbo, sno, rqo)
                     */
-                    resultobject = PyObject_CallMethod( obCallBack, "AuthTrans", "OOO",
+                    start = stats_clock();
+                    resultobject = PyObject_CallMethod( callback, "AuthTrans", "OOO",
                             (PyObject *)pbo, (PyObject *)sno, (PyObject *)rqo);
+                    spent = stats_clock() - start;
 
                     if (!resultobject) 
                     {
@@ -1515,43 +10669,45 @@ if ( obCrit != Py_None )
                     }
                     else
                     {
-                        /* Attempt to analyse the result as a string indicating which
-                         result to return */
-                        if (!PyString_Check(resultobject)) 
+                        /* The result is one of the REQ_* codes, or
+                           its name as a string */
+                        if ( ! req_result( resultobject, &result ) )
                         {
-                            nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "AuthTrans() returned non-string");
-                            Log("nsapy_AuthTrans: AuthTrans() result not string");
+                            nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "AuthTrans returned something other than a REQ_* code");
+                            Log("nsapy_AuthTrans: AuthTrans() result not a REQ_* code, defaults to REQ_ABORTED");
+                            result = REQ_ABORTED;
                         }
                         else
                         {
-                            resultstring = PyString_AS_STRING( (PyStringObject *) resultobject);
-                            if (strcmp(resultstring, "REQ_NOACTION")==0) 
-                            {
-                                Log("nsapy_AuthTrans: AuthTrans() returns REQ_NOACTION");
-                                result = REQ_NOACTION;
-                            }
-                            else if (strcmp(resultstring, "REQ_PROCEED")==0) 
-                            {
-                                Log("nsapy_AuthTrans: AuthTrans() returns REQ_PROCEED");
-                                result = REQ_PROCEED;
-                            }
-                            else if (strcmp(resultstring, "REQ_EXIT")==0) 
-							{
-                                Log("nsapy_AuthTrans: AuthTrans() returns REQ_EXIT");
-                                result = REQ_EXIT;
-                            }
-                            else
-							{
-                                result = REQ_ABORTED;
-							    sprintf( buff, "nsapy_AuthTrans: AuthTrans() returns %s, defaults to REQ_ABORTED", resultstring );
-								Log( buff );
-							}
+                            Log( "nsapy_AuthTrans: AuthTrans() returns %d", result );
                         }
                     }
                 }
             }
         }
     }
+  /* send whatever is still waiting in sn.out. If the handler failed,
+     drop it, and any headers held back with it, so that the server
+     sends its own error. Once some of the body is out, that can't be
+     ended properly either, and the connection has to go */
+  if ( sno && result == REQ_ABORTED )
+  {
+        out_finish( sno, 0 );
+        if ( rq->senthdrs )
+        {
+            nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "REQ_ABORTED after the response started, closing the connection");
+            result = REQ_EXIT;
+        }
+  }
+  else if ( sno && ! out_finish( sno, 1 ) )
+  {
+        PyErr_Clear();
+        nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "couldn't flush sn.out, client gone?");
+        result = REQ_EXIT;
+  }
+  if ( sno )
+        sent = sno->sent;
+
   if (result == REQ_ABORTED) 
   {
         nsapy_log_error(LOG_WARN, "nsapy_AuthTrans", sn, rq, "REQ_ABORTED");
@@ -1565,13 +10721,22 @@ if ( obCrit != Py_None )
   Py_XDECREF(rqo);
   Py_XDECREF(resultobject);
 
+  if ( entered && obCrit != Py_None )
+  {
+      Log( "nsapy_AuthTrans: exiting critical section %p", ( void * ) ( ( criticalobject * ) obCrit )->crit );
+  }
+
+  /* leave Python, the interpreter goes back to the pool */
+  interp_put( interp, entered );
+
 if ( obCrit != Py_None )
 {
-	sprintf( buff, "nsapy_AuthTrans: exiting critical section %d", ( int ) ( ( criticalobject * ) obCrit )->crit );
-	Log( buff );
 	crit_exit( ( ( criticalobject * ) obCrit )->crit );
 }
 
+  /* the "userdb" module did the work */
+  stats_record( STATS_AUTHTRANS, pblock_findval( "userdb", pb ), -1, result, spent, sent );
+
 	/* return the translated result (or default result) to the Server. */
   return result;
 }
@@ -42,12 +42,101 @@
   # (Note: on Solaris, it seemed like Netscape creates the file as root, then
   # switches to nobody and can't write to the file anymore. It is better to
   # use an existing file with correct permissions)
+  # Lines are written in the background by a thread of nsapi's own, so
+  # they show up in the file up to a tenth of a second late.
+  # Only info and above is logged unless you ask for more with
+  #  Init fn="nsapy_Init" ... loglevel="debug"
+  # ( or nsapi.log_level( "debug" ) at run time ), "warning" or "error"
+  # log less. Debug shows the goings on inside nsapy for every request.
   #
   # b. criticalonly to nsapy_Init() e.g.:
   #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" criticalonly="xxx"
   # "xxx" can be anything, the actual value is ignored. This makes Nsapy
   # enter a critical section for every call into the Python interpreter.
   # See (4) below for some more details.
+  #
+  # c. interpreters to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" interpreters="8"
+  # Instead of one interpreter, create a pool of 8 separate ones ( "auto"
+  # means one per processor ). module and initstring are run in every one
+  # of them, so each has its own modules and its own callback object. A
+  # request is given a free interpreter for the time it spends in Python,
+  # so a handler never has two requests running in its interpreter at the
+  # same time, yet up to 8 requests can be in progress at once. Keep in
+  # mind that module globals are NOT shared between the interpreters.
+  # Can not be used together with criticalonly.
+  #
+  # d. maxbody to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" maxbody="1048576"
+  # Refuse ( with a ValueError in the handler ) request bodies over 1M.
+  # A handler can change it for its request with sn.set_max_body(). 
+  # The default is no limit.
+  #
+  # e. outbuf to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" outbuf="16384"
+  # How many bytes sn.out ( see 2. below ) collects before writing them to
+  # the client, 8192 by default, 0 writes every piece as it comes.
+  #
+  # f. filecache to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" filecache="262144"
+  # sn.send_file() keeps a copy of files up to this size ( 64K by default )
+  # in memory between requests, 0 turns this off.
+  #
+  # g. reload to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" reload="2"
+  # Check the source of every handler module every 2 seconds, and load
+  # a fresh copy of the ones that changed. .pyd requests then no longer
+  # reload the module every time ( they still show errors ), so a
+  # staging server can run .pyd at full speed. Requests already running
+  # finish with the old module, a module that fails to load is logged
+  # and the old one kept.
+  #
+  # h. statsuri to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" statsuri="/nsapy-stats"
+  # A request for exactly this URI gets the statistics ( see 5. below )
+  # as a text table, or as JSON if the query string or the Accept header
+  # says "json". It is answered without Python, but it still has to be
+  # sent to nsapy_Service, e.g. with a Service line for its path. There
+  # is no such page by default, and you may want to keep it internal.
+  #
+  # i. maxfields and maxfieldsize to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" maxfields="200"
+  # sn.parse_form() and nsapy.parse_qs() ( see 2. below ) refuse, with a
+  # ValueError, forms with more than this many fields ( 1000 by default )
+  # or a name or value longer than maxfieldsize ( 1M by default ). 0 
+  # means no limit.
+  #
+  # j. spool to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" spool="16384"
+  # Parts of a multipart form ( see sn.parse_multipart() in 2. below ) 
+  # bigger than this many bytes ( 64K by default ) are written to a 
+  # temporary file as they are read, rather than kept in memory. 0 puts
+  # every part in a file.
+  #
+  # k. compress and compressmin to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" compress="6"
+  # Compress responses with zlib at this level ( 1 fastest to 9 smallest,
+  # 0, the default, is off ) for clients that send Accept-Encoding: gzip 
+  # or deflate. Only text/*, JSON, JavaScript and XML are compressed,
+  # and not a whole response smaller than compressmin ( 1024 bytes by 
+  # default ). See sn.out in 2. below.
+  #
+  # l. cache to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" cache="16777216"
+  # Keep up to this many bytes of responses that handlers ask to have
+  # kept with sn.out.cache() ( see 2. below ), and answer requests for 
+  # them without calling Python. 0, the default, is off.
+  #
+  # m. tasks and taskqueue to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" tasks="4"
+  # Start this many threads to run background tasks ( see 6. below ),
+  # 0, the default, is none. taskqueue is how many tasks may wait for
+  # them ( 1000 by default ).
+  #
+  # n. processes to nsapy_Init() e.g.:
+  #  Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" processes="4"
+  # Run Python in this many worker processes instead of in the server
+  # ( see 7. below ), UNIX only. 0, the default, is in the server.
 
   # ask the server to call our function to process PYthon files
   # put this inside <Object name=default> ( or some other object )
@@ -146,8 +235,36 @@
 	      self.redirect = "http://www.python.org"
 	      return "<HTML>Your browser doesn't understand redirects!'</HTML>"
 
+  A new RequestHandler is made for every request. If yours has expensive
+  setup ( compiled regular expressions, a parser, a database connection ),
+  make it persistent: every server thread then makes one instance and 
+  keeps it, and instead of __init__, reset( pb, sn, rq ) is called before
+  each request after the first:
+
+      class RequestHandler( nsapy.RequestHandler ):
+	  persistent = 1
+
+	  def __init__( self, pb, sn, rq ):
+	      self.db = connect( "reports" )
+	      nsapy.RequestHandler.__init__( self, pb, sn, rq )
+
+	  def reset( self, pb, sn, rq ):
+	      nsapy.RequestHandler.reset( self, pb, sn, rq )
+	      self.rows = []
+
   Here is how to get form data ( doesn't matter POST or GET ):
 
+	fd = self.sn.parse_form()
+
+  This gives the same dictionary of lists as cgi.parse_qs, with the
+  fields of the query string and of a urlencoded body together, but 
+  it's done in C and the body is parsed as it's read, never as a whole
+  string. sn.parse_form( 1 ) keeps fields with blank values. A body 
+  of another type ( e.g. multipart/form-data ) is left alone. For a 
+  string you already have, there is nsapy.parse_qs( string [, keep_blank ] ).
+
+  The old way still works, only slower:
+
        --snip--
 	method = self.rq.reqpb.findval('method')
 
@@ -159,6 +276,123 @@
 		fd = cgi.parse_qs(self.rq.reqpb.findval('query'))
        --snip-- 
 
+  A form with a file upload in it ( enctype="multipart/form-data" ) is
+  read with sn.parse_multipart( [ spool ] ). It gives a dictionary of 
+  lists too, but of parts, which are read like files: read( [n] ), 
+  readline(), seek(), tell() and close(), plus name, filename ( None if
+  it isn't a file ), type, headers ( a dictionary with lower case names ),
+  size and value ( the whole content as a string ). Parts bigger than 
+  spool bytes ( see j. above ) are in temporary files, which go away 
+  with the part, so an upload of any size takes little memory. 
+  part.save( path ) copies one to a file without reading it into Python:
+
+       --snip--
+	fd = self.sn.parse_multipart()
+	title = fd[ "title" ][0].value
+	for part in fd.get( "upload", [] ):
+	    if part.filename:
+		part.save( "/var/uploads/" + os.path.basename( part.filename ) )
+       --snip-- 
+
+  pblocks ( pb, sn.client(), rq.reqpb, rq.headers, rq.srvhdrs, rq.vars )
+  work like dictionaries of strings: pb[ name ], pb.get( name, default ),
+  name in pb, len( pb ), for name in pb, keys(), values() and items(),
+  pb[ name ] = value ( which replaces, unlike nvinsert ) and del pb[ name ].
+  pb.to_dict() makes a real dictionary of it. There is no need to take
+  pblock2str() apart:
+
+	for name, value in self.rq.headers.items():
+	    ...
+
+  To look at request headers, rq.header_map is quicker than asking
+  rq.request_header( name, sn ) every time. It is a read-only
+  dictionary of them, filled once the first time it's used, that 
+  doesn't care about case:
+
+	ae = self.rq.header_map.get( "Accept-Encoding", "" )
+	if self.rq.header_map.has_key( "cookie" ):
+	    ...
+
+  A big body ( e.g. an upload ) doesn't have to be read in one piece. 
+  sn.read( [n] ) and sn.readinto( buffer ) read as much as you ask for,
+  sn.chunks( [size] ) loops over the whole thing and sn.remaining() says
+  how much is left ( None if there is no content-length ):
+
+       --snip--
+	out = open( '/tmp/upload', 'wb' )
+	for chunk in self.sn.chunks( 65536 ):
+	    out.write( chunk )
+       --snip-- 
+
+  None of these read past content-length, so they can be mixed with 
+  form_data.
+
+  sn.net_write() sends to the client right away, which is wasteful when
+  a response is put together from many small pieces. sn.out.write() 
+  collects them and sends them together once sn.out.threshold bytes are
+  waiting, on sn.out.flush(), and at the end of the request ( Send() 
+  uses it ). sn.out.set_threshold( n ) changes the threshold for this
+  request. Anything written with sn.net_write() goes after what sn.out
+  has collected so far.
+
+  With compress ( see k. above ) on, a response that may be compressed
+  doesn't start at rq.start_response() but when the first of its body
+  goes out, and the body goes through zlib on its way ( sn.net_write()
+  and sn.send_file() in the middle of it too ), with Content-Encoding
+  set and Content-Length taken out. sn.out.flush() still gets everything
+  so far to the client. sn.out.set_compress( level ) changes the level
+  for this response before it starts, 0 turns compression off ( e.g. for
+  content that is compressed already ), and sn.out.compress is the level.
+
+  So the server can keep the connection open for the client's next
+  request, a response without Content-Length doesn't start right away
+  either. If all of its body is in sn.out by the end of the request,
+  it goes with a Content-Length; if not ( or if it's compressed ), an
+  HTTP/1.1 client gets it with Transfer-Encoding: chunked, each write
+  a chunk. Send() sets Content-Length itself, it has the whole body.
+
+  With cache ( see l. above ) on, sn.out.cache( seconds ) before the body
+  is written keeps the response for that long, and the same request 
+  ( Host, URI, query string and the request headers named in Vary ) is 
+  answered from memory meanwhile, Python isn't called at all. Only a 
+  GET answered with 200, without Set-Cookie and written all through 
+  sn.out ( or sn.net_write() ) is kept, not one that used sn.send_file().
+  A RequestHandler sets cache_ttl instead, 0 by default. 
+  nsapy.cache_clear( [uri] ) forgets one URI's responses ( on every
+  virtual server ), or all of them,
+  and nsapy.cache_info() counts entries, bytes, hits and so on.
+
+  A response with an ETag or a Last-Modified header gets a 304, with no
+  body, when it starts if the client's If-None-Match or If-Modified-Since
+  says it has it already ( rq.start_response() then raises 
+  KeyboardInterrupt, as for a HEAD ). sn.validate( [etag [, mtime]] ) 
+  sets them ( mtime is seconds since 1970, as from os.stat() ) and 
+  returns 1 if the client has the response, so it needn't be made:
+
+       --snip--
+	if self.sn.validate( str( row.version ) ):
+	    self.rq.start_response( self.sn )       # sends the 304
+       --snip--
+
+  sn.out.set_etag( 1 ) instead hashes the body into an ETag, as long as
+  all of it fits in sn.out ( see set_threshold ). A RequestHandler sets
+  etag = 1 for that, or overrides Validator() and LastModified(), and 
+  with head_safe = 1 doesn't call Content() for a HEAD.
+
+  To send a file ( or a piece of one ), don't read it into Python, use
+  sn.send_file( path [, offset [, length ]] ). If the response hasn't
+  been started yet, it sets content-length and starts it:
+
+	self.rq.srvhdrs.nvinsert( "content-type", "application/pdf" )
+	self.sn.send_file( "/reports/monthly.pdf" )
+	return nsapy.REQ_PROCEED
+
+  Small files are kept in memory between requests, and sent again as
+  long as the file's size, inode and mtime haven't changed. A file that
+  is replaced ( a new one written and renamed ) is safe to send at any
+  time; one rewritten in place while it is being sent makes send_file
+  raise IOError, and the client gets a short response.
+
   Raise SERVER_RETURN with a pair (return_code, status) at any point.  
   If status is not None it will serve as the protocol_status, the return_code 
   will be used as the return code returned to the server-interface:
@@ -169,6 +403,12 @@
   or to simply give up (eg, if the response already started):
       raise SERVER_RETURN, (REQ_ABORTED, None)
 
+  rq.protocol_status() takes any HTTP status code, with an optional
+  reason phrase:
+
+      self.rq.protocol_status( self.sn, 201 )
+      self.rq.protocol_status( self.sn, 429, "Slow Down" )
+
 
   3. When the server wants to do authentication, ( see nsapimod.c )
   the AuthTrans function of the callback object is called.
@@ -198,7 +438,14 @@
 	     else:
 		 return nsapy.REQ_NOACTION
 
-  4. Nsapy provides an interface to NSAPI critical-section processing.
+  4. Requests are served by many server threads at once, and each
+  thread gets its own Python thread state. Python only runs one thread
+  at a time, but whenever a thread waits on the server ( net_write to 
+  a slow client, sn.out, sn.send_file, form_data, sn.read and friends,
+  session_dns, crit_enter, lock waits, start_response ) it lets the others run. So, unless criticalonly is used, handler code
+  must not assume it is alone.
+
+  Nsapy provides an interface to NSAPI critical-section processing.
   Look at http://developer.netscape.com/support/faqs/champions/nsapi.html#q16
   for more information.
 
@@ -228,6 +475,92 @@
             nsapy.crit_exit( nsapy.CRITICAL )
         time.sleep( 2600 )  
 
+  For what is read far more often than it is changed ( settings, a
+  table kept in memory ), nsapy.lock() is a lock readers can share:
+
+	settings_lock = nsapy.lock( "settings" )
+	...
+	with settings_lock.shared:
+	    value = settings[ key ]
+	...
+	with settings_lock:
+	    settings[ key ] = value
+
+  Any number of threads can hold lk.shared at once, but lk itself only
+  one, and only while nobody holds lk.shared. Writers that are waiting
+  go before readers that come later, but not before a thread that
+  holds lk.shared already and enters it again. A thread holding lk 
+  that enters lk or lk.shared, or holding lk.shared that enters lk, 
+  would wait for itself for ever, so that's a ValueError instead.
+  lk.enter() and lk.exit() do what "with" does; lk.try_enter( 
+  [ seconds ] ) waits no more than seconds ( none by default ) and 
+  returns 0 if it didn't get the lock. Waiting lets other threads run.
+  Only the thread that entered a lock can exit it, anything else is a
+  ValueError. A lock with a name is the same lock for everybody who 
+  asks for that name, in any module and any interpreter ( but each of
+  the processes, see 7. below, has its own ).
+  lk.stats(), and nsapy.lock_stats() for all the named ones, count the
+  enters, the ones that had to wait and the ones that gave up, the most
+  readers at once, and how long the waits were, in microseconds.
+
+  5. nsapy counts, for every handler module ( and every "userdb" module
+  in AuthTrans ), requests, the REQ_* codes they ended with, the response
+  bytes sent, and the time spent in Python, as a histogram precise to
+  about 6%. Every server thread counts on its own, so this costs next
+  to nothing. nsapy.stats() adds the threads up:
+
+	>>> s = nsapy.stats()
+	>>> s[ "Service" ][ "handlers" ][ "myscript" ][ "usec" ][ "p99" ]
+	2047
+	>>> s[ "Service" ][ "total" ][ "aborted" ]
+	0
+
+  The times are in microseconds; "usec" has min, mean, p50, p90, p99, 
+  p999 and max. nsapy.stats( 1 ) adds the histogram itself, as a list
+  of ( up to usec, requests ). The counters only go up, take the 
+  difference of two calls for a rate. See also statsuri above.
+
+  6. Work the client needn't wait for ( an audit record, warming a 
+  cache, telling others ) can be left to background tasks, see m. 
+  above:
+
+       --snip--
+	def Content( self ):
+	    ...
+	    self.sn.defer( audit.record, ( user, action ) )
+	    return page
+       --snip--
+
+  sn.defer( func [, args [, wait ]] ) calls func( *args ) in a task 
+  thread once the request is over and the response is out, 
+  nsapi.defer() the same but right away. The task runs in the same
+  interpreter ( and with criticalonly, the same critical section ) as
+  the handler did, its exceptions go to the log. When taskqueue tasks
+  are waiting already, defer waits up to wait seconds ( none by default,
+  a negative wait for as long as it takes ) for room, then raises
+  IOError; do the work there and then, or drop it.
+  Tasks are counted in nsapy.stats() under "Task", by function name,
+  and nsapy.task_stats() has the queue's depth, the deepest it's been,
+  the tasks refused and how long they waited, in microseconds.
+
+  7. With processes ( see n. above ), the server doesn't run Python at
+  all. nsapy_Init starts a supervisor process, which starts the
+  workers, and each of them imports module and runs initstring just as
+  the server would have, with its own interpreters, tasks, log and 
+  nsapy.stats(). Every request goes to a free worker, with copies of
+  its pblocks; starting the response, writing it and reading the body
+  are done by the server thread on the worker's behalf, through memory
+  the two share, so handlers don't know the difference. A worker that
+  crashes fails the request it had, and the supervisor starts a new
+  one ( no more than one a second for each worker ). The statsuri page
+  counts the requests of all of them.
+
+  A handler can't share anything with the other workers but files and
+  the like, each worker only ever has one request at a time, and every
+  byte of the response is copied once more, so this is for handlers
+  and extension modules that aren't safe or stable enough to run in
+  the server itself.
+
   That's basically it...
 
 """
@@ -236,24 +569,52 @@ import sys
 import string
 import traceback
 import time
+import os
+import imp
+import thread
+import nsapi
 
 SERVER_RETURN = "SERVER_RETURN"
 
-REQ_PROCEED = "REQ_PROCEED"   
-REQ_ABORTED = "REQ_ABORTED"   
-REQ_NOACTION = "REQ_NOACTION" 
-REQ_EXIT = "REQ_EXIT"         
-
-# Response status codes for use with rq.protocol_status(sn, *)
-PROTOCOL_OK = "PROTOCOL_OK" 
-PROTOCOL_REDIRECT = "PROTOCOL_REDIRECT" 
-PROTOCOL_NOT_MODIFIED = "PROTOCOL_NOT_MODIFIED" 
-PROTOCOL_BAD_REQUEST = "PROTOCOL_BAD_REQUEST" 
-PROTOCOL_UNAUTHORIZED = "PROTOCOL_UNAUTHORIZED" 
-PROTOCOL_FORBIDDEN = "PROTOCOL_FORBIDDEN" 
-PROTOCOL_NOT_FOUND = "PROTOCOL_NOT_FOUND" 
-PROTOCOL_SERVER_ERROR = "PROTOCOL_SERVER_ERROR" 
-PROTOCOL_NOT_IMPLEMENTED = "PROTOCOL_NOT_IMPLEMENTED" 
+# Result codes, these are the server's own numbers. ( The names, 
+# e.g. "REQ_PROCEED", are still understood, as they used to be the
+# values )
+REQ_PROCEED = nsapi.REQ_PROCEED
+REQ_ABORTED = nsapi.REQ_ABORTED
+REQ_NOACTION = nsapi.REQ_NOACTION
+REQ_EXIT = nsapi.REQ_EXIT
+
+# Response status codes for use with rq.protocol_status(sn, *), which
+# will just as well take any other HTTP status code, e.g. 201 or 503.
+PROTOCOL_OK = nsapi.PROTOCOL_OK
+PROTOCOL_NO_RESPONSE = nsapi.PROTOCOL_NO_RESPONSE
+PROTOCOL_REDIRECT = nsapi.PROTOCOL_REDIRECT
+PROTOCOL_NOT_MODIFIED = nsapi.PROTOCOL_NOT_MODIFIED
+PROTOCOL_BAD_REQUEST = nsapi.PROTOCOL_BAD_REQUEST
+PROTOCOL_UNAUTHORIZED = nsapi.PROTOCOL_UNAUTHORIZED
+PROTOCOL_FORBIDDEN = nsapi.PROTOCOL_FORBIDDEN
+PROTOCOL_NOT_FOUND = nsapi.PROTOCOL_NOT_FOUND
+PROTOCOL_PROXY_UNAUTHORIZED = nsapi.PROTOCOL_PROXY_UNAUTHORIZED
+PROTOCOL_SERVER_ERROR = nsapi.PROTOCOL_SERVER_ERROR
+PROTOCOL_NOT_IMPLEMENTED = nsapi.PROTOCOL_NOT_IMPLEMENTED
+
+# request counters and latencies, see 5. above
+stats = nsapi.stats
+
+# cgi.parse_qs, only quicker
+parse_qs = nsapi.parse_qs
+
+# the response cache, see sn.out.cache() in 2. above
+cache_info = nsapi.cache_info
+cache_clear = nsapi.cache_clear
+
+# background tasks, see 6. above
+defer = nsapi.defer
+task_stats = nsapi.task_stats
+
+# locks readers can share, see 4. above
+lock = nsapi.lock
+lock_stats = nsapi.lock_stats
 
 
 class nsCallBack:
@@ -267,26 +628,52 @@ class nsCallBack:
 	if self.debug is not 0, the Python error
 	output will be sent to the browser - very
 	useful for debugging.
+
+	NOTE: one callback object serves all the 
+	threads, so nothing about a request may be 
+	kept in self. pb, sn and rq are passed along
+	instead.
 	"""
 
 	# don't change this here
 	self.debug = 0
 
+	# with "reload" in nsapy_Init, modules are reloaded when
+	# they change ( see check_changes ), self.seen is the last
+	# nsapi.changes() generation we have seen
+	self.reload = nsapi.RELOAD
+	self.seen = 0
+	self.watched = {}
+
+	# persistent handlers, by ( thread, class ), see make_handler
+	self.instances = {}
 
-    def Service(self, pb, sn, rq):
+
+    def Service(self, pb, sn, rq, Class=None):
 	""" 
 	This method is envoked by nsapi module for
 	each request. The return value is one of the
 	REQ constants above. REQ_PROCEED means OK.
-	"""
 
-	(self.pb, self.sn, self.rq) = (pb, sn, rq)
+	Class is the RequestHandler class for this URI, 
+	if get_request_handler() has found it before.
+	"""
 
 	# be pessimistic
 	result = REQ_ABORTED
 
+	debug = self.is_debug( rq )
+
+	# the cached class may be from a module about to be swapped
+	if self.reload and self.check_changes():
+	    Class = None
+
+	handler = None
 	try:
-	    handler = self.get_request_handler()
+	    if Class:
+		handler = self.make_handler( Class, pb, sn, rq )
+	    else:
+		handler = self.get_request_handler( pb, sn, rq, debug )
 	    result = handler.Handle()
 
 	except SERVER_RETURN, value:
@@ -307,11 +694,14 @@ class nsCallBack:
 
 	except:
 	    # Any other rerror
-	    if self.debug :
-		result = self.ReportError(sys.exc_type, sys.exc_value, sys.exc_traceback)
+	    if debug :
+		etype, evalue, etb = sys.exc_info()
+		result = self.ReportError(sn, rq, etype, evalue, etb)
 	    else:
 		result = REQ_ABORTED
 
+	self.release_handler( handler )
+
 	# lest we waste memory, always clear traceback
 	sys.last_traceback = None
 
@@ -333,36 +723,43 @@ class nsCallBack:
 
 	"""
 
-	(self.pb, self.sn, self.rq) = (pb, sn, rq)
-
 	# be pessimistic
 	result = REQ_ABORTED
 
 	# get URI
 	try:
-	    module_name = self.pb.findval( "userdb" )
+	    module_name = pb.findval( "userdb" )
 	except:
 	    raise ValueError, "Failed to locate auth module name"
 
 	# debugging?
 	if module_name[-5:] == 'DEBUG':
-	    self.debug = 1
+	    debug = 1
 	    module_name = module_name[:-5]
 	else:
-	    self.debug = 0
+	    debug = self.debug
+
+	if self.reload:
+	    self.check_changes()
 
 	# try to import the module
+	handler = None
 	try:
 	    module = __import__(module_name)
-	    # if module extension ends with DEBUG reload it
-	    if self.debug :
+	    # if module extension ends with DEBUG reload it, unless
+	    # modules get reloaded when they change
+	    if self.reload:
+		self.watch_module( module )
+	    elif debug :
 		module = reload( module )
 	    # get the Handler class
-	    handler = module.AuthHandler( self.pb, self.sn, self.rq )
+	    handler = self.make_handler( module.AuthHandler, pb, sn, rq )
 	    result = handler.Handle()
 	except:
 	    pass
 
+	self.release_handler( handler )
+
 	# lest we waste memory, always clear traceback
 	sys.last_traceback = None
 
@@ -373,34 +770,42 @@ class nsCallBack:
         log( str )
 
 
-    def get_request_handler( self ):
+    def is_debug( self, rq ):
+	""" 
+	Depending on the last letter of the extension
+	debugging is on or off:
+	   .pyd   -   debugging ON
+	   .pye   -   debugging OFF
+	"""
+
+	try:
+	    uri = rq.reqpb.findval( "uri" )
+	except:
+	    return self.debug
+
+	return self.debug or uri[-1:] == 'd'
+
+    def get_request_handler( self, pb, sn, rq, debug ):
 	""" 
 	Get the module and the object to handle the request. 
 	This function is called by Service(). The module is 
 	extracted from the URI.
 
-	Depending on the last letter of the extension
-	self.debug is set:
-	   .pyd   -   debugging ON
-	   .pye   -   debugging OFF
-	   
-	When envoked with .pyd, the module is *reloaded*
-	for every request, otherwise, it follows normal
-	Python behaviour  - "import" loads a module only once.
+	When envoked with .pyd ( debug is true ), the module 
+	is *reloaded* for every request, otherwise, it follows 
+	normal Python behaviour  - "import" loads a module only once,
+	and the class is handed to nsapi.cache_handler() so that the
+	next request for this URI doesn't have to come here at all.
+	With "reload" in nsapy_Init, the module is reloaded only
+	when its source changes, .pyd or not.
 	"""
 
 	# get URI
 	try:
-	    uri = self.rq.reqpb.findval( "uri" )
+	    uri = rq.reqpb.findval( "uri" )
 	except:
 	    raise ValueError, "Failed to locate URI in rq.reqpb"
 
-	# debugging?
-	if uri[-1:] == 'd' :
-	    self.debug = 1
-	else:
-	    self.debug = 0
-
 	# find the module name by getting the string between the
 	# last slash and the last dot.
 
@@ -412,34 +817,136 @@ class nsCallBack:
 
 	try:
 	    module = __import__(module_name)
-	    # if module extension ends with a d reload it
-	    if self.debug :
+	    # if module extension ends with a d reload it, unless
+	    # modules get reloaded when they change
+	    if self.reload:
+		self.watch_module( module )
+	    elif debug :
 		module = reload( module )
+		# the cached classes, and the persistent instances
+		# of them, may be from the old module
+		nsapi.clear_handlers()
+		self.instances = {}
 	    # get the Handler class
 	    Class = module.RequestHandler
 
 	except (ImportError, AttributeError, SyntaxError):
-	    if self.debug :
+	    if debug :
 		# pass it on
-		raise sys.exc_type, sys.exc_value
+		raise
 	    else:
 		# show and HTTP error
 		raise SERVER_RETURN, (REQ_ABORTED, PROTOCOL_FORBIDDEN)
 
-	# construct and return an instance of the handler class
-	result = Class( self.pb, self.sn, self.rq )
+	# ( unless check_changes() swapped the module meanwhile )
+	if ( self.reload or not debug ) and \
+	   sys.modules.get( module_name ) is module:
+	    nsapi.cache_handler( uri, Class )
+
+	# construct ( or reuse ) and return an instance of the handler class
+	result = self.make_handler( Class, pb, sn, rq )
 
 	return result
 
-    def ReportError(self, etype, evalue, etb):
+    def make_handler( self, Class, pb, sn, rq ):
+	"""
+	Make an instance of Class for this request. If Class is
+	persistent, every thread makes one the first time and 
+	after that calls its reset() before each request.
+	"""
+
+	if not getattr( Class, 'persistent', 0 ):
+	    return Class( pb, sn, rq )
+
+	# a thread serves one request at a time, so it can't
+	# be using its instance already
+	key = ( thread.get_ident(), Class )
+	handler = self.instances.get( key )
+	if handler is None:
+	    handler = Class( pb, sn, rq )
+	    self.instances[ key ] = handler
+	else:
+	    handler.reset( pb, sn, rq )
+
+	return handler
+
+    def release_handler( self, handler ):
+	"""
+	The request is over, a persistent handler stays, but mustn't 
+	hang on to its pb, sn and rq.
+	"""
+
+	if handler is not None and getattr( handler, 'persistent', 0 ):
+	    handler.pb = handler.sn = handler.rq = None
+
+    def check_changes( self ):
+	"""
+	Swap in a fresh copy of every watched module that changed
+	since we last looked. Returns the number of modules swapped.
+	"""
+
+	gen, names = nsapi.changes( self.seen )
+	self.seen = gen
+
+	for name in names:
+	    self.swap_module( name )
+
+	if names:
+	    # the cached classes are from the old modules
+	    nsapi.clear_handlers()
+	    self.instances = {}
+
+	return len( names )
+
+    def swap_module( self, name ):
+	"""
+	Load module name anew from its source and put it in 
+	sys.modules in place of the old one. Unlike reload(), this
+	doesn't touch the old module, so requests still running in
+	it aren't disturbed, and if the new source is broken, the 
+	old module stays.
+	"""
+
+	old = sys.modules.get( name )
+	path = old and source_file( old )
+	if not path:
+	    return
+
+	try:
+	    code = compile( open( path ).read() + '\n', path, 'exec' )
+	    module = imp.new_module( name )
+	    module.__file__ = path
+	    exec code in module.__dict__
+	except:
+	    etype, evalue = sys.exc_info()[:2]
+	    log( 'reloading %s failed: %s: %s' % ( name, etype, evalue ), 'warning:' )
+	    return
+
+	# this is the swap
+	sys.modules[ name ] = module
+	log( 'reloaded %s' % name )
+
+    def watch_module( self, module ):
+	"""
+	Ask nsapi to tell us ( see check_changes ) when the 
+	module's source changes.
+	"""
+
+	name = module.__name__
+	if not self.watched.has_key( name ):
+	    self.watched[ name ] = 1
+	    path = source_file( module )
+	    if path:
+		nsapi.watch( name, path )
+
+    def ReportError(self, sn, rq, etype, evalue, etb):
 	""" 
 	This function is only used when debugging is on.
 	It sends the output similar to what you'd see
 	when using Python interactively to the browser
 	"""
-	(sn, rq) = (self.sn, self.rq)
 
-	srvhdrs = self.rq.srvhdrs
+	srvhdrs = rq.srvhdrs
 
 	# replace magnus-internal/X-python-e with text/html
 	srvhdrs.pblock_remove("content-type")
@@ -455,18 +962,31 @@ class nsCallBack:
 
 	sn.net_write( text )
 
-	return "REQ_PROCEED"
+	return REQ_PROCEED
+
+def source_file( module ):
+    """
+    The .py a module was loaded from, None if there isn't one
+    """
+
+    path = getattr( module, '__file__', None )
+    if not path:
+	return None
+    if path[-4:] in ( '.pyc', '.pyo' ):
+	path = path[:-1]
+    if path[-3:] != '.py' or not os.path.exists( path ):
+	return None
+
+    return path
 
 def log( s, kind='info:' ):
     """
-    This adds a timestamp and writes to the log file
+    This writes to the log file, kind is one of 'debug:', 
+    'info:', 'warning:' or 'error:'. nsapi adds the time stamp
+    and writes the line out in the background.
     """
 
-    if logfile:
-        t = time.strftime( '[%d/%b/%Y:%H:%M:%S]', time.localtime( time.time() ) )
-        f = open( logfile, 'a' )
-        f.write( '%s %s %s\n' % ( t, kind, str( s ) ) )
-        f.close()
+    nsapi.log( kind[:-1], str( s ) )
 
 def init( logname=None ):
     """ 
@@ -476,14 +996,12 @@ def init( logname=None ):
         logfile.
     """
 
-    global logfile
-    logfile = logname
+    if logname:
+	nsapi.log_open( logname )
 
     # create a callback object
     obCallBack = nsCallBack( )
 
-    import nsapi
-
     # "give it back" to nsapi
     nsapi.SetCallBack( obCallBack )
 
@@ -498,17 +1016,79 @@ class RequestHandler:
     in other modules, for use with this module.
     """
 
+    # set this to 1 in a subclass to keep one instance per
+    # server thread ( see reset )
+    persistent = 0
+
+    # seconds to keep the response for, with cache set ( see 
+    # sn.out.cache ), 0 for not at all
+    cache_ttl = 0
+
+    # 1 to give the response an ETag hashed from its body ( see
+    # sn.out.set_etag ), and 1 if a HEAD can do without Content()
+    etag = 0
+    head_safe = 0
+
     def __init__( self, pb, sn, rq ):
+	self.reset( pb, sn, rq )
+
+    def reset( self, pb, sn, rq ):
+	"""
+	Get ready for a request. __init__ calls this, and for a
+	persistent handler it is called again before every request
+	that reuses the instance. Override it ( calling this one ) to 
+	clear your own per-request state.
+	"""
 	( self.pb, self.sn, self.rq ) = ( pb, sn, rq )
 	# default content-type
 	self.content_type = 'text/html'
 	# no redirect
 	self.redirect = ''
+	# as the class says, unless Content() says otherwise
+	self.cache_ttl = self.__class__.cache_ttl
+	self.etag = self.__class__.etag
 	
     def Send( self, content ):
 
+	if self.cache_ttl and not self.redirect:
+	    self.sn.out.cache( self.cache_ttl )
+	content = str( content )
+	if self.etag:
+	    # the whole body has to be in sn.out to be hashed
+	    if len( content ) >= self.sn.out.threshold:
+		self.sn.out.set_threshold( len( content ) + 1 )
+	    self.sn.out.set_etag( 1 )
+	# all of the body is here, so the client can be told how long it
+	# is and keep the connection ( unless it's compressed, see sn.out )
+	if content or self.rq.reqpb.findval( "method" ) != "HEAD":
+	    if not self.rq.srvhdrs.has_key( "content-length" ):
+		self.rq.srvhdrs.nvinsert( "content-length", str( len( content ) ) )
 	self.rq.start_response( self.sn )
-	self.sn.net_write( str( content ) )
+	self.sn.out.write( content )
+
+    def Validator( self ):
+	"""
+	Return the ETag of the response, if you can tell it without
+	making it ( a version number, say ), or None. A client that
+	has it then gets a 304 without Content() being called.
+	"""
+	return None
+
+    def LastModified( self ):
+	"""
+	The same, for the time ( seconds since 1970 ) the response
+	last changed.
+	"""
+	return None
+
+    def Current( self ):
+	"""
+	Does the client have the response already? See Validator().
+	"""
+	etag, mtime = self.Validator(), self.LastModified()
+	if etag is None and mtime is None:
+	    return 0
+	return self.sn.validate( etag, mtime )
 
     def Header( self ):
 	""" 
@@ -545,15 +1125,24 @@ class RequestHandler:
 	overriding Content() first, it may be all you need.
 	"""
 	try:
-	    content = self.Content()
+	    if self.Current() or ( self.head_safe and 
+		    self.rq.reqpb.findval( "method" ) == "HEAD" ):
+		# start_response() will send all there is to send
+		content = ''
+		self.etag = 0
+	    else:
+		content = self.Content()
 	    self.Header()
 	    self.Status()
 	    self.Send( content )
+	except KeyboardInterrupt:
+	    # the server wants no body ( a HEAD, a 304 ), fine
+	    raise
 	except:
 	    # debugging ?
 	    uri = self.rq.reqpb.findval("uri")
 	    if uri[-1:] == 'd':
-		raise sys.exc_type, sys.exc_value
+		raise
 	    return REQ_ABORTED
 	
 	return REQ_PROCEED
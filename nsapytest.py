@@ -15,7 +15,6 @@ Minimally, all you need is:
 """
 
 import nsapy
-import string
 
 class RequestHandler( nsapy.RequestHandler ):
 
@@ -72,9 +71,8 @@ class RequestHandler( nsapy.RequestHandler ):
 # convert a block to an HTML table
 def pblock_table( pblock ):
     s = '\n<table border=1 cellpadding=3>\n'
-    l = string.split( pblock.pblock2str(), '"' )
-    for n in range( 1, len( l ), 2 ):
+    for name, value in pblock.items():
 	s = s + '<tr><td align=center>%s</td><td align=center>%s</td></tr>\n' \
-		% ( l[n-1][:-1], l[n] )
+		% ( name, value )
     s = s + '\n</table>\n'
     return s
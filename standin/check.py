@@ -0,0 +1,249 @@
+# check.py - regression checks for the form, multipart and chunked paths
+#
+# Runs ./loadtest once per case against the chk*.py handlers in this
+# directory and looks at the response it dumps with -o. Needs the
+# loadtest built, run it with
+#
+#	make check
+#
+# Prints a line per failed case and exits 1 if there were any.
+
+import os, re, string, sys, tempfile
+
+LOADTEST = "./loadtest"
+
+# FORM_BLOCK and FORM_BLOCK + MP_HEADERS in nsapimod.c, and the
+# 8192 byte netbuf loadtest reads through: the places a field, an
+# escape, a boundary or the headers of a part can be cut in two
+EDGES = ( 8192, 16384, 24576 )
+
+tmp = tempfile.mkdtemp()
+failed = 0
+cases = 0
+
+def fail( case, why ):
+    global failed
+    failed = failed + 1
+    print "FAIL %s: %s" % ( case, why )
+
+def run( uri, body=None, ctype=None, query=None, protocol=None, xargs=None ):
+    """ one request, gives ( status line, headers, body as the client saw it ) """
+    global cases
+    cases = cases + 1
+    args = [ LOADTEST, "-t", "1", "-n", "1", "-o", "-u", uri ]
+    if body is not None:
+        name = os.path.join( tmp, "body" )
+        f = open( name, "wb" )
+        f.write( body )
+        f.close()
+        args = args + [ "-m", "POST", "-f", name ]
+    if ctype:
+        args = args + [ "-H", "content-type=" + ctype ]
+    if xargs:
+        args = args + [ "-H", "x-args=" + xargs ]
+    if query is not None:
+        args = args + [ "-q", query ]
+    if protocol:
+        args = args + [ "-p", protocol ]
+    p = os.popen( string.join( map( quote, args ) ) + " 2>&1", "r" )
+    out = p.read()
+    p.close()
+
+    i = string.find( out, "HTTP/1." )
+    j = string.rfind( out, "\n-- " )
+    if i < 0 or j < i:
+        return None, {}, out
+    head, body = string.split( out[i:j], "\r\n\r\n", 1 )
+    lines = string.split( head, "\r\n" )
+    hdrs = {}
+    for name, value in re.findall( r'([a-z-]+)="([^"]*)"', lines[1] ):
+        hdrs[name] = value
+    return lines[0], hdrs, body
+
+def quote( s ):
+    return "'" + string.replace( s, "'", "'\\''" ) + "'"
+
+def dechunk( body ):
+    """ the body a chunked response carries, None if the framing is off """
+    out = []
+    p = 0
+    while 1:
+        e = string.find( body, "\r\n", p )
+        if e < 0:
+            return None
+        try:
+            size = string.atoi( body[p:e], 16 )
+        except ValueError:
+            return None
+        p = e + 2
+        if size == 0:
+            if body[p:] != "\r\n":
+                return None
+            return string.join( out, "" )
+        if size < 0 or body[p + size:p + size + 2] != "\r\n":
+            return None
+        out.append( body[p:p + size] )
+        p = p + size + 2
+
+def content( case, status, hdrs, body ):
+    """ the body of a plain response, checked against its content-length """
+    if not status:
+        fail( case, "no response: %s" % repr( body[-200:] ) )
+        return None
+    if hdrs.has_key( "content-length" ) and string.atoi( hdrs["content-length"] ) != len( body ):
+        fail( case, "content-length %s, body %d" % ( hdrs["content-length"], len( body ) ) )
+        return None
+    return body
+
+def expect( case, got, want ):
+    if got is not None and got != want:
+        fail( case, "got %s, want %s" % ( repr( got[:300] ), repr( want[:300] ) ) )
+
+# -- urlencoded --------------------------------------------------------------
+
+URLENCODED = "application/x-www-form-urlencoded"
+
+def form( case, body, want, xargs=None, query=None ):
+    st, h, b = run( "/chkform.pye", body, URLENCODED, query, xargs=xargs )
+    expect( case, content( case, st, h, b ), want )
+
+def qs( case, s, want ):
+    st, h, b = run( "/chkform.pye", query="qs=" + s )
+    expect( case, content( case, st, h, b ), repr( want ) )
+
+qs( "parse_qs", "a=1&b=x+y&a=%41%2b&c=",
+    [ ( "a", [ "1", "A+" ] ), ( "b", [ "x y" ] ), ( "c", [ "" ] ) ] )
+qs( "parse_qs bad escape", "a=%4&b=%zz%", [ ( "a", [ "%4" ] ), ( "b", [ "%zz%" ] ) ] )
+
+form( "parse_form", "a=1&b=&c=x%20y",
+      repr( [ ( "a", [ "1" ] ), ( "c", [ "x y" ] ) ] ) )
+form( "parse_form keep_blank", "a=1&b=&c=x%20y",
+      repr( [ ( "a", [ "1" ] ), ( "b", [ "" ] ), ( "c", [ "x y" ] ) ] ), "1" )
+form( "parse_form query and body", "a=1&c=x%20y",
+      repr( [ ( "a", [ "0", "1" ] ), ( "c", [ "x y" ] ), ( "q", [ "2" ] ) ] ), query="a=0&q=2" )
+
+# a field and a %XX escape cut in two by every block edge
+for edge in EDGES:
+    for cut in range( -6, 3 ):
+        pad = "p" * ( edge + cut - len( "a=" ) )
+        body = "a=" + pad + "%41%42&field=v%20w&z=1"
+        form( "parse_form field across %d%+d" % ( edge, cut ), body,
+              repr( [ ( "a", [ pad + "AB" ] ), ( "field", [ "v w" ] ), ( "z", [ "1" ] ) ] ) )
+
+form( "parse_form maxfieldsize", "a=1&b=" + "x" * 101, "ValueError: form field is over the size limit",
+      "0,0,100" )
+form( "parse_form maxfieldsize ok", "a=1&b=" + "x" * 100,
+      repr( [ ( "a", [ "1" ] ), ( "b", [ "x" * 100 ] ) ] ), "0,0,100" )
+form( "parse_form maxfields", "a=1&b=2&c=3&d=4", "ValueError: too many form fields", "0,3" )
+
+# -- multipart ---------------------------------------------------------------
+
+BOUNDARY = "----chk7d91a"
+MULTIPART = "multipart/form-data; boundary=" + BOUNDARY
+
+def part( name, value, filename=None, ctype=None ):
+    d = 'form-data; name="%s"' % name
+    if filename:
+        d = d + '; filename="%s"' % filename
+    h = "Content-Disposition: " + d + "\r\n"
+    if ctype:
+        h = h + "Content-Type: " + ctype + "\r\n"
+    return "--" + BOUNDARY + "\r\n" + h + "\r\n" + value + "\r\n"
+
+def multipart( case, body, want, xargs=None ):
+    st, h, b = run( "/chkmp.pye", body, MULTIPART, xargs=xargs )
+    expect( case, content( case, st, h, b ), want )
+
+END = "--" + BOUNDARY + "--\r\n"
+
+multipart( "multipart", part( "a", "1" ) + part( "f", "file\r\ndata", "f.txt", "text/plain" ) + END,
+           repr( [ ( "a", None, "text/plain", 1, 0, "1" ),
+                   ( "f", "f.txt", "text/plain", 10, 0, "file\r\ndata" ) ] ) )
+
+# the delimiter and the headers of the next part cut in two by every
+# block edge, a byte at a time; near misses of the delimiter in the data
+head = part( "a", "" )[:-2]
+for edge in EDGES:
+    for cut in range( -len( BOUNDARY ) - 60, 4 ):
+        n = edge + cut - len( head )
+        data = ( "\r\n--" + BOUNDARY[:-1] + "x" ) * ( n / ( len( BOUNDARY ) + 4 ) )
+        data = data + "d" * ( n - len( data ) )
+        body = head + data + "\r\n" + part( "b", "bee", "b.bin" ) + END
+        multipart( "multipart boundary across %d%+d" % ( edge, cut ), body,
+                   repr( [ ( "a", None, "text/plain", len( data ), 0, data ),
+                           ( "b", "b.bin", "text/plain", 3, 0, "bee" ) ] ) )
+
+# a part over the spool size goes to a file, one under it doesn't
+big = ""
+for i in range( 1000 ):
+    big = big + "%04d\n" % i
+multipart( "multipart spool", part( "small", "s" * 999 ) + part( "big", big, "big.txt" ) + END,
+           repr( [ ( "big", "big.txt", "text/plain", 5000, 1, big ),
+                   ( "small", None, "text/plain", 999, 0, "s" * 999 ) ] ), "1000" )
+
+multipart( "multipart maxfieldsize", part( "a", "1" ) + part( "b", "x" * 101 ) + END,
+           "ValueError: form field is over the size limit", "0,0,100" )
+multipart( "multipart maxfieldsize spooled", part( "a", "1" ) + part( "b", big ) + END,
+           "ValueError: form field is over the size limit", "1000,0,4999" )
+# file uploads are only limited by spool
+multipart( "multipart maxfieldsize file", part( "b", big, "b" ) + END,
+           repr( [ ( "b", "b", "text/plain", 5000, 1, big ) ] ), "1000,0,100" )
+multipart( "multipart maxfields", part( "a", "1" ) + part( "b", "2" ) + part( "c", "3" ) + END,
+           "ValueError: too many form fields", "0,2" )
+
+for body in ( part( "a", "1" ),
+              part( "a", "1" ) + "--" + BOUNDARY,
+              part( "a", "1" ) + part( "b", big )[:-200] ):
+    multipart( "multipart truncated at %d" % len( body ), body,
+               "ValueError: multipart body ends before its last boundary" )
+
+# -- chunked -----------------------------------------------------------------
+
+lines = ""
+for i in range( 200 ):
+    lines = lines + "line %d of a streamed body\n" % i
+
+small = os.path.join( tmp, "small.txt" )
+f = open( small, "wb" )
+f.write( "a small file\n" * 20 )
+f.close()
+mix = "x" * 10000 + "direct\n" + "a small file\n" * 20 + "tail\n"
+
+for query, want in ( ( "lines", lines ), ( "mix," + small, mix ) ):
+    case = "chunked " + string.split( query, "," )[0]
+    st, h, b = run( "/chkout.pye", query=query )
+    if not st:
+        fail( case, "no response: %s" % repr( b[-200:] ) )
+    elif h.get( "transfer-encoding" ) != "chunked" or h.has_key( "content-length" ):
+        fail( case, "headers %s" % repr( h ) )
+    else:
+        got = dechunk( b )
+        if got is None:
+            fail( case, "bad chunk framing, ends %s" % repr( b[-40:] ) )
+        expect( case, got, want )
+
+    # an HTTP/1.0 client gets the bytes as they are, no framing
+    case = case + " HTTP/1.0"
+    st, h, b = run( "/chkout.pye", query=query, protocol="HTTP/1.0" )
+    if st and h.has_key( "transfer-encoding" ):
+        fail( case, "headers %s" % repr( h ) )
+    else:
+        expect( case, content( case, st, h, b ), want )
+
+# a handler that fails leaves the response to the server if it hasn't
+# started, and doesn't end it if it has
+st, h, b = run( "/chkout.pye", query="abort" )
+if st:
+    fail( "chunked abort", "held back headers went: %s" % st )
+st, h, b = run( "/chkout.pye", query="abort,flushed" )
+if not st or h.get( "transfer-encoding" ) != "chunked":
+    fail( "chunked abort flushed", "headers %s %s" % ( st, repr( h ) ) )
+elif b != "5\r\nsent\n":
+    fail( "chunked abort flushed", "body %s" % repr( b ) )
+
+os.system( "rm -rf " + quote( tmp ) )
+
+if failed:
+    print "%d of %d checks failed" % ( failed, cases )
+    sys.exit( 1 )
+print "%d checks passed" % cases
@@ -0,0 +1,26 @@
+# Handler for check.py: the urlencoded form parsers
+
+import nsapy, nsapi, string
+
+class RequestHandler( nsapy.RequestHandler ):
+
+    def Content( self ):
+
+	# /chkform.pye?qs=<string> gives nsapi.parse_qs of the string,
+	# anything else is sn.parse_form( keep_blank, maxfields, maxfieldsize ),
+	# the arguments comma separated in an x-args header ( the query
+	# is part of the form )
+	q = self.rq.reqpb.get( "query", "" )
+	a = self.rq.headers.get( "x-args", "" )
+	try:
+	    if q[:3] == "qs=":
+		fd = nsapi.parse_qs( q[3:], 1 )
+	    else:
+		args = tuple( map( string.atoi, filter( None, string.split( a, "," ) ) ) )
+		fd = apply( self.sn.parse_form, args )
+	except ValueError, e:
+	    return "ValueError: %s" % e
+
+	items = fd.items()
+	items.sort()
+	return repr( items )
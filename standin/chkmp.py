@@ -0,0 +1,25 @@
+# Handler for check.py: the multipart/form-data parser
+
+import nsapy, string
+
+class RequestHandler( nsapy.RequestHandler ):
+
+    def Content( self ):
+
+	# an x-args header gives sn.parse_multipart( spool, maxfields,
+	# maxfieldsize ), comma separated
+	a = self.rq.headers.get( "x-args", "" )
+	args = tuple( map( string.atoi, filter( None, string.split( a, "," ) ) ) )
+	try:
+	    fd = apply( self.sn.parse_multipart, args )
+	except ValueError, e:
+	    return "ValueError: %s" % e
+
+	r = []
+	names = fd.keys()
+	names.sort()
+	for name in names:
+	    for p in fd[name]:
+		r.append( ( name, p.filename, p.type, p.size, p.spooled, p.value ) )
+		p.close()
+	return repr( r )
@@ -0,0 +1,32 @@
+# Handler for check.py: streamed responses, chunked to an HTTP/1.1 client
+
+import nsapy, string
+
+class RequestHandler( nsapy.RequestHandler ):
+
+    def Handle( self ):
+
+	# ?lines streams small writes with a flush now and then,
+	# ?mix,<file> mixes sn.out, net_write and send_file,
+	# ?abort fails with the headers held back, ?abort,flushed after
+	# some of the body is out
+	q = string.split( self.rq.reqpb.get( "query", "" ), "," )
+	self.rq.srvhdrs[ "content-type" ] = "text/plain"
+	self.rq.start_response( self.sn )
+	if q[0] == "mix":
+	    self.sn.out.write( "x" * 10000 )
+	    self.sn.net_write( "direct\n" )
+	    self.sn.send_file( q[1] )
+	    self.sn.out.write( "tail\n" )
+	elif q[0] == "abort":
+	    self.sn.out.write( "sent\n" )
+	    if q[1:]:
+		self.sn.out.flush()
+		self.sn.out.write( "never sent\n" )
+	    return nsapy.REQ_ABORTED
+	else:
+	    for i in range( 200 ):
+		self.sn.out.write( "line %d of a streamed body\n" % i )
+		if i % 50 == 0:
+		    self.sn.out.flush()
+	return nsapy.REQ_PROCEED
@@ -0,0 +1,26 @@
+/*
+ * base/buffer.h - stand-in network buffers.
+ */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "netsite.h"
+
+typedef struct {
+    SYS_NETFD sd;
+    int pos, cursize, maxsize, rdtimeout;
+    char address[64];
+    unsigned char *inbuf;
+    char *errmsg;
+} netbuf;
+
+NSAPI_PUBLIC netbuf *netbuf_open(SYS_NETFD sd, int sz);
+NSAPI_PUBLIC void netbuf_close(netbuf *buf);
+NSAPI_PUBLIC int netbuf_next(netbuf *buf, int advance);
+NSAPI_PUBLIC int netbuf_grab(netbuf *buf, int sz);
+
+#define netbuf_getc(b) \
+    ((b)->pos != (b)->cursize ? (int)((b)->inbuf[(b)->pos++]) : netbuf_next(b,1))
+
+#endif
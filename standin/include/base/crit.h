@@ -0,0 +1,27 @@
+/*
+ * base/crit.h - stand-in critical sections and condition variables.
+ *
+ * As in the real server, a thread may enter a critical section
+ * it already owns.
+ */
+
+#ifndef CRIT_H
+#define CRIT_H
+
+#include "netsite.h"
+
+typedef void *CRITICAL;
+typedef void *CONDVAR;
+
+NSAPI_PUBLIC CRITICAL crit_init(void);
+NSAPI_PUBLIC void crit_enter(CRITICAL id);
+NSAPI_PUBLIC void crit_exit(CRITICAL id);
+NSAPI_PUBLIC void crit_terminate(CRITICAL id);
+
+NSAPI_PUBLIC CONDVAR condvar_init(CRITICAL id);
+NSAPI_PUBLIC void condvar_wait(CONDVAR cv);
+NSAPI_PUBLIC void condvar_notify(CONDVAR cv);
+NSAPI_PUBLIC void condvar_notifyAll(CONDVAR cv);
+NSAPI_PUBLIC void condvar_terminate(CONDVAR cv);
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * base/file.h - stand-in file I/O.
+ */
+
+#ifndef FILE_H
+#define FILE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "netsite.h"
+
+#define IO_OKAY 1
+#define IO_ERROR -1
+#define IO_EOF 0
+
+NSAPI_PUBLIC SYS_FILE system_fopenRO(char *path);
+NSAPI_PUBLIC int system_fread(SYS_FILE fd, char *buf, int sz);
+NSAPI_PUBLIC int system_fclose(SYS_FILE fd);
+NSAPI_PUBLIC int system_stat(char *path, struct stat *finfo);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * base/net.h - stand-in network I/O.
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include "netsite.h"
+
+#define IO_OKAY 1
+#define IO_ERROR -1
+#define IO_EOF 0
+
+#define NET_INFINITE_TIMEOUT 0
+
+NSAPI_PUBLIC int net_read(SYS_NETFD sd, char *buf, int sz, int timeout);
+NSAPI_PUBLIC int net_write(SYS_NETFD sd, char *buf, int sz);
+
+#endif
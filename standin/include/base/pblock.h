@@ -0,0 +1,38 @@
+/*
+ * base/pblock.h - stand-in parameter blocks.
+ *
+ * The layout of pb_param, pb_entry and pblock matches the one
+ * shipped with the 2.0 and 3.0 servers.
+ */
+
+#ifndef PBLOCK_H
+#define PBLOCK_H
+
+#include "netsite.h"
+
+typedef struct {
+    char *name,*value;
+} pb_param;
+
+struct pb_entry {
+    pb_param *param;
+    struct pb_entry *next;
+};
+
+typedef struct {
+    int hsize;
+    struct pb_entry **ht;
+} pblock;
+
+NSAPI_PUBLIC pb_param *param_create(char *name, char *value);
+NSAPI_PUBLIC int param_free(pb_param *pp);
+NSAPI_PUBLIC pblock *pblock_create(int n);
+NSAPI_PUBLIC void pblock_free(pblock *pb);
+NSAPI_PUBLIC pb_param *pblock_find(char *name, pblock *pb);
+NSAPI_PUBLIC char *pblock_findval(char *name, pblock *pb);
+NSAPI_PUBLIC pb_param *pblock_remove(char *name, pblock *pb);
+NSAPI_PUBLIC pb_param *pblock_nvinsert(char *name, char *value, pblock *pb);
+NSAPI_PUBLIC void pblock_pinsert(pb_param *pp, pblock *pb);
+NSAPI_PUBLIC char *pblock_pblock2str(pblock *pb, char *str);
+
+#endif
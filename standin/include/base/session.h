@@ -0,0 +1,26 @@
+/*
+ * base/session.h - stand-in Session.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "netsite.h"
+#include "base/pblock.h"
+#include "base/buffer.h"
+#include "base/net.h"
+
+typedef struct {
+    pblock *client;
+    SYS_NETFD csd;
+    netbuf *inbuf;
+    int csd_open;
+    void *pool;
+    void *clauth;
+} Session;
+
+NSAPI_PUBLIC char *session_dns_lookup(Session *sn, int verify);
+
+#define session_dns(sn) session_dns_lookup(sn, 0)
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * base/systhr.h - stand-in system threads.
+ */
+
+#ifndef SYSTHR_H
+#define SYSTHR_H
+
+#include "netsite.h"
+
+#define SYSTHREAD_DEFAULT_PRIORITY 16
+
+NSAPI_PUBLIC SYS_THREAD systhread_start(int prio, int stksz,
+                                        void (*fn)(void *), void *arg);
+NSAPI_PUBLIC SYS_THREAD systhread_current(void);
+NSAPI_PUBLIC void systhread_yield(void);
+NSAPI_PUBLIC void systhread_sleep(int milliseconds);
+NSAPI_PUBLIC int systhread_newkey(void);
+NSAPI_PUBLIC void *systhread_getdata(int key);
+NSAPI_PUBLIC void systhread_setdata(int key, void *data);
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * frame/http.h - stand-in HTTP definitions.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "base/session.h"
+#include "frame/req.h"
+
+#define HTTP_DATE_LEN 128
+#define HTTP_DATE_FMT "%a, %d %b %Y %T GMT"
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * frame/log.h - stand-in error log.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "base/session.h"
+#include "frame/req.h"
+
+#define LOG_WARN 0
+#define LOG_MISCONFIG 1
+#define LOG_SECURITY 2
+#define LOG_FAILURE 3
+#define LOG_CATASTROPHE 4
+#define LOG_INFORM 5
+
+NSAPI_PUBLIC int log_error(int degree, char *func, Session *sn,
+                           Request *rq, char *fmt, ...);
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * frame/protocol.h - stand-in protocol functions.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "base/session.h"
+#include "frame/req.h"
+
+#define PROTOCOL_OK 200
+#define PROTOCOL_NO_RESPONSE 204
+#define PROTOCOL_REDIRECT 302
+#define PROTOCOL_NOT_MODIFIED 304
+#define PROTOCOL_BAD_REQUEST 400
+#define PROTOCOL_UNAUTHORIZED 401
+#define PROTOCOL_FORBIDDEN 403
+#define PROTOCOL_NOT_FOUND 404
+#define PROTOCOL_PROXY_UNAUTHORIZED 407
+#define PROTOCOL_SERVER_ERROR 500
+#define PROTOCOL_NOT_IMPLEMENTED 501
+
+NSAPI_PUBLIC void protocol_status(Session *sn, Request *rq,
+                                  int n, char *r);
+NSAPI_PUBLIC int protocol_start_response(Session *sn, Request *rq);
+
+#endif
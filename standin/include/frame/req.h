@@ -0,0 +1,36 @@
+/*
+ * frame/req.h - stand-in Request.
+ */
+
+#ifndef REQ_H
+#define REQ_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "netsite.h"
+#include "base/pblock.h"
+#include "base/session.h"
+
+#define REQ_PROCEED 0
+#define REQ_ABORTED -1
+#define REQ_NOACTION -2
+#define REQ_EXIT -3
+
+typedef struct {
+    pblock *vars;
+    pblock *reqpb;
+    int loadhdrs;
+    pblock *headers;
+    int senthdrs;
+    pblock *srvhdrs;
+    void *os;
+    void *tmpos;
+    char *statpath;
+    char *staterr;
+    struct stat *finfo;
+} Request;
+
+NSAPI_PUBLIC int request_header(char *name, char **value,
+                                Session *sn, Request *rq);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * netsite.h - stand-in for the Netscape server's master include.
+ *
+ * Only the handful of types and macros that nsapimod.c relies upon
+ * are defined here. See standin/README for what this is for.
+ */
+
+#ifndef NETSITE_H
+#define NETSITE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NSAPI_PUBLIC
+
+#ifndef XP_UNIX
+#define XP_UNIX
+#endif
+
+/* a "network descriptor" is an index into the stand-in connection table */
+typedef int SYS_NETFD;
+typedef int SYS_FILE;
+typedef void * SYS_THREAD;
+
+#define SYS_NET_ERRORFD -1
+#define SYS_ERROR_FD -1
+
+#define MALLOC(sz)      malloc(sz)
+#define FREE(p)         free(p)
+#define STRDUP(s)       strdup(s)
+#define PERM_MALLOC(sz) malloc(sz)
+#define PERM_FREE(p)    free(p)
+#define PERM_STRDUP(s)  strdup(s)
+
+#endif
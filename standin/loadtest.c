@@ -0,0 +1,319 @@
+/**********************************************************
+* loadtest.c - drive nsapy_Service from many threads.
+
+Links nsapimod.c against the stand-in NSAPI library and a
+Python build, starts Python the same way obj.conf would and
+then fires synthetic requests at nsapy_Service, reporting
+requests per second and latency percentiles.
+
+  usage: loadtest [-t threads] [-n requests-per-thread] [-u uri]
+                  [-m method] [-b body-size | -f body-file] [-q query]
+                  [-p protocol]
+                  [-H name=value]... [-i initparam=value]...
+                  [-w usec] [-v] [-o] [-s uri]
+
+  -i passes extra name=value pairs to nsapy_Init (e.g.
+     -i criticalonly=1, or -i initstring=... to replace nsapy.init()),
+     -w makes every net_write take that many microseconds ( a slow
+     client ), -v prints log_error lines, -o dumps the response of the
+     last request to stdout, -s requests uri once after the run and
+     dumps that response ( e.g. the statsuri page ), -f sends the
+     contents of a file as the body ( give it a content-type with -H,
+     e.g. -H "content-type=multipart/form-data; boundary=xyz" ), -p
+     is the client's protocol ( HTTP/1.1 by default ).
+
+The handler module named by the URI (e.g. /x/nsapytest.pye) has to
+be on PYTHONPATH, same as nsapy itself.
+
+*
+***********************************************************/
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "base/pblock.h"
+#include "base/session.h"
+#include "frame/req.h"
+#include "standin.h"
+
+NSAPI_PUBLIC int nsapy_Init( pblock *pb, Session *sn, Request *rq );
+NSAPI_PUBLIC int nsapy_Service( pblock *pb, Session *sn, Request *rq );
+
+#define MAXPAIRS 32
+
+static int nthreads = 4;
+static int nrequests = 1000;
+static char *uri = "/nsapytest.pye";
+static char *method = "GET";
+static char *query = NULL;
+static char *protocol = "HTTP/1.1";
+static int bodysize = 0;
+static char *bodyfile = NULL;
+static int dumpout = 0;
+static char *afteruri = NULL;
+static char *hdrs[MAXPAIRS];
+static int nhdrs = 0;
+static char *initparams[MAXPAIRS];
+static int ninitparams = 0;
+
+/* per request latencies, in microseconds */
+static long *latencies;
+static int aborted = 0;
+static pthread_mutex_t aborted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long now_usec( void )
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* insert "name=value" into pb */
+
+static void nvinsert_pair( char *pair, pblock *pb )
+{
+    char name[256], *eq;
+
+    eq = strchr( pair, '=' );
+    if ( ! eq || eq - pair >= ( int ) sizeof( name ) )
+        return;
+
+    memcpy( name, pair, eq - pair );
+    name[ eq - pair ] = '\0';
+    pblock_nvinsert( name, eq + 1, pb );
+}
+
+/**
+ ** one_request - fabricate a session and a request, call nsapy_Service
+ **/
+
+static int one_request( char *body, int last )
+{
+    pblock *pb;
+    Session sn;
+    Request rq;
+    char clen[32];
+    standin_conn *c;
+    int i, result;
+
+    memset( &sn, 0, sizeof( sn ) );
+    memset( &rq, 0, sizeof( rq ) );
+
+    sn.csd = standin_conn_open( body, bodysize, dumpout && last );
+    sn.csd_open = 1;
+    sn.inbuf = netbuf_open( sn.csd, 8192 );
+    sn.client = pblock_create( 5 );
+    pblock_nvinsert( "ip", "127.0.0.1", sn.client );
+    pblock_nvinsert( "dns", "localhost", sn.client );
+
+    pb = pblock_create( 5 );
+    pblock_nvinsert( "fn", "nsapy_Service", pb );
+
+    rq.vars = pblock_create( 5 );
+    pblock_nvinsert( "path", uri, rq.vars );
+    rq.reqpb = pblock_create( 5 );
+    pblock_nvinsert( "method", method, rq.reqpb );
+    pblock_nvinsert( "uri", uri, rq.reqpb );
+    pblock_nvinsert( "protocol", protocol, rq.reqpb );
+    if ( query )
+        pblock_nvinsert( "query", query, rq.reqpb );
+    rq.headers = pblock_create( 11 );
+    pblock_nvinsert( "host", "localhost", rq.headers );
+    pblock_nvinsert( "user-agent", "loadtest", rq.headers );
+    for ( i = 0; i < nhdrs; i++ )
+        nvinsert_pair( hdrs[i], rq.headers );
+    if ( bodysize )
+    {
+        sprintf( clen, "%d", bodysize );
+        pblock_nvinsert( "content-length", clen, rq.headers );
+        if ( ! pblock_findval( "content-type", rq.headers ) )
+            pblock_nvinsert( "content-type", "application/x-www-form-urlencoded", rq.headers );
+    }
+    rq.srvhdrs = pblock_create( 11 );
+    pblock_nvinsert( "content-type", "magnus-internal/X-python-e", rq.srvhdrs );
+
+    result = nsapy_Service( pb, &sn, &rq );
+
+    c = standin_conn_get( sn.csd );
+    if ( dumpout && last && c->out )
+    {
+        fwrite( c->out, 1, c->outlen, stdout );
+        printf( "\n-- %ld bytes, %d writes, %d reads --\n",
+                c->written, c->writes, c->reads );
+    }
+
+    standin_conn_close( sn.csd );
+    netbuf_close( sn.inbuf );
+    pblock_free( sn.client );
+    pblock_free( pb );
+    pblock_free( rq.vars );
+    pblock_free( rq.reqpb );
+    pblock_free( rq.headers );
+    pblock_free( rq.srvhdrs );
+
+    return result;
+}
+
+/* the -f file into body, bodysize bytes of it */
+
+static void read_body( char *body )
+{
+    FILE *f;
+
+    f = fopen( bodyfile, "rb" );
+    if ( ! f || fread( body, 1, bodysize, f ) != ( size_t ) bodysize )
+    {
+        fprintf( stderr, "can't read %s\n", bodyfile );
+        exit( 1 );
+    }
+    fclose( f );
+}
+
+static void *worker( void *arg )
+{
+    long *mine, start;
+    char *body;
+    int i, result;
+
+    mine = latencies + ( long ) arg * nrequests;
+
+    body = NULL;
+    if ( bodysize )
+    {
+        body = malloc( bodysize );
+        if ( bodyfile )
+            read_body( body );
+        else
+            for ( i = 0; i < bodysize; i++ )
+                body[i] = "abcdefghij&=" [ i % 12 ];
+    }
+
+    for ( i = 0; i < nrequests; i++ )
+    {
+        start = now_usec();
+        result = one_request( body, ( long ) arg == 0 && i == nrequests - 1 );
+        mine[i] = now_usec() - start;
+
+        if ( result == REQ_ABORTED )
+        {
+            pthread_mutex_lock( &aborted_lock );
+            aborted++;
+            pthread_mutex_unlock( &aborted_lock );
+        }
+    }
+
+    free( body );
+    return NULL;
+}
+
+static int cmp_long( const void *a, const void *b )
+{
+    long x = *( long * ) a, y = *( long * ) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static long percentile( long *sorted, long n, double p )
+{
+    long i;
+
+    i = ( long ) ( p * n );
+    if ( i >= n )
+        i = n - 1;
+
+    return sorted[i];
+}
+
+int main( int argc, char **argv )
+{
+    pblock *initpb;
+    pthread_t *threads;
+    long i, total, start, elapsed;
+    struct stat st;
+    int c;
+
+    while ( ( c = getopt( argc, argv, "t:n:u:m:b:f:q:p:H:i:w:vos:" ) ) != -1 )
+        switch ( c )
+        {
+            case 't': nthreads = atoi( optarg ); break;
+            case 'n': nrequests = atoi( optarg ); break;
+            case 'u': uri = optarg; break;
+            case 'm': method = optarg; break;
+            case 'b': bodysize = atoi( optarg ); break;
+            case 'f': bodyfile = optarg; break;
+            case 'q': query = optarg; break;
+            case 'p': protocol = optarg; break;
+            case 'H': if ( nhdrs < MAXPAIRS ) hdrs[ nhdrs++ ] = optarg; break;
+            case 'i': if ( ninitparams < MAXPAIRS ) initparams[ ninitparams++ ] = optarg; break;
+            case 'w': standin_write_delay = atoi( optarg ); break;
+            case 'v': standin_verbose = 1; break;
+            case 'o': dumpout = 1; break;
+            case 's': afteruri = optarg; break;
+            default:
+                fprintf( stderr, "usage: %s [-t threads] [-n requests] [-u uri] [-m method]\n"
+                                 "       [-b bodysize | -f bodyfile] [-q query] [-p protocol] [-H name=value]...\n"
+                                 "       [-i initparam=value]... [-w usec] [-v] [-o] [-s uri]\n", argv[0] );
+                return 2;
+        }
+
+    if ( bodyfile )
+    {
+        if ( stat( bodyfile, &st ) != 0 )
+        {
+            fprintf( stderr, "can't stat %s\n", bodyfile );
+            return 2;
+        }
+        bodysize = ( int ) st.st_size;
+    }
+
+    /* same as Init fn="nsapy_Init" initstring="nsapy.init()" module="nsapy" */
+    initpb = pblock_create( 5 );
+    pblock_nvinsert( "fn", "nsapy_Init", initpb );
+    for ( i = 0; i < ninitparams; i++ )
+        nvinsert_pair( initparams[i], initpb );
+    if ( ! pblock_findval( "module", initpb ) )
+        pblock_nvinsert( "module", "nsapy", initpb );
+    if ( ! pblock_findval( "initstring", initpb ) )
+        pblock_nvinsert( "initstring", "nsapy.init()", initpb );
+
+    if ( nsapy_Init( initpb, NULL, NULL ) != REQ_PROCEED )
+    {
+        fprintf( stderr, "nsapy_Init failed: %s\n", pblock_findval( "error", initpb ) );
+        return 1;
+    }
+
+    total = ( long ) nthreads * nrequests;
+    latencies = ( long * ) malloc( total * sizeof( long ) );
+    threads = ( pthread_t * ) malloc( nthreads * sizeof( pthread_t ) );
+
+    start = now_usec();
+    for ( i = 0; i < nthreads; i++ )
+        pthread_create( &threads[i], NULL, worker, ( void * ) i );
+    for ( i = 0; i < nthreads; i++ )
+        pthread_join( threads[i], NULL );
+    elapsed = now_usec() - start;
+
+    qsort( latencies, total, sizeof( long ), cmp_long );
+
+    printf( "%ld requests, %d threads, %d aborted, %.3f s\n",
+            total, nthreads, aborted, elapsed / 1e6 );
+    printf( "%.1f req/s\n", total / ( elapsed / 1e6 ) );
+    printf( "latency usec: p50 %ld  p90 %ld  p99 %ld  max %ld\n",
+            percentile( latencies, total, 0.50 ),
+            percentile( latencies, total, 0.90 ),
+            percentile( latencies, total, 0.99 ),
+            latencies[ total - 1 ] );
+
+    if ( afteruri )
+    {
+        uri = afteruri;
+        bodysize = 0;
+        dumpout = 1;
+        one_request( NULL, 1 );
+    }
+
+    return aborted ? 1 : 0;
+}
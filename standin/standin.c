@@ -0,0 +1,641 @@
+/**********************************************************
+* standin.c - a stand-in for the parts of the Netscape
+* server API that nsapimod.c uses.
+
+This lets nsapimod.c be compiled, linked and driven on a
+plain UNIX box without a Netscape server. Everything is backed
+by memory: a "network descriptor" (SYS_NETFD) is an index into
+a table of connections, each of which holds the request body
+to be read and counts (and optionally keeps) what gets written.
+
+Threads, critical sections and condition variables are POSIX
+threads underneath.
+
+This is NOT a web server, it only has to behave like one as far
+as nsapimod.c can tell.
+
+*
+***********************************************************/
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "base/pblock.h"
+#include "base/session.h"
+#include "base/crit.h"
+#include "base/systhr.h"
+#include "base/file.h"
+#include "frame/req.h"
+#include "frame/protocol.h"
+#include "frame/log.h"
+#include "standin.h"
+
+/* the connection table */
+static standin_conn conns[STANDIN_MAXCONN];
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* print log_error lines to stderr? */
+int standin_verbose = 0;
+
+/* microseconds every net_write takes, to play a slow client */
+int standin_write_delay = 0;
+
+
+/**
+ ** pblocks
+ **
+ *  These are plain chained hash tables, same as the server's.
+ */
+
+static int pblock_hash( char *name, int hsize )
+{
+    unsigned int h = 0;
+
+    while ( *name )
+        h = ( h << 5 ) + h + ( unsigned char ) *name++;
+
+    return h % hsize;
+}
+
+NSAPI_PUBLIC pb_param *param_create( char *name, char *value )
+{
+    pb_param *pp;
+
+    pp = ( pb_param * ) malloc( sizeof( pb_param ) );
+    pp->name = name ? strdup( name ) : NULL;
+    pp->value = value ? strdup( value ) : NULL;
+
+    return pp;
+}
+
+NSAPI_PUBLIC int param_free( pb_param *pp )
+{
+    if ( pp )
+    {
+        free( pp->name );
+        free( pp->value );
+        free( pp );
+        return 1;
+    }
+    return 0;
+}
+
+NSAPI_PUBLIC pblock *pblock_create( int n )
+{
+    pblock *pb;
+
+    pb = ( pblock * ) malloc( sizeof( pblock ) );
+    pb->hsize = n > 0 ? n : 1;
+    pb->ht = ( struct pb_entry ** ) calloc( pb->hsize, sizeof( struct pb_entry * ) );
+
+    return pb;
+}
+
+NSAPI_PUBLIC void pblock_free( pblock *pb )
+{
+    struct pb_entry *p, *next;
+    int i;
+
+    if ( ! pb )
+        return;
+
+    for ( i = 0; i < pb->hsize; i++ )
+        for ( p = pb->ht[i]; p; p = next )
+        {
+            next = p->next;
+            param_free( p->param );
+            free( p );
+        }
+
+    free( pb->ht );
+    free( pb );
+}
+
+NSAPI_PUBLIC pb_param *pblock_find( char *name, pblock *pb )
+{
+    struct pb_entry *p;
+
+    for ( p = pb->ht[ pblock_hash( name, pb->hsize ) ]; p; p = p->next )
+        if ( strcmp( p->param->name, name ) == 0 )
+            return p->param;
+
+    return NULL;
+}
+
+NSAPI_PUBLIC char *pblock_findval( char *name, pblock *pb )
+{
+    pb_param *pp;
+
+    pp = pblock_find( name, pb );
+
+    return pp ? pp->value : NULL;
+}
+
+NSAPI_PUBLIC pb_param *pblock_remove( char *name, pblock *pb )
+{
+    struct pb_entry **pp, *p;
+    pb_param *param;
+
+    pp = &pb->ht[ pblock_hash( name, pb->hsize ) ];
+
+    for ( ; *pp; pp = &( *pp )->next )
+        if ( strcmp( ( *pp )->param->name, name ) == 0 )
+        {
+            p = *pp;
+            *pp = p->next;
+            param = p->param;
+            free( p );
+            return param;
+        }
+
+    return NULL;
+}
+
+NSAPI_PUBLIC void pblock_pinsert( pb_param *pp, pblock *pb )
+{
+    struct pb_entry *p;
+    int i;
+
+    i = pblock_hash( pp->name, pb->hsize );
+
+    p = ( struct pb_entry * ) malloc( sizeof( struct pb_entry ) );
+    p->param = pp;
+    p->next = pb->ht[i];
+    pb->ht[i] = p;
+}
+
+NSAPI_PUBLIC pb_param *pblock_nvinsert( char *name, char *value, pblock *pb )
+{
+    pb_param *pp;
+
+    pp = param_create( name, value );
+    pblock_pinsert( pp, pb );
+
+    return pp;
+}
+
+NSAPI_PUBLIC char *pblock_pblock2str( pblock *pb, char *str )
+{
+    struct pb_entry *p;
+    int i, len;
+
+    len = 1;
+    for ( i = 0; i < pb->hsize; i++ )
+        for ( p = pb->ht[i]; p; p = p->next )
+            len += strlen( p->param->name ) + strlen( p->param->value ) + 4;
+
+    str = ( char * ) realloc( str, len );
+    str[0] = '\0';
+
+    for ( i = 0; i < pb->hsize; i++ )
+        for ( p = pb->ht[i]; p; p = p->next )
+        {
+            if ( str[0] )
+                strcat( str, " " );
+            strcat( str, p->param->name );
+            strcat( str, "=\"" );
+            strcat( str, p->param->value );
+            strcat( str, "\"" );
+        }
+
+    return str;
+}
+
+
+/**
+ ** connections
+ **
+ */
+
+NSAPI_PUBLIC standin_conn *standin_conn_get( SYS_NETFD sd )
+{
+    if ( sd < 0 || sd >= STANDIN_MAXCONN || ! conns[sd].inuse )
+        return NULL;
+
+    return &conns[sd];
+}
+
+NSAPI_PUBLIC SYS_NETFD standin_conn_open( char *body, int bodylen, int keep )
+{
+    int i;
+
+    pthread_mutex_lock( &conns_lock );
+    for ( i = 0; i < STANDIN_MAXCONN; i++ )
+        if ( ! conns[i].inuse )
+            break;
+
+    if ( i == STANDIN_MAXCONN )
+    {
+        pthread_mutex_unlock( &conns_lock );
+        return SYS_NET_ERRORFD;
+    }
+
+    memset( &conns[i], 0, sizeof( standin_conn ) );
+    conns[i].inuse = 1;
+    pthread_mutex_unlock( &conns_lock );
+
+    conns[i].in = body;
+    conns[i].inlen = bodylen;
+    conns[i].keep = keep;
+
+    return i;
+}
+
+NSAPI_PUBLIC void standin_conn_close( SYS_NETFD sd )
+{
+    standin_conn *c;
+
+    if ( ( c = standin_conn_get( sd ) ) == NULL )
+        return;
+
+    free( c->out );
+    c->out = NULL;
+
+    pthread_mutex_lock( &conns_lock );
+    c->inuse = 0;
+    pthread_mutex_unlock( &conns_lock );
+}
+
+NSAPI_PUBLIC int net_read( SYS_NETFD sd, char *buf, int sz, int timeout )
+{
+    standin_conn *c;
+    int n;
+
+    if ( ( c = standin_conn_get( sd ) ) == NULL )
+        return IO_ERROR;
+
+    /* hand out at most STANDIN_READSZ at a time, like a socket would */
+    n = c->inlen - c->inpos;
+    if ( n > sz )
+        n = sz;
+    if ( n > STANDIN_READSZ )
+        n = STANDIN_READSZ;
+
+    memcpy( buf, c->in + c->inpos, n );
+    c->inpos += n;
+    c->reads++;
+
+    return n;
+}
+
+NSAPI_PUBLIC int net_write( SYS_NETFD sd, char *buf, int sz )
+{
+    standin_conn *c;
+
+    if ( ( c = standin_conn_get( sd ) ) == NULL )
+        return IO_ERROR;
+
+    if ( standin_write_delay )
+        usleep( standin_write_delay );
+
+    /* only the start of a huge response is kept, -o can't print it all anyway */
+    if ( c->keep && c->outlen + sz <= STANDIN_KEEPMAX )
+    {
+        if ( c->outlen + sz > c->outsize )
+        {
+            c->outsize = ( c->outlen + sz ) * 2;
+            c->out = ( char * ) realloc( c->out, c->outsize );
+        }
+        memcpy( c->out + c->outlen, buf, sz );
+        c->outlen += sz;
+    }
+    c->written += sz;
+    c->writes++;
+
+    return sz;
+}
+
+/* The real netbuf reads in sz sized gulps from the descriptor */
+
+NSAPI_PUBLIC netbuf *netbuf_open( SYS_NETFD sd, int sz )
+{
+    netbuf *buf;
+
+    buf = ( netbuf * ) calloc( 1, sizeof( netbuf ) );
+    buf->sd = sd;
+    buf->maxsize = sz;
+    buf->inbuf = ( unsigned char * ) malloc( sz );
+    buf->rdtimeout = 30;
+
+    return buf;
+}
+
+NSAPI_PUBLIC void netbuf_close( netbuf *buf )
+{
+    if ( buf )
+    {
+        free( buf->inbuf );
+        free( buf );
+    }
+}
+
+NSAPI_PUBLIC int netbuf_grab( netbuf *buf, int sz )
+{
+    int n;
+
+    if ( sz > buf->maxsize )
+        sz = buf->maxsize;
+
+    n = net_read( buf->sd, ( char * ) buf->inbuf, sz, buf->rdtimeout );
+    if ( n <= 0 )
+        return n;
+
+    buf->pos = 0;
+    buf->cursize = n;
+
+    return n;
+}
+
+NSAPI_PUBLIC int netbuf_next( netbuf *buf, int advance )
+{
+    int n;
+
+    n = netbuf_grab( buf, buf->maxsize );
+    if ( n <= 0 )
+        return n == 0 ? IO_EOF : IO_ERROR;
+
+    return ( int ) buf->inbuf[ advance ? buf->pos++ : buf->pos ];
+}
+
+NSAPI_PUBLIC char *session_dns_lookup( Session *sn, int verify )
+{
+    return pblock_findval( "dns", sn->client );
+}
+
+
+/**
+ ** requests and protocol
+ **
+ */
+
+NSAPI_PUBLIC int request_header( char *name, char **value, Session *sn, Request *rq )
+{
+    *value = pblock_findval( name, rq->headers );
+    return REQ_PROCEED;
+}
+
+NSAPI_PUBLIC void protocol_status( Session *sn, Request *rq, int n, char *r )
+{
+    char buff[256];
+
+    if ( ! r )
+        switch ( n )
+        {
+            case PROTOCOL_OK:             r = "OK"; break;
+            case PROTOCOL_NO_RESPONSE:    r = "No Content"; break;
+            case PROTOCOL_REDIRECT:       r = "Found"; break;
+            case PROTOCOL_NOT_MODIFIED:   r = "Not Modified"; break;
+            case PROTOCOL_BAD_REQUEST:    r = "Bad Request"; break;
+            case PROTOCOL_UNAUTHORIZED:   r = "Unauthorized"; break;
+            case PROTOCOL_FORBIDDEN:      r = "Forbidden"; break;
+            case PROTOCOL_NOT_FOUND:      r = "Not Found"; break;
+            case PROTOCOL_SERVER_ERROR:   r = "Server Error"; break;
+            default:                      r = "Unknown reason"; break;
+        }
+
+    sprintf( buff, "%d %s", n, r );
+    param_free( pblock_remove( "status", rq->srvhdrs ) );
+    pblock_nvinsert( "status", buff, rq->srvhdrs );
+}
+
+NSAPI_PUBLIC int protocol_start_response( Session *sn, Request *rq )
+{
+    char *hdrs, *method, *protocol;
+    char head[64];
+
+    if ( rq->senthdrs )
+        return REQ_PROCEED;
+
+    if ( ! pblock_findval( "status", rq->srvhdrs ) )
+        protocol_status( sn, rq, PROTOCOL_OK, NULL );
+
+    /* HTTP/1.1 to a 1.1 client, a chunked body needs it */
+    protocol = pblock_findval( "protocol", rq->reqpb );
+    sprintf( head, "%s ", protocol && strcmp( protocol, "HTTP/1.1" ) == 0 ? protocol : "HTTP/1.0" );
+    net_write( sn->csd, head, strlen( head ) );
+    net_write( sn->csd, pblock_findval( "status", rq->srvhdrs ),
+               strlen( pblock_findval( "status", rq->srvhdrs ) ) );
+    net_write( sn->csd, "\r\n", 2 );
+
+    hdrs = pblock_pblock2str( rq->srvhdrs, NULL );
+    net_write( sn->csd, hdrs, strlen( hdrs ) );
+    net_write( sn->csd, "\r\n\r\n", 4 );
+    free( hdrs );
+
+    rq->senthdrs = 1;
+
+    method = pblock_findval( "method", rq->reqpb );
+    if ( method && strcmp( method, "HEAD" ) == 0 )
+        return REQ_NOACTION;
+
+    return REQ_PROCEED;
+}
+
+NSAPI_PUBLIC int log_error( int degree, char *func, Session *sn, Request *rq, char *fmt, ... )
+{
+    va_list args;
+
+    if ( standin_verbose )
+    {
+        fprintf( stderr, "[log_error %d] %s: ", degree, func );
+        va_start( args, fmt );
+        vfprintf( stderr, fmt, args );
+        va_end( args );
+        fprintf( stderr, "\n" );
+    }
+
+    return 0;
+}
+
+
+/**
+ ** critical sections and condition variables
+ **
+ */
+
+typedef struct {
+    pthread_mutex_t lock;
+} standin_crit;
+
+typedef struct {
+    pthread_cond_t cond;
+    standin_crit *crit;
+} standin_condvar;
+
+NSAPI_PUBLIC CRITICAL crit_init( void )
+{
+    standin_crit *c;
+    pthread_mutexattr_t attr;
+
+    c = ( standin_crit * ) malloc( sizeof( standin_crit ) );
+
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &c->lock, &attr );
+    pthread_mutexattr_destroy( &attr );
+
+    return ( CRITICAL ) c;
+}
+
+NSAPI_PUBLIC void crit_enter( CRITICAL id )
+{
+    pthread_mutex_lock( &( ( standin_crit * ) id )->lock );
+}
+
+NSAPI_PUBLIC void crit_exit( CRITICAL id )
+{
+    pthread_mutex_unlock( &( ( standin_crit * ) id )->lock );
+}
+
+NSAPI_PUBLIC void crit_terminate( CRITICAL id )
+{
+    pthread_mutex_destroy( &( ( standin_crit * ) id )->lock );
+    free( id );
+}
+
+NSAPI_PUBLIC CONDVAR condvar_init( CRITICAL id )
+{
+    standin_condvar *cv;
+
+    cv = ( standin_condvar * ) malloc( sizeof( standin_condvar ) );
+    pthread_cond_init( &cv->cond, NULL );
+    cv->crit = ( standin_crit * ) id;
+
+    return ( CONDVAR ) cv;
+}
+
+NSAPI_PUBLIC void condvar_wait( CONDVAR _cv )
+{
+    standin_condvar *cv = ( standin_condvar * ) _cv;
+
+    pthread_cond_wait( &cv->cond, &cv->crit->lock );
+}
+
+NSAPI_PUBLIC void condvar_notify( CONDVAR _cv )
+{
+    pthread_cond_signal( &( ( standin_condvar * ) _cv )->cond );
+}
+
+NSAPI_PUBLIC void condvar_notifyAll( CONDVAR _cv )
+{
+    pthread_cond_broadcast( &( ( standin_condvar * ) _cv )->cond );
+}
+
+NSAPI_PUBLIC void condvar_terminate( CONDVAR _cv )
+{
+    pthread_cond_destroy( &( ( standin_condvar * ) _cv )->cond );
+    free( _cv );
+}
+
+
+/**
+ ** threads
+ **
+ */
+
+typedef struct {
+    void ( *fn )( void * );
+    void *arg;
+} standin_thread_start;
+
+static void *standin_thread_main( void *arg )
+{
+    standin_thread_start start;
+
+    start = *( standin_thread_start * ) arg;
+    free( arg );
+
+    start.fn( start.arg );
+
+    return NULL;
+}
+
+NSAPI_PUBLIC SYS_THREAD systhread_start( int prio, int stksz, void ( *fn )( void * ), void *arg )
+{
+    pthread_t t;
+    standin_thread_start *start;
+
+    start = ( standin_thread_start * ) malloc( sizeof( standin_thread_start ) );
+    start->fn = fn;
+    start->arg = arg;
+
+    if ( pthread_create( &t, NULL, standin_thread_main, start ) != 0 )
+    {
+        free( start );
+        return NULL;
+    }
+    pthread_detach( t );
+
+    return ( SYS_THREAD ) t;
+}
+
+NSAPI_PUBLIC SYS_THREAD systhread_current( void )
+{
+    return ( SYS_THREAD ) pthread_self();
+}
+
+NSAPI_PUBLIC void systhread_yield( void )
+{
+    sched_yield();
+}
+
+NSAPI_PUBLIC void systhread_sleep( int milliseconds )
+{
+    struct timespec ts;
+
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = ( milliseconds % 1000 ) * 1000000L;
+    nanosleep( &ts, NULL );
+}
+
+NSAPI_PUBLIC int systhread_newkey( void )
+{
+    pthread_key_t key;
+
+    pthread_key_create( &key, NULL );
+
+    return ( int ) key;
+}
+
+NSAPI_PUBLIC void *systhread_getdata( int key )
+{
+    return pthread_getspecific( ( pthread_key_t ) key );
+}
+
+NSAPI_PUBLIC void systhread_setdata( int key, void *data )
+{
+    pthread_setspecific( ( pthread_key_t ) key, data );
+}
+
+
+/**
+ ** files
+ **
+ */
+
+NSAPI_PUBLIC SYS_FILE system_fopenRO( char *path )
+{
+    return open( path, O_RDONLY );
+}
+
+NSAPI_PUBLIC int system_fread( SYS_FILE fd, char *buf, int sz )
+{
+    int n;
+
+    n = read( fd, buf, sz );
+
+    return n < 0 ? IO_ERROR : n;
+}
+
+NSAPI_PUBLIC int system_fclose( SYS_FILE fd )
+{
+    return close( fd ) == 0 ? 0 : IO_ERROR;
+}
+
+NSAPI_PUBLIC int system_stat( char *path, struct stat *finfo )
+{
+    return stat( path, finfo ) == 0 ? 0 : -1;
+}
@@ -0,0 +1,39 @@
+/*
+ * standin.h - the parts of the stand-in library that are not
+ * NSAPI, used by the load-test driver to fabricate connections,
+ * sessions and requests.
+ */
+
+#ifndef STANDIN_H
+#define STANDIN_H
+
+#include "base/session.h"
+#include "frame/req.h"
+
+#define STANDIN_MAXCONN 1024
+
+/* most bytes a single net_read will return, like a socket would */
+#define STANDIN_READSZ 16384
+
+/* most bytes of a response kept for loadtest -o */
+#define STANDIN_KEEPMAX ( 16 * 1024 * 1024 )
+
+typedef struct {
+    int inuse;
+    char *in;                /* request body */
+    int inlen, inpos;
+    int keep;                /* keep the output? */
+    char *out;
+    int outlen, outsize;
+    long written;            /* bytes net_write'n */
+    int writes, reads;       /* calls to net_write, net_read */
+} standin_conn;
+
+extern int standin_verbose;
+extern int standin_write_delay;
+
+NSAPI_PUBLIC SYS_NETFD standin_conn_open( char *body, int bodylen, int keep );
+NSAPI_PUBLIC standin_conn *standin_conn_get( SYS_NETFD sd );
+NSAPI_PUBLIC void standin_conn_close( SYS_NETFD sd );
+
+#endif